@@ -0,0 +1,1411 @@
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+// End-to-end decode benchmark.
+//
+// Generates synthetic E57 files in memory, writes them to a scratch file and times
+// openE57 and readE57Points through the memory-mapped file reader. Results are written
+// to stdout as CSV, one line per case, log messages go to stderr.
+//
+// Each case is also read once through PointReader, both straight through with next and
+// after seeks, and the points are checked against those passed to the consume callback.
+// Before the cases, the spill paths of the octree builder and the voxel filter are checked
+// against running in memory.
+
+// Don't complain about fopen
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <limits>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include "Common.h"
+#include "e57File.h"
+#include "e57Histogram.h"
+#include "e57Kernels.h"
+#include "e57Octree.h"
+#include "e57VoxelFilter.h"
+#include "e57Writer.h"
+#include "MemoryMappedFile.h"
+
+namespace {
+
+  size_t logLevel = 2;
+
+  void logger(size_t level, const char* msg, va_list arg)
+  {
+    if (level < logLevel || 5 <= level) {
+      return;
+    }
+    const char levels[5] = { 'T', 'D', 'I', 'W', 'E' };
+    fprintf(stderr, "[%c] ", levels[level]);
+    vfprintf(stderr, msg, arg);
+    fputc('\n', stderr);
+  }
+
+  enum struct ValueType : uint32_t {
+    Float,
+    Double,
+    Integer,
+    ScaledInteger
+  };
+
+  const char* valueTypeNames[] = {
+    "float",
+    "double",
+    "integer",
+    "scaledinteger"
+  };
+
+  // Element names used for stream 0, 1, 2, ...
+  const char* streamNames[] = {
+    "cartesianX",
+    "cartesianY",
+    "cartesianZ",
+    "intensity",
+    "colorRed",
+    "colorGreen",
+    "colorBlue",
+    "rowIndex",
+    "columnIndex",
+    "returnIndex",
+    "returnCount",
+    "timeStamp"
+  };
+  constexpr uint32_t MaxStreamCount = sizeof(streamNames) / sizeof(streamNames[0]);
+
+  // Widths above 56 bits take the two-load path of the unpacker.
+  constexpr uint32_t MaxBitWidth = 64;
+
+  struct BenchCase
+  {
+    size_t pointCount = 1000000;
+    ValueType type = ValueType::ScaledInteger;
+    uint32_t bitWidth = 18;           // Integer and ScaledInteger only.
+    uint32_t streamCount = 3;
+    uint32_t packetSize = 0x10000;    // Upper bound of data packet size in bytes.
+    uint32_t pageSize = 1024;
+    bool index = false;               // Add index packets after the data packets.
+  };
+
+  struct BenchOptions
+  {
+    size_t repeat = 5;
+    size_t batchSize = 0;
+    size_t pipelineDepth = 1;
+    bool check = true;
+    std::string scratchPath = "e57bench.tmp.e57";
+  };
+
+  uint32_t valueBitWidth(const BenchCase& bc)
+  {
+    switch (bc.type) {
+    case ValueType::Float: return 32;
+    case ValueType::Double: return 64;
+    default: return bc.bitWidth;
+    }
+  }
+
+
+  // --- Generator --------------------------------------------------------------
+
+  struct BitWriter
+  {
+    std::vector<uint8_t>& out;
+    uint64_t acc = 0;
+    uint32_t fill = 0;
+
+    void put(uint64_t value, uint32_t width)
+    {
+      if (32 < width) {
+        put(value & 0xFFFFFFFFu, 32);
+        put(value >> 32, width - 32);
+        return;
+      }
+      acc |= (value & ((uint64_t(1) << width) - 1)) << fill;
+      fill += width;
+      while (8 <= fill) {
+        out.push_back(static_cast<uint8_t>(acc));
+        acc >>= 8;
+        fill -= 8;
+      }
+    }
+
+    void flush()
+    {
+      if (fill) {
+        out.push_back(static_cast<uint8_t>(acc));
+        acc = 0;
+        fill = 0;
+      }
+    }
+  };
+
+  void putUint16LE(std::vector<uint8_t>& out, size_t offset, uint64_t value)
+  {
+    for (size_t i = 0; i < 2; i++) out[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+
+  void putUint32LE(std::vector<uint8_t>& out, size_t offset, uint64_t value)
+  {
+    for (size_t i = 0; i < 4; i++) out[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+
+  void putUint64LE(std::vector<uint8_t>& out, size_t offset, uint64_t value)
+  {
+    for (size_t i = 0; i < 8; i++) out[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+
+  struct IndexEntry
+  {
+    uint64_t record;          // First record of the chunk.
+    uint64_t physicalOffset;  // Physical offset of the packet the chunk starts with.
+  };
+
+  // Appends index packets over the given entries, adding levels until one packet remains,
+  // and returns the logical offset of the root packet.
+  template<typename Physical>
+  uint64_t appendIndex(std::vector<uint8_t>& logical, std::vector<IndexEntry> entries, Physical physical)
+  {
+    constexpr size_t MaxEntries = (0x10000 - 16) / 16;
+
+    for (uint8_t level = 0; ; level++) {
+      std::vector<IndexEntry> parents;
+      for (size_t first = 0; first < entries.size(); first += MaxEntries) {
+        const size_t count = std::min(MaxEntries, entries.size() - first);
+        const size_t packetOffset = logical.size();
+        logical.resize(packetOffset + 16 + 16 * count);
+        logical[packetOffset + 0] = 0;  // Index packet
+        putUint16LE(logical, packetOffset + 2, 16 + 16 * count - 1);
+        putUint16LE(logical, packetOffset + 4, count);
+        logical[packetOffset + 6] = level;
+        for (size_t i = 0; i < count; i++) {
+          putUint64LE(logical, packetOffset + 16 + 16 * i, entries[first + i].record);
+          putUint64LE(logical, packetOffset + 24 + 16 * i, entries[first + i].physicalOffset);
+        }
+        parents.push_back({ .record = entries[first].record, .physicalOffset = physical(packetOffset) });
+        if (entries.size() <= MaxEntries) {
+          return packetOffset;
+        }
+      }
+      entries = std::move(parents);
+    }
+  }
+
+  uint64_t xorshift(uint64_t& state)
+  {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+
+  // Number of records per data packet such that the packet fits in bc.packetSize.
+  size_t recordsPerPacket(const BenchCase& bc)
+  {
+    const uint64_t w = valueBitWidth(bc);
+    const uint64_t header = 6 + 2 * uint64_t(bc.streamCount);
+    auto packetBytes = [&](uint64_t records) { return (header + bc.streamCount * ((records * w + 7) / 8) + 3) & ~uint64_t(3); };
+
+    uint64_t records = (8 * (bc.packetSize - header)) / (bc.streamCount * w);
+    while (records && bc.packetSize < packetBytes(records)) {
+      records--;
+    }
+    // Stream lengths are 16-bit.
+    while (records && 0xFFFFu < (records * w + 7) / 8) {
+      records--;
+    }
+    return static_cast<size_t>(records);
+  }
+
+  constexpr uint64_t GeneratorSeed = 0x9E3779B97F4A7C15ull;
+
+  int64_t integerMinimum(uint32_t w)
+  {
+    return w < 64 ? -(int64_t(1) << (w - 1)) : std::numeric_limits<int64_t>::min();
+  }
+
+  // Bits of the next value of a stream, in valueBitWidth bits.
+  uint64_t generateBits(const BenchCase& bc, uint64_t& rng)
+  {
+    const uint64_t r = xorshift(rng);
+    switch (bc.type) {
+    case ValueType::Float: {
+      float value = 2000.f * float(r >> 40) / float(1 << 24) - 1000.f;
+      uint32_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      return bits;
+    }
+    case ValueType::Double: {
+      double value = 2000.0 * double(r >> 11) / double(uint64_t(1) << 53) - 1000.0;
+      uint64_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      return bits;
+    }
+    default:
+      return bc.bitWidth < 64 ? r & ((uint64_t(1) << bc.bitWidth) - 1) : r;
+    }
+  }
+
+  // Value of generated bits as read into a double, integers before scale and offset.
+  double generatedValue(const BenchCase& bc, uint64_t bits)
+  {
+    switch (bc.type) {
+    case ValueType::Float: {
+      float value;
+      const uint32_t low = static_cast<uint32_t>(bits);
+      std::memcpy(&value, &low, sizeof(value));
+      return value;
+    }
+    case ValueType::Double: {
+      double value;
+      std::memcpy(&value, &bits, sizeof(value));
+      return value;
+    }
+    default:
+      return static_cast<double>(static_cast<int64_t>(static_cast<uint64_t>(integerMinimum(bc.bitWidth)) + bits));
+    }
+  }
+
+  // Replays the values of generateE57 in point order, see generatedValue.
+  struct GeneratedPoints
+  {
+    const BenchCase& bc;
+    uint64_t rng = GeneratorSeed;
+    std::vector<double> packet;     // Values of the current data packet, stream by stream.
+    size_t packetRecords = 0;
+    size_t packetPosition = 0;
+    uint64_t pointsLeft = 0;
+
+    GeneratedPoints(const BenchCase& bc_) : bc(bc_), pointsLeft(bc_.pointCount) {}
+
+    void next(double* dst, size_t count)
+    {
+      for (size_t i = 0; i < count; i++) {
+        if (packetPosition == packetRecords) {
+          packetRecords = static_cast<size_t>(std::min(uint64_t(recordsPerPacket(bc)), pointsLeft));
+          packetPosition = 0;
+          pointsLeft -= packetRecords;
+          packet.resize(bc.streamCount * packetRecords);
+          for (double& value : packet) {
+            value = generatedValue(bc, generateBits(bc, rng));
+          }
+        }
+        for (uint32_t stream = 0; stream < bc.streamCount; stream++) {
+          *dst++ = packet[stream * packetRecords + packetPosition];
+        }
+        packetPosition++;
+      }
+    }
+  };
+
+  bool generateE57(std::vector<uint8_t>& file, const BenchCase& bc)
+  {
+    const uint64_t pageSize = bc.pageSize;
+    const uint64_t logicalPageSize = pageSize - 4;
+    auto physical = [&](uint64_t logical) { return (logical / logicalPageSize) * pageSize + logical % logicalPageSize; };
+
+    const uint32_t w = valueBitWidth(bc);
+    const size_t packetRecords = recordsPerPacket(bc);
+    if (packetRecords == 0) {
+      logError(logger, "Packet size %u too small for %u streams of %u bits", bc.packetSize, bc.streamCount, w);
+      return false;
+    }
+
+    std::vector<uint8_t> logical(48);
+
+    // Compressed vector section, header patched when the length is known.
+    const uint64_t sectionOffset = logical.size();
+    logical.resize(logical.size() + 32);
+    const uint64_t dataOffset = logical.size();
+
+    uint64_t rng = GeneratorSeed;
+    std::vector<uint8_t> streamBytes;
+    std::vector<IndexEntry> indexEntries;
+    for (size_t pointsDone = 0; pointsDone < bc.pointCount; pointsDone += packetRecords) {
+      const size_t records = std::min(packetRecords, bc.pointCount - pointsDone);
+
+      const size_t packetOffset = logical.size();
+      indexEntries.push_back({ .record = pointsDone, .physicalOffset = physical(packetOffset) });
+      const size_t tableOffset = packetOffset + 6;
+      logical.resize(tableOffset + 2 * size_t(bc.streamCount));
+
+      for (uint32_t stream = 0; stream < bc.streamCount; stream++) {
+        streamBytes.clear();
+        BitWriter bitWriter{ .out = streamBytes };
+        for (size_t i = 0; i < records; i++) {
+          bitWriter.put(generateBits(bc, rng), w);
+        }
+        bitWriter.flush();
+        putUint16LE(logical, tableOffset + 2 * stream, streamBytes.size());
+        logical.insert(logical.end(), streamBytes.begin(), streamBytes.end());
+      }
+      while (logical.size() % 4) {
+        logical.push_back(0);
+      }
+
+      const size_t packetLength = logical.size() - packetOffset;
+      logical[packetOffset + 0] = 1;  // Data packet
+      logical[packetOffset + 1] = 0;
+      putUint16LE(logical, packetOffset + 2, packetLength - 1);
+      putUint16LE(logical, packetOffset + 4, bc.streamCount);
+    }
+
+    const uint64_t indexOffset = bc.index ? appendIndex(logical, std::move(indexEntries), physical) : 0;
+
+    const uint64_t sectionLength = logical.size() - sectionOffset;
+    logical[sectionOffset] = 1;  // Compressed vector section
+    putUint64LE(logical, sectionOffset + 8, sectionLength);
+    putUint64LE(logical, sectionOffset + 16, physical(dataOffset));
+    putUint64LE(logical, sectionOffset + 24, bc.index ? physical(indexOffset) : 0);
+
+    // XML
+    std::string xml;
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp),
+             "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+             "<e57Root type=\"Structure\" xmlns=\"http://www.astm.org/COMMIT/E57/2010-e57-v1.0\">\n"
+             "<data3D type=\"Vector\" allowHeterogeneousChildren=\"1\">\n"
+             "<vectorChild type=\"Structure\">\n"
+             "<points type=\"CompressedVector\" fileOffset=\"%" PRIu64 "\" recordCount=\"%zu\">\n"
+             "<prototype type=\"Structure\">\n",
+             physical(sectionOffset), bc.pointCount);
+    xml += tmp;
+    for (uint32_t stream = 0; stream < bc.streamCount; stream++) {
+      const int64_t min = integerMinimum(w);
+      const int64_t max = w < 64 ? min + int64_t((uint64_t(1) << w) - 1) : std::numeric_limits<int64_t>::max();
+      switch (bc.type) {
+      case ValueType::Float:
+        snprintf(tmp, sizeof(tmp), "<%s type=\"Float\" precision=\"single\" minimum=\"-1000\" maximum=\"1000\"/>\n", streamNames[stream]);
+        break;
+      case ValueType::Double:
+        snprintf(tmp, sizeof(tmp), "<%s type=\"Float\" precision=\"double\" minimum=\"-1000\" maximum=\"1000\"/>\n", streamNames[stream]);
+        break;
+      case ValueType::Integer:
+        snprintf(tmp, sizeof(tmp), "<%s type=\"Integer\" minimum=\"%" PRId64 "\" maximum=\"%" PRId64 "\"/>\n", streamNames[stream], min, max);
+        break;
+      case ValueType::ScaledInteger:
+        snprintf(tmp, sizeof(tmp), "<%s type=\"ScaledInteger\" minimum=\"%" PRId64 "\" maximum=\"%" PRId64 "\" scale=\"0.001\" offset=\"0\"/>\n", streamNames[stream], min, max);
+        break;
+      }
+      xml += tmp;
+    }
+    xml += "</prototype>\n"
+           "<codecs type=\"Vector\" allowHeterogeneousChildren=\"1\"></codecs>\n"
+           "</points>\n"
+           "</vectorChild>\n"
+           "</data3D>\n"
+           "</e57Root>\n";
+    const uint64_t xmlOffset = logical.size();
+    logical.insert(logical.end(), xml.begin(), xml.end());
+
+    // Pad to whole pages and fill in the file header.
+    const uint64_t pageCount = (logical.size() + logicalPageSize - 1) / logicalPageSize;
+    logical.resize(pageCount * logicalPageSize);
+    std::memcpy(logical.data(), "ASTM-E57", 8);
+    putUint32LE(logical, 8, 1);
+    putUint32LE(logical, 12, 0);
+    putUint64LE(logical, 16, pageCount * pageSize);
+    putUint64LE(logical, 24, physical(xmlOffset));
+    putUint64LE(logical, 32, xml.size());
+    putUint64LE(logical, 40, pageSize);
+
+    // Split into pages with checksums, stored big endian to match the reader.
+    file.resize(pageCount * pageSize);
+    for (uint64_t page = 0; page < pageCount; page++) {
+      const uint8_t* src = logical.data() + page * logicalPageSize;
+      uint8_t* dst = file.data() + page * pageSize;
+      std::memcpy(dst, src, logicalPageSize);
+
+      uint32_t crc = crc32c(src, logicalPageSize);
+      dst[logicalPageSize + 0] = static_cast<uint8_t>(crc >> 24);
+      dst[logicalPageSize + 1] = static_cast<uint8_t>(crc >> 16);
+      dst[logicalPageSize + 2] = static_cast<uint8_t>(crc >> 8);
+      dst[logicalPageSize + 3] = static_cast<uint8_t>(crc);
+    }
+    return true;
+  }
+
+
+  // --- Benchmark --------------------------------------------------------------
+
+  bool consumeCallback(void* /*callbackData*/, char* /*batch*/, size_t /*pointCount*/)
+  {
+    return true;
+  }
+
+  struct CollectPoints
+  {
+    size_t bytesPerPoint = 0;
+    std::vector<char> bytes;
+
+    static bool consumeCallback(void* data, char* batch, size_t pointCount)
+    {
+      CollectPoints* that = static_cast<CollectPoints*>(data);
+      that->bytes.insert(that->bytes.end(), batch, batch + that->bytesPerPoint * pointCount);
+      return true;
+    }
+  };
+
+  // Checks that PointReader returns the same points as readE57Points, both when reading
+  // straight through and after seeking forwards and backwards, across packet boundaries.
+  bool checkPointReader(const E57File& e57, const BenchCase& bc, View<const ComponentWriteDesc> writeDesc, size_t bytesPerPoint)
+  {
+    const size_t pointCapacity = suggestE57BatchSize(&e57, logger, 0, bytesPerPoint);
+    if (pointCapacity == 0) {
+      return false;
+    }
+    std::vector<char> buffer(pointCapacity * bytesPerPoint);
+    CollectPoints expected{ .bytesPerPoint = bytesPerPoint };
+    ReadPointsArgs readPointsArgs{
+      .buffer = View<char>(buffer.data(), buffer.size()),
+      .writeDesc = writeDesc,
+      .consumeCallback = CollectPoints::consumeCallback,
+      .consumeCallbackData = &expected,
+      .pointCapacity = pointCapacity,
+      .pointSetIndex = 0
+    };
+    if (!readE57Points(&e57, logger, readPointsArgs) || expected.bytes.size() != bc.pointCount * bytesPerPoint) {
+      logError(logger, "Reading the reference points failed");
+      return false;
+    }
+
+    PointReader reader;
+    if (!reader.open(&e57, logger, 0, writeDesc)) {
+      return false;
+    }
+
+    // Straight through, in batches that do not line up with packets.
+    constexpr size_t MaxPoints = 1000;
+    std::vector<char> batch(MaxPoints * bytesPerPoint);
+    View<char> batchView(batch.data(), batch.size());
+    for (uint64_t position = 0; position < bc.pointCount;) {
+      const size_t count = reader.next(batchView, MaxPoints);
+      if (count == 0 || std::memcmp(batch.data(), expected.bytes.data() + bytesPerPoint * position, bytesPerPoint * count) != 0) {
+        logError(logger, "PointReader::next differs from the consume callback at point %" PRIu64, position);
+        return false;
+      }
+      position += count;
+    }
+    if (reader.next(batchView, MaxPoints) != 0 || reader.failed()) {
+      logError(logger, "PointReader::next did not stop at the end of the point set");
+      return false;
+    }
+
+    // Seeks to the ends, around packet boundaries, backwards and to random points.
+    const uint64_t n = bc.pointCount;
+    const uint64_t p = recordsPerPacket(bc);
+    std::vector<uint64_t> targets = { 0, 1, p - 1, p, p + 1, 3 * p + 7, n / 2, n - 1, n / 3, 2, n };
+    uint64_t rng = 0x2545F4914F6CDD1Dull;
+    for (size_t i = 0; i < 16; i++) {
+      targets.push_back(xorshift(rng) % n);
+    }
+    for (uint64_t target : targets) {
+      target = std::min(target, n);
+      if (!reader.seek(target) || reader.position() != target) {
+        logError(logger, "PointReader::seek to point %" PRIu64 " failed", target);
+        return false;
+      }
+      const size_t count = reader.next(batchView, MaxPoints);
+      if (count != std::min(uint64_t(MaxPoints), n - target) ||
+          std::memcmp(batch.data(), expected.bytes.data() + bytesPerPoint * target, bytesPerPoint * count) != 0)
+      {
+        logError(logger, "PointReader::seek to point %" PRIu64 " followed by next differs from the consume callback", target);
+        return false;
+      }
+    }
+
+    // A batch short of room for 8 points gets 7, and the bytes beyond it are left alone.
+    constexpr char Guard = 0x5A;
+    const uint64_t target = std::min(uint64_t(3), n);
+    std::fill(batch.begin(), batch.end(), Guard);
+    const size_t shortSize = 8 * bytesPerPoint - 1;
+    if (!reader.seek(target) ||
+        reader.next(View<char>(batch.data(), shortSize), MaxPoints) != std::min(uint64_t(7), n - target) ||
+        std::memcmp(batch.data(), expected.bytes.data() + bytesPerPoint * target, bytesPerPoint * std::min(uint64_t(7), n - target)) != 0 ||
+        std::any_of(batch.begin() + shortSize, batch.end(), [](char c) { return c != Guard; }))
+    {
+      logError(logger, "PointReader::next into a batch of %zu bytes did not return the points it has room for", shortSize);
+      return false;
+    }
+    return true;
+  }
+
+  // Checks that histograms filled by two PointReaders on separate threads, one for each
+  // half of the points, merge into the histograms of a single readE57Points pass. Integer
+  // bins must match exactly, float sketches must agree on count, min and max and give
+  // quantiles whose true rank is close to the requested one.
+  bool checkHistogramMerge(const E57File& e57, const BenchCase& bc, View<const ComponentWriteDesc> writeDesc, size_t bytesPerPoint)
+  {
+    const Points& pts = e57.points[0];
+    auto initHistograms = [&](std::vector<ComponentHistogram>& histograms)
+    {
+      histograms.resize(writeDesc.size);
+      for (size_t i = 0; i < writeDesc.size; i++) {
+        histograms[i].init(pts.components[writeDesc[i].stream]);
+      }
+    };
+
+    const size_t pointCapacity = suggestE57BatchSize(&e57, logger, 0, bytesPerPoint);
+    if (pointCapacity == 0) {
+      return false;
+    }
+    std::vector<char> buffer(pointCapacity * bytesPerPoint);
+    std::vector<ComponentHistogram> expected;
+    initHistograms(expected);
+    CollectPoints points{ .bytesPerPoint = bytesPerPoint };
+    ReadPointsArgs readPointsArgs{
+      .buffer = View<char>(buffer.data(), buffer.size()),
+      .writeDesc = writeDesc,
+      .consumeCallback = CollectPoints::consumeCallback,
+      .consumeCallbackData = &points,
+      .pointCapacity = pointCapacity,
+      .pointSetIndex = 0,
+      .componentHistograms = expected.data()
+    };
+    if (!readE57Points(&e57, logger, readPointsArgs) || points.bytes.size() != bc.pointCount * bytesPerPoint) {
+      logError(logger, "Reading the reference histograms failed");
+      return false;
+    }
+
+    const uint64_t n = bc.pointCount;
+    std::vector<ComponentHistogram> halves[2];
+    bool halfOk[2] = { false, false };
+    auto readHalf = [&](size_t half)
+    {
+      initHistograms(halves[half]);
+      const uint64_t begin = half == 0 ? 0 : n / 2;
+      const uint64_t end = half == 0 ? n / 2 : n;
+      PointReader reader;
+      if (!reader.open(&e57, logger, 0, writeDesc, nullptr, halves[half].data()) || !reader.seek(begin)) {
+        return;
+      }
+      constexpr size_t MaxPoints = 1000;
+      std::vector<char> batch(MaxPoints * bytesPerPoint);
+      for (uint64_t position = begin; position < end;) {
+        const size_t count = reader.next(View<char>(batch.data(), batch.size()), static_cast<size_t>(std::min(uint64_t(MaxPoints), end - position)));
+        if (count == 0) {
+          return;
+        }
+        position += count;
+      }
+      halfOk[half] = true;
+    };
+    std::thread thread(readHalf, 1);
+    readHalf(0);
+    thread.join();
+    if (!halfOk[0] || !halfOk[1]) {
+      logError(logger, "Reading histograms through PointReader failed");
+      return false;
+    }
+
+    std::vector<float> values(n);
+    for (size_t i = 0; i < writeDesc.size; i++) {
+      ComponentHistogram& merged = halves[0][i];
+      const ComponentHistogram& reference = expected[i];
+      if (!merged.merge(halves[1][i]) || merged.count() != n || merged.count() != reference.count()) {
+        logError(logger, "Merged histogram of stream %zu holds %" PRIu64 " values, expected %" PRIu64, i, merged.count(), reference.count());
+        return false;
+      }
+      if (!merged.bins.empty()) {
+        if (merged.bins != reference.bins) {
+          logError(logger, "Merged histogram bins of stream %zu differ from a single pass", i);
+          return false;
+        }
+        continue;
+      }
+      if (merged.sketch.min != reference.sketch.min || merged.sketch.max != reference.sketch.max) {
+        logError(logger, "Merged sketch of stream %zu has range [%g, %g], expected [%g, %g]", i,
+                 merged.sketch.min, merged.sketch.max, reference.sketch.min, reference.sketch.max);
+        return false;
+      }
+
+      // True rank of the quantiles from the decoded values.
+      for (uint64_t k = 0; k < n; k++) {
+        std::memcpy(&values[k], points.bytes.data() + bytesPerPoint * k + writeDesc[i].offset, sizeof(float));
+      }
+      std::sort(values.begin(), values.end());
+      for (double q : { 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99 }) {
+        const float value = static_cast<float>(merged.quantile(q));
+        const size_t lower = std::lower_bound(values.begin(), values.end(), value) - values.begin();
+        const size_t upper = std::upper_bound(values.begin(), values.end(), value) - values.begin();
+        const double rank = 0.5 * double(lower + upper) / double(n);
+        if (0.03 < std::abs(rank - q)) {
+          logError(logger, "Merged sketch quantile %.2f of stream %zu is %g at rank %.4f", q, i, value, rank);
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Checks that a grid filled by a pipelined readE57Points without a consume callback
+  // holds the last point of each cell and counts the points outside, when the case has
+  // row and column index streams. The grid covers only part of the index values.
+  bool checkGrid(const E57File& e57, const BenchCase& bc, View<const ComponentWriteDesc> writeDesc, size_t bytesPerPoint)
+  {
+    constexpr uint32_t RowStream = 7;
+    constexpr uint32_t ColumnStream = 8;
+    if (bc.streamCount <= ColumnStream) {
+      return true;
+    }
+
+    const size_t pointCapacity = suggestE57BatchSize(&e57, logger, 0, bytesPerPoint);
+    if (pointCapacity == 0) {
+      return false;
+    }
+    std::vector<char> buffer(2 * pointCapacity * bytesPerPoint);
+    CollectPoints points{ .bytesPerPoint = bytesPerPoint };
+    ReadPointsArgs readPointsArgs{
+      .buffer = View<char>(buffer.data(), pointCapacity * bytesPerPoint),
+      .writeDesc = writeDesc,
+      .consumeCallback = CollectPoints::consumeCallback,
+      .consumeCallbackData = &points,
+      .pointCapacity = pointCapacity,
+      .pointSetIndex = 0
+    };
+    if (!readE57Points(&e57, logger, readPointsArgs) || points.bytes.size() != bc.pointCount * bytesPerPoint) {
+      logError(logger, "Reading the reference points failed");
+      return false;
+    }
+
+    constexpr size_t Rows = 100;
+    constexpr size_t Columns = 150;
+    std::vector<char> expected(Rows * Columns * bytesPerPoint);
+    const float invalid = std::numeric_limits<float>::quiet_NaN();
+    for (size_t offset = 0; offset < expected.size(); offset += sizeof(float)) {
+      std::memcpy(expected.data() + offset, &invalid, sizeof(float));
+    }
+    uint64_t outside = 0;
+    for (size_t k = 0; k < bc.pointCount; k++) {
+      const char* point = points.bytes.data() + bytesPerPoint * k;
+      float row, column;
+      std::memcpy(&row, point + writeDesc[RowStream].offset, sizeof(float));
+      std::memcpy(&column, point + writeDesc[ColumnStream].offset, sizeof(float));
+      if (0.f <= row && row < float(Rows) && 0.f <= column && column < float(Columns)) {
+        std::memcpy(expected.data() + bytesPerPoint * (size_t(row) * Columns + size_t(column)), point, bytesPerPoint);
+      }
+      else {
+        outside++;
+      }
+    }
+
+    std::vector<char> cells(expected.size());
+    GridWriteDesc grid{
+      .cells = View<char>(cells.data(), cells.size()),
+      .rows = Rows,
+      .columns = Columns,
+      .cellStride = bytesPerPoint,
+      .rowDesc = RowStream,
+      .columnDesc = ColumnStream
+    };
+    readPointsArgs.buffer = View<char>(buffer.data(), buffer.size());
+    readPointsArgs.consumeCallback = nullptr;
+    readPointsArgs.consumeCallbackData = nullptr;
+    readPointsArgs.bufferCount = 2;
+    readPointsArgs.grid = &grid;
+    if (!readE57Points(&e57, logger, readPointsArgs)) {
+      logError(logger, "Reading into a grid failed");
+      return false;
+    }
+    if (grid.pointsOutside != outside || grid.pointsWritten + grid.pointsOutside != bc.pointCount) {
+      logError(logger, "Grid has %" PRIu64 " points written and %" PRIu64 " outside, expected %" PRIu64 " outside",
+               grid.pointsWritten, grid.pointsOutside, outside);
+      return false;
+    }
+    for (size_t cell = 0; cell < Rows * Columns; cell++) {
+      if (std::memcmp(cells.data() + bytesPerPoint * cell, expected.data() + bytesPerPoint * cell, bytesPerPoint) != 0) {
+        logError(logger, "Grid cell %zu differs from the last point with its indices", cell);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  struct FileOutput
+  {
+    FILE* file = nullptr;
+    uint64_t position = 0;
+
+    static bool writeCallback(void* data, uint64_t offset, const void* ptr, size_t size)
+    {
+      FileOutput* that = static_cast<FileOutput*>(data);
+      if (offset != that->position && !seekFile(that->file, offset)) {
+        return false;
+      }
+      if (std::fwrite(ptr, 1, size, that->file) != size) {
+        return false;
+      }
+      that->position = offset + size;
+      return true;
+    }
+  };
+
+  // Compares batches of doubles, one per stream, with the generated values.
+  struct CompareGenerated
+  {
+    GeneratedPoints generated;
+    std::vector<double> expected;
+    uint64_t position = 0;
+
+    static bool consumeCallback(void* data, char* batch, size_t pointCount)
+    {
+      CompareGenerated* that = static_cast<CompareGenerated*>(data);
+      that->expected.resize(that->generated.bc.streamCount * pointCount);
+      that->generated.next(that->expected.data(), pointCount);
+      if (std::memcmp(batch, that->expected.data(), sizeof(double) * that->expected.size()) != 0) {
+        logError(logger, "Points from %" PRIu64 " differ from the generated values", that->position);
+        return false;
+      }
+      that->position += pointCount;
+      return true;
+    }
+  };
+
+  // Checks that a copy of the case written through E57Writer, with the page size of the
+  // case, reads back as the generated values through readE57Points, and as the source
+  // after seeks. Values are passed as doubles, integers before scale and offset, so
+  // they round trip exactly. The copy is also given a name and a pose that must be
+  // read back unchanged.
+  bool checkWriter(const E57File& e57, const BenchCase& bc, const BenchOptions& options)
+  {
+    const Points& pts = e57.points[0];
+    const size_t bytesPerPoint = sizeof(double) * bc.streamCount;
+    std::vector<ComponentWriteDesc> writeDescs;
+    for (uint32_t stream = 0; stream < bc.streamCount; stream++) {
+      writeDescs.push_back(ComponentWriteDesc{ .offset = sizeof(double) * stream, .stride = bytesPerPoint, .type = ComponentWriteDesc::Type::Double, .stream = stream, .unscaled = true });
+    }
+    const View<const ComponentWriteDesc> writeDesc(writeDescs.data(), writeDescs.size());
+
+    const std::string copyPath = options.scratchPath + ".copy";
+    FileOutput output{ .file = std::fopen(copyPath.c_str(), "wb") };
+    if (!output.file) {
+      logError(logger, "Failed to open '%s' for writing", copyPath.c_str());
+      return false;
+    }
+
+    constexpr size_t MaxPoints = 1000;
+    std::vector<char> batch(MaxPoints * bytesPerPoint);
+    const char* name = "bench & copy";
+    const Pose pose{ .rotation = { 0.5, -0.5, 0.5, 0.5 }, .translation = { 1e6, -0.25, 3.0 } };
+    PointReader source;
+    E57Writer writer;
+    bool written = source.open(&e57, logger, 0, writeDesc) &&
+                   writer.open(logger, FileOutput::writeCallback, &output, bc.pageSize) &&
+                   writer.beginPoints(View<const Component>(pts.components.data, pts.components.size), writeDesc, name, &pose);
+    while (written) {
+      const size_t count = source.next(View<char>(batch.data(), batch.size()), MaxPoints);
+      if (count == 0) {
+        written = !source.failed() && writer.endPoints();
+        break;
+      }
+      written = writer.writePoints(batch.data(), count);
+    }
+    written = writer.close() && written;
+    if (std::fclose(output.file) != 0 || !written) {
+      logError(logger, "Failed to write '%s'", copyPath.c_str());
+      std::remove(copyPath.c_str());
+      return false;
+    }
+
+    bool success = false;
+    {
+      MemoryMappedFile mappedFile(logger, copyPath.c_str());
+      E57File copy;
+      if (mappedFile.good && openE57(copy, logger, memoryMappedFileCallback, &mappedFile, mappedFile.size)) {
+        success = copy.points.size == 1 && copy.points[0].recordCount == bc.pointCount;
+        if (!success) {
+          logError(logger, "Copy does not hold a single point set of %zu points", bc.pointCount);
+        }
+      }
+      if (success) {
+        const Points& copyPts = copy.points[0];
+        success = copyPts.name && std::strcmp(copyPts.name, name) == 0 && copyPts.hasPose &&
+                  std::memcmp(&copyPts.pose, &pose, sizeof(Pose)) == 0;
+        if (!success) {
+          logError(logger, "Copy does not keep the name and pose of the point set");
+        }
+      }
+
+      // Straight through against the generated values.
+      if (success) {
+        const size_t pointCapacity = suggestE57BatchSize(&copy, logger, 0, bytesPerPoint);
+        std::vector<char> buffer(pointCapacity * bytesPerPoint);
+        CompareGenerated compare{ .generated = GeneratedPoints(bc) };
+        ReadPointsArgs readPointsArgs{
+          .buffer = View<char>(buffer.data(), buffer.size()),
+          .writeDesc = writeDesc,
+          .consumeCallback = CompareGenerated::consumeCallback,
+          .consumeCallbackData = &compare,
+          .pointCapacity = pointCapacity,
+          .pointSetIndex = 0
+        };
+        success = pointCapacity != 0 && readE57Points(&copy, logger, readPointsArgs);
+        if (!success) {
+          logError(logger, "Copy written by E57Writer differs from the generated values");
+        }
+      }
+
+      // Seeks through the index of the copy, at the ends and at random points.
+      if (success) {
+        const uint64_t n = bc.pointCount;
+        std::vector<uint64_t> targets = { 0, n - 1, n / 2, 1, n };
+        uint64_t rng = 0x853C49E6748FEA9Bull;
+        for (size_t i = 0; i < 16; i++) {
+          targets.push_back(xorshift(rng) % n);
+        }
+        std::vector<char> expected(batch.size());
+        PointReader reader;
+        success = reader.open(&copy, logger, 0, writeDesc);
+        for (size_t i = 0; success && i < targets.size(); i++) {
+          const uint64_t target = targets[i];
+          const size_t count = static_cast<size_t>(std::min(uint64_t(MaxPoints), n - target));
+          success = reader.seek(target) && source.seek(target) &&
+                    reader.next(View<char>(batch.data(), batch.size()), MaxPoints) == count &&
+                    source.next(View<char>(expected.data(), expected.size()), MaxPoints) == count &&
+                    std::memcmp(batch.data(), expected.data(), bytesPerPoint * count) == 0;
+          if (!success) {
+            logError(logger, "Seek to point %" PRIu64 " in the copy written by E57Writer differs from the source", target);
+          }
+        }
+      }
+    }
+    std::remove(copyPath.c_str());
+    return success;
+  }
+
+  bool readWholeFile(std::vector<char>& bytes, const std::filesystem::path& path)
+  {
+    FILE* file = std::fopen(path.string().c_str(), "rb");
+    if (!file) {
+      logError(logger, "Failed to open '%s'", path.string().c_str());
+      return false;
+    }
+    bytes.clear();
+    char block[4096];
+    for (size_t n; (n = std::fread(block, 1, sizeof(block), file)) != 0; ) {
+      bytes.insert(bytes.end(), block, block + n);
+    }
+    const bool good = std::ferror(file) == 0;
+    std::fclose(file);
+    return good;
+  }
+
+  // Checks that octrees built with memory budgets small enough to spill to the temporary
+  // file, down to zero which spills as soon as a node worth of points is held, are
+  // identical to the octree built fully in memory. Half the points are in a dense
+  // cluster so that spilled cells are split further through the temporary file.
+  bool checkOctreeSpill(const BenchOptions& options)
+  {
+    constexpr size_t PointCount = 300000;
+    constexpr uint32_t MaxNodePoints = 4096;
+    const OctreeDesc desc{ .bits = 20, .hasIntensity = true, .hasColor = true };
+
+    std::vector<OctreePoint> points(PointCount);
+    uint64_t rng = GeneratorSeed;
+    for (size_t i = 0; i < PointCount; i++) {
+      const uint64_t r = xorshift(rng);
+      const bool cluster = (r & 1) != 0;
+      uint32_t c[3];
+      for (size_t a = 0; a < 3; a++) {
+        const uint32_t bits = static_cast<uint32_t>(xorshift(rng));
+        c[a] = cluster ? (1u << 18) + (bits & 0x3FFF) : bits & 0xFFFFF;
+      }
+      points[i] = OctreePoint{ .x = c[0], .y = c[1], .z = c[2],
+                               .r = uint8_t(r >> 8), .g = uint8_t(r >> 16), .b = uint8_t(r >> 24), .intensity = uint8_t(r >> 32) };
+    }
+
+    const size_t budgets[3] = { std::numeric_limits<size_t>::max(), 0, size_t(1) << 20 };
+    std::vector<std::filesystem::path> directories;
+    bool success = true;
+    for (size_t k = 0; success && k < 3; k++) {
+      const std::filesystem::path& directory = directories.emplace_back(options.scratchPath + ".octree" + std::to_string(k));
+      OctreeBuilder builder;
+      success = builder.open(logger, directory.string().c_str(), desc, budgets[k], MaxNodePoints);
+      for (size_t first = 0; success && first < PointCount; first += 10000) {
+        success = builder.addPoints(points.data() + first, std::min(size_t(10000), PointCount - first));
+      }
+      success = builder.close() && success;
+      if (!success) {
+        logError(logger, "Failed to build octree with a memory budget of %zu bytes", budgets[k]);
+      }
+    }
+
+    for (const char* name : { "octree.bin", "hierarchy.bin", "metadata.json" }) {
+      std::vector<char> expected, bytes;
+      if (success) {
+        success = readWholeFile(expected, directories[0] / name);
+      }
+      for (size_t k = 1; success && k < 3; k++) {
+        success = readWholeFile(bytes, directories[k] / name) && bytes == expected;
+        if (!success) {
+          logError(logger, "%s of octree built with a memory budget of %zu bytes differs from the one built in memory", name, budgets[k]);
+        }
+      }
+    }
+
+    for (const std::filesystem::path& directory : directories) {
+      std::error_code ec;
+      std::filesystem::remove_all(directory, ec);
+    }
+    return success;
+  }
+
+  // Collects the points passed on by a voxel filter.
+  struct VoxelOutput
+  {
+    using Record = std::array<uint8_t, 16>;
+    std::vector<Record> records;
+
+    static bool consumeCallback(void* data, char* batch, size_t pointCount)
+    {
+      VoxelOutput* that = reinterpret_cast<VoxelOutput*>(data);
+      const size_t size = that->records.size();
+      that->records.resize(size + pointCount);
+      std::memcpy(that->records.data() + size, batch, sizeof(Record) * pointCount);
+      return true;
+    }
+  };
+
+  // Checks that voxel filtering with memory budgets that spill to the temporary file,
+  // down to zero which spills on every new voxel, passes on the same points as filtering
+  // in memory, for every mode. Spilling changes the order, so points are compared sorted.
+  // Positions and attributes are integers, so sums and with that means are exact in any
+  // order. Half the points are in a dense cluster, to get voxels that hold many points.
+  bool checkVoxelSpill()
+  {
+    constexpr size_t PointCount = 100000;
+    constexpr size_t Capacity = 1000;
+    using Record = VoxelOutput::Record;
+    const ComponentWriteDesc layout[6] = {
+      { .offset = 0,  .stride = sizeof(Record), .type = ComponentWriteDesc::Type::Int32, .stream = 0 },
+      { .offset = 4,  .stride = sizeof(Record), .type = ComponentWriteDesc::Type::Int32, .stream = 1 },
+      { .offset = 8,  .stride = sizeof(Record), .type = ComponentWriteDesc::Type::Int32, .stream = 2 },
+      { .offset = 12, .stride = sizeof(Record), .type = ComponentWriteDesc::Type::UInt16, .stream = 3 },
+      { .offset = 14, .stride = sizeof(Record), .type = ComponentWriteDesc::Type::UInt8, .stream = 4 },
+      { .offset = 15, .stride = sizeof(Record), .type = ComponentWriteDesc::Type::UInt8, .stream = 5 }
+    };
+    const VoxelFilter::Axis axes[3] = {
+      { .field = 0, .scale = 0.001 },
+      { .field = 1, .scale = 0.001 },
+      { .field = 2, .scale = 0.001 }
+    };
+
+    std::vector<Record> points(PointCount);
+    uint64_t rng = GeneratorSeed;
+    for (size_t i = 0; i < PointCount; i++) {
+      const uint64_t r = xorshift(rng);
+      const bool cluster = (r & 1) != 0;
+      int32_t c[3];
+      for (size_t a = 0; a < 3; a++) {
+        const uint64_t bits = xorshift(rng);
+        c[a] = cluster ? 8000 + static_cast<int32_t>(bits % 2000) : static_cast<int32_t>(bits % 16000) - 8000;
+      }
+      const uint16_t intensity = static_cast<uint16_t>(r >> 8);
+      std::memcpy(points[i].data(), c, sizeof(c));
+      std::memcpy(points[i].data() + 12, &intensity, sizeof(intensity));
+      points[i][14] = uint8_t(r >> 24);
+      points[i][15] = uint8_t(r >> 32);
+    }
+
+    const size_t budgets[3] = { size_t(1024) << 20, 0, size_t(64) << 10 };
+    std::vector<char> buffer(sizeof(Record) * Capacity);
+    for (VoxelFilter::Mode mode : { VoxelFilter::Mode::First, VoxelFilter::Mode::Centroid, VoxelFilter::Mode::Average }) {
+      std::vector<Record> expected;
+      for (size_t k = 0; k < 3; k++) {
+        VoxelFilter filter;
+        VoxelOutput output;
+        uint64_t pointCount = 0;
+        bool success = filter.init(logger, View<const ComponentWriteDesc>(layout, 6), axes, 0.5, mode, budgets[k]);
+        for (size_t first = 0; success && first < PointCount; first += Capacity) {
+          success = VoxelFilter::consumeCallback(&filter, reinterpret_cast<char*>(points.data() + first), std::min(Capacity, PointCount - first));
+        }
+        success = success &&
+          filter.finish(pointCount) &&
+          filter.emit(VoxelOutput::consumeCallback, &output, buffer.data(), Capacity) &&
+          output.records.size() == pointCount;
+        if (!success) {
+          logError(logger, "Voxel filter failed with a memory budget of %zu bytes", budgets[k]);
+          return false;
+        }
+        std::sort(output.records.begin(), output.records.end());
+        if (k == 0) {
+          expected = std::move(output.records);
+        }
+        else if (output.records != expected) {
+          logError(logger, "Voxel filter mode %u with a memory budget of %zu bytes differs from filtering in memory",
+                   static_cast<uint32_t>(mode), budgets[k]);
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  void printCsvHeader()
+  {
+    printf("type,bit_width,streams,packet_size,page_size,index,points,file_bytes,open_s,read_s,points_per_s,gb_per_s\n");
+  }
+
+  bool runCase(const BenchCase& bc, const BenchOptions& options)
+  {
+    std::vector<uint8_t> bytes;
+    if (!generateE57(bytes, bc)) {
+      return false;
+    }
+
+    FILE* file = std::fopen(options.scratchPath.c_str(), "wb");
+    if (!file) {
+      logError(logger, "Failed to open '%s' for writing", options.scratchPath.c_str());
+      return false;
+    }
+    bool written = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    if (std::fclose(file) != 0 || !written) {
+      logError(logger, "Failed to write '%s'", options.scratchPath.c_str());
+      return false;
+    }
+
+    bool success = true;
+    double bestOpen = std::numeric_limits<double>::max();
+    double bestRead = std::numeric_limits<double>::max();
+    {
+      MemoryMappedFile mappedFile(logger, options.scratchPath.c_str());
+      if (!mappedFile.good) {
+        success = false;
+      }
+
+      const size_t bytesPerPoint = sizeof(float) * bc.streamCount;
+      std::vector<ComponentWriteDesc> writeDescs;
+      for (uint32_t stream = 0; stream < bc.streamCount; stream++) {
+        writeDescs.push_back(ComponentWriteDesc{ .offset = sizeof(float) * stream, .stride = bytesPerPoint, .stream = stream });
+      }
+
+      Buffer<char> buffer;
+      for (size_t iteration = 0; success && iteration < options.repeat; iteration++) {
+
+        uint64_t t0 = getMonotonicNanoseconds();
+        E57File e57;
+        if (!openE57(e57, logger, memoryMappedFileCallback, &mappedFile, mappedFile.size)) {
+          success = false;
+          break;
+        }
+        uint64_t t1 = getMonotonicNanoseconds();
+
+        size_t pointCapacity = options.batchSize ? options.batchSize : suggestE57BatchSize(&e57, logger, 0, bytesPerPoint);
+        size_t bufferSize = options.pipelineDepth * pointCapacity * bytesPerPoint;
+        if (buffer.size() < bufferSize) {
+          buffer.accommodate(bufferSize);
+        }
+
+        ReadPointsArgs readPointsArgs{
+          .buffer = View<char>(buffer.data(), bufferSize),
+          .writeDesc = View<const ComponentWriteDesc>(writeDescs.data(), writeDescs.size()),
+          .consumeCallback = consumeCallback,
+          .consumeCallbackData = nullptr,
+          .pointCapacity = pointCapacity,
+          .pointSetIndex = 0,
+          .bufferCount = options.pipelineDepth
+        };
+        uint64_t t2 = getMonotonicNanoseconds();
+        if (!readE57Points(&e57, logger, readPointsArgs)) {
+          success = false;
+          break;
+        }
+        uint64_t t3 = getMonotonicNanoseconds();
+
+        bestOpen = std::min(bestOpen, 1e-9 * double(t1 - t0));
+        bestRead = std::min(bestRead, 1e-9 * double(t3 - t2));
+
+        if (options.check && iteration == 0 &&
+            (!checkPointReader(e57, bc, View<const ComponentWriteDesc>(writeDescs.data(), writeDescs.size()), bytesPerPoint) ||
+             !checkHistogramMerge(e57, bc, View<const ComponentWriteDesc>(writeDescs.data(), writeDescs.size()), bytesPerPoint) ||
+             !checkGrid(e57, bc, View<const ComponentWriteDesc>(writeDescs.data(), writeDescs.size()), bytesPerPoint) ||
+             !checkWriter(e57, bc, options)))
+        {
+          success = false;
+          break;
+        }
+      }
+    }
+    std::remove(options.scratchPath.c_str());
+
+    if (!success) {
+      logError(logger, "Benchmark case failed");
+      return false;
+    }
+
+    printf("%s,%u,%u,%u,%u,%d,%zu,%zu,%.6f,%.6f,%.0f,%.3f\n",
+           valueTypeNames[static_cast<uint32_t>(bc.type)],
+           valueBitWidth(bc),
+           bc.streamCount, bc.packetSize, bc.pageSize, bc.index ? 1 : 0, bc.pointCount, bytes.size(),
+           bestOpen, bestRead,
+           double(bc.pointCount) / bestRead,
+           1e-9 * double(bytes.size()) / bestRead);
+    fflush(stdout);
+    return true;
+  }
+
+  // Default set of cases, covering each value type, a range of bit widths, stream
+  // counts, packet sizes and page sizes, with and without an index.
+  std::vector<BenchCase> suiteCases(size_t pointCount)
+  {
+    std::vector<BenchCase> cases;
+    for (ValueType type : { ValueType::Float, ValueType::Double }) {
+      cases.push_back(BenchCase{ .pointCount = pointCount, .type = type });
+    }
+    for (ValueType type : { ValueType::Integer, ValueType::ScaledInteger }) {
+      for (uint32_t bitWidth : { 1u, 8u, 12u, 18u, 24u, 32u, 48u, 62u, 64u }) {
+        cases.push_back(BenchCase{ .pointCount = pointCount, .type = type, .bitWidth = bitWidth });
+      }
+    }
+    for (uint32_t streamCount : { 1u, 4u, 7u, 12u }) {
+      cases.push_back(BenchCase{ .pointCount = pointCount, .streamCount = streamCount });
+    }
+    for (uint32_t packetSize : { 1024u, 4096u, 16384u }) {
+      cases.push_back(BenchCase{ .pointCount = pointCount, .packetSize = packetSize });
+    }
+    for (uint32_t pageSize : { 256u, 4096u, 65536u }) {
+      cases.push_back(BenchCase{ .pointCount = pointCount, .pageSize = pageSize });
+    }
+    for (uint32_t packetSize : { 1024u, 65536u }) {
+      cases.push_back(BenchCase{ .pointCount = pointCount, .packetSize = packetSize, .index = true });
+    }
+
+    // Enough points that the copy written by E57Writer has more than 2048 data packets,
+    // and with that a second index level.
+    cases.push_back(BenchCase{ .pointCount = std::max(pointCount, size_t(1500000)), .type = ValueType::Double, .streamCount = 12 });
+    return cases;
+  }
+
+  void printHelp(const char* path)
+  {
+    fprintf(stderr, R"help(
+Usage: %s [options]
+
+Generates synthetic E57 files and times openE57 and readE57Points through the
+memory-mapped file reader. Prints one CSV line per case to stdout, times are
+the best of the repeats. Without any case options, a default suite is run.
+Each case is also read through PointReader, straight through and after
+seeks, and checked against the points passed to the consume callback, and
+component histograms of the two halves read on separate threads are merged
+and checked against those of a single pass. Cases with row and column index
+streams are also read into a grid, which is checked cell by cell. Finally, a
+copy is written through E57Writer with the page size of the case, and read
+back and checked against the generated values, and after seeks. Before the
+cases, octrees built and points voxel filtered with memory budgets that
+spill to a temporary file are checked to be identical to those of running
+in memory.
+
+Options:
+  --help                  This help text.
+  --loglevel=<uint>       Specifies amount of logging, 0=trace, 1=debug,
+                          2=info, 3=warnings, 4=errors, 5=silent.
+  --repeat=<uint>         Number of times each case is timed. Defaults to 5.
+  --batch-size=<uint>     Number of points decoded per batch, 0=suggested
+                          by the reader. Defaults to 0.
+  --pipeline-depth=<uint> Number of point batch buffers. Defaults to 1.
+  --check=<bool>          Check PointReader, merged histograms, grids,
+                          E57Writer copies, and octree and voxel filter
+                          spilling. Defaults to true.
+  --scratch=<path>        File used to hold the generated E57 file, the
+                          E57Writer copy gets .copy appended and octree
+                          directories .octree0 to .octree2. Defaults to
+                          e57bench.tmp.e57, all removed afterwards.
+  --points=<uint>         Number of points per case. Defaults to 1000000.
+
+Case options:
+  --type=<type>           Component type, one of float, double, integer or
+                          scaledinteger. Defaults to scaledinteger.
+  --bit-width=<uint>      Bit width of integer types, 1 to %u. Defaults to 18.
+  --streams=<uint>        Number of components, 1 to %u. Defaults to 3.
+  --packet-size=<uint>    Max data packet size in bytes, up to 65536.
+                          Defaults to 65536.
+  --page-size=<uint>      Page size in bytes, a power of two from 128.
+                          Defaults to 1024.
+  --index=<bool>          Add index packets, used by PointReader::seek.
+                          Defaults to false.
+)help", path, MaxBitWidth, MaxStreamCount);
+  }
+
+  bool parseBool(bool& output, const char* arg, size_t offset)
+  {
+    const char* value = arg + offset;
+    if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0 || strcmp(value, "yes") == 0) {
+      output = true;
+      return true;
+    }
+    if (strcmp(value, "false") == 0 || strcmp(value, "0") == 0 || strcmp(value, "no") == 0) {
+      output = false;
+      return true;
+    }
+    logError(logger, "Failed to parse boolean in '%s'", arg);
+    return false;
+  }
+
+  bool parseUint(size_t& output, const char* arg, size_t offset)
+  {
+    char* end = nullptr;
+    const char* start = arg + offset;
+    unsigned long long value = std::strtoull(start, &end, 10);
+    if (end == start || *end != '\0') {
+      logError(logger, "Failed to parse unsigned integer in '%s'", arg);
+      return false;
+    }
+    output = static_cast<size_t>(value);
+    return true;
+  }
+
+}
+
+
+int main(int argc, char** argv)
+{
+  static const std::string option_help           = "--help";
+  static const std::string option_loglevel       = "--loglevel=";
+  static const std::string option_repeat         = "--repeat=";
+  static const std::string option_batch_size     = "--batch-size=";
+  static const std::string option_pipeline_depth = "--pipeline-depth=";
+  static const std::string option_check          = "--check=";
+  static const std::string option_scratch        = "--scratch=";
+  static const std::string option_points         = "--points=";
+  static const std::string option_type           = "--type=";
+  static const std::string option_bit_width      = "--bit-width=";
+  static const std::string option_streams        = "--streams=";
+  static const std::string option_packet_size    = "--packet-size=";
+  static const std::string option_page_size      = "--page-size=";
+  static const std::string option_index          = "--index=";
+
+  BenchOptions options;
+  BenchCase bc;
+  bool custom = false;
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    size_t value = 0;
+    if (strcmp(arg, option_help.c_str()) == 0) {
+      printHelp(argv[0]);
+      return EXIT_SUCCESS;
+    }
+    else if (strncmp(arg, option_loglevel.c_str(), option_loglevel.length()) == 0) {
+      if (!parseUint(logLevel, arg, option_loglevel.length())) return EXIT_FAILURE;
+    }
+    else if (strncmp(arg, option_repeat.c_str(), option_repeat.length()) == 0) {
+      if (!parseUint(options.repeat, arg, option_repeat.length())) return EXIT_FAILURE;
+      if (options.repeat == 0) {
+        logError(logger, "Repeat must be at least 1");
+        return EXIT_FAILURE;
+      }
+    }
+    else if (strncmp(arg, option_batch_size.c_str(), option_batch_size.length()) == 0) {
+      if (!parseUint(options.batchSize, arg, option_batch_size.length())) return EXIT_FAILURE;
+    }
+    else if (strncmp(arg, option_pipeline_depth.c_str(), option_pipeline_depth.length()) == 0) {
+      if (!parseUint(options.pipelineDepth, arg, option_pipeline_depth.length())) return EXIT_FAILURE;
+      if (options.pipelineDepth == 0) {
+        logError(logger, "Pipeline depth must be at least 1");
+        return EXIT_FAILURE;
+      }
+    }
+    else if (strncmp(arg, option_check.c_str(), option_check.length()) == 0) {
+      if (!parseBool(options.check, arg, option_check.length())) return EXIT_FAILURE;
+    }
+    else if (strncmp(arg, option_scratch.c_str(), option_scratch.length()) == 0) {
+      options.scratchPath = arg + option_scratch.length();
+    }
+    else if (strncmp(arg, option_points.c_str(), option_points.length()) == 0) {
+      if (!parseUint(bc.pointCount, arg, option_points.length())) return EXIT_FAILURE;
+      if (bc.pointCount == 0) {
+        logError(logger, "Point count must be at least 1");
+        return EXIT_FAILURE;
+      }
+    }
+    else if (strncmp(arg, option_type.c_str(), option_type.length()) == 0) {
+      const char* name = arg + option_type.length();
+      bool found = false;
+      for (uint32_t t = 0; t < sizeof(valueTypeNames) / sizeof(valueTypeNames[0]); t++) {
+        if (strcmp(name, valueTypeNames[t]) == 0) {
+          bc.type = static_cast<ValueType>(t);
+          found = true;
+        }
+      }
+      if (!found) {
+        logError(logger, "Unrecognized type '%s'", name);
+        return EXIT_FAILURE;
+      }
+      custom = true;
+    }
+    else if (strncmp(arg, option_bit_width.c_str(), option_bit_width.length()) == 0) {
+      if (!parseUint(value, arg, option_bit_width.length())) return EXIT_FAILURE;
+      if (value < 1 || MaxBitWidth < value) {
+        logError(logger, "Bit width must be in 1..%u", MaxBitWidth);
+        return EXIT_FAILURE;
+      }
+      bc.bitWidth = static_cast<uint32_t>(value);
+      custom = true;
+    }
+    else if (strncmp(arg, option_streams.c_str(), option_streams.length()) == 0) {
+      if (!parseUint(value, arg, option_streams.length())) return EXIT_FAILURE;
+      if (value < 1 || MaxStreamCount < value) {
+        logError(logger, "Stream count must be in 1..%u", MaxStreamCount);
+        return EXIT_FAILURE;
+      }
+      bc.streamCount = static_cast<uint32_t>(value);
+      custom = true;
+    }
+    else if (strncmp(arg, option_packet_size.c_str(), option_packet_size.length()) == 0) {
+      if (!parseUint(value, arg, option_packet_size.length())) return EXIT_FAILURE;
+      if (value < 64 || 0x10000 < value) {
+        logError(logger, "Packet size must be in 64..65536");
+        return EXIT_FAILURE;
+      }
+      bc.packetSize = static_cast<uint32_t>(value);
+      custom = true;
+    }
+    else if (strncmp(arg, option_page_size.c_str(), option_page_size.length()) == 0) {
+      if (!parseUint(value, arg, option_page_size.length())) return EXIT_FAILURE;
+      if (value < 128 || (value & (value - 1)) != 0 || (size_t(1) << 31) < value) {
+        logError(logger, "Page size must be a power of two, at least 128");
+        return EXIT_FAILURE;
+      }
+      bc.pageSize = static_cast<uint32_t>(value);
+      custom = true;
+    }
+    else if (strncmp(arg, option_index.c_str(), option_index.length()) == 0) {
+      if (!parseBool(bc.index, arg, option_index.length())) return EXIT_FAILURE;
+      custom = true;
+    }
+    else {
+      logError(logger, "Unrecognized command line option '%s'", arg);
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::vector<BenchCase> cases;
+  if (custom) {
+    cases.push_back(bc);
+  }
+  else {
+    cases = suiteCases(bc.pointCount);
+  }
+
+  bool success = true;
+  if (options.check && (!checkOctreeSpill(options) || !checkVoxelSpill())) {
+    success = false;
+  }
+
+  printCsvHeader();
+  for (const BenchCase& c : cases) {
+    if (!runCase(c, options)) {
+      success = false;
+    }
+  }
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,391 @@
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+// Microbenchmarks of the reader's inner loops.
+//
+// Times consumeBits for every component type and bit width, checkPage on hot and cold
+// pages and readE57Bytes for page aligned and page straddling ranges. Results are
+// written to stdout as CSV, one line per kernel variant, with the best cycles per item
+// and bytes per cycle over the repeats.
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <algorithm>
+#include <bit>
+#include <limits>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define E57_HAVE_TSC 1
+#endif
+
+#include "Common.h"
+#include "e57File.h"
+#include "e57Kernels.h"
+
+namespace {
+
+  size_t logLevel = 2;
+
+  void logger(size_t level, const char* msg, va_list arg)
+  {
+    if (level < logLevel || 5 <= level) {
+      return;
+    }
+    const char levels[5] = { 'T', 'D', 'I', 'W', 'E' };
+    fprintf(stderr, "[%c] ", levels[level]);
+    vfprintf(stderr, msg, arg);
+    fputc('\n', stderr);
+  }
+
+  // Time stamp counter where available, which counts reference cycles at a constant
+  // rate that may differ from the current core clock. Nanoseconds elsewhere.
+#ifdef E57_HAVE_TSC
+  uint64_t readCycleCounter() { return __rdtsc(); }
+#else
+  uint64_t readCycleCounter() { return getMonotonicNanoseconds(); }
+#endif
+
+  struct MicroOptions
+  {
+    size_t repeat = 20;
+    size_t items = 4096;              // Items per consumeBits call.
+    size_t pageSize = 1024;
+    size_t coldBytes = 256u << 20;    // Should be well beyond the last-level cache.
+    std::string filter;               // Only run kernels with this name if non-empty.
+  };
+
+  uint64_t xorshift(uint64_t& state)
+  {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+
+  void fillRandom(std::vector<uint8_t>& bytes, uint64_t seed)
+  {
+    for (uint8_t& byte : bytes) {
+      byte = static_cast<uint8_t>(xorshift(seed) >> 56);
+    }
+  }
+
+  void report(const char* kernel, const char* variant, size_t items, uint64_t cycles, double bytes)
+  {
+    const double c = double(std::max(cycles, uint64_t(1)));
+    printf("%s,%s,%zu,%.3f,%.3f\n", kernel, variant, items, c / double(items), bytes / c);
+    fflush(stdout);
+  }
+
+  bool enabled(const MicroOptions& options, const char* kernel)
+  {
+    return options.filter.empty() || options.filter == kernel;
+  }
+
+
+  // --- consumeBits ------------------------------------------------------------
+
+  void benchConsumeBits(const MicroOptions& options, const char* variant, const Component& comp, uint32_t bitWidth, bool accumulateStats)
+  {
+    const size_t items = options.items;
+
+    // Input as if it was a bytestream in a stream slot, with padding for the 64-bit fetch.
+    std::vector<uint8_t> data((items * bitWidth + 7) / 8 + 8);
+    fillRandom(data, 0x9E3779B97F4A7C15ull + bitWidth);
+
+    // Write x of an interleaved xyz float batch.
+    constexpr size_t stride = 3 * sizeof(float);
+    std::vector<char> batch(items * stride);
+    const ComponentWriteDesc writeDesc{ .offset = 0, .stride = stride, .stream = 0 };
+    const BitUnpackDesc unpackDesc{ .maxItems = items, .data = data.data(), .bitsAvailable = static_cast<uint32_t>(items * bitWidth) };
+
+    // Enough calls per repeat to get well above timer resolution.
+    const size_t calls = std::max(size_t(1), (size_t(1) << 20) / items);
+    ComponentStats stats;
+    uint64_t best = std::numeric_limits<uint64_t>::max();
+    for (size_t r = 0; r < options.repeat; r++) {
+      uint64_t t0 = readCycleCounter();
+      for (size_t c = 0; c < calls; c++) {
+        BitUnpackState state = consumeBits(View<char>(batch.data(), batch.size()), BitUnpackState{}, unpackDesc, writeDesc, comp, accumulateStats ? &stats : nullptr);
+        if (state.itemsWritten != items) {
+          logError(logger, "consumeBits %s: wrote %zu of %zu items", variant, state.itemsWritten, items);
+          return;
+        }
+      }
+      best = std::min(best, readCycleCounter() - t0);
+    }
+    report("consumeBits", variant, calls * items, best, double(calls * items) * bitWidth / 8.0);
+  }
+
+  void benchConsumeBitsAll(const MicroOptions& options)
+  {
+    char variant[64];
+
+    // Plain unpacking, then with component statistics accumulated.
+    for (bool accumulateStats : { false, true }) {
+      const char* suffix = accumulateStats ? "+stats" : "";
+
+      Component comp{};
+      comp.initReal(Component::Type::Float);
+      snprintf(variant, sizeof(variant), "float/32%s", suffix);
+      benchConsumeBits(options, variant, comp, 32, accumulateStats);
+
+      comp.initReal(Component::Type::Double);
+      snprintf(variant, sizeof(variant), "double/64%s", suffix);
+      benchConsumeBits(options, variant, comp, 64, accumulateStats);
+
+      // Values are fetched with a single unaligned 64-bit load and a shift of up to 7 bits.
+      for (Component::Type type : { Component::Type::Integer, Component::Type::ScaledInteger }) {
+        for (uint32_t w = 1; w <= 56; w++) {
+          comp.initInteger(type);
+          comp.integer.min = -(int64_t(1) << (w - 1));
+          comp.integer.max = comp.integer.min + int64_t((uint64_t(1) << w) - 1);
+          comp.integer.bitWidth = static_cast<uint8_t>(w);
+          if (type == Component::Type::ScaledInteger) {
+            comp.integer.scale = 0.001;
+          }
+          snprintf(variant, sizeof(variant), "%s/%u%s", type == Component::Type::Integer ? "integer" : "scaledinteger", w, suffix);
+          benchConsumeBits(options, variant, comp, w, accumulateStats);
+        }
+      }
+    }
+  }
+
+
+  // --- checkPage and readE57Bytes ---------------------------------------------
+
+  struct MemoryFile
+  {
+    std::vector<uint8_t> bytes;
+  };
+
+  View<const char> memoryFileCallback(void* callbackData, uint64_t offset, uint64_t size)
+  {
+    const MemoryFile* file = static_cast<const MemoryFile*>(callbackData);
+    if (file->bytes.size() < offset || file->bytes.size() < offset + size) {
+      return View<const char>(nullptr, 0);
+    }
+    return View<const char>(reinterpret_cast<const char*>(file->bytes.data()) + offset, size);
+  }
+
+  // File of random pages with valid checksums, set up directly without an E57 header.
+  void initPagedFile(E57File& e57, MemoryFile& file, size_t pageSize, size_t pageCount)
+  {
+    file.bytes.resize(pageSize * pageCount);
+    fillRandom(file.bytes, 0xD1B54A32D192ED03ull);
+    for (size_t page = 0; page < pageCount; page++) {
+      uint8_t* ptr = file.bytes.data() + page * pageSize;
+      uint32_t crc = crc32c(ptr, pageSize - 4);
+      ptr[pageSize - 4] = static_cast<uint8_t>(crc >> 24);
+      ptr[pageSize - 3] = static_cast<uint8_t>(crc >> 16);
+      ptr[pageSize - 2] = static_cast<uint8_t>(crc >> 8);
+      ptr[pageSize - 1] = static_cast<uint8_t>(crc);
+    }
+
+    e57.fileRead = memoryFileCallback;
+    e57.fileReadData = &file;
+    e57.fileSize = file.bytes.size();
+    e57.header.pageSize = pageSize;
+    e57.header.filePhysicalLength = file.bytes.size();
+    e57.page.size = pageSize;
+    e57.page.logicalSize = pageSize - 4;
+    e57.page.mask = pageSize - 1;
+    e57.page.shift = static_cast<uint8_t>(std::countr_zero(pageSize));
+  }
+
+  void benchCheckPage(const MicroOptions& options)
+  {
+    E57File e57;
+    MemoryFile file;
+    const size_t pageCount = std::max(size_t(1), options.coldBytes / options.pageSize);
+    initPagedFile(e57, file, options.pageSize, pageCount);
+    const double logicalBytes = double(e57.page.logicalSize);
+
+    // Hot: the same page over and over, stays in L1.
+    {
+      const size_t calls = 4096;
+      View<const char> page(reinterpret_cast<const char*>(file.bytes.data()), options.pageSize);
+      uint64_t best = std::numeric_limits<uint64_t>::max();
+      for (size_t r = 0; r < options.repeat; r++) {
+        uint64_t t0 = readCycleCounter();
+        for (size_t c = 0; c < calls; c++) {
+          if (!checkPage(&e57, logger, page)) return;
+        }
+        best = std::min(best, readCycleCounter() - t0);
+      }
+      report("checkPage", "hot", calls, best, double(calls) * logicalBytes);
+    }
+
+    // Cold: one pass over all pages, where pages are evicted before they are seen again.
+    {
+      const size_t repeat = std::min(options.repeat, size_t(3));
+      uint64_t best = std::numeric_limits<uint64_t>::max();
+      for (size_t r = 0; r < repeat; r++) {
+        uint64_t t0 = readCycleCounter();
+        for (size_t p = 0; p < pageCount; p++) {
+          View<const char> page(reinterpret_cast<const char*>(file.bytes.data()) + p * options.pageSize, options.pageSize);
+          if (!checkPage(&e57, logger, page)) return;
+        }
+        best = std::min(best, readCycleCounter() - t0);
+      }
+      report("checkPage", "cold", pageCount, best, double(pageCount) * logicalBytes);
+    }
+  }
+
+  void benchReadE57Bytes(const MicroOptions& options)
+  {
+    // Fits in the mid-level caches, this measures the per-call and per-page overhead.
+    E57File e57;
+    MemoryFile file;
+    const size_t pageCount = std::max(size_t(4), (size_t(1) << 20) / options.pageSize);
+    initPagedFile(e57, file, options.pageSize, pageCount);
+    const size_t logicalPageSize = e57.page.logicalSize;
+
+    std::vector<char> dst(0x10000);
+    char variant[64];
+    for (size_t size : { size_t(16), size_t(256), logicalPageSize, size_t(4096), size_t(0x10000) }) {
+      for (bool straddle : { false, true }) {
+
+        // Start at the beginning of a page, or halfway into a page boundary.
+        const size_t logicalStart = straddle ? logicalPageSize - std::min(size / 2, logicalPageSize / 2) : 0;
+        const size_t pagesSpanned = (logicalStart + size + logicalPageSize - 1) / logicalPageSize;
+        if (pageCount < pagesSpanned + 1) {
+          continue;
+        }
+        const size_t startPages = pageCount - pagesSpanned;
+
+        const size_t calls = std::max(size_t(16), (size_t(1) << 22) / std::max(size, logicalPageSize));
+        uint64_t best = std::numeric_limits<uint64_t>::max();
+        for (size_t r = 0; r < options.repeat; r++) {
+          uint64_t t0 = readCycleCounter();
+          for (size_t c = 0; c < calls; c++) {
+            const size_t page = c % startPages;
+            uint64_t physicalOffset = page * options.pageSize + logicalStart;
+            if (!readE57Bytes(&e57, logger, dst.data(), physicalOffset, size)) return;
+          }
+          best = std::min(best, readCycleCounter() - t0);
+        }
+        snprintf(variant, sizeof(variant), "%s/%zu", straddle ? "straddling" : "aligned", size);
+        report("readE57Bytes", variant, calls, best, double(calls) * double(size));
+      }
+    }
+  }
+
+  void printHelp(const char* path)
+  {
+    fprintf(stderr, R"help(
+Usage: %s [options]
+
+Times the inner loops of the reader in isolation and prints one CSV line per
+kernel variant to stdout with the best cycles per item and bytes per cycle.
+Cycles are time stamp counter ticks on x86 and nanoseconds elsewhere. Items are
+values for consumeBits, pages for checkPage and calls for readE57Bytes.
+
+Options:
+  --help               This help text.
+  --loglevel=<uint>    Specifies amount of logging, 0=trace, 1=debug, 2=info,
+                       3=warnings, 4=errors, 5=silent.
+  --kernel=<name>      Only run consumeBits, checkPage or readE57Bytes.
+  --repeat=<uint>      Number of times each variant is timed. Defaults to 20.
+  --items=<uint>       Values per consumeBits call. Defaults to 4096.
+  --page-size=<uint>   Page size in bytes, a power of two from 128. Defaults
+                       to 1024.
+  --cold-size=<uint>   Megabytes of pages for cold checkPage. Defaults to 256.
+)help", path);
+  }
+
+  bool parseUint(size_t& output, const char* arg, size_t offset)
+  {
+    char* end = nullptr;
+    const char* start = arg + offset;
+    unsigned long long value = std::strtoull(start, &end, 10);
+    if (end == start || *end != '\0') {
+      logError(logger, "Failed to parse unsigned integer in '%s'", arg);
+      return false;
+    }
+    output = static_cast<size_t>(value);
+    return true;
+  }
+
+}
+
+
+int main(int argc, char** argv)
+{
+  static const std::string option_help      = "--help";
+  static const std::string option_loglevel  = "--loglevel=";
+  static const std::string option_kernel    = "--kernel=";
+  static const std::string option_repeat    = "--repeat=";
+  static const std::string option_items     = "--items=";
+  static const std::string option_page_size = "--page-size=";
+  static const std::string option_cold_size = "--cold-size=";
+
+  MicroOptions options;
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    size_t value = 0;
+    if (strcmp(arg, option_help.c_str()) == 0) {
+      printHelp(argv[0]);
+      return EXIT_SUCCESS;
+    }
+    else if (strncmp(arg, option_loglevel.c_str(), option_loglevel.length()) == 0) {
+      if (!parseUint(logLevel, arg, option_loglevel.length())) return EXIT_FAILURE;
+    }
+    else if (strncmp(arg, option_kernel.c_str(), option_kernel.length()) == 0) {
+      options.filter = arg + option_kernel.length();
+      if (options.filter != "consumeBits" && options.filter != "checkPage" && options.filter != "readE57Bytes") {
+        logError(logger, "Unrecognized kernel '%s'", options.filter.c_str());
+        return EXIT_FAILURE;
+      }
+    }
+    else if (strncmp(arg, option_repeat.c_str(), option_repeat.length()) == 0) {
+      if (!parseUint(options.repeat, arg, option_repeat.length())) return EXIT_FAILURE;
+      if (options.repeat == 0) {
+        logError(logger, "Repeat must be at least 1");
+        return EXIT_FAILURE;
+      }
+    }
+    else if (strncmp(arg, option_items.c_str(), option_items.length()) == 0) {
+      if (!parseUint(options.items, arg, option_items.length())) return EXIT_FAILURE;
+      if (options.items == 0 || 0x10000 < options.items) {
+        logError(logger, "Items must be in 1..65536");
+        return EXIT_FAILURE;
+      }
+    }
+    else if (strncmp(arg, option_page_size.c_str(), option_page_size.length()) == 0) {
+      if (!parseUint(value, arg, option_page_size.length())) return EXIT_FAILURE;
+      if (value < 128 || (value & (value - 1)) != 0 || (size_t(1) << 24) < value) {
+        logError(logger, "Page size must be a power of two, at least 128");
+        return EXIT_FAILURE;
+      }
+      options.pageSize = value;
+    }
+    else if (strncmp(arg, option_cold_size.c_str(), option_cold_size.length()) == 0) {
+      if (!parseUint(value, arg, option_cold_size.length())) return EXIT_FAILURE;
+      options.coldBytes = value << 20;
+    }
+    else {
+      logError(logger, "Unrecognized command line option '%s'", arg);
+      return EXIT_FAILURE;
+    }
+  }
+
+#ifndef E57_HAVE_TSC
+  logWarning(logger, "No cycle counter on this platform, cycles are nanoseconds");
+#endif
+
+  printf("kernel,variant,items,cycles_per_item,bytes_per_cycle\n");
+  if (enabled(options, "consumeBits")) benchConsumeBitsAll(options);
+  if (enabled(options, "checkPage")) benchCheckPage(options);
+  if (enabled(options, "readE57Bytes")) benchReadE57Bytes(options);
+
+  return EXIT_SUCCESS;
+}
@@ -7,6 +7,7 @@
 #include <cstdarg>
 #include <cstring>
 #include <algorithm>
+#include <chrono>
 
 #include "Common.h"
 
@@ -25,6 +26,20 @@ void logWarning(Logger logger, const char* msg, ...) { va_list ap; va_start(ap,
 void logError(Logger logger, const char* msg, ...) { va_list ap; va_start(ap, msg); logger(4, msg, ap); va_end(ap); }
 #endif
 
+uint64_t getMonotonicNanoseconds()
+{
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+bool seekFile(FILE* file, uint64_t offset)
+{
+#ifdef _WIN32
+  return _fseeki64(file, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+  return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
 void BufferBase::free()
 {
   if (ptr) ::free(ptr - sizeof(size_t));
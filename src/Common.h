@@ -4,6 +4,7 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <cstdio>
 #include <cstdarg>
 #include <cassert>
 
@@ -42,6 +43,12 @@ void logError(Logger logger, const char* msg, ...);
 
 struct E57File;
 
+// Monotonic clock in nanoseconds, cheap enough to use for instrumentation.
+uint64_t getMonotonicNanoseconds();
+
+// Seek to an absolute offset, also beyond 2GB on platforms with a 32-bit long.
+bool seekFile(FILE* file, uint64_t offset);
+
 void* xmalloc(size_t size);
 void* xcalloc(size_t count, size_t size);
 void* xrealloc(void* ptr, size_t size);
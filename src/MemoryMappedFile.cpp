@@ -0,0 +1,184 @@
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+#ifdef _WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+
+#else
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#endif
+
+#include <cerrno>
+#include <cstring>
+
+#include "MemoryMappedFile.h"
+
+#ifdef _WIN32
+
+MemoryMappedFile::MemoryMappedFile(Logger logger, const char* path)
+  : logger(logger)
+{
+  h = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (h == INVALID_HANDLE_VALUE) {
+    logError(logger, "CreateFileA returned INVALID_HANDLE_VALUE");
+    return;
+  }
+  DWORD hiSize;
+  DWORD loSize = GetFileSize(h, &hiSize);
+  size = (size_t(hiSize) << 32u) + loSize;
+
+  m = CreateFileMappingA(h, 0, PAGE_READONLY, 0, 0, NULL);
+  if (m == NULL) {
+    logError(logger, "CreateFileMappingA returned NULL");
+    return;
+
+  }
+
+  ptr = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+  if (ptr == nullptr) {
+    logError(logger, "MapViewOfFile returned INVALID_HANDLE_VALUE");
+    return;
+  }
+  good = true;
+}
+
+MemoryMappedFile::MemoryMappedFile(Logger logger, const char* path, size_t size_)
+  : logger(logger)
+{
+  h = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (h == INVALID_HANDLE_VALUE) {
+    logError(logger, "CreateFileA returned INVALID_HANDLE_VALUE");
+    return;
+  }
+  size = size_;
+
+  m = CreateFileMappingA(h, 0, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(size), NULL);
+  if (m == NULL) {
+    logError(logger, "CreateFileMappingA returned NULL");
+    return;
+  }
+
+  ptr = MapViewOfFile(m, FILE_MAP_WRITE, 0, 0, 0);
+  if (ptr == nullptr) {
+    logError(logger, "MapViewOfFile returned NULL");
+    return;
+  }
+  good = true;
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+  if (ptr != nullptr) {
+    UnmapViewOfFile(ptr);
+    ptr = nullptr;
+  }
+  if (m != nullptr) {
+    CloseHandle(m);
+    m = nullptr;
+  }
+  if (h != nullptr && h != INVALID_HANDLE_VALUE) {
+    CloseHandle(h);
+    h = nullptr;
+  }
+}
+
+#else
+
+MemoryMappedFile::MemoryMappedFile(Logger logger, const char* path)
+  : logger(logger)
+{
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    logError(logger, "%s: open failed: %s", path, strerror(errno));
+    return;
+  }
+
+  struct stat stat {};
+  if (fstat(fd, &stat) != 0) {
+    logError(logger, "%s: fstat failed: %s", path, strerror(errno));
+    return;
+  }
+  size = stat.st_size;
+
+#ifdef __linux__
+  ptr = mmap(nullptr, stat.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+#else
+  ptr = mmap(nullptr, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+#endif
+  if (ptr == MAP_FAILED) {
+    logError(logger, "%s: mmap failed: %s", path, strerror(errno));
+    return;
+  }
+
+  if (madvise(ptr, stat.st_size, MADV_SEQUENTIAL) != 0) {
+    logError(logger, "%s: madvise(MADV_SEQUENTIAL) failed: %s", path, strerror(errno));
+    return;
+  }
+  good = true;
+}
+
+MemoryMappedFile::MemoryMappedFile(Logger logger, const char* path, size_t size_)
+  : logger(logger)
+{
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    logError(logger, "%s: open failed: %s", path, strerror(errno));
+    return;
+  }
+  size = size_;
+
+  // Allocate the blocks up front where possible, running out of space while writing
+  // through the mapping would raise a signal instead of an error.
+#ifdef __linux__
+  if (int err = posix_fallocate(fd, 0, static_cast<off_t>(size)); err != 0) {
+    logError(logger, "%s: posix_fallocate failed: %s", path, strerror(err));
+    return;
+  }
+#else
+  if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    logError(logger, "%s: ftruncate failed: %s", path, strerror(errno));
+    return;
+  }
+#endif
+
+  ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED) {
+    logError(logger, "%s: mmap failed: %s", path, strerror(errno));
+    return;
+  }
+  good = true;
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+  if (ptr != nullptr && ptr != MAP_FAILED) {
+    if (munmap(ptr, size) != 0) {
+      logError(logger, "munmap failed: %s", strerror(errno));
+    }
+    ptr = nullptr;
+  }
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+#endif
+
+View<const char> memoryMappedFileCallback(void* callbackData, uint64_t offset, uint64_t size)
+{
+  const MemoryMappedFile* mappedFile = static_cast<const MemoryMappedFile*>(callbackData);
+  if (!mappedFile->good || mappedFile->size < offset || mappedFile->size < offset + size) {
+    return View<const char>(nullptr, 0);
+  }
+  return View<const char>((const char*)mappedFile->ptr + static_cast<size_t>(offset), size);
+}
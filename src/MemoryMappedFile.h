@@ -0,0 +1,36 @@
+#pragma once
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+#include <cstdint>
+#include "Common.h"
+
+// Memory mapping of a whole file, check good before use.
+struct MemoryMappedFile
+{
+  // Read-only mapping of an existing file.
+  MemoryMappedFile(Logger logger, const char* path);
+
+  // Writable mapping of a new file of the given size, replacing any existing file.
+  // Changes are written back to the file, at the latest when the mapping is destroyed.
+  MemoryMappedFile(Logger logger, const char* path, size_t size);
+
+  ~MemoryMappedFile();
+
+  MemoryMappedFile(const MemoryMappedFile&) = delete;
+  MemoryMappedFile& operator=(const MemoryMappedFile&) = delete;
+
+  Logger logger = nullptr;
+#ifdef _WIN32
+  void* h = nullptr;  // HANDLE
+  void* m = nullptr;  // HANDLE
+#else
+  int fd = -1;
+#endif
+  void* ptr = nullptr;
+  size_t size = 0;
+  bool good = false;
+};
+
+// ReadCallback that serves views into a MemoryMappedFile passed as callbackData.
+View<const char> memoryMappedFileCallback(void* callbackData, uint64_t offset, uint64_t size);
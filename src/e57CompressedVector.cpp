@@ -1,10 +1,24 @@
 #include "Common.h"
 #include "e57File.h"
+#include "e57Histogram.h"
+#include "e57Kernels.h"
+#include "e57Trace.h"
 
 #include <bit>
 #include <cassert>
+#include <cmath>
 #include <cstring>
+#include <cinttypes>
+#include <limits>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <thread>
+#include <type_traits>
 
 namespace {
 
@@ -14,17 +28,39 @@ namespace {
     Empty
   };
 
+  // Shared limit on how many workers fetch and verify file pages at the same time.
+  struct IoBudget
+  {
+    std::counting_semaphore<> semaphore;
+
+    explicit IoBudget(size_t count) : semaphore(static_cast<std::ptrdiff_t>(count)) {}
+  };
+
   struct Context
   {
     const E57File* e57 = nullptr;
     Logger logger = nullptr;
-    const ReadPointsArgs& args;
-    const Points& pts;
+    IoBudget* ioBudget = nullptr;
+    const Points* pts = nullptr;
+    View<const ComponentWriteDesc> writeDesc;
+    ComponentStats* componentStats = nullptr;           // One per writeDesc entry if set.
+    ComponentHistogram* componentHistograms = nullptr;  // One per writeDesc entry if set.
+    GridWriteDesc* grid = nullptr;
+
+    // Batch currently being filled by the decoder, and the index of its first point.
+    View<char> batch;
+    uint64_t batchPosition = 0;
+
+    // Offset of the furthest packet fetched, used to detect re-fetches.
+    uint64_t furthestPacketOffset = 0;
+
+    // Last page that passed its checksum, adjacent bytestream reads often share a page.
+    uint64_t lastVerifiedPage = ~uint64_t(0);
 
     struct {
       uint64_t currentOffset = 0u; // Current packet offset
       uint64_t nextOffset = 0u;    // Next packet
-      uint8_t data[0x10000 + 8]; // packet length is 16 bits. Include extra 8 bytes so it is safe to do a 64-bit unaligned fetch at end.
+      uint8_t data[0x10000 + 8]; // Header and bytestream table of data packets, all of index packets. Packet length is 16 bits.
       size_t size = 0;
       PacketType type = PacketType::Empty;
       const uint8_t operator[](size_t ix) const{ return data[ix]; }
@@ -39,6 +75,14 @@ namespace {
 
   };
 
+  // Location of a compressed vector section
+  struct Section
+  {
+    uint64_t dataPhysicalOffset = 0;  // Offset of first data packet
+    uint64_t indexPhysicalOffset = 0; // Offset of first index packet, zero if there is no index
+    uint64_t physicalEnd = 0;         // Physical offset of the end of the section
+  };
+
   uint64_t getUint64LEUnaligned(const uint8_t* ptr)
   {
     static_assert(std::endian::native == std::endian::little);
@@ -51,6 +95,25 @@ namespace {
 #endif
   }
 
+  // Mask of the low w bits, for w up to 64.
+  uint64_t bitMask(uint32_t w)
+  {
+    return w < 64 ? (uint64_t(1u) << w) - 1u : ~uint64_t(0);
+  }
+
+  // Widths up to 56 bits fit in one unaligned 64-bit load with a shift of up to 7 bits,
+  // wider ones may continue into the ninth byte.
+  uint64_t getBitsUnaligned(const uint8_t* data, uint32_t bitOffset, uint32_t w, uint64_t m)
+  {
+    const uint8_t* ptr = data + (bitOffset >> 3u);
+    const uint32_t shift = bitOffset & 7u;
+    uint64_t bits = getUint64LEUnaligned(ptr) >> shift;
+    if (64 < shift + w) {
+      bits |= uint64_t(ptr[8]) << (64 - shift);
+    }
+    return bits & m;
+  }
+
   float getFloat32LEUnaligned(const uint8_t* ptr) {
     static_assert(std::endian::native == std::endian::little);
 #ifdef _MSC_VER
@@ -73,6 +136,26 @@ namespace {
 #endif
   }
 
+  // Physical offset of the byte that is logicalDelta logical bytes past physicalOffset.
+  uint64_t advancePhysicalOffset(const Context& ctx, uint64_t physicalOffset, uint64_t logicalDelta)
+  {
+    uint64_t logicalOffset = ((physicalOffset >> ctx.e57->page.shift) * ctx.e57->page.logicalSize +
+                              (physicalOffset & ctx.e57->page.mask) + logicalDelta);
+    return ((logicalOffset / ctx.e57->page.logicalSize) * ctx.e57->page.size +
+            (logicalOffset % ctx.e57->page.logicalSize));
+  }
+
+  bool readBytes(Context& ctx, void* dst, uint64_t& physicalOffset, uint64_t bytesToRead)
+  {
+    if (ctx.ioBudget == nullptr) {
+      return readE57Bytes(ctx.e57, ctx.logger, dst, physicalOffset, bytesToRead, &ctx.lastVerifiedPage);
+    }
+    ctx.ioBudget->semaphore.acquire();
+    bool rv = readE57Bytes(ctx.e57, ctx.logger, dst, physicalOffset, bytesToRead, &ctx.lastVerifiedPage);
+    ctx.ioBudget->semaphore.release();
+    return rv;
+  }
+
   uint64_t getPacket(Context& ctx, uint64_t packetOffset, PacketType expectedPacketType)
   {
     // Check if we already have read this packet.
@@ -81,10 +164,21 @@ namespace {
     }
 
     // Read packet
+    E57TraceScope traceScope(ctx.e57->trace, "getPacket");
     ctx.packet.currentOffset = packetOffset;
+    if (E57Stats* stats = ctx.e57->stats; stats) {
+      E57Stats::add(stats->packetsFetched, 1);
+      if (expectedPacketType == PacketType::Data && packetOffset <= ctx.furthestPacketOffset) {
+        E57Stats::add(stats->packetsRefetched, 1);
+      }
+    }
+    if (expectedPacketType == PacketType::Data) {
+      ctx.furthestPacketOffset = std::max(ctx.furthestPacketOffset, packetOffset);
+    }
 
     // Read 4 - byte sized packet header
-    if (!readE57Bytes(ctx.e57, ctx.logger, ctx.packet.data, packetOffset, 4)) {
+    uint64_t offset = packetOffset;
+    if (!readBytes(ctx, ctx.packet.data, offset, 4)) {
       return ctx.packet.nextOffset = ctx.packet.currentOffset = 0;
     }
     ctx.packet.type = static_cast<PacketType>(ctx.packet[0]);
@@ -100,13 +194,14 @@ namespace {
       return ctx.packet.nextOffset = ctx.packet.currentOffset = 0;
     }
 
-    // Read rest of packet
-    if (!readE57Bytes(ctx.e57, ctx.logger, ctx.packet.data + 4, packetOffset, ctx.packet.size - 4)) {
-      return ctx.packet.nextOffset = ctx.packet.currentOffset = 0;
-    }
-
     // Decode index packet
     if (ctx.packet.type == PacketType::Index) {
+
+      // Read rest of packet
+      if (!readBytes(ctx, ctx.packet.data + 4, offset, ctx.packet.size - 4)) {
+        return ctx.packet.nextOffset = ctx.packet.currentOffset = 0;
+      }
+
       uint8_t flags = ctx.packet[1];
       size_t entryCount = getUint16LE(ctx.packet.data + 4);
       uint8_t indexLevel = ctx.packet[6];
@@ -122,76 +217,182 @@ namespace {
         return ctx.packet.nextOffset = ctx.packet.currentOffset = 0;
       }
 
+      // Only the bytestream count and length table is read here, the bytestreams
+      // themselves are read by the components that need them. The first read
+      // covers the table for packets with a moderate number of streams.
+      size_t headRead = std::min(ctx.packet.size - 4, size_t(60));
+      if (!readBytes(ctx, ctx.packet.data + 4, offset, headRead)) {
+        return ctx.packet.nextOffset = ctx.packet.currentOffset = 0;
+      }
+
       ctx.dataPacket.byteStreamsCount = getUint16LE(ctx.packet.data + 4);
       if (ctx.dataPacket.byteStreamsCount == 0) {
         logError(ctx.logger, "No bytestreams in packet");
         return ctx.packet.nextOffset = ctx.packet.currentOffset = 0;
       }
 
-      uint32_t offset = 6 + 2 * ctx.dataPacket.byteStreamsCount;
+      size_t tableEnd = 6 + 2 * size_t(ctx.dataPacket.byteStreamsCount);
+      if (ctx.packet.size < tableEnd) {
+        logError(ctx.logger, "Bytestream table end %zu beyond packet length %zu", tableEnd, ctx.packet.size);
+        return ctx.packet.nextOffset = ctx.packet.currentOffset = 0;
+      }
+      if (4 + headRead < tableEnd) {
+        if (!readBytes(ctx, ctx.packet.data + 4 + headRead, offset, tableEnd - 4 - headRead)) {
+          return ctx.packet.nextOffset = ctx.packet.currentOffset = 0;
+        }
+      }
+
+      uint32_t streamOffset = 6 + 2 * ctx.dataPacket.byteStreamsCount;
       for (size_t i = 0; i < ctx.dataPacket.byteStreamsCount; i++) {
-        ctx.dataPacket.byteStreamOffsets[i] = offset;
-        offset += getUint16LE(ctx.packet.data + 6 + 2 * i);
-        if (ctx.packet.size < offset) {
-          logError(ctx.logger, "Bytestream offset %u beyond packet length %zu", offset, ctx.packet.size);
+        ctx.dataPacket.byteStreamOffsets[i] = streamOffset;
+        streamOffset += getUint16LE(ctx.packet.data + 6 + 2 * i);
+        if (ctx.packet.size < streamOffset) {
+          logError(ctx.logger, "Bytestream offset %u beyond packet length %zu", streamOffset, ctx.packet.size);
           return ctx.packet.nextOffset = ctx.packet.currentOffset = 0;
         }
       }
-      ctx.dataPacket.byteStreamOffsets[ctx.dataPacket.byteStreamsCount] = offset;
-      logTrace(ctx.logger, "Got data packet: size=%zu byteStreamCount=%u expectedPacketSize=%u", ctx.packet.size, ctx.dataPacket.byteStreamsCount, offset);
+      ctx.dataPacket.byteStreamOffsets[ctx.dataPacket.byteStreamsCount] = streamOffset;
+      logTrace(ctx.logger, "Got data packet: size=%zu byteStreamCount=%u expectedPacketSize=%u", ctx.packet.size, ctx.dataPacket.byteStreamsCount, streamOffset);
     }
 
     else if (ctx.packet.type == PacketType::Empty) {
       logDebug(ctx.logger, "Empty packet: size=%zu ", ctx.packet.size);
     }
 
-    return ctx.packet.nextOffset = packetOffset;
+    return ctx.packet.nextOffset = advancePhysicalOffset(ctx, packetOffset, ctx.packet.size);
   }
 
 
-  constexpr uint32_t AllBitsRead = ~uint32_t(0);
+  // Each component keeps its own copy of its bytestream from the current packet,
+  // so only requested streams are read and components may be in different packets.
+  constexpr size_t StreamSlotSize = 0x10000 + 8; // Include extra 8 bytes so it is safe to do a 64-bit unaligned fetch at end.
 
-  struct BitUnpackState
+  struct ComponentReadState
   {
-    size_t itemsWritten = 0;
-    uint32_t bitsConsumed = 0;
+    uint64_t packetOffset = 0;        // Offset of the next packet
+    uint64_t streamOffset = 0;        // Physical offset of bytestream in current packet, zero when loaded.
+    uint8_t* streamData = nullptr;    // StreamSlotSize bytes of storage for the bytestream.
+
+    BitUnpackState unpackState{};
+    BitUnpackDesc unpackDesc{};
   };
 
-  struct BitUnpackDesc
+  // Running extents of the values in one call, kept in registers and folded into
+  // ComponentStats once at the end. Integer types track the raw bit patterns.
+  struct IntegerExtents
   {
-    size_t maxItems = 0;
-    uint32_t byteStreamOffset = 0;
-    uint32_t bitsAvailable = 0;
+    uint64_t lo = ~uint64_t(0);
+    uint64_t hi = 0;
+    uint64_t sumLo = 0;   // 128-bit sum, integer adds keep the loop-carried latency low.
+    uint64_t sumHi = 0;
+
+    void add(uint64_t bits)
+    {
+      lo = bits < lo ? bits : lo;
+      hi = hi < bits ? bits : hi;
+      uint64_t s = sumLo + bits;
+      sumHi += s < sumLo ? 1 : 0;
+      sumLo = s;
+    }
+
+    double sum() const { return 18446744073709551616.0 * static_cast<double>(sumHi) + static_cast<double>(sumLo); }
   };
 
-  struct ComponentReadState
+  struct RealExtents
   {
-    uint64_t packetOffset = 0;
-
-    BitUnpackState unpackState{};
-    BitUnpackDesc unpackDesc{};
+    double lo = std::numeric_limits<double>::infinity();
+    double hi = -std::numeric_limits<double>::infinity();
+    double sum = 0.0;
+
+    void add(double value)
+    {
+      lo = value < lo ? value : lo;
+      hi = hi < value ? value : hi;
+      sum += value;
+    }
   };
 
+  void mergeExtents(ComponentStats& stats, const IntegerExtents& extents, size_t count, const Component& comp)
+  {
+    if (count == 0) return;
+
+    // value = scale * (min + bits) + offset, scale may be negative.
+    const double scale = comp.type == Component::Type::ScaledInteger ? comp.integer.scale : 1.0;
+    const double offset = comp.type == Component::Type::ScaledInteger ? comp.integer.offset : 0.0;
+    const double a = scale * static_cast<double>(static_cast<int64_t>(static_cast<uint64_t>(comp.integer.min) + extents.lo)) + offset;
+    const double b = scale * static_cast<double>(static_cast<int64_t>(static_cast<uint64_t>(comp.integer.min) + extents.hi)) + offset;
+    const double n = static_cast<double>(count);
+    stats.merge(ComponentStats{
+      .min = std::min(a, b),
+      .max = std::max(a, b),
+      .sum = scale * (n * static_cast<double>(comp.integer.min) + extents.sum()) + n * offset,
+      .count = count
+    });
+  }
+
+  void mergeExtents(ComponentStats& stats, const RealExtents& extents, size_t count)
+  {
+    if (count == 0) return;
+    stats.merge(ComponentStats{ .min = extents.lo, .max = extents.hi, .sum = extents.sum, .count = count });
+  }
+
+  template<ComponentWriteDesc::Type WriteType> struct WriteTypeOf;
+  template<> struct WriteTypeOf<ComponentWriteDesc::Type::Float> { using type = float; };
+  template<> struct WriteTypeOf<ComponentWriteDesc::Type::Double> { using type = double; };
+  template<> struct WriteTypeOf<ComponentWriteDesc::Type::UInt8> { using type = uint8_t; };
+  template<> struct WriteTypeOf<ComponentWriteDesc::Type::UInt16> { using type = uint16_t; };
+  template<> struct WriteTypeOf<ComponentWriteDesc::Type::Int32> { using type = int32_t; };
+
+  // Converts a value to the type written, integer types round to nearest and clamp.
+  template<typename Dst, typename Src>
+  Dst convertValue(Src value)
+  {
+    constexpr Dst lo = std::numeric_limits<Dst>::lowest();
+    constexpr Dst hi = std::numeric_limits<Dst>::max();
+    if constexpr (std::is_floating_point_v<Dst>) {
+      return static_cast<Dst>(value);
+    }
+    else if constexpr (std::is_integral_v<Src>) {
+      return static_cast<Dst>(value < int64_t(lo) ? int64_t(lo) : (int64_t(hi) < value ? int64_t(hi) : value));
+    }
+    else {
+      // Written so that NaN maps to the lowest value.
+      double v = std::floor(static_cast<double>(value) + 0.5);
+      return !(double(lo) < v) ? lo : (double(hi) < v ? hi : static_cast<Dst>(v));
+    }
+  }
+
+  template<ComponentWriteDesc::Type WriteType, typename Src>
+  void storeValue(char* ptr, Src value)
+  {
+    using Dst = typename WriteTypeOf<WriteType>::type;
+    Dst converted = convertValue<Dst>(value);
+    std::memcpy(ptr, &converted, sizeof(Dst));
+  }
 
-  BitUnpackState consumeBits(const Context& ctx, const BitUnpackState& unpackState, const BitUnpackDesc& unpackDesc, const ComponentWriteDesc& writeDesc, const Component& comp)
+  // Accumulating statistics and histograms and the type written are template parameters
+  // so the plain loops stay as they were.
+  template<bool Accumulate, bool Histogram, ComponentWriteDesc::Type WriteType>
+  BitUnpackState unpackItems(View<char> batch, const BitUnpackState& unpackState, const BitUnpackDesc& unpackDesc, const ComponentWriteDesc& writeDesc, const Component& comp,
+                             ComponentStats* stats, ComponentHistogram* histogram)
   {
     const size_t maxItems = unpackDesc.maxItems;
-    const size_t byteStreamOffset = unpackDesc.byteStreamOffset;
+    const uint8_t* data = unpackDesc.data;
     const uint32_t bitsAvailable = unpackDesc.bitsAvailable;
 
     uint32_t bitsConsumed = unpackState.bitsConsumed;
     size_t item = unpackState.itemsWritten;
 
-    char* ptr = ctx.args.buffer.data + writeDesc.offset;
-    char* end = ctx.args.buffer.data + ctx.args.buffer.size;
+    char* ptr = batch.data + writeDesc.offset;
+    [[maybe_unused]] char* end = batch.data + batch.size;
     size_t stride = writeDesc.stride;
+    constexpr size_t writeSize = sizeof(typename WriteTypeOf<WriteType>::type);
 
-    //size_t moo = ctx.args.buffer.size;
-
-    if (comp.type == Component::Type::Integer) {
+    if (comp.type == Component::Type::Integer || (comp.type == Component::Type::ScaledInteger && writeDesc.unscaled)) {
       const uint8_t w = comp.integer.bitWidth;
-      const uint64_t m = (uint64_t(1u) << w) - 1u;
+      const uint64_t m = bitMask(w);
       uint32_t bitsConsumedNext = bitsConsumed + w;
+      IntegerExtents extents;
       for (; item < maxItems; item++) {
 
         if (bitsAvailable < bitsConsumedNext) {
@@ -199,24 +400,26 @@ namespace {
           break;
         }
 
-        uint64_t byteOffset = bitsConsumed >> 3u;
-        uint64_t shift = bitsConsumed & 7u;
-        uint64_t bits = (getUint64LEUnaligned(ctx.packet.data + byteStreamOffset + byteOffset) >> shift) & m;
+        uint64_t bits = getBitsUnaligned(data, bitsConsumed, w, m);
 
         bitsConsumed = bitsConsumedNext;
         bitsConsumedNext += w;
 
-        int64_t value = comp.integer.min + static_cast<int64_t>(bits);
+        int64_t value = static_cast<int64_t>(static_cast<uint64_t>(comp.integer.min) + bits);
+        if constexpr (Accumulate) extents.add(bits);
+        if constexpr (Histogram) histogram->addCode(bits);
 
         char* pptr = ptr + stride * item;
-        assert(pptr + sizeof(float) <= end);
-        *reinterpret_cast<float*>(pptr) = static_cast<float>(value);
+        assert(pptr + writeSize <= end);
+        storeValue<WriteType>(pptr, value);
       }
+      if constexpr (Accumulate) mergeExtents(*stats, extents, item - unpackState.itemsWritten, comp);
     }
     else if (comp.type == Component::Type::ScaledInteger) {
       const uint8_t w = comp.integer.bitWidth;
-      const uint64_t m = (uint64_t(1u) << w) - 1u;
+      const uint64_t m = bitMask(w);
       uint32_t bitsConsumedNext = bitsConsumed + w;
+      IntegerExtents extents;
       for (; item < maxItems; item++) {
 
         if (bitsAvailable < bitsConsumedNext) {
@@ -224,23 +427,25 @@ namespace {
           break;
         }
 
-        uint64_t byteOffset = bitsConsumed >> 3u;
-        uint64_t shift = bitsConsumed & 7u;
-        uint64_t bits = (getUint64LEUnaligned(ctx.packet.data + byteStreamOffset + byteOffset) >> shift) & m;
+        uint64_t bits = getBitsUnaligned(data, bitsConsumed, w, m);
 
         bitsConsumed = bitsConsumedNext;
         bitsConsumedNext += w;
 
-        int64_t value = comp.integer.min + static_cast<int64_t>(bits);
+        int64_t value = static_cast<int64_t>(static_cast<uint64_t>(comp.integer.min) + bits);
+        if constexpr (Accumulate) extents.add(bits);
+        if constexpr (Histogram) histogram->addCode(bits);
 
         char* pptr = ptr + stride * item;
-        assert(pptr + sizeof(float) <= end);
-        *reinterpret_cast<float*>(pptr) = static_cast<float>(comp.integer.scale * static_cast<double>(value) + comp.integer.offset);
+        assert(pptr + writeSize <= end);
+        storeValue<WriteType>(pptr, comp.integer.scale * static_cast<double>(value) + comp.integer.offset);
       }
+      if constexpr (Accumulate) mergeExtents(*stats, extents, item - unpackState.itemsWritten, comp);
     }
     else if (comp.type == Component::Type::Float) {
       constexpr uint32_t w = 8 * 4;
       uint32_t bitsConsumedNext = bitsConsumed + w;
+      RealExtents extents;
       for (; item < maxItems; item++) {
 
         if (bitsAvailable < bitsConsumedNext) {
@@ -249,19 +454,24 @@ namespace {
         }
 
         uint64_t byteOffset = bitsConsumed >> 3u;
-        float value = getFloat32LEUnaligned(ctx.packet.data + byteStreamOffset + byteOffset);
+        float value = getFloat32LEUnaligned(data + byteOffset);
 
         bitsConsumed = bitsConsumedNext;
         bitsConsumedNext += w;
 
+        if constexpr (Accumulate) extents.add(value);
+        if constexpr (Histogram) histogram->addReal(value);
+
         char* pptr = ptr + stride * item;
-        assert(pptr + sizeof(float) <= end);
-        *reinterpret_cast<float*>(pptr) = static_cast<float>(value);
+        assert(pptr + writeSize <= end);
+        storeValue<WriteType>(pptr, value);
       }
+      if constexpr (Accumulate) mergeExtents(*stats, extents, item - unpackState.itemsWritten);
     }
     else if (comp.type == Component::Type::Double) {
       constexpr uint32_t w = 8 * 8;
       uint32_t bitsConsumedNext = bitsConsumed + w;
+      RealExtents extents;
       for (; item < maxItems; item++) {
 
         if (bitsAvailable < bitsConsumedNext) {
@@ -270,21 +480,293 @@ namespace {
         }
 
         uint64_t byteOffset = bitsConsumed >> 3u;
-        double value = getFloat64LEUnaligned(ctx.packet.data + byteStreamOffset + byteOffset);
+        double value = getFloat64LEUnaligned(data + byteOffset);
 
         bitsConsumed = bitsConsumedNext;
         bitsConsumedNext += w;
 
+        if constexpr (Accumulate) extents.add(value);
+        if constexpr (Histogram) histogram->addReal(value);
+
         char* pptr = ptr + stride * item;
-        assert(pptr + sizeof(float) <= end);
-        *reinterpret_cast<float*>(pptr) = static_cast<float>(value);
+        assert(pptr + writeSize <= end);
+        storeValue<WriteType>(pptr, value);
       }
+      if constexpr (Accumulate) mergeExtents(*stats, extents, item - unpackState.itemsWritten);
     }
 
     assert((bitsConsumed == AllBitsRead || item != unpackState.itemsWritten) && "No progress");
     return { item,  bitsConsumed };
   }
 
+}
+
+namespace {
+
+  template<bool Accumulate, bool Histogram>
+  BitUnpackState unpackItemsAs(View<char> batch, const BitUnpackState& unpackState, const BitUnpackDesc& unpackDesc, const ComponentWriteDesc& writeDesc, const Component& comp,
+                               ComponentStats* stats, ComponentHistogram* histogram)
+  {
+    using Type = ComponentWriteDesc::Type;
+    switch (writeDesc.type) {
+    case Type::Double: return unpackItems<Accumulate, Histogram, Type::Double>(batch, unpackState, unpackDesc, writeDesc, comp, stats, histogram);
+    case Type::UInt8:  return unpackItems<Accumulate, Histogram, Type::UInt8>(batch, unpackState, unpackDesc, writeDesc, comp, stats, histogram);
+    case Type::UInt16: return unpackItems<Accumulate, Histogram, Type::UInt16>(batch, unpackState, unpackDesc, writeDesc, comp, stats, histogram);
+    case Type::Int32:  return unpackItems<Accumulate, Histogram, Type::Int32>(batch, unpackState, unpackDesc, writeDesc, comp, stats, histogram);
+    default:
+      assert(writeDesc.type == Type::Float);
+      return unpackItems<Accumulate, Histogram, Type::Float>(batch, unpackState, unpackDesc, writeDesc, comp, stats, histogram);
+    }
+  }
+
+}
+
+BitUnpackState consumeBits(View<char> batch, const BitUnpackState& unpackState, const BitUnpackDesc& unpackDesc, const ComponentWriteDesc& writeDesc, const Component& comp,
+                           ComponentStats* stats, ComponentHistogram* histogram)
+{
+  if (stats && histogram) {
+    return unpackItemsAs<true, true>(batch, unpackState, unpackDesc, writeDesc, comp, stats, histogram);
+  }
+  if (stats) {
+    return unpackItemsAs<true, false>(batch, unpackState, unpackDesc, writeDesc, comp, stats, nullptr);
+  }
+  if (histogram) {
+    return unpackItemsAs<false, true>(batch, unpackState, unpackDesc, writeDesc, comp, nullptr, histogram);
+  }
+  return unpackItemsAs<false, false>(batch, unpackState, unpackDesc, writeDesc, comp, nullptr, nullptr);
+}
+
+struct E57Decoder::State
+{
+  Context ctx;
+  std::vector<ComponentReadState> readStates;
+  Buffer<uint8_t> streamSlots;
+};
+
+namespace {
+
+  uint32_t componentBitWidth(const Component& comp)
+  {
+    switch (comp.type) {
+    case Component::Type::Integer:
+    case Component::Type::ScaledInteger:
+      return comp.integer.bitWidth;
+    case Component::Type::Float:
+      return 8 * 4;
+    case Component::Type::Double:
+      return 8 * 8;
+    default:
+      assert(false);
+      return 0;
+    }
+  }
+
+  // Read the bytestream of the current packet if that hasn't been done yet.
+  bool loadStream(Context& ctx, ComponentReadState& readState)
+  {
+    if (readState.streamOffset == 0) {
+      return true;
+    }
+    uint64_t offset = readState.streamOffset;
+    readState.streamOffset = 0;
+    return readBytes(ctx, readState.streamData, offset, readState.unpackDesc.bitsAvailable / 8);
+  }
+
+  // Fetch the header of the next data packet of a component and point the unpack state at
+  // its stream. The stream bytes are read right away unless loadStreamData is false.
+  bool fetchPacket(Context& ctx, ComponentReadState& readState, uint32_t stream, uint64_t sectionPhysicalEnd, bool loadStreamData)
+  {
+    if (sectionPhysicalEnd <= readState.packetOffset) {
+      logError(ctx.logger, "Premature end of section when reading compressed vector");
+      return false;
+    }
+    uint64_t packetOffset = readState.packetOffset;
+    readState.packetOffset = getPacket(ctx, packetOffset, PacketType::Data);
+    if (readState.packetOffset == 0) return false;
+
+    if (ctx.dataPacket.byteStreamsCount <= stream) {
+      logError(ctx.logger, "Stream %u not in packet", uint32_t(stream));
+      return false;
+    }
+
+    // Update unpack state and desc for newly read package
+    uint32_t streamBegin = ctx.dataPacket.byteStreamOffsets[stream];
+    uint32_t streamEnd = ctx.dataPacket.byteStreamOffsets[stream + 1];
+    readState.streamOffset = streamBegin < streamEnd ? advancePhysicalOffset(ctx, packetOffset, streamBegin) : 0;
+    readState.unpackState.bitsConsumed = 0;
+    readState.unpackDesc.data = readState.streamData;
+    readState.unpackDesc.bitsAvailable = 8 * (streamEnd - streamBegin);
+    return !loadStreamData || loadStream(ctx, readState);
+  }
+
+  // Advance the read states past itemCount items without decoding them, all
+  // component types have a fixed bit width so no unpacking is needed.
+  bool skipPoints(Context& ctx, View<ComponentReadState> readStates, uint64_t itemCount, uint64_t sectionPhysicalEnd)
+  {
+    for (size_t i = 0; i < readStates.size; i++) {
+      ComponentReadState& readState = readStates[i];
+      const uint32_t stream = ctx.writeDesc[i].stream;
+      const uint32_t w = componentBitWidth(ctx.pts->components[stream]);
+
+      // Streams of packets that are skipped entirely are never read.
+      uint64_t remaining = itemCount;
+      while (remaining) {
+        if (readState.unpackState.bitsConsumed == AllBitsRead) {
+          if (!fetchPacket(ctx, readState, stream, sectionPhysicalEnd, false)) {
+            return false;
+          }
+        }
+        if (w == 0) break;
+
+        uint64_t available = (readState.unpackDesc.bitsAvailable - readState.unpackState.bitsConsumed) / w;
+        uint64_t skip = std::min(available, remaining);
+        readState.unpackState.bitsConsumed += static_cast<uint32_t>(skip * w);
+        remaining -= skip;
+        if (remaining) {
+          readState.unpackState.bitsConsumed = AllBitsRead;
+        }
+      }
+
+      if (readState.unpackState.bitsConsumed != AllBitsRead && !loadStream(ctx, readState)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Walk the index tree to find the last data packet that starts at or before
+  // recordIndex. Leaves chunkRecord and chunkOffset untouched if there is none.
+  bool findIndexedChunk(Context& ctx, uint64_t indexPhysicalOffset, uint64_t recordIndex, uint64_t& chunkRecord, uint64_t& chunkOffset)
+  {
+    // Index packet:
+    //   0x00  uint8_t      Packet type: 0 = index
+    //   0x01  uint8_t      Flags
+    //   0x02  uint16_t     Packet logical length minus one
+    //   0x04  uint16_t     Entry count
+    //   0x06  uint8_t      Index level, 0 = entries refer to data packets
+    //   0x07  uint8_t[9]   Reserved
+    //   0x10               Entries of { uint64_t chunkRecordNumber, uint64_t chunkPhysicalOffset }
+
+    uint64_t packetOffset = indexPhysicalOffset;
+    for (size_t depth = 0; depth < 8; depth++) {
+      if (getPacket(ctx, packetOffset, PacketType::Index) == 0) {
+        return false;
+      }
+      size_t entryCount = getUint16LE(ctx.packet.data + 4);
+      uint8_t indexLevel = ctx.packet[6];
+      if (ctx.packet.size < 16 + 16 * entryCount) {
+        logError(ctx.logger, "Index packet size %zu too small for %zu entries", ctx.packet.size, entryCount);
+        return false;
+      }
+
+      const char* entries = reinterpret_cast<const char*>(ctx.packet.data + 16);
+      size_t found = entryCount;
+      for (size_t i = 0; i < entryCount; i++) {
+        const char* ptr = entries + 16 * i;
+        if (recordIndex < readUint64LE(ptr)) break;
+        found = i;
+      }
+      if (found == entryCount) {
+        return true;
+      }
+
+      const char* ptr = entries + 16 * found;
+      uint64_t entryRecord = readUint64LE(ptr);
+      uint64_t entryOffset = readUint64LE(ptr);
+      if (indexLevel == 0) {
+        chunkRecord = entryRecord;
+        chunkOffset = entryOffset;
+        return true;
+      }
+      packetOffset = entryOffset;
+    }
+    logError(ctx.logger, "Index tree is too deep");
+    return false;
+  }
+
+  bool setupGrid(const Context& ctx, GridWriteDesc& grid)
+  {
+    if (ctx.writeDesc.size <= grid.rowDesc || ctx.writeDesc.size <= grid.columnDesc ||
+        ctx.pts->components.size <= ctx.writeDesc[grid.rowDesc].stream || ctx.pts->components.size <= ctx.writeDesc[grid.columnDesc].stream)
+    {
+      logError(ctx.logger, "Grid row or column write description out of range");
+      return false;
+    }
+    if (ctx.pts->components[ctx.writeDesc[grid.rowDesc].stream].role != Component::Role::RowIndex ||
+        ctx.pts->components[ctx.writeDesc[grid.columnDesc].stream].role != Component::Role::ColumnIndex)
+    {
+      logError(ctx.logger, "Grid row and column write descriptions must be of row and column index components");
+      return false;
+    }
+    if (ctx.writeDesc[grid.rowDesc].type != ComponentWriteDesc::Type::Float || ctx.writeDesc[grid.columnDesc].type != ComponentWriteDesc::Type::Float) {
+      logError(ctx.logger, "Grid row and column write descriptions must be of type float");
+      return false;
+    }
+    for (size_t i = 0; i < ctx.writeDesc.size; i++) {
+      if (ctx.writeDesc[i].pointSetBase) {
+        logError(ctx.logger, "Write description %zu bypasses the batch, which a grid cannot be filled from", i);
+        return false;
+      }
+      if (ctx.writeDesc[i].stride != grid.cellStride || grid.cellStride < ctx.writeDesc[i].offset + ComponentWriteDesc::typeSize(ctx.writeDesc[i].type)) {
+        logError(ctx.logger, "Write description %zu does not fit a grid cell of %zu bytes", i, grid.cellStride);
+        return false;
+      }
+    }
+    if (grid.cellStride == 0 || grid.cells.size / grid.cellStride / std::max(size_t(1), grid.columns) < grid.rows) {
+      logError(ctx.logger, "Grid of %zu x %zu cells of %zu bytes does not fit in %zu bytes",
+               grid.rows, grid.columns, grid.cellStride, grid.cells.size);
+      return false;
+    }
+
+    std::vector<char> invalidCell(grid.cellStride);
+    for (size_t i = 0; i < ctx.writeDesc.size; i++) {
+      char* ptr = invalidCell.data() + ctx.writeDesc[i].offset;
+      switch (ctx.writeDesc[i].type) {
+      case ComponentWriteDesc::Type::Double: storeValue<ComponentWriteDesc::Type::Double>(ptr, grid.invalidValue); break;
+      case ComponentWriteDesc::Type::UInt8:  storeValue<ComponentWriteDesc::Type::UInt8>(ptr, grid.invalidValue); break;
+      case ComponentWriteDesc::Type::UInt16: storeValue<ComponentWriteDesc::Type::UInt16>(ptr, grid.invalidValue); break;
+      case ComponentWriteDesc::Type::Int32:  storeValue<ComponentWriteDesc::Type::Int32>(ptr, grid.invalidValue); break;
+      default:                               storeValue<ComponentWriteDesc::Type::Float>(ptr, grid.invalidValue); break;
+      }
+    }
+    const size_t cellCount = grid.rows * grid.columns;
+    for (size_t cell = 0; cell < cellCount; cell++) {
+      std::memcpy(grid.cells.data + grid.cellStride * cell, invalidCell.data(), grid.cellStride);
+    }
+    grid.pointsWritten = 0;
+    grid.pointsOutside = 0;
+    return true;
+  }
+
+  // Copy each point of a decoded batch into the grid cell given by its indices.
+  void scatterToGrid(Context& ctx, size_t pointCount)
+  {
+    E57TraceScope traceScope(ctx.e57->trace, "scatterToGrid");
+    GridWriteDesc& grid = *ctx.grid;
+    const size_t rowOffset = ctx.writeDesc[grid.rowDesc].offset;
+    const size_t columnOffset = ctx.writeDesc[grid.columnDesc].offset;
+    const size_t stride = grid.cellStride;
+    const float rows = static_cast<float>(grid.rows);
+    const float columns = static_cast<float>(grid.columns);
+
+    uint64_t written = 0;
+    for (size_t i = 0; i < pointCount; i++) {
+      const char* point = ctx.batch.data + stride * i;
+      float row, column;
+      std::memcpy(&row, point + rowOffset, sizeof(float));
+      std::memcpy(&column, point + columnOffset, sizeof(float));
+
+      // Written so that NaN fails too.
+      if (!(0.f <= row && row < rows && 0.f <= column && column < columns)) {
+        continue;
+      }
+      size_t cell = static_cast<size_t>(row) * grid.columns + static_cast<size_t>(column);
+      std::memcpy(grid.cells.data + stride * cell, point, stride);
+      written++;
+    }
+    grid.pointsWritten += written;
+    grid.pointsOutside += pointCount - written;
+  }
 
   bool readPointsIteration(Context& ctx, View<ComponentReadState> readStates, size_t pointsToDo, uint64_t dataPhysicalOffset, uint64_t sectionPhysicalEnd)
   {
@@ -301,7 +783,7 @@ namespace {
       done = true;
       for (size_t i = 0; i < readStates.size; i++) {
         ComponentReadState& readState = readStates[i];
-        const ComponentWriteDesc& writeDesc = ctx.args.writeDesc[i];
+        const ComponentWriteDesc& writeDesc = ctx.writeDesc[i];
         const uint32_t stream = writeDesc.stream;
 
         // Skip components where we have enough items
@@ -309,61 +791,219 @@ namespace {
 
           // Fetch packet if we have no bits ready
           if (readState.unpackState.bitsConsumed == AllBitsRead) {
-
-            if (sectionPhysicalEnd <= readState.packetOffset) {
-              logError(ctx.logger, "Premature end of section when reading compressed vector");
+            if (!fetchPacket(ctx, readState, stream, sectionPhysicalEnd, true)) {
               return false;
             }
-            readState.packetOffset = getPacket(ctx, readState.packetOffset, PacketType::Data);
-            if (readState.packetOffset == 0) return false;
+          }
 
-            if (ctx.dataPacket.byteStreamsCount <= stream) {
-              logError(ctx.logger, "Stream %u not in packet", uint32_t(stream));
-              return false;
-            }
+          E57Stats* stats = ctx.e57->stats;
+          uint64_t t0 = stats ? getMonotonicNanoseconds() : 0;
+
+          View<char> batch = ctx.batch;
+          if (writeDesc.pointSetBase) {
+            batch = View<char>(writeDesc.pointSetBase + writeDesc.stride * ctx.batchPosition, writeDesc.offset + writeDesc.stride * pointsToDo);
+          }
 
-            // Update unpack state and desc for newly read package
-            readState.unpackState.bitsConsumed = 0;
-            readState.unpackDesc.byteStreamOffset = ctx.dataPacket.byteStreamOffsets[stream];
-            readState.unpackDesc.bitsAvailable = 8 * (ctx.dataPacket.byteStreamOffsets[stream + 1] - readState.unpackDesc.byteStreamOffset);
+          BitUnpackState unpackStateNew;
+          {
+            E57TraceScope traceScope(ctx.e57->trace, "consumeBits");
+            unpackStateNew = consumeBits(batch, readState.unpackState, readState.unpackDesc, writeDesc, ctx.pts->components[stream], ctx.componentStats ? &ctx.componentStats[i] : nullptr,
+                                         ctx.componentHistograms ? &ctx.componentHistograms[i] : nullptr);
           }
 
-          BitUnpackState unpackStateNew = consumeBits(ctx, readState.unpackState, readState.unpackDesc, writeDesc, ctx.pts.components[stream]);
+          if (stats) {
+            stats->addTime(E57Stats::Stage::Unpack, getMonotonicNanoseconds() - t0);
+            E57Stats::add(stats->recordsDecoded[static_cast<size_t>(ctx.pts->components[stream].role)], unpackStateNew.itemsWritten - readState.unpackState.itemsWritten);
+          }
 
           assert((unpackStateNew.bitsConsumed == AllBitsRead || unpackStateNew.itemsWritten != readState.unpackState.itemsWritten) && "No progress");
 
           readState.unpackState = unpackStateNew;
 
           // Continue until we have enough items for all components
-          done = done && readState.unpackState.itemsWritten < readState.unpackDesc.maxItems;
+          done = done && readState.unpackState.itemsWritten == readState.unpackDesc.maxItems;
         }
       }
     } while (!done);
 
+    if (ctx.grid) {
+      scatterToGrid(ctx, pointsToDo);
+    }
     return true;
   }
 
 
-  bool readPoints(Context& ctx, uint64_t dataPhysicalOffset, uint64_t sectionPhysicalEnd)
+  // Decoder and consumer run on separate threads and pass the buffer slices
+  // back and forth. A slice is owned by the decoder until it is published as
+  // produced, and by the consumer until the callback for it has returned.
+  bool readPointsPipelined(Context& ctx, const ReadPointsArgs& args, View<ComponentReadState> readStates, uint64_t dataPhysicalOffset, uint64_t sectionPhysicalEnd)
   {
-    std::vector<ComponentReadState> readStates_(ctx.args.writeDesc.size);
+    const size_t sliceCount = args.bufferCount;
+    const size_t sliceSize = args.buffer.size / sliceCount;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<size_t> slicePointCounts(sliceCount);
+    size_t produced = 0;          // Number of batches handed to the consumer.
+    size_t consumed = 0;          // Number of batches handed back to the decoder.
+    bool decoderDone = false;
+    bool decoderFailed = false;
+    bool consumerStopped = false;
+
+    std::thread decoder([&]() {
+      bool ok = true;
+      size_t pointsDone = 0;
+      while (pointsDone < ctx.pts->recordCount) {
+        size_t slice = 0;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          cond.wait(lock, [&]() { return consumerStopped || produced - consumed < sliceCount; });
+          if (consumerStopped) break;
+          slice = produced % sliceCount;
+        }
 
-    View<ComponentReadState> readStates(readStates_.data(), ctx.args.writeDesc.size);
-    for (size_t i = 0; i < ctx.args.writeDesc.size; i++) {
-      readStates[i].packetOffset = dataPhysicalOffset;
+        size_t pointsToDo = std::min(ctx.pts->recordCount - pointsDone, args.pointCapacity);
+        ctx.batch = View<char>(args.buffer.data + slice * sliceSize, sliceSize);
+        ctx.batchPosition = pointsDone;
+        if (!readPointsIteration(ctx, readStates, pointsToDo, dataPhysicalOffset, sectionPhysicalEnd)) {
+          ok = false;
+          break;
+        }
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          slicePointCounts[slice] = pointsToDo;
+          produced++;
+        }
+        cond.notify_all();
+        pointsDone += pointsToDo;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        decoderDone = true;
+        decoderFailed = !ok;
+      }
+      cond.notify_all();
+    });
+
+    bool ok = true;
+    while (true) {
+      size_t slice = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&]() { return consumed < produced || decoderDone; });
+        if (consumed == produced) break;
+        slice = consumed % sliceCount;
+      }
+
+      E57Stats* stats = ctx.e57->stats;
+      uint64_t t0 = stats ? getMonotonicNanoseconds() : 0;
+      if (args.consumeCallback) {
+        E57TraceScope traceScope(ctx.e57->trace, "consumeCallback");
+        ok = args.consumeCallback(args.consumeCallbackData, args.buffer.data + slice * sliceSize, slicePointCounts[slice]);
+      }
+      if (stats) {
+        stats->addTime(E57Stats::Stage::Consume, getMonotonicNanoseconds() - t0);
+        E57Stats::add(stats->pointsConsumed, slicePointCounts[slice]);
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ok) {
+          consumed++;
+        }
+        else {
+          consumerStopped = true;
+        }
+      }
+      cond.notify_all();
+      if (!ok) break;
+    }
+
+    decoder.join();
+    return ok && !decoderFailed;
+  }
+
+  void resetReadStates(View<ComponentReadState> readStates, uint64_t packetOffset)
+  {
+    for (size_t i = 0; i < readStates.size; i++) {
+      uint8_t* streamData = readStates[i].streamData;
+      readStates[i] = ComponentReadState{};
+      readStates[i].packetOffset = packetOffset;
+      readStates[i].streamData = streamData;
       readStates[i].unpackState.bitsConsumed = AllBitsRead;
-      readStates[i].unpackDesc.maxItems = 5;
     }
+  }
+
+  void assignStreamSlots(View<ComponentReadState> readStates, Buffer<uint8_t>& slots)
+  {
+    slots.accommodate(StreamSlotSize * readStates.size);
+    for (size_t i = 0; i < readStates.size; i++) {
+      readStates[i].streamData = slots.data() + StreamSlotSize * i;
+    }
+  }
+
+  // Point a decoder at a point set, keeping the allocations from earlier use. The packet
+  // buffer and tables are left as is, as the cached packet offset is cleared.
+  View<ComponentReadState> resetDecoder(E57Decoder::State& decoder, const E57File* e57, Logger logger, IoBudget* ioBudget, const Points* pts,
+                                        View<const ComponentWriteDesc> writeDesc, ComponentStats* componentStats, ComponentHistogram* componentHistograms)
+  {
+    Context& ctx = decoder.ctx;
+    ctx.e57 = e57;
+    ctx.logger = logger;
+    ctx.ioBudget = ioBudget;
+    ctx.pts = pts;
+    ctx.writeDesc = writeDesc;
+    ctx.componentStats = componentStats;
+    ctx.componentHistograms = componentHistograms;
+    ctx.grid = nullptr;
+    ctx.batch = View<char>();
+    ctx.batchPosition = 0;
+    ctx.furthestPacketOffset = 0;
+    ctx.lastVerifiedPage = ~uint64_t(0);
+    ctx.packet.currentOffset = 0;
+    ctx.packet.nextOffset = 0;
+    ctx.packet.size = 0;
+    ctx.packet.type = PacketType::Empty;
+    ctx.dataPacket.byteStreamsCount = 0;
+
+    decoder.readStates.resize(writeDesc.size);
+    View<ComponentReadState> readStates(decoder.readStates.data(), decoder.readStates.size());
+    assignStreamSlots(readStates, decoder.streamSlots);
+    return readStates;
+  }
+
+  bool readPoints(Context& ctx, const ReadPointsArgs& args, View<ComponentReadState> readStates, uint64_t dataPhysicalOffset, uint64_t sectionPhysicalEnd)
+  {
+    resetReadStates(readStates, dataPhysicalOffset);
+
+    if (1 < args.bufferCount) {
+      return readPointsPipelined(ctx, args, readStates, dataPhysicalOffset, sectionPhysicalEnd);
+    }
+
+    ctx.batch = args.buffer;
 
     size_t pointsDone = 0;
-    while (pointsDone < ctx.pts.recordCount) {
-      size_t pointsToDo = std::min(ctx.pts.recordCount - pointsDone,ctx.args.pointCapacity);
+    while (pointsDone < ctx.pts->recordCount) {
+      size_t pointsToDo = std::min(ctx.pts->recordCount - pointsDone, args.pointCapacity);
+      ctx.batchPosition = pointsDone;
       if (!readPointsIteration(ctx, readStates, pointsToDo, dataPhysicalOffset, sectionPhysicalEnd)) {
         return false;
       }
 
       // callback to process the pointsToDo
-      ctx.args.consumeCallback(ctx.args.consumeCallbackData, pointsToDo);
+      E57Stats* stats = ctx.e57->stats;
+      uint64_t t0 = stats ? getMonotonicNanoseconds() : 0;
+      bool ok = true;
+      if (args.consumeCallback) {
+        E57TraceScope traceScope(ctx.e57->trace, "consumeCallback");
+        ok = args.consumeCallback(args.consumeCallbackData, ctx.batch.data, pointsToDo);
+      }
+      if (!ok) {
+        return false;
+      }
+      if (stats) {
+        stats->addTime(E57Stats::Stage::Consume, getMonotonicNanoseconds() - t0);
+        E57Stats::add(stats->pointsConsumed, pointsToDo);
+      }
 
       pointsDone += pointsToDo;
     }
@@ -385,70 +1025,464 @@ namespace {
             (sectionLogicalEnd % ctx.e57->page.logicalSize));
   }
 
+  bool readSectionHeader(Context& ctx, Section& section)
+  {
+    // CompressedVectorSectionHeader:
+    // -----------------------------
+    //
+    //   0x00  uint8_t      Section id: 1 = compressed vector section
+    //   0x01  uint8_t[7]   Reserved, must be zero.
+    //   0x08  uint64_t     Section logical length, byte length
+    //   0x10  uint64_t     Data physical offset, offset of first data packet.
+    //   0x18  uint64_t     Index physical offset, offset of first index packet.
+    //   0x20               Header size.
+
+
+    constexpr uint8_t CompressedVectorSectionId = 1;
+    constexpr uint64_t CompressedVectorSectionHeaderSize = 8 + 3 * 8;
+
+    uint64_t fileOffset = ctx.pts->fileOffset;
+
+    char buf[CompressedVectorSectionHeaderSize];
+    if (!readBytes(ctx, buf, fileOffset, CompressedVectorSectionHeaderSize)) {
+      return false;
+    }
+
+
+    const char* ptr = buf;
+    if (uint8_t sectionId = static_cast<uint8_t>(*ptr); sectionId != CompressedVectorSectionId) {
+      logError(ctx.logger, "Expected section id 0x%x, got 0x%x", CompressedVectorSectionId, sectionId);
+      return false;
+    }
+    ptr += 8;
+
+    // Bytelength of whole section
+    uint64_t sectionLogicalLength = readUint64LE(ptr);
+
+    // Calculate section end
+    section.physicalEnd = calculateSectionPhysicalEnd(ctx, ctx.pts->fileOffset, sectionLogicalLength);
+
+    // Offset of first datapacket
+    section.dataPhysicalOffset = readUint64LE(ptr);
+
+    // Offset of first index packet
+    section.indexPhysicalOffset = readUint64LE(ptr);
+
+    logDebug(ctx.logger, "sectionLogicalLength=0x%zx dataPhysicalOffset=0x%zx indexPhysicalOffset=%zx sectionPhysicalEnd=0x%zx",
+           sectionLogicalLength, section.dataPhysicalOffset, section.indexPhysicalOffset, section.physicalEnd);
+    return true;
+  }
+
+  bool checkWriteDesc(Logger logger, const Points& pts, View<const ComponentWriteDesc> writeDesc)
+  {
+    for (size_t i = 0; i < writeDesc.size; i++) {
+      if (pts.components.size <= writeDesc[i].stream) {
+        logError(logger, "Write description %zu refers to stream %u, but point set only has %zu", i, writeDesc[i].stream, pts.components.size);
+        return false;
+      }
+      if (ComponentWriteDesc::typeSize(writeDesc[i].type) == 0) {
+        logError(logger, "Write description %zu has invalid type %u", i, uint32_t(writeDesc[i].type));
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Number of points a batch of size bytes has room for in every write description that
+  // writes into the batch.
+  size_t batchCapacity(View<const ComponentWriteDesc> writeDesc, size_t size)
+  {
+    size_t capacity = ~size_t(0);
+    for (size_t i = 0; i < writeDesc.size; i++) {
+      const ComponentWriteDesc& desc = writeDesc[i];
+      if (desc.pointSetBase) {
+        continue;
+      }
+      const size_t first = desc.offset + ComponentWriteDesc::typeSize(desc.type);
+      if (size < first) {
+        return 0;
+      }
+      if (desc.stride) {
+        capacity = std::min(capacity, 1 + (size - first) / desc.stride);
+      }
+    }
+    return capacity;
+  }
+
+  // Each of the bufferCount slices of the buffer must hold a full batch of points.
+  bool checkBuffer(Logger logger, const ReadPointsArgs& args)
+  {
+    const size_t sliceCount = std::max(size_t(1), args.bufferCount);
+    const size_t sliceSize = args.buffer.size / sliceCount;
+    for (size_t i = 0; i < args.writeDesc.size; i++) {
+      const ComponentWriteDesc& desc = args.writeDesc[i];
+      if (desc.pointSetBase) {
+        continue;
+      }
+      const size_t end = desc.offset + desc.stride * (args.pointCapacity - 1) + ComponentWriteDesc::typeSize(desc.type);
+      if (sliceSize < end) {
+        logError(logger, "Buffer of %zu bytes split into %zu slices can not hold %zu points of write description %zu, which needs %zu bytes per slice",
+                 args.buffer.size, sliceCount, args.pointCapacity, i, end);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool readPointSet(const E57File* e57, Logger logger, const ReadPointsArgs& args, IoBudget* ioBudget)
+  {
+    if (e57->points.size <= args.pointSetIndex) {
+      logError(logger, "Point set index %zu is out of range (count=%zu)", args.pointSetIndex, e57->points.size);
+      return false;
+    }
+    if (args.pointCapacity == 0) {
+      logError(logger, "Point capacity must be at least 1");
+      return false;
+    }
+    if (!checkWriteDesc(logger, e57->points[args.pointSetIndex], args.writeDesc) || !checkBuffer(logger, args)) {
+      return false;
+    }
+
+    std::unique_ptr<E57Decoder> localDecoder;
+    E57Decoder* decoder = args.decoder;
+    if (decoder == nullptr) {
+      localDecoder = std::make_unique<E57Decoder>();
+      decoder = localDecoder.get();
+    }
+
+    View<ComponentReadState> readStates = resetDecoder(*decoder->state, e57, logger, ioBudget, &e57->points[args.pointSetIndex], args.writeDesc, args.componentStats, args.componentHistograms);
+    Context& ctx = decoder->state->ctx;
+
+    logDebug(ctx.logger, "Reading compressed vector %zu: fileOffset=0x%zx recordCount=0x%zx",
+             args.pointSetIndex, ctx.pts->fileOffset, ctx.pts->recordCount);
+
+    if (args.grid) {
+      if (!setupGrid(ctx, *args.grid)) {
+        return false;
+      }
+      ctx.grid = args.grid;
+    }
+
+    Section section;
+    if (!readSectionHeader(ctx, section)) {
+      return false;
+    }
+
+    if (!readPoints(ctx, args, readStates, section.dataPhysicalOffset, section.physicalEnd)) {
+      return false;
+    }
+
+    return true;
+  }
+
+}
+
+
+E57Decoder::E57Decoder()
+{
+  // Default-initialized, there is no need to clear the packet buffers.
+  state = new State;
+}
+
+E57Decoder::~E57Decoder()
+{
+  delete state;
 }
 
 
 bool readE57Points(const E57File* e57, Logger logger, const ReadPointsArgs& args)
 {
-  Context ctx{
-    .e57 = e57,
-    .logger = logger,
-    .args = args,
-    .pts = e57->points[args.pointSetIndex]
+  return readPointSet(e57, logger, args, nullptr);
+}
+
+
+bool readE57PointSets(const E57File* e57, Logger logger, const ReadPointSetsArgs& args)
+{
+  if (args.setupCallback == nullptr) {
+    logError(logger, "No setup callback");
+    return false;
+  }
+
+  std::vector<size_t> order;
+  if (args.pointSetIndices.size) {
+    std::vector<bool> seen(e57->points.size);
+    for (size_t i = 0; i < args.pointSetIndices.size; i++) {
+      if (e57->points.size <= args.pointSetIndices[i]) {
+        logError(logger, "Point set index %zu is out of range (count=%zu)", args.pointSetIndices[i], e57->points.size);
+        return false;
+      }
+      // Each point set is handed to one worker, which owns its output while reading.
+      if (seen[args.pointSetIndices[i]]) {
+        logError(logger, "Point set index %zu is given more than once", args.pointSetIndices[i]);
+        return false;
+      }
+      seen[args.pointSetIndices[i]] = true;
+      order.push_back(args.pointSetIndices[i]);
+    }
+  }
+  else {
+    for (size_t i = 0; i < e57->points.size; i++) {
+      order.push_back(i);
+    }
+  }
+  if (order.empty()) {
+    return true;
+  }
+
+  // Largest first, so the last point sets handed out are the cheap ones.
+  std::stable_sort(order.begin(), order.end(), [e57](size_t a, size_t b) { return e57->points[b].recordCount < e57->points[a].recordCount; });
+
+  size_t threadCount = args.threadCount ? args.threadCount : std::max(1u, std::thread::hardware_concurrency());
+  threadCount = std::min(threadCount, order.size());
+
+  std::unique_ptr<IoBudget> ioBudget;
+  if (args.maxConcurrentReads) {
+    ioBudget = std::make_unique<IoBudget>(args.maxConcurrentReads);
+  }
+
+  logDebug(logger, "Reading %zu point sets using %zu threads, maxConcurrentReads=%zu", order.size(), threadCount, args.maxConcurrentReads);
+
+  std::atomic<size_t> next = 0;
+  std::atomic<bool> success = true;
+  auto worker = [&]() {
+    E57Decoder decoder;
+    for (size_t i = next++; i < order.size(); i = next++) {
+      ReadPointsArgs readArgs{};
+      readArgs.pointSetIndex = order[i];
+      readArgs.decoder = &decoder;
+
+      bool ok = args.setupCallback(args.callbackData, readArgs) && readPointSet(e57, logger, readArgs, ioBudget.get());
+      if (args.finishCallback) {
+        args.finishCallback(args.callbackData, order[i], ok);
+      }
+      if (!ok) {
+        success = false;
+      }
+    }
   };
 
+  if (threadCount == 1) {
+    worker();
+  }
+  else {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < threadCount; i++) {
+      threads.emplace_back(worker);
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+
+  return success;
+}
 
-  logDebug(ctx.logger, "Reading compressed vector %zu: fileOffset=0x%zx recordCount=0x%zx",
-           args.pointSetIndex, ctx.pts.fileOffset, ctx.pts.recordCount);
 
-  // CompressedVectorSectionHeader:
-  // -----------------------------
-  // 
-  //   0x00  uint8_t      Section id: 1 = compressed vector section
-  //   0x01  uint8_t[7]   Reserved, must be zero.
-  //   0x08  uint64_t     Section logical length, byte length
-  //   0x10  uint64_t     Data physical offset, offset of first data packet.
-  //   0x18  uint64_t     Index physical offset, offset of first index packet.
-  //   0x20               Header size.
+size_t suggestE57BatchSize(const E57File* e57, Logger logger, size_t pointSetIndex, size_t bytesPerPoint, size_t memoryBudget)
+{
+  constexpr size_t DefaultMemoryBudget = 256 * 1024; // Fits comfortably in a typical L2 cache.
 
+  if (e57->points.size <= pointSetIndex) {
+    logError(logger, "Point set index %zu is out of range (count=%zu)", pointSetIndex, e57->points.size);
+    return 0;
+  }
+  const Points& pts = e57->points[pointSetIndex];
 
-  constexpr uint8_t CompressedVectorSectionId = 1;
-  constexpr uint64_t CompressedVectorSectionHeaderSize = 8 + 3 * 8;
+  size_t batchSize = std::max(size_t(1), (memoryBudget ? memoryBudget : DefaultMemoryBudget) / std::max(size_t(1), bytesPerPoint));
 
-  uint64_t fileOffset = ctx.pts.fileOffset;
+  // Records per data packet, from the bytestream lengths of the first packet.
+  size_t recordsPerPacket = 0;
+  {
+    std::unique_ptr<Context> ctx = std::make_unique<Context>();
+    ctx->e57 = e57;
+    ctx->logger = logger;
+    ctx->pts = &pts;
+
+    Section section;
+    if (pts.recordCount && readSectionHeader(*ctx, section) && getPacket(*ctx, section.dataPhysicalOffset, PacketType::Data) != 0) {
+      for (size_t i = 0; i < pts.components.size && i < ctx->dataPacket.byteStreamsCount; i++) {
+        uint32_t w = componentBitWidth(pts.components[i]);
+        if (w == 0) continue;
+
+        size_t records = 8 * size_t(ctx->dataPacket.byteStreamOffsets[i + 1] - ctx->dataPacket.byteStreamOffsets[i]) / w;
+        recordsPerPacket = recordsPerPacket ? std::min(recordsPerPacket, records) : records;
+      }
+    }
+  }
 
-  Buffer<char> buf;
-  buf.accommodate(CompressedVectorSectionHeaderSize);
-  if (!readE57Bytes(e57, logger, buf.data(), fileOffset, CompressedVectorSectionHeaderSize)) {
+  // Align batches with packet boundaries, either whole packets per batch or an
+  // even split of each packet.
+  if (recordsPerPacket) {
+    if (recordsPerPacket <= batchSize) {
+      batchSize = recordsPerPacket * (batchSize / recordsPerPacket);
+    }
+    else {
+      size_t batchesPerPacket = (recordsPerPacket + batchSize - 1) / batchSize;
+      batchSize = (recordsPerPacket + batchesPerPacket - 1) / batchesPerPacket;
+    }
+  }
+  batchSize = static_cast<size_t>(std::max(uint64_t(1), std::min(uint64_t(batchSize), pts.recordCount)));
+
+  logDebug(logger, "Point set %zu: recordsPerPacket=%zu bytesPerPoint=%zu batchSize=%zu", pointSetIndex, recordsPerPacket, bytesPerPoint, batchSize);
+  return batchSize;
+}
+
+
+bool getE57GridSize(const E57File* e57, Logger logger, size_t pointSetIndex, size_t& rows, size_t& columns)
+{
+  if (e57->points.size <= pointSetIndex) {
+    logError(logger, "Point set index %zu is out of range (count=%zu)", pointSetIndex, e57->points.size);
     return false;
   }
-  
 
-  const char* ptr = buf.data();
-  if (uint8_t sectionId = static_cast<uint8_t>(*ptr); sectionId != CompressedVectorSectionId) {
-    logError(ctx.logger, "Expected section id 0x%x, got 0x%x", CompressedVectorSectionId, sectionId);
+  bool hasRows = false;
+  bool hasColumns = false;
+  const Points& pts = e57->points[pointSetIndex];
+  for (size_t i = 0; i < pts.components.size; i++) {
+    const Component& comp = pts.components[i];
+    if (comp.type != Component::Type::Integer || comp.integer.max < 0) {
+      continue;
+    }
+    if (comp.role == Component::Role::RowIndex) {
+      rows = static_cast<size_t>(comp.integer.max) + 1;
+      hasRows = true;
+    }
+    else if (comp.role == Component::Role::ColumnIndex) {
+      columns = static_cast<size_t>(comp.integer.max) + 1;
+      hasColumns = true;
+    }
+  }
+  if (!hasRows || !hasColumns) {
+    logError(logger, "Point set %zu has no integer row and column index components", pointSetIndex);
     return false;
   }
-  ptr += 8;
+  return true;
+}
 
-  // Bytelength of whole section
-  uint64_t sectionLogicalLength = readUint64LE(ptr); 
+struct PointReader::State
+{
+  E57Decoder::State decoder;
+  Section section;
+  uint64_t position = 0;
+  bool failed = false;
+};
+
+PointReader::~PointReader()
+{
+  close();
+}
+
+bool PointReader::open(const E57File* e57, Logger logger, size_t pointSetIndex, View<const ComponentWriteDesc> writeDesc, ComponentStats* componentStats, ComponentHistogram* componentHistograms)
+{
+  close();
+
+  if (e57->points.size <= pointSetIndex) {
+    logError(logger, "Point set index %zu is out of range (count=%zu)", pointSetIndex, e57->points.size);
+    return false;
+  }
+  const Points& pts = e57->points[pointSetIndex];
+  if (!checkWriteDesc(logger, pts, writeDesc)) {
+    return false;
+  }
+
+  state = new State;
+  View<ComponentReadState> readStates = resetDecoder(state->decoder, e57, logger, nullptr, &pts, writeDesc, componentStats, componentHistograms);
 
-  // Calculate section end 
-  uint64_t sectionPhysicalEnd = calculateSectionPhysicalEnd(ctx, ctx.pts.fileOffset, sectionLogicalLength);
+  logDebug(logger, "Opening point reader on compressed vector %zu: fileOffset=0x%zx recordCount=0x%zx",
+           pointSetIndex, pts.fileOffset, pts.recordCount);
 
-  // Offset of first datapacket
-  uint64_t dataPhysicalOffset = readUint64LE(ptr);
+  if (!readSectionHeader(state->decoder.ctx, state->section)) {
+    close();
+    return false;
+  }
+
+  resetReadStates(readStates, state->section.dataPhysicalOffset);
+  return true;
+}
+
+void PointReader::close()
+{
+  delete state;
+  state = nullptr;
+}
+
+size_t PointReader::next(View<char> batch, size_t maxPoints)
+{
+  if (state == nullptr || state->failed) {
+    return 0;
+  }
 
-  // Offset of first index packet
-  uint64_t indexPhysicalOffset = readUint64LE(ptr);
+  Context& ctx = state->decoder.ctx;
+  size_t pointsToDo = static_cast<size_t>(std::min(uint64_t(maxPoints), ctx.pts->recordCount - state->position));
+  if (pointsToDo == 0) {
+    return 0;
+  }
+  const size_t capacity = batchCapacity(ctx.writeDesc, batch.size);
+  if (capacity == 0) {
+    logError(ctx.logger, "Batch of %zu bytes can not hold a single point", batch.size);
+    state->failed = true;
+    return 0;
+  }
+  pointsToDo = std::min(pointsToDo, capacity);
+
+  ctx.batch = batch;
+  ctx.batchPosition = state->position;
+  View<ComponentReadState> readStates(state->decoder.readStates.data(), state->decoder.readStates.size());
+  if (!readPointsIteration(ctx, readStates, pointsToDo, state->section.dataPhysicalOffset, state->section.physicalEnd)) {
+    state->failed = true;
+    return 0;
+  }
+  state->position += pointsToDo;
+  return pointsToDo;
+}
 
-  logDebug(ctx.logger, "sectionLogicalLength=0x%zx dataPhysicalOffset=0x%zx indexPhysicalOffset=%zx sectionPhysicalEnd=0x%zx",
-         sectionLogicalLength, dataPhysicalOffset, indexPhysicalOffset, sectionPhysicalEnd);
+bool PointReader::seek(uint64_t pointIndex)
+{
+  if (state == nullptr || state->failed) {
+    return false;
+  }
 
-  if (!readPoints(ctx, dataPhysicalOffset, sectionPhysicalEnd)) {
+  Context& ctx = state->decoder.ctx;
+  if (ctx.pts->recordCount < pointIndex) {
+    logError(ctx.logger, "Seek position %" PRIu64 " is beyond record count %" PRIu64, pointIndex, ctx.pts->recordCount);
     return false;
   }
 
+  uint64_t chunkRecord = 0;
+  uint64_t chunkOffset = state->section.dataPhysicalOffset;
+  if (state->section.indexPhysicalOffset != 0) {
+    if (!findIndexedChunk(ctx, state->section.indexPhysicalOffset, pointIndex, chunkRecord, chunkOffset)) {
+      state->failed = true;
+      return false;
+    }
+  }
+
+  // Restart at the chunk unless the current position is a closer starting point.
+  View<ComponentReadState> readStates(state->decoder.readStates.data(), state->decoder.readStates.size());
+  if (state->position < chunkRecord || pointIndex < state->position) {
+    resetReadStates(readStates, chunkOffset);
+    state->position = chunkRecord;
+  }
+
+  if (!skipPoints(ctx, readStates, pointIndex - state->position, state->section.physicalEnd)) {
+    state->failed = true;
+    return false;
+  }
+  state->position = pointIndex;
   return true;
 }
+
+uint64_t PointReader::position() const
+{
+  return state ? state->position : 0;
+}
+
+uint64_t PointReader::recordCount() const
+{
+  return state ? state->decoder.ctx.pts->recordCount : 0;
+}
+
+bool PointReader::failed() const
+{
+  return state == nullptr || state->failed;
+}
@@ -11,6 +11,8 @@
 
 #include "Common.h"
 #include "e57File.h"
+#include "e57Kernels.h"
+#include "e57Trace.h"
 #include "cd_xml.h"
 
 
@@ -37,6 +39,9 @@ namespace {
   View<const char> e57Read(const E57File* e57, Logger logger, uint64_t offset, uint64_t size)
   {
     View<const char> rv = e57->fileRead(e57->fileReadData, offset, size);
+    if (e57->stats) {
+      E57Stats::add(e57->stats->bytesRead, rv.size);
+    }
     if (rv.size != size) {
       logError(logger, "File read error, offset=%" PRIu64 ", size=%" PRIu64, offset, size);
       rv.data = nullptr;
@@ -89,11 +94,12 @@ namespace {
     return true;
   }
 
-  bool checkPage(const E57File* e57, Logger logger, const View<const char>& bytes)
+  struct CrcTable
   {
-    static bool first = true;
-    static uint32_t table[256];
-    if (first) {
+    uint32_t table[256];
+
+    CrcTable()
+    {
       const uint32_t polynomial = 0x82f63b78; // reflected 0x1EDC6F41
       for (uint32_t n = 0; n < 256; n++) {
         uint32_t c = n;
@@ -108,28 +114,45 @@ namespace {
         table[n] = c;
       }
     }
+  };
 
-    uint32_t crc = 0xFFFFFFFFu;
-    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(bytes.data);
-    for (size_t i = 0; i < e57->page.logicalSize; i++) {
-      crc = (crc >> 8) ^ table[(crc ^ *ptr++) & 0xff];
-    }
-    crc ^= 0xFFFFFFFFu;
+}
 
-    // For some reason the CRC calc above gets endian swapped, so we read this as big endian for now...
-    uint32_t crcRef = uint32_t(ptr[0]) << 24 | uint32_t(ptr[1]) << 16 | uint32_t(ptr[2]) << 8 | uint32_t(ptr[3]);
-    if (crc != crcRef) {
-      logError(logger, "CRC error, expected 0x%8x, got 0x%8x", crcRef, crc);
-      return false;
-    }
+uint32_t crc32c(const void* data, size_t size)
+{
+  // Function-local static, initialization is thread-safe and happens once.
+  static const CrcTable crcTable;
+  const uint32_t* table = crcTable.table;
+
+  uint32_t crc = 0xFFFFFFFFu;
+  const uint8_t* ptr = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; i++) {
+    crc = (crc >> 8) ^ table[(crc ^ *ptr++) & 0xff];
+  }
+  return crc ^ 0xFFFFFFFFu;
+}
 
-    return true;
+bool checkPage(const E57File* e57, Logger logger, const View<const char>& bytes)
+{
+  E57TraceScope traceScope(e57->trace, "checkPage");
+
+  uint32_t crc = crc32c(bytes.data, e57->page.logicalSize);
+
+  // For some reason the CRC calc above gets endian swapped, so we read this as big endian for now...
+  const uint8_t* ptr = reinterpret_cast<const uint8_t*>(bytes.data) + e57->page.logicalSize;
+  uint32_t crcRef = uint32_t(ptr[0]) << 24 | uint32_t(ptr[1]) << 16 | uint32_t(ptr[2]) << 8 | uint32_t(ptr[3]);
+  if (crc != crcRef) {
+    logError(logger, "CRC error, expected 0x%8x, got 0x%8x", crcRef, crc);
+    return false;
   }
 
+  return true;
 }
 
-bool readE57Bytes(const E57File* e57, Logger logger, void* dst_, uint64_t& physicalOffset, uint64_t bytesToRead)
+bool readE57Bytes(const E57File* e57, Logger logger, void* dst_, uint64_t& physicalOffset, uint64_t bytesToRead, uint64_t* lastVerifiedPage)
 {
+  E57TraceScope traceScope(e57->trace, "readE57Bytes");
+
   size_t page = physicalOffset >> e57->page.shift;
   size_t offsetInPage = physicalOffset & e57->page.mask;
   if (e57->page.logicalSize <= offsetInPage) {
@@ -137,18 +160,37 @@ bool readE57Bytes(const E57File* e57, Logger logger, void* dst_, uint64_t& physi
     return false;
   }
 
+  E57Stats* stats = e57->stats;
   char* dst = static_cast<char*>(dst_);
   while (bytesToRead) {
 
+    uint64_t t0 = stats ? getMonotonicNanoseconds() : 0;
     View<const char> pageBytes = e57Read(e57, logger, page * e57->page.size, e57->page.size);
-    if (!checkPage(e57, logger, pageBytes)) {
+    if (!pageBytes.size) {
       return false;
     }
+    uint64_t t1 = stats ? getMonotonicNanoseconds() : 0;
+    bool verify = lastVerifiedPage == nullptr || *lastVerifiedPage != page;
+    if (verify) {
+      if (!checkPage(e57, logger, pageBytes)) {
+        return false;
+      }
+      if (lastVerifiedPage) {
+        *lastVerifiedPage = page;
+      }
+    }
+    uint64_t t2 = stats ? getMonotonicNanoseconds() : 0;
     size_t bytesToReadFromPage = std::min(e57->page.logicalSize - offsetInPage, bytesToRead);
 #if 0
     logDebug(logger, "copy %zu bytes from page %zu", bytesToReadFromPage, page);
 #endif
     std::memcpy(dst, pageBytes.data + offsetInPage, bytesToReadFromPage);
+    if (stats) {
+      uint64_t t3 = getMonotonicNanoseconds();
+      stats->addTime(E57Stats::Stage::Read, (t1 - t0) + (t3 - t2));
+      stats->addTime(E57Stats::Stage::Verify, t2 - t1);
+      E57Stats::add(stats->pagesVerified, verify ? 1 : 0);
+    }
     physicalOffset = page * e57->header.pageSize + offsetInPage + bytesToReadFromPage;
     offsetInPage = 0;
 
@@ -1,6 +1,11 @@
 #pragma once
+#include <atomic>
+#include <limits>
 #include "Common.h"
 
+struct E57Trace;
+struct ComponentHistogram;
+
 // Readback callback. 
 //
 // Returns a view of the file. The returned view will ony be accessed before the next
@@ -8,7 +13,12 @@
 typedef View<const char>(*ReadCallback)(void* callbackData, uint64_t offset, uint64_t size);
 
 
-typedef bool(*ConsumePointsCallback)(void* callbackData, size_t pointCount);
+// Consume callback.
+//
+// Invoked with the start of the batch that holds pointCount decoded points, laid out
+// according to the write descriptions. The batch may be accessed until the callback
+// returns. Returning false stops the read.
+typedef bool(*ConsumePointsCallback)(void* callbackData, char* batch, size_t pointCount);
 
 struct Component
 {
@@ -72,15 +82,99 @@ struct Component
 };
 
 
+// Counters and timings of the stages of reading an E57 file.
+//
+// Set E57File::stats to collect. Updates are relaxed atomic adds, so a single instance
+// can be shared by concurrent readers. Stage times are summed over threads.
+struct E57Stats
+{
+  enum struct Stage : uint32_t {
+    Read,       // Fetching pages through the read callback and copying out payload.
+    Verify,     // Page checksums.
+    Unpack,     // Unpacking bytestreams into point batches.
+    Consume,    // Consume callbacks.
+    Count
+  };
+
+  std::atomic<uint64_t> bytesRead{ 0 };         // Bytes returned by the read callback.
+  std::atomic<uint64_t> pagesVerified{ 0 };
+  std::atomic<uint64_t> packetsFetched{ 0 };
+  std::atomic<uint64_t> packetsRefetched{ 0 };  // Fetches of packets at or before one already fetched.
+  std::atomic<uint64_t> pointsConsumed{ 0 };
+  std::atomic<uint64_t> recordsDecoded[static_cast<size_t>(Component::Role::Count)];
+  std::atomic<uint64_t> stageNanoseconds[static_cast<size_t>(Stage::Count)];
+
+  static void add(std::atomic<uint64_t>& counter, uint64_t value) { counter.fetch_add(value, std::memory_order_relaxed); }
+  void addTime(Stage stage, uint64_t nanoseconds) { add(stageNanoseconds[static_cast<size_t>(stage)], nanoseconds); }
+};
+
+// Actual extents of the decoded values of a component, as opposed to the declared
+// minimum and maximum in the XML. Values are after scale and offset are applied.
+struct ComponentStats
+{
+  double min = std::numeric_limits<double>::infinity();
+  double max = -std::numeric_limits<double>::infinity();
+  double sum = 0.0;
+  uint64_t count = 0;
+
+  double mean() const { return count ? sum / static_cast<double>(count) : 0.0; }
+
+  void merge(const ComponentStats& other)
+  {
+    min = other.min < min ? other.min : min;
+    max = max < other.max ? other.max : max;
+    sum += other.sum;
+    count += other.count;
+  }
+};
+
+// Where and how to store the values of a component in a batch.
+//
+// Values are converted from the value after scale and offset, or before if unscaled is
+// set. Conversions to integer types round to nearest and clamp to the range of the type.
+// Stores do not need to be aligned.
+//
+// Point i of a batch is written at offset + stride * i from the start of the batch. If
+// pointSetBase is set, point i of the point set is written at pointSetBase + offset +
+// stride * i instead, bypassing the batch, which lets the decoder fill arrays that
+// hold a whole point set, like memory mapped output files.
 struct ComponentWriteDesc
 {
   enum struct Type : uint32_t {
-    Float
+    Float,
+    Double,
+    UInt8,
+    UInt16,
+    Int32,
+    Count
   };
   size_t offset = 0;
   size_t stride = 0;
   Type type = Type::Float;
   uint32_t stream = 0;
+  bool unscaled = false;        // Store scaled integers as the integer, without scale and offset.
+  char* pointSetBase = nullptr;
+
+  static size_t typeSize(Type type)
+  {
+    switch (type) {
+    case Type::Float:  return sizeof(float);
+    case Type::Double: return sizeof(double);
+    case Type::UInt8:  return sizeof(uint8_t);
+    case Type::UInt16: return sizeof(uint16_t);
+    case Type::Int32:  return sizeof(int32_t);
+    default:           return 0;
+    }
+  }
+};
+
+// Rigid transform from the coordinates of a point set to the file coordinates.
+struct Pose
+{
+  double rotation[4];     // Unit quaternion w, x, y, z.
+  double translation[3];
+
+  void init() { rotation[0] = 1.0; rotation[1] = rotation[2] = rotation[3] = 0.0; translation[0] = translation[1] = translation[2] = 0.0; }
 };
 
 struct Points
@@ -88,8 +182,11 @@ struct Points
   uint64_t fileOffset;
   uint64_t recordCount;
   UninitializedView<Component> components;
+  const char* name;       // Name of the point set, null if none.
+  Pose pose;              // Identity if the point set has none.
+  bool hasPose;
 
-  void init() { fileOffset = 0; recordCount = 0; components.init(); }
+  void init() { fileOffset = 0; recordCount = 0; components.init(); name = nullptr; pose.init(); hasPose = false; }
 };
 
 struct E57File
@@ -101,6 +198,9 @@ struct E57File
   View<Points> points{};
   Arena arena;
 
+  E57Stats* stats = nullptr;
+  E57Trace* trace = nullptr;  // See e57Trace.h.
+
   bool ready = false;
 
   struct Header {
@@ -127,16 +227,156 @@ struct E57File
 
 bool openE57(E57File& e57, Logger logger, ReadCallback fileRead, void* fileReadData, uint64_t fileSize);
 
-bool readE57Bytes(const E57File* e57, Logger logger, void* dst, uint64_t& physicalOffset, uint64_t bytesToRead);
+// Read logical bytes starting at a physical offset, verifying page checksums.
+//
+// If lastVerifiedPage is given, it holds the index of a page that has already passed
+// its checksum, and is updated as pages are verified. This lets consecutive small reads
+// avoid checking the page they share, pass ~0 initially.
+bool readE57Bytes(const E57File* e57, Logger logger, void* dst, uint64_t& physicalOffset, uint64_t bytesToRead, uint64_t* lastVerifiedPage = nullptr);
 bool parseE57Xml(E57File* e57File, Logger logger, const char* xmlBytes, size_t xmlLength);
 
+// Decoder state that can be kept and passed to successive reads.
+//
+// Setting up a decoder involves more than 300 KB of packet buffers and tables, which
+// a reused decoder only allocates once. It keeps no reference to a file or point set
+// between reads. Not thread-safe, use one per thread.
+struct E57Decoder
+{
+  E57Decoder();
+  ~E57Decoder();
+
+  E57Decoder(const E57Decoder&) = delete;
+  E57Decoder& operator=(const E57Decoder&) = delete;
+
+  struct State;
+  State* state = nullptr;
+};
+
+// Organized output, where each decoded point is also written to the cell of a row-major
+// grid given by its RowIndex and ColumnIndex values.
+//
+// The row and column indices are taken from the writeDesc entries rowDesc and columnDesc,
+// so these components must be decoded too. Each cell holds one point record of
+// cellStride bytes with the same layout as a point in the batch, which requires all
+// writeDesc entries to have stride cellStride, and the indices must be written as floats.
+// Before decoding, every component of every cell is set to invalidValue converted to its
+// write type, so cells without a point keep that. If several points map to the same
+// cell, the last one wins.
+struct GridWriteDesc
+{
+  View<char> cells;                   // rows * columns * cellStride bytes.
+  size_t rows = 0;
+  size_t columns = 0;
+  size_t cellStride = 0;
+  uint32_t rowDesc = 0;               // Index of the writeDesc entry holding RowIndex.
+  uint32_t columnDesc = 0;            // Index of the writeDesc entry holding ColumnIndex.
+  float invalidValue = std::numeric_limits<float>::quiet_NaN();
+
+  // Updated by the read
+  uint64_t pointsWritten = 0;
+  uint64_t pointsOutside = 0;         // Points with indices outside of the grid.
+};
+
+// Get the grid size of a point set from the declared maximum of its RowIndex and
+// ColumnIndex components. Returns false if it has no such components.
+bool getE57GridSize(const E57File* e57, Logger logger, size_t pointSetIndex, size_t& rows, size_t& columns);
+
+// If bufferCount is larger than one, buffer is split into bufferCount equally sized
+// slices that each hold pointCapacity points, and decoding runs on a separate thread
+// that fills the next slices while the consume callback processes the current one.
+// The consume callback is always invoked on the calling thread, in order.
+//
+// If decoder is null, a decoder is set up for this read only.
+//
+// If componentStats is set, it points to one ComponentStats per writeDesc entry, and
+// the values written are merged into these as they are unpacked. The same goes for
+// componentHistograms, see e57Histogram.h, which must be initialized for the component.
+//
+// If grid is set, points are scattered into it on the decoding thread, see GridWriteDesc.
+// The consume callback may be null, which is useful when all output goes to a grid or
+// to pointSetBase arrays, batches are then just discarded.
 struct ReadPointsArgs
 {
   View<char> buffer;
   View<const ComponentWriteDesc> writeDesc;
   ConsumePointsCallback consumeCallback = nullptr;
   void* consumeCallbackData = nullptr;
-  size_t pointCapacity = 0;
+  size_t pointCapacity = 0;         // Points per batch, at least 1, see suggestE57BatchSize.
   size_t pointSetIndex = 0;
+  size_t bufferCount = 1;
+  E57Decoder* decoder = nullptr;
+  ComponentStats* componentStats = nullptr;
+  ComponentHistogram* componentHistograms = nullptr;
+  GridWriteDesc* grid = nullptr;
 };
 bool readE57Points(const E57File* e57, Logger logger, const ReadPointsArgs& args);
+
+// Suggest the number of points per batch when reading a point set.
+//
+// The batch is sized so that bytesPerPoint times the batch size fits in memoryBudget, where
+// zero selects a budget that fits in a typical L2 cache. The size is then adjusted to the
+// number of records per data packet, so batch boundaries line up with packet boundaries.
+size_t suggestE57BatchSize(const E57File* e57, Logger logger, size_t pointSetIndex, size_t bytesPerPoint, size_t memoryBudget = 0);
+
+
+// Invoked on a worker thread before a point set is decoded. Fills in args with the
+// buffer, write descriptions and consumer for that point set, pointSetIndex is
+// already set. Returning false skips the point set and flags the read as failed.
+typedef bool(*SetupPointSetCallback)(void* callbackData, ReadPointsArgs& args);
+
+// Invoked on the same worker thread after a point set has been decoded or failed.
+typedef void(*FinishPointSetCallback)(void* callbackData, size_t pointSetIndex, bool success);
+
+// Decode multiple point sets concurrently.
+//
+// Point sets are handed out to the workers largest first, so that the total time
+// approaches that of the largest point set. Callbacks may be invoked concurrently
+// from different workers, but the calls for a single point set are made from one
+// thread. The file read callback must be thread-safe. Each worker reuses one decoder
+// across its point sets unless the setup callback provides one.
+struct ReadPointSetsArgs
+{
+  View<const size_t> pointSetIndices;       // Distinct point sets to read, empty means all.
+  SetupPointSetCallback setupCallback = nullptr;  // Required.
+  FinishPointSetCallback finishCallback = nullptr;
+  void* callbackData = nullptr;
+  size_t threadCount = 0;                   // Number of workers, 0 means hardware concurrency.
+  size_t maxConcurrentReads = 0;            // Shared I/O budget, max workers reading pages at once, 0 means unlimited.
+};
+bool readE57PointSets(const E57File* e57, Logger logger, const ReadPointSetsArgs& args);
+
+
+// Pull-style reader of a point set.
+//
+// Decodes points on demand into batches provided by the caller, laid out according to
+// the write descriptions. Decode state is carried across calls, and all state is
+// allocated by open, so next and seek do not allocate. Seeking uses the index packets
+// of the compressed vector if present, and skips forward without unpacking otherwise.
+struct PointReader
+{
+  PointReader() = default;
+  PointReader(const PointReader&) = delete;
+  PointReader& operator=(const PointReader&) = delete;
+  ~PointReader();
+
+  // If componentStats or componentHistograms are set, they point to one entry per
+  // writeDesc entry that the values returned by next are added to.
+  bool open(const E57File* e57, Logger logger, size_t pointSetIndex, View<const ComponentWriteDesc> writeDesc,
+            ComponentStats* componentStats = nullptr, ComponentHistogram* componentHistograms = nullptr);
+  void close();
+
+  // Decode up to maxPoints points into batch, fewer if batch can not hold that many,
+  // returns the number of points decoded. Returns zero when all points have been read
+  // or on failure, including a batch too small for a single point.
+  size_t next(View<char> batch, size_t maxPoints);
+
+  // Position the reader so that the next point decoded is pointIndex.
+  bool seek(uint64_t pointIndex);
+
+  uint64_t position() const;
+  uint64_t recordCount() const;
+  bool failed() const;
+
+  struct State;
+  State* state = nullptr;
+};
@@ -0,0 +1,212 @@
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "e57Histogram.h"
+
+void KllSketch::init(uint32_t k_)
+{
+  k = std::max(8u, k_);
+  count = 0;
+  min = max = 0.0;
+  levels.assign(1, std::vector<double>());
+  size = 0;
+  updateCapacity();
+}
+
+size_t KllSketch::levelCapacity(size_t level) const
+{
+  // Capacities shrink by 2/3 per level below the top, never below 2.
+  const size_t depth = levels.size() - 1 - level;
+  return std::max(size_t(2), static_cast<size_t>(std::ceil(double(k) * std::pow(2.0 / 3.0, double(depth)))));
+}
+
+void KllSketch::updateCapacity()
+{
+  capacity = 0;
+  for (size_t level = 0; level < levels.size(); level++) {
+    capacity += levelCapacity(level);
+  }
+}
+
+void KllSketch::compress()
+{
+  while (capacity <= size) {
+    for (size_t level = 0; level < levels.size(); level++) {
+      if (levels[level].size() < levelCapacity(level)) {
+        continue;
+      }
+      if (level + 1 == levels.size()) {
+        levels.emplace_back();
+        updateCapacity();
+      }
+
+      // Sort and promote every other item, starting at a random parity. With an odd
+      // count, the largest item stays behind.
+      std::vector<double>& items = levels[level];
+      std::vector<double>& above = levels[level + 1];
+      std::sort(items.begin(), items.end());
+      random ^= random << 13;
+      random ^= random >> 7;
+      random ^= random << 17;
+      const size_t pairs = items.size() / 2;
+      const size_t parity = random & 1;
+      for (size_t i = 0; i < pairs; i++) {
+        above.push_back(items[2 * i + parity]);
+      }
+      if (items.size() & 1) {
+        items[0] = items.back();
+        items.resize(1);
+      }
+      else {
+        items.clear();
+      }
+      size -= pairs;
+      break;
+    }
+  }
+}
+
+void KllSketch::merge(const KllSketch& other)
+{
+  if (other.count == 0) {
+    return;
+  }
+  if (count == 0) {
+    min = other.min;
+    max = other.max;
+  }
+  else {
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+  }
+  count += other.count;
+
+  if (levels.size() < other.levels.size()) {
+    levels.resize(other.levels.size());
+    updateCapacity();
+  }
+  for (size_t level = 0; level < other.levels.size(); level++) {
+    levels[level].insert(levels[level].end(), other.levels[level].begin(), other.levels[level].end());
+    size += other.levels[level].size();
+  }
+  compress();
+}
+
+double KllSketch::quantile(double q) const
+{
+  if (count == 0) {
+    return 0.0;
+  }
+  if (q <= 0.0) return min;
+  if (1.0 <= q) return max;
+
+  std::vector<std::pair<double, uint64_t>> weighted;
+  weighted.reserve(size);
+  uint64_t totalWeight = 0;
+  for (size_t level = 0; level < levels.size(); level++) {
+    for (double value : levels[level]) {
+      weighted.emplace_back(value, uint64_t(1) << level);
+      totalWeight += uint64_t(1) << level;
+    }
+  }
+  std::sort(weighted.begin(), weighted.end());
+
+  const double target = q * double(totalWeight);
+  uint64_t cumulative = 0;
+  for (const auto& [value, weight] : weighted) {
+    cumulative += weight;
+    if (target < double(cumulative)) {
+      return value;
+    }
+  }
+  return max;
+}
+
+
+void ComponentHistogram::init(const Component& comp, size_t maxBinCount, uint32_t sketchK)
+{
+  type = comp.type;
+  bins.clear();
+  sketch.init(sketchK);
+
+  if (type == Component::Type::Integer || type == Component::Type::ScaledInteger) {
+    codeMin = comp.integer.min;
+    scale = type == Component::Type::ScaledInteger ? comp.integer.scale : 1.0;
+    offset = type == Component::Type::ScaledInteger ? comp.integer.offset : 0.0;
+
+    // Bins cover every code of the bit width, not only up to the declared maximum.
+    uint32_t binBits = 0;
+    while (binBits < comp.integer.bitWidth && (size_t(2) << binBits) <= maxBinCount) {
+      binBits++;
+    }
+    shift = comp.integer.bitWidth - binBits;
+    bins.assign(size_t(1) << binBits, 0);
+  }
+}
+
+bool ComponentHistogram::merge(const ComponentHistogram& other)
+{
+  if (type != other.type || codeMin != other.codeMin || shift != other.shift || bins.size() != other.bins.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < bins.size(); i++) {
+    bins[i] += other.bins[i];
+  }
+  sketch.merge(other.sketch);
+  return true;
+}
+
+uint64_t ComponentHistogram::count() const
+{
+  uint64_t rv = sketch.count;
+  for (uint64_t n : bins) {
+    rv += n;
+  }
+  return rv;
+}
+
+double ComponentHistogram::binLower(size_t bin) const
+{
+  return scale * double(codeMin + int64_t(bin << shift)) + offset;
+}
+
+double ComponentHistogram::binUpper(size_t bin) const
+{
+  return scale * double(codeMin + int64_t((bin + 1) << shift)) + offset;
+}
+
+double ComponentHistogram::quantile(double q) const
+{
+  if (bins.empty()) {
+    return sketch.quantile(q);
+  }
+
+  const uint64_t total = count();
+  if (total == 0) {
+    return 0.0;
+  }
+
+  // Bins are in code order, which is descending value order with a negative scale.
+  q = std::clamp(q, 0.0, 1.0);
+  if (scale < 0.0) {
+    q = 1.0 - q;
+  }
+
+  const double target = q * double(total);
+  uint64_t cumulative = 0;
+  for (size_t bin = 0; bin < bins.size(); bin++) {
+    if (bins[bin] == 0) {
+      continue;
+    }
+    if (target <= double(cumulative + bins[bin])) {
+      const double t = (target - double(cumulative)) / double(bins[bin]);
+      return binLower(bin) + t * (binUpper(bin) - binLower(bin));
+    }
+    cumulative += bins[bin];
+  }
+  return binUpper(bins.size() - 1);
+}
@@ -0,0 +1,90 @@
+#pragma once
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+#include <cstdint>
+#include <vector>
+#include "e57File.h"
+
+// Mergeable quantile sketch for floating point values (Karnin, Lang and Liberty, 2016).
+//
+// Keeps a hierarchy of compactors where an item at level h represents 2^h values. The
+// rank error is roughly 1.7/k with high probability, memory is O(k) values.
+struct KllSketch
+{
+  uint32_t k = 200;
+  uint64_t count = 0;           // Values added, including those merged in.
+  double min = 0.0;
+  double max = 0.0;
+
+  void init(uint32_t k);
+
+  void add(double value)
+  {
+    if (count == 0) {
+      min = max = value;
+    }
+    else {
+      min = value < min ? value : min;
+      max = max < value ? value : max;
+    }
+    count++;
+    levels[0].push_back(value);
+    if (capacity <= ++size) {
+      compress();
+    }
+  }
+
+  void merge(const KllSketch& other);
+
+  // Approximate value at normalized rank q in [0, 1].
+  double quantile(double q) const;
+
+  std::vector<std::vector<double>> levels = std::vector<std::vector<double>>(1);
+  size_t size = 0;              // Items held over all levels.
+  size_t capacity = 200;        // Compress when size reaches this, matches k with one level.
+  uint64_t random = 0x9E3779B97F4A7C15ull;
+
+  size_t levelCapacity(size_t level) const;
+  void updateCapacity();
+  void compress();
+};
+
+// Distribution of the decoded values of a component, filled while unpacking.
+//
+// Integer and scaled integer components are counted exactly in equal-width bins over
+// the raw codes, that is, the declared range from minimum and up. Float and double
+// components are summarized by a KLL sketch. Initialize with init before reading, and
+// merge histograms of the same component to combine results from several reads.
+struct ComponentHistogram
+{
+  Component::Type type = Component::Type::None;
+
+  // Integer and ScaledInteger
+  int64_t codeMin = 0;          // Value of code zero before scale and offset.
+  double scale = 1.0;
+  double offset = 0.0;
+  uint32_t shift = 0;           // Bin of a code is code >> shift.
+  std::vector<uint64_t> bins;
+
+  // Float and Double
+  KllSketch sketch;
+
+  // At most maxBinCount bins, rounded down to a power of two.
+  void init(const Component& comp, size_t maxBinCount = 256, uint32_t sketchK = 200);
+
+  void addCode(uint64_t code) { bins[code >> shift]++; }
+  void addReal(double value) { sketch.add(value); }
+
+  // Returns false if the histograms are not of the same component layout.
+  bool merge(const ComponentHistogram& other);
+
+  uint64_t count() const;
+
+  // Value range [lower, upper) covered by a bin, after scale and offset.
+  double binLower(size_t bin) const;
+  double binUpper(size_t bin) const;
+
+  // Approximate value at normalized rank q in [0, 1], interpolated within bins.
+  double quantile(double q) const;
+};
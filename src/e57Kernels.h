@@ -0,0 +1,37 @@
+#pragma once
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+// Inner loops of the reader. Not part of the regular API, declared here so they can be
+// exercised in isolation by the microbenchmarks.
+
+#include <cstdint>
+#include "Common.h"
+#include "e57File.h"
+
+constexpr uint32_t AllBitsRead = ~uint32_t(0);
+
+struct BitUnpackState
+{
+  size_t itemsWritten = 0;
+  uint32_t bitsConsumed = 0;
+};
+
+struct BitUnpackDesc
+{
+  size_t maxItems = 0;
+  const uint8_t* data = nullptr;   // Must be readable 8 bytes past the last item.
+  uint32_t bitsAvailable = 0;
+};
+
+// Unpack items of comp from a bytestream into batch until maxItems are written or the
+// bytestream runs out, in which case bitsConsumed is set to AllBitsRead. If stats or
+// histogram are set, the unpacked values are added to them.
+BitUnpackState consumeBits(View<char> batch, const BitUnpackState& unpackState, const BitUnpackDesc& unpackDesc, const ComponentWriteDesc& writeDesc, const Component& comp,
+                           ComponentStats* stats = nullptr, ComponentHistogram* histogram = nullptr);
+
+// CRC-32C (Castagnoli) as used for E57 page checksums.
+uint32_t crc32c(const void* data, size_t size);
+
+// Verify the checksum of a page, bytes must hold the whole page.
+bool checkPage(const E57File* e57, Logger logger, const View<const char>& bytes);
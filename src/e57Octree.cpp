@@ -0,0 +1,579 @@
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+#include <algorithm>
+#include <bit>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "e57Octree.h"
+
+namespace {
+
+  constexpr uint32_t NoNode = ~uint32_t(0);
+  constexpr uint32_t SamplingBits = 7;          // Inner nodes sample on a 128^3 grid.
+  constexpr uint32_t MaxSpillLevel = 4;         // At most 4096 cells.
+  constexpr size_t BlockPoints = 4096;          // Points per block of the temporary file.
+  constexpr size_t HierarchyRecordSize = 16;
+
+  struct NodeKey
+  {
+    uint32_t level = 0;
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t z = 0;
+
+    NodeKey child(uint32_t i) const
+    {
+      return NodeKey{ .level = level + 1, .x = 2 * x + (i & 1), .y = 2 * y + ((i >> 1) & 1), .z = 2 * z + ((i >> 2) & 1) };
+    }
+  };
+
+  struct Node
+  {
+    NodeKey key;
+    uint32_t pointCount = 0;
+    uint64_t byteOffset = 0;
+    uint32_t children[8] = { NoNode, NoNode, NoNode, NoNode, NoNode, NoNode, NoNode, NoNode };
+
+    bool isLeaf() const
+    {
+      for (uint32_t child : children) {
+        if (child != NoNode) return false;
+      }
+      return true;
+    }
+  };
+
+  // Points of a cell in the temporary file.
+  struct Spill
+  {
+    struct Block
+    {
+      uint64_t offset;
+      uint32_t count;
+    };
+    std::vector<Block> blocks;
+    uint64_t count = 0;
+  };
+
+  template<typename T>
+  void put(char* dst, size_t offset, T value) { std::memcpy(dst + offset, &value, sizeof(T)); }
+
+}
+
+struct OctreeBuilder::State
+{
+  Logger logger = nullptr;
+  std::filesystem::path directory;
+  OctreeDesc desc;
+  uint32_t maxNodePoints = 0;
+  size_t inMemoryPoints = 0;          // Most points loaded at once, beyond that points are spilled.
+  uint32_t spillLevel = 0;
+  uint64_t pointCount = 0;
+
+  std::vector<OctreePoint> pending;   // Points added before spilling starts.
+
+  FILE* spillFile = nullptr;
+  std::filesystem::path spillPath;
+  uint64_t spillSize = 0;
+  uint64_t spillPosition = 0;
+  bool spillReading = false;          // Last access was a read, switching between reads and writes needs a seek.
+  std::vector<Spill> cells;
+  std::vector<std::vector<OctreePoint>> cellBuffers;
+
+  FILE* octreeFile = nullptr;
+  uint64_t octreeSize = 0;
+  std::vector<Node> nodes;
+  std::vector<uint64_t> taken;
+  uint32_t depth = 0;                 // Deepest level written.
+
+  bool failed = false;
+  bool closed = false;
+
+  uint32_t childIndex(const OctreePoint& p, uint32_t level) const
+  {
+    const uint32_t shift = desc.bits - level - 1;
+    return ((p.x >> shift) & 1) | ((p.y >> shift) & 1) << 1 | ((p.z >> shift) & 1) << 2;
+  }
+
+  size_t cellIndex(const OctreePoint& p) const
+  {
+    const uint32_t shift = desc.bits - spillLevel;
+    return size_t(p.x >> shift) | size_t(p.y >> shift) << spillLevel | size_t(p.z >> shift) << (2 * spillLevel);
+  }
+
+  size_t cellIndex(const NodeKey& key) const
+  {
+    return size_t(key.x) | size_t(key.y) << spillLevel | size_t(key.z) << (2 * spillLevel);
+  }
+
+  bool spillWrite(Spill& spill, const OctreePoint* points, size_t count)
+  {
+    if (count == 0) {
+      return true;
+    }
+    if ((spillReading || spillPosition != spillSize) && !seekFile(spillFile, spillSize)) {
+      logError(logger, "Failed to seek in temporary file");
+      return false;
+    }
+    if (std::fwrite(points, sizeof(OctreePoint), count, spillFile) != count) {
+      logError(logger, "Failed to write %zu points to temporary file", count);
+      return false;
+    }
+    spill.blocks.push_back({ .offset = spillSize, .count = static_cast<uint32_t>(count) });
+    spill.count += count;
+    spillSize += sizeof(OctreePoint) * count;
+    spillPosition = spillSize;
+    spillReading = false;
+    return true;
+  }
+
+  bool spillRead(OctreePoint* points, const Spill::Block& block)
+  {
+    if ((!spillReading || spillPosition != block.offset) && !seekFile(spillFile, block.offset)) {
+      logError(logger, "Failed to seek in temporary file");
+      return false;
+    }
+    if (std::fread(points, sizeof(OctreePoint), block.count, spillFile) != block.count) {
+      logError(logger, "Failed to read %u points from temporary file", block.count);
+      return false;
+    }
+    spillPosition = block.offset + sizeof(OctreePoint) * block.count;
+    spillReading = true;
+    return true;
+  }
+
+  bool distribute(const OctreePoint* points, size_t count)
+  {
+    for (size_t i = 0; i < count; i++) {
+      const size_t cell = cellIndex(points[i]);
+      std::vector<OctreePoint>& buffer = cellBuffers[cell];
+      buffer.push_back(points[i]);
+      if (buffer.size() == BlockPoints) {
+        if (!spillWrite(cells[cell], buffer.data(), buffer.size())) {
+          return false;
+        }
+        buffer.clear();
+      }
+    }
+    return true;
+  }
+
+  bool startSpilling()
+  {
+    spillPath = directory / "octree.spill";
+    spillFile = std::fopen(spillPath.string().c_str(), "w+b");
+    if (!spillFile) {
+      logError(logger, "Failed to open temporary file '%s'", spillPath.string().c_str());
+      return false;
+    }
+    const size_t cellCount = size_t(1) << (3 * spillLevel);
+    cells.resize(cellCount);
+    cellBuffers.resize(cellCount);
+    logDebug(logger, "Octree: spilling points into %zu cells", cellCount);
+
+    bool ok = distribute(pending.data(), pending.size());
+    pending.clear();
+    pending.shrink_to_fit();
+    return ok;
+  }
+
+  uint32_t newNode(const NodeKey& key)
+  {
+    nodes.push_back(Node{ .key = key });
+    return static_cast<uint32_t>(nodes.size() - 1);
+  }
+
+  bool writeNode(uint32_t index, const std::vector<OctreePoint>& points)
+  {
+    static_assert(std::endian::native == std::endian::little);
+    Node& node = nodes[index];
+    node.pointCount = static_cast<uint32_t>(points.size());
+    node.byteOffset = octreeSize;
+    if (!points.empty() && std::fwrite(points.data(), sizeof(OctreePoint), points.size(), octreeFile) != points.size()) {
+      logError(logger, "Failed to write %zu points to octree", points.size());
+      return false;
+    }
+    octreeSize += sizeof(OctreePoint) * points.size();
+    return true;
+  }
+
+  // Moves the first point of every cell of the sampling grid of a node from its children
+  // into output, the children keep the rest.
+  void sample(const NodeKey& key, std::vector<OctreePoint>* childPoints, std::vector<OctreePoint>& output)
+  {
+    const uint32_t span = desc.bits - key.level;
+    const uint32_t gridBits = std::min(SamplingBits, span);
+    const uint32_t shift = span - gridBits;
+    const uint32_t mask = (uint32_t(1) << gridBits) - 1;
+    taken.assign(((size_t(1) << (3 * gridBits)) + 63) / 64, 0);
+
+    output.clear();
+    for (size_t c = 0; c < 8; c++) {
+      std::vector<OctreePoint>& points = childPoints[c];
+      size_t keep = 0;
+      for (const OctreePoint& p : points) {
+        const size_t cell =
+          size_t((p.x >> shift) & mask) |
+          size_t((p.y >> shift) & mask) << gridBits |
+          size_t((p.z >> shift) & mask) << (2 * gridBits);
+        uint64_t& word = taken[cell / 64];
+        const uint64_t bit = uint64_t(1) << (cell % 64);
+        if (word & bit) {
+          points[keep++] = p;
+        }
+        else {
+          word |= bit;
+          output.push_back(p);
+        }
+      }
+      points.resize(keep);
+    }
+  }
+
+  // Builds the children of a node with buildChild, samples the node from them and writes
+  // the children. Returns the node, with its points in points.
+  template<typename BuildChild>
+  uint32_t buildInner(const NodeKey& key, BuildChild&& buildChild, std::vector<OctreePoint>& points)
+  {
+    const uint32_t index = newNode(key);
+    std::vector<OctreePoint> childPoints[8];
+    uint32_t childNodes[8];
+    for (uint32_t c = 0; c < 8; c++) {
+      childNodes[c] = buildChild(c, childPoints[c]);
+      if (failed) {
+        return index;
+      }
+    }
+
+    sample(key, childPoints, points);
+
+    for (uint32_t c = 0; c < 8; c++) {
+      if (childNodes[c] == NoNode) {
+        continue;
+      }
+      // Leaves that gave away all their points are dropped.
+      if (childPoints[c].empty() && nodes[childNodes[c]].isLeaf()) {
+        continue;
+      }
+      if (!writeNode(childNodes[c], childPoints[c])) {
+        failed = true;
+        return index;
+      }
+      nodes[index].children[c] = childNodes[c];
+    }
+    return index;
+  }
+
+  uint32_t buildInMemory(const NodeKey& key, std::vector<OctreePoint>& points)
+  {
+    if (points.size() <= maxNodePoints || key.level == desc.bits) {
+      return newNode(key);
+    }
+
+    std::vector<OctreePoint> parts[8];
+    size_t counts[8] = {};
+    for (const OctreePoint& p : points) {
+      counts[childIndex(p, key.level)]++;
+    }
+    for (size_t c = 0; c < 8; c++) {
+      parts[c].reserve(counts[c]);
+    }
+    for (const OctreePoint& p : points) {
+      parts[childIndex(p, key.level)].push_back(p);
+    }
+    points.clear();
+    points.shrink_to_fit();
+
+    return buildInner(key, [&](uint32_t c, std::vector<OctreePoint>& childPoints) {
+      if (parts[c].empty()) {
+        return NoNode;
+      }
+      childPoints = std::move(parts[c]);
+      return buildInMemory(key.child(c), childPoints);
+    }, points);
+  }
+
+  // Builds a node from a cell in the temporary file, loading it if it fits in memory
+  // and splitting it into its children through the temporary file otherwise.
+  uint32_t buildFromSpill(const NodeKey& key, Spill& spill, std::vector<OctreePoint>& points)
+  {
+    if (spill.count <= inMemoryPoints || key.level == desc.bits) {
+      points.resize(spill.count);
+      size_t offset = 0;
+      for (const Spill::Block& block : spill.blocks) {
+        if (!spillRead(points.data() + offset, block)) {
+          failed = true;
+          return NoNode;
+        }
+        offset += block.count;
+      }
+      spill = Spill();
+      return buildInMemory(key, points);
+    }
+
+    Spill children[8];
+    std::vector<OctreePoint> buffers[8];
+    std::vector<OctreePoint> block(BlockPoints);
+    for (const Spill::Block& b : spill.blocks) {
+      if (!spillRead(block.data(), b)) {
+        failed = true;
+        return NoNode;
+      }
+      for (uint32_t i = 0; i < b.count; i++) {
+        const uint32_t c = childIndex(block[i], key.level);
+        buffers[c].push_back(block[i]);
+        if (buffers[c].size() == BlockPoints) {
+          if (!spillWrite(children[c], buffers[c].data(), buffers[c].size())) {
+            failed = true;
+            return NoNode;
+          }
+          buffers[c].clear();
+        }
+      }
+    }
+    for (uint32_t c = 0; c < 8; c++) {
+      if (!spillWrite(children[c], buffers[c].data(), buffers[c].size())) {
+        failed = true;
+        return NoNode;
+      }
+      buffers[c] = std::vector<OctreePoint>();
+    }
+    spill = Spill();
+
+    return buildInner(key, [&](uint32_t c, std::vector<OctreePoint>& childPoints) {
+      return children[c].count ? buildFromSpill(key.child(c), children[c], childPoints) : NoNode;
+    }, points);
+  }
+
+  // Builds the nodes above the cells of the temporary file.
+  uint32_t buildAboveSpill(const NodeKey& key, std::vector<OctreePoint>& points)
+  {
+    return buildInner(key, [&](uint32_t c, std::vector<OctreePoint>& childPoints) {
+      const NodeKey child = key.child(c);
+      if (child.level < spillLevel) {
+        return buildAboveSpill(child, childPoints);
+      }
+      Spill& cell = cells[cellIndex(child)];
+      return cell.count ? buildFromSpill(child, cell, childPoints) : NoNode;
+    }, points);
+  }
+
+  bool writeHierarchy(uint32_t root, size_t& nodeCount)
+  {
+    const std::filesystem::path path = directory / "hierarchy.bin";
+    FILE* file = std::fopen(path.string().c_str(), "wb");
+    if (!file) {
+      logError(logger, "Failed to open '%s' for writing", path.string().c_str());
+      return false;
+    }
+
+    nodeCount = 0;
+    std::deque<uint32_t> queue(1, root);
+    while (!queue.empty()) {
+      const Node& node = nodes[queue.front()];
+      queue.pop_front();
+      depth = std::max(depth, node.key.level);
+
+      uint8_t childMask = 0;
+      for (uint32_t c = 0; c < 8; c++) {
+        if (node.children[c] != NoNode) {
+          childMask |= uint8_t(1) << c;
+          queue.push_back(node.children[c]);
+        }
+      }
+      char record[HierarchyRecordSize] = {};
+      put<uint8_t>(record, 0, childMask);
+      put<uint8_t>(record, 1, static_cast<uint8_t>(node.key.level));
+      put<uint32_t>(record, 4, node.pointCount);
+      put<uint64_t>(record, 8, node.byteOffset);
+      std::fwrite(record, 1, HierarchyRecordSize, file);
+      nodeCount++;
+    }
+
+    if (std::ferror(file) || std::fclose(file) != 0) {
+      logError(logger, "Failed to write '%s'", path.string().c_str());
+      return false;
+    }
+    return true;
+  }
+
+  bool writeMetadata(size_t nodeCount)
+  {
+    const std::filesystem::path path = directory / "metadata.json";
+    FILE* file = std::fopen(path.string().c_str(), "w");
+    if (!file) {
+      logError(logger, "Failed to open '%s' for writing", path.string().c_str());
+      return false;
+    }
+    const double size = desc.scale * double(uint64_t(1) << desc.bits);
+    fprintf(file, "{\n");
+    fprintf(file, "  \"version\": \"1.0\",\n");
+    fprintf(file, "  \"points\": %" PRIu64 ",\n", pointCount);
+    fprintf(file, "  \"nodes\": %zu,\n", nodeCount);
+    fprintf(file, "  \"depth\": %u,\n", depth);
+    fprintf(file, "  \"offset\": [%.17g, %.17g, %.17g],\n", desc.offset[0], desc.offset[1], desc.offset[2]);
+    fprintf(file, "  \"scale\": %.17g,\n", desc.scale);
+    fprintf(file, "  \"bits\": %u,\n", desc.bits);
+    fprintf(file, "  \"size\": %.17g,\n", size);
+    fprintf(file, "  \"spacing\": %.17g,\n", size / double(uint32_t(1) << std::min(SamplingBits, desc.bits)));
+    fprintf(file, "  \"maxNodePoints\": %u,\n", maxNodePoints);
+    fprintf(file, "  \"hasIntensity\": %s,\n", desc.hasIntensity ? "true" : "false");
+    fprintf(file, "  \"hasColor\": %s,\n", desc.hasColor ? "true" : "false");
+    fprintf(file, "  \"pointSize\": %zu,\n", sizeof(OctreePoint));
+    fprintf(file, "  \"hierarchyRecordSize\": %zu\n", HierarchyRecordSize);
+    fprintf(file, "}\n");
+    if (std::ferror(file) || std::fclose(file) != 0) {
+      logError(logger, "Failed to write '%s'", path.string().c_str());
+      return false;
+    }
+    return true;
+  }
+
+  void removeSpill()
+  {
+    if (spillFile) {
+      std::fclose(spillFile);
+      spillFile = nullptr;
+      std::error_code ec;
+      std::filesystem::remove(spillPath, ec);
+    }
+  }
+
+  bool build()
+  {
+    const std::filesystem::path path = directory / "octree.bin";
+    octreeFile = std::fopen(path.string().c_str(), "wb");
+    if (!octreeFile) {
+      logError(logger, "Failed to open '%s' for writing", path.string().c_str());
+      return false;
+    }
+
+    std::vector<OctreePoint> rootPoints;
+    uint32_t root = NoNode;
+    if (!spillFile) {
+      rootPoints = std::move(pending);
+      root = buildInMemory(NodeKey(), rootPoints);
+    }
+    else {
+      for (size_t cell = 0; cell < cells.size(); cell++) {
+        if (!spillWrite(cells[cell], cellBuffers[cell].data(), cellBuffers[cell].size())) {
+          return false;
+        }
+      }
+      cellBuffers.clear();
+      cellBuffers.shrink_to_fit();
+      root = buildAboveSpill(NodeKey(), rootPoints);
+    }
+    if (failed || !writeNode(root, rootPoints)) {
+      return false;
+    }
+
+    if (std::ferror(octreeFile) || std::fclose(octreeFile) != 0) {
+      octreeFile = nullptr;
+      logError(logger, "Failed to write '%s'", path.string().c_str());
+      return false;
+    }
+    octreeFile = nullptr;
+
+    size_t nodeCount = 0;
+    if (!writeHierarchy(root, nodeCount) || !writeMetadata(nodeCount)) {
+      return false;
+    }
+    logInfo(logger, "Octree: %" PRIu64 " points in %zu nodes, depth %u, %" PRIu64 " bytes spilled",
+            pointCount, nodeCount, depth, spillSize);
+    return true;
+  }
+};
+
+OctreeBuilder::~OctreeBuilder()
+{
+  if (state) {
+    state->removeSpill();
+    if (state->octreeFile) {
+      std::fclose(state->octreeFile);
+    }
+  }
+  delete state;
+}
+
+bool OctreeBuilder::open(Logger logger, const char* directory, const OctreeDesc& desc, size_t memoryBudget, uint32_t maxNodePoints)
+{
+  if (state) {
+    logError(logger, "Octree builder already open");
+    return false;
+  }
+  if (desc.bits == 0 || 31 < desc.bits) {
+    logError(logger, "Octree bits must be in 1..31, got %u", desc.bits);
+    return false;
+  }
+  if (maxNodePoints == 0) {
+    logError(logger, "Octree node point count must be positive");
+    return false;
+  }
+
+  std::error_code ec;
+  std::filesystem::create_directories(directory, ec);
+  if (ec) {
+    logError(logger, "Failed to create directory '%s': %s", directory, ec.message().c_str());
+    return false;
+  }
+
+  state = new State();
+  State& s = *state;
+  s.logger = logger;
+  s.directory = directory;
+  s.desc = desc;
+  s.maxNodePoints = maxNodePoints;
+
+  // Points are copied once when split, so a third of the budget is held as points. A
+  // quarter of the budget goes to the block buffers of the cells.
+  s.inMemoryPoints = std::max(size_t(maxNodePoints), memoryBudget / (3 * sizeof(OctreePoint)));
+  s.spillLevel = 1;
+  while (s.spillLevel < MaxSpillLevel && s.spillLevel < desc.bits &&
+         (size_t(1) << (3 * (s.spillLevel + 1))) * BlockPoints * sizeof(OctreePoint) <= memoryBudget / 4)
+  {
+    s.spillLevel++;
+  }
+  return true;
+}
+
+bool OctreeBuilder::addPoints(const OctreePoint* points, size_t count)
+{
+  if (!state || state->failed || state->closed) {
+    return false;
+  }
+  State& s = *state;
+  s.pointCount += count;
+  if (!s.spillFile) {
+    s.pending.insert(s.pending.end(), points, points + count);
+    if (s.inMemoryPoints < s.pending.size() && !s.startSpilling()) {
+      s.failed = true;
+    }
+  }
+  else if (!s.distribute(points, count)) {
+    s.failed = true;
+  }
+  return !s.failed;
+}
+
+bool OctreeBuilder::close()
+{
+  if (!state || state->closed) {
+    return false;
+  }
+  State& s = *state;
+  s.closed = true;
+  if (!s.failed && !s.build()) {
+    s.failed = true;
+  }
+  s.removeSpill();
+  return !s.failed;
+}
@@ -0,0 +1,70 @@
+#pragma once
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+#include <cstdint>
+#include <cstddef>
+#include "Common.h"
+
+// A point as stored in the octree. The position is a code in [0, 2^bits) per axis, the
+// position in space is offset + scale * code, with offset and scale given in the metadata.
+struct OctreePoint
+{
+  uint32_t x;
+  uint32_t y;
+  uint32_t z;
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+  uint8_t intensity;
+};
+static_assert(sizeof(OctreePoint) == 16);
+
+struct OctreeDesc
+{
+  double offset[3] = { 0.0, 0.0, 0.0 };   // Minimum corner of the cube.
+  double scale = 0.001;                   // Size of a code unit.
+  uint32_t bits = 31;                     // The cube spans 2^bits code units per axis, at most 31.
+  bool hasIntensity = false;
+  bool hasColor = false;
+};
+
+// Out-of-core builder of a level of detail octree for streaming to viewers.
+//
+// Points are passed in batches as they are decoded, and are kept in memory until the
+// memory budget is reached. After that, points are binned into the cells of a fixed
+// octree level and spilled to a temporary file in blocks. Close builds the hierarchy
+// one cell at a time, cells that do not fit the budget are split further through the
+// temporary file.
+//
+// Nodes with more than maxNodePoints points are split. Inner nodes are built bottom up
+// by grid sampling of their children, a point is moved into the parent if it is the
+// first to fall into its cell of a 128^3 grid over the parent, so each point is stored
+// exactly once and the spacing halves per level.
+//
+// Close writes three files into the output directory:
+// - octree.bin: the points of each node as a contiguous run of OctreePoint, little endian.
+// - hierarchy.bin: 16 bytes per node in breadth first order, starting with the root:
+//   uint8 child mask, uint8 level, uint16 zero, uint32 point count and uint64 byte
+//   offset into octree.bin. Child i covers the half of its parent given by bit 0 of i
+//   along x, bit 1 along y and bit 2 along z, children follow in increasing i.
+// - metadata.json: offset, scale, bits, counts, root spacing and attributes.
+struct OctreeBuilder
+{
+  OctreeBuilder() = default;
+  OctreeBuilder(const OctreeBuilder&) = delete;
+  OctreeBuilder& operator=(const OctreeBuilder&) = delete;
+  ~OctreeBuilder();
+
+  // The directory is created if it does not exist. Memory budget is in bytes.
+  bool open(Logger logger, const char* directory, const OctreeDesc& desc, size_t memoryBudget, uint32_t maxNodePoints);
+
+  // Not thread safe, concurrent producers must serialize calls.
+  bool addPoints(const OctreePoint* points, size_t count);
+
+  // Builds the hierarchy and writes the files, returns false if anything failed on the way.
+  bool close();
+
+  struct State;
+  State* state = nullptr;
+};
@@ -0,0 +1,76 @@
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+// Don't complain about fopen
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <cstdio>
+#include <cinttypes>
+#include <atomic>
+
+#include "e57Trace.h"
+
+namespace {
+
+  std::atomic<uint64_t> traceSerial{ 0 };
+
+  // Thread this thread last recorded into, valid while serial matches the trace.
+  thread_local struct {
+    uint64_t serial = 0;
+    E57Trace::Thread* thread = nullptr;
+  } threadCache;
+
+}
+
+E57Trace::E57Trace()
+{
+  origin = getMonotonicNanoseconds();
+  serial = traceSerial.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+void E57Trace::record(const char* name, uint64_t begin, uint64_t end)
+{
+  if (threadCache.serial != serial) {
+    std::lock_guard<std::mutex> guard(threadsLock);
+    threads.push_back(std::make_unique<Thread>());
+    threads.back()->id = static_cast<uint32_t>(threads.size());
+    threadCache.serial = serial;
+    threadCache.thread = threads.back().get();
+  }
+  threadCache.thread->events.push_back(Event{ .name = name, .begin = begin, .end = end });
+}
+
+bool writeE57Trace(const E57Trace* trace, Logger logger, const char* path)
+{
+  FILE* file = std::fopen(path, "w");
+  if (!file) {
+    logError(logger, "Failed to open '%s' for writing", path);
+    return false;
+  }
+
+  // Complete events with microsecond timestamps, one process, a track per thread.
+  size_t eventCount = 0;
+  std::fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (const auto& thread : trace->threads) {
+    std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                 eventCount++ ? ",\n" : "", thread->id, thread->id);
+    for (const E57Trace::Event& event : thread->events) {
+      uint64_t begin = event.begin - trace->origin;
+      uint64_t duration = event.end - event.begin;
+      std::fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u}",
+                   event.name, thread->id,
+                   begin / 1000, static_cast<unsigned>(begin % 1000),
+                   duration / 1000, static_cast<unsigned>(duration % 1000));
+      eventCount++;
+    }
+  }
+  std::fprintf(file, "\n]}\n");
+
+  bool ok = std::ferror(file) == 0;
+  if (std::fclose(file) != 0 || !ok) {
+    logError(logger, "Error while writing '%s'", path);
+    return false;
+  }
+  logDebug(logger, "Wrote %zu trace events to '%s'", eventCount, path);
+  return true;
+}
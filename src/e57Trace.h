@@ -0,0 +1,70 @@
+#pragma once
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Common.h"
+
+// Timeline of scoped events that can be written as Chrome trace JSON, viewable in
+// chrome://tracing or Perfetto.
+//
+// Set E57File::trace to record. Each thread appends to its own event list, the lock is
+// only taken the first time a thread records into a trace.
+struct E57Trace
+{
+  struct Event
+  {
+    const char* name;   // Must be a string literal.
+    uint64_t begin;     // Monotonic nanoseconds.
+    uint64_t end;
+  };
+
+  struct Thread
+  {
+    uint32_t id = 0;
+    std::vector<Event> events;
+  };
+
+  E57Trace();
+  E57Trace(const E57Trace&) = delete;
+  E57Trace& operator=(const E57Trace&) = delete;
+
+  void record(const char* name, uint64_t begin, uint64_t end);
+
+  uint64_t origin = 0;  // Creation time, timestamps are written relative to this.
+  uint64_t serial = 0;  // Identifies this instance in the per-thread cache.
+  std::mutex threadsLock;
+  std::vector<std::unique_ptr<Thread>> threads;
+};
+
+// Write recorded events to a file. No thread may record into the trace while writing.
+bool writeE57Trace(const E57Trace* trace, Logger logger, const char* path);
+
+// Records an event covering the lifetime of the scope. With a null trace, the only
+// cost is a test of the pointer.
+struct E57TraceScope
+{
+  E57Trace* const trace;
+  const char* const name;
+  uint64_t begin = 0;
+
+  E57TraceScope(E57Trace* trace, const char* name) : trace(trace), name(name)
+  {
+    if (trace) {
+      begin = getMonotonicNanoseconds();
+    }
+  }
+
+  ~E57TraceScope()
+  {
+    if (trace) {
+      trace->record(name, begin, getMonotonicNanoseconds());
+    }
+  }
+
+  E57TraceScope(const E57TraceScope&) = delete;
+  E57TraceScope& operator=(const E57TraceScope&) = delete;
+};
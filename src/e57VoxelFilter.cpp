@@ -0,0 +1,541 @@
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "e57VoxelFilter.h"
+
+namespace {
+
+  constexpr uint32_t NoEntry = ~uint32_t(0);
+  constexpr uint32_t PartitionBits = 6;
+  constexpr uint32_t PartitionCount = 1u << PartitionBits;
+  constexpr uint32_t MaxPartitionLevel = 64 / PartitionBits;
+  constexpr size_t EntryHeaderSize = 3 * sizeof(int32_t) + sizeof(uint32_t) + sizeof(uint64_t);   // Voxel, padding and point count.
+  constexpr size_t BlockBytes = size_t(1) << 16;   // Entries and points are read from the temporary file in blocks of about this size.
+
+  // Runs of entries or points in the temporary file.
+  struct Partition
+  {
+    struct Block
+    {
+      uint64_t offset;
+      uint64_t count;
+    };
+    std::vector<Block> blocks;
+    uint64_t count = 0;
+  };
+
+  uint64_t hashVoxel(const int32_t* voxel)
+  {
+    uint64_t h =
+      uint64_t(uint32_t(voxel[0])) * 0x9E3779B97F4A7C15ull ^
+      uint64_t(uint32_t(voxel[1])) * 0xC2B2AE3D27D4EB4Full ^
+      uint64_t(uint32_t(voxel[2])) * 0x165667B19E3779F9ull;
+    h ^= h >> 31;
+    h *= 0xD6E8FEB86659FD93ull;
+    h ^= h >> 32;
+    return h;
+  }
+
+  double readField(const char* record, const ComponentWriteDesc& desc)
+  {
+    const char* src = record + desc.offset;
+    switch (desc.type) {
+    case ComponentWriteDesc::Type::Float:  { float v;    std::memcpy(&v, src, sizeof(v)); return v; }
+    case ComponentWriteDesc::Type::Double: { double v;   std::memcpy(&v, src, sizeof(v)); return v; }
+    case ComponentWriteDesc::Type::UInt8:  { uint8_t v;  std::memcpy(&v, src, sizeof(v)); return v; }
+    case ComponentWriteDesc::Type::UInt16: { uint16_t v; std::memcpy(&v, src, sizeof(v)); return v; }
+    case ComponentWriteDesc::Type::Int32:  { int32_t v;  std::memcpy(&v, src, sizeof(v)); return v; }
+    default:
+      assert(false);
+      return 0.0;
+    }
+  }
+
+  template<typename T>
+  void writeInteger(char* dst, double value)
+  {
+    const double q = std::clamp(std::floor(value + 0.5), double(std::numeric_limits<T>::min()), double(std::numeric_limits<T>::max()));
+    const T v = static_cast<T>(q);
+    std::memcpy(dst, &v, sizeof(T));
+  }
+
+  void writeField(char* record, const ComponentWriteDesc& desc, double value)
+  {
+    char* dst = record + desc.offset;
+    switch (desc.type) {
+    case ComponentWriteDesc::Type::Float:  { float v = static_cast<float>(value); std::memcpy(dst, &v, sizeof(v)); break; }
+    case ComponentWriteDesc::Type::Double: { std::memcpy(dst, &value, sizeof(value)); break; }
+    case ComponentWriteDesc::Type::UInt8:  writeInteger<uint8_t>(dst, value); break;
+    case ComponentWriteDesc::Type::UInt16: writeInteger<uint16_t>(dst, value); break;
+    case ComponentWriteDesc::Type::Int32:  writeInteger<int32_t>(dst, value); break;
+    default:
+      assert(false);
+      break;
+    }
+  }
+
+}
+
+struct VoxelFilter::State
+{
+  Logger logger = nullptr;
+  std::vector<ComponentWriteDesc> layout;
+  Axis axes[3];
+  double voxelSize = 0.0;
+  Mode mode = Mode::First;
+  size_t memoryBudget = 0;
+
+  size_t stride = 0;
+  std::vector<size_t> averaged;       // Fields summed up and replaced by their mean.
+  size_t sumsOffset = 0;              // Entry: voxel, count, first point and sums of averaged fields.
+  size_t entrySize = 0;
+
+  std::vector<char> entries;          // Dense, in the order voxels were first seen.
+  size_t entryCount = 0;
+  std::vector<uint32_t> table;        // Open addressing with linear probing, indices into entries.
+
+  FILE* file = nullptr;
+  uint64_t fileSize = 0;
+  uint64_t filePosition = 0;
+  bool fileReading = false;           // Last access was a read, switching between reads and writes needs a seek.
+  std::vector<Partition> partitions;  // Spilled entries, empty if nothing was spilled.
+  Partition output;                   // Merged points of spilled entries.
+  uint64_t pointsIn = 0;
+  bool failed = false;
+  bool finished = false;
+
+  char* entry(size_t index) { return entries.data() + entrySize * index; }
+
+  // Table slots for count entries, at most half full.
+  size_t tableSizeFor(size_t count) const
+  {
+    size_t size = table.size();
+    while (size < 2 * count) {
+      size = std::max(size_t(1024), 2 * size);
+    }
+    return size;
+  }
+
+  // Entry bytes for count entries. Grows by doubling, but not beyond what the memory
+  // budget leaves next to a table of tableSize slots.
+  size_t entryBytesFor(size_t count, size_t tableSize) const
+  {
+    if (entrySize * count <= entries.size()) {
+      return entries.size();
+    }
+    const size_t tableBytes = sizeof(uint32_t) * tableSize;
+    const size_t left = tableBytes < memoryBudget ? entrySize * ((memoryBudget - tableBytes) / entrySize) : 0;
+    return std::max(entrySize * count, std::min(std::max(entries.size() * 2, entrySize * 1024), left));
+  }
+
+  // Bytes held by entries and table once they have grown to hold count entries.
+  size_t memoryUse(size_t count) const
+  {
+    const size_t tableSize = tableSizeFor(count);
+    return entryBytesFor(count, tableSize) + sizeof(uint32_t) * tableSize;
+  }
+
+  bool fileWrite(Partition& partition, const char* data, size_t count, size_t size)
+  {
+    if (count == 0) {
+      return true;
+    }
+    if (!file) {
+      file = std::tmpfile();
+      if (!file) {
+        logError(logger, "Failed to create temporary file for voxel filter");
+        return false;
+      }
+    }
+    if ((fileReading || filePosition != fileSize) && !seekFile(file, fileSize)) {
+      logError(logger, "Failed to seek in temporary file");
+      return false;
+    }
+    if (std::fwrite(data, size, count, file) != count) {
+      logError(logger, "Failed to write %zu bytes to temporary file", size * count);
+      return false;
+    }
+    partition.blocks.push_back({ .offset = fileSize, .count = count });
+    partition.count += count;
+    fileSize += size * count;
+    filePosition = fileSize;
+    fileReading = false;
+    return true;
+  }
+
+  bool fileRead(char* data, uint64_t offset, size_t count, size_t size)
+  {
+    if ((!fileReading || filePosition != offset) && !seekFile(file, offset)) {
+      logError(logger, "Failed to seek in temporary file");
+      return false;
+    }
+    if (std::fread(data, size, count, file) != count) {
+      logError(logger, "Failed to read %zu bytes from temporary file", size * count);
+      return false;
+    }
+    filePosition = offset + size * count;
+    fileReading = true;
+    return true;
+  }
+
+  void clearTable()
+  {
+    entryCount = 0;
+    std::fill(table.begin(), table.end(), NoEntry);
+  }
+
+  void growTable(size_t size)
+  {
+    table.assign(size, NoEntry);
+    const size_t mask = table.size() - 1;
+    for (size_t i = 0; i < entryCount; i++) {
+      size_t slot = hashVoxel(reinterpret_cast<const int32_t*>(entry(i))) & mask;
+      while (table[slot] != NoEntry) {
+        slot = (slot + 1) & mask;
+      }
+      table[slot] = static_cast<uint32_t>(i);
+    }
+  }
+
+  // Writes all entries to the partitions of target given by the hash bits of level.
+  bool spillTable(std::vector<Partition>& target, uint32_t level)
+  {
+    if (target.empty()) {
+      target.resize(PartitionCount);
+    }
+    const uint32_t shift = 64 - PartitionBits * (level + 1);
+    std::vector<char> buffers[PartitionCount];
+    for (size_t i = 0; i < entryCount; i++) {
+      const char* e = entry(i);
+      const uint64_t p = (hashVoxel(reinterpret_cast<const int32_t*>(e)) >> shift) & (PartitionCount - 1);
+      buffers[p].insert(buffers[p].end(), e, e + entrySize);
+      if (BlockBytes <= buffers[p].size()) {
+        if (!fileWrite(target[p], buffers[p].data(), buffers[p].size() / entrySize, entrySize)) {
+          return false;
+        }
+        buffers[p].clear();
+      }
+    }
+    for (uint32_t p = 0; p < PartitionCount; p++) {
+      if (!fileWrite(target[p], buffers[p].data(), buffers[p].size() / entrySize, entrySize)) {
+        return false;
+      }
+    }
+    logDebug(logger, "Voxel filter: spilled %zu voxels at level %u", entryCount, level);
+    clearTable();
+    return true;
+  }
+
+  // Finds the entry of a voxel, or adds one and sets inserted. Spills into target first
+  // if the table would exceed the memory budget.
+  char* lookup(const int32_t* voxel, bool& inserted, std::vector<Partition>& target, uint32_t level)
+  {
+    const uint64_t hash = hashVoxel(voxel);
+    size_t mask = table.size() - 1;
+    size_t slot = hash & mask;
+    for (uint32_t index; (index = table[slot]) != NoEntry; slot = (slot + 1) & mask) {
+      char* e = entry(index);
+      if (std::memcmp(e, voxel, 3 * sizeof(int32_t)) == 0) {
+        inserted = false;
+        return e;
+      }
+    }
+
+    if (entryCount != 0 && (memoryBudget < memoryUse(entryCount + 1) || NoEntry / 2 <= entryCount) && level < MaxPartitionLevel) {
+      if (!spillTable(target, level)) {
+        failed = true;
+        return nullptr;
+      }
+    }
+    const size_t tableSize = tableSizeFor(entryCount + 1);
+    if (table.size() < tableSize) {
+      growTable(tableSize);
+    }
+    if (const size_t entryBytes = entryBytesFor(entryCount + 1, tableSize); entries.size() < entryBytes) {
+      entries.reserve(entryBytes);    // Exactly, resize alone may double the capacity.
+      entries.resize(entryBytes);
+    }
+    mask = table.size() - 1;
+    slot = hash & mask;
+    while (table[slot] != NoEntry) {
+      slot = (slot + 1) & mask;
+    }
+    table[slot] = static_cast<uint32_t>(entryCount);
+    inserted = true;
+    return entry(entryCount++);
+  }
+
+  void voxelOf(const char* record, int32_t* voxel) const
+  {
+    for (size_t a = 0; a < 3; a++) {
+      const double value = axes[a].offset + axes[a].scale * readField(record, layout[axes[a].field]);
+      const double q = std::floor(value / voxelSize);
+      voxel[a] = q == q ? static_cast<int32_t>(std::clamp(q, double(INT32_MIN), double(INT32_MAX))) : INT32_MIN;
+    }
+  }
+
+  bool addPoints(const char* batch, size_t pointCount)
+  {
+    pointsIn += pointCount;
+    for (size_t i = 0; i < pointCount; i++) {
+      const char* record = batch + stride * i;
+      int32_t voxel[3];
+      voxelOf(record, voxel);
+
+      bool inserted = false;
+      char* e = lookup(voxel, inserted, partitions, 0);
+      if (!e) {
+        return false;
+      }
+      uint64_t count = 0;
+      if (inserted) {
+        std::memcpy(e, voxel, sizeof(voxel));
+        std::memset(e + 3 * sizeof(int32_t), 0, sizeof(uint32_t));
+        std::memcpy(e + EntryHeaderSize, record, stride);
+      }
+      else {
+        std::memcpy(&count, e + 16, sizeof(count));
+      }
+      count++;
+      std::memcpy(e + 16, &count, sizeof(count));
+      for (size_t k = 0; k < averaged.size(); k++) {
+        double sum = 0.0;
+        if (!inserted) {
+          std::memcpy(&sum, e + sumsOffset + sizeof(double) * k, sizeof(double));
+        }
+        sum += readField(record, layout[averaged[k]]);
+        std::memcpy(e + sumsOffset + sizeof(double) * k, &sum, sizeof(double));
+      }
+    }
+    return true;
+  }
+
+  // Merges a partial entry of the temporary file into the table.
+  bool addEntry(const char* src, std::vector<Partition>& target, uint32_t level)
+  {
+    bool inserted = false;
+    char* e = lookup(reinterpret_cast<const int32_t*>(src), inserted, target, level);
+    if (!e) {
+      return false;
+    }
+    if (inserted) {
+      std::memcpy(e, src, entrySize);
+      return true;
+    }
+    uint64_t count, other;
+    std::memcpy(&count, e + 16, sizeof(count));
+    std::memcpy(&other, src + 16, sizeof(other));
+    count += other;
+    std::memcpy(e + 16, &count, sizeof(count));
+    for (size_t k = 0; k < averaged.size(); k++) {
+      double sum, add;
+      std::memcpy(&sum, e + sumsOffset + sizeof(double) * k, sizeof(double));
+      std::memcpy(&add, src + sumsOffset + sizeof(double) * k, sizeof(double));
+      sum += add;
+      std::memcpy(e + sumsOffset + sizeof(double) * k, &sum, sizeof(double));
+    }
+    return true;
+  }
+
+  // Writes the point of an entry to dst, with averaged fields replaced by their mean.
+  void finalize(char* dst, const char* e) const
+  {
+    std::memcpy(dst, e + EntryHeaderSize, stride);
+    uint64_t count;
+    std::memcpy(&count, e + 16, sizeof(count));
+    for (size_t k = 0; k < averaged.size(); k++) {
+      double sum;
+      std::memcpy(&sum, e + sumsOffset + sizeof(double) * k, sizeof(double));
+      writeField(dst, layout[averaged[k]], sum / double(count));
+    }
+  }
+
+  // Merges the entries of a partition, splitting it further if it does not fit, and
+  // appends the resulting points to output.
+  bool mergePartition(Partition& partition, uint32_t level)
+  {
+    std::vector<Partition> split;
+    std::vector<char> block;
+    const size_t blockEntries = std::max(size_t(1), BlockBytes / entrySize);
+    for (const Partition::Block& b : partition.blocks) {
+      for (uint64_t first = 0; first < b.count; first += blockEntries) {
+        const size_t count = static_cast<size_t>(std::min(uint64_t(blockEntries), b.count - first));
+        block.resize(entrySize * count);
+        if (!fileRead(block.data(), b.offset + entrySize * first, count, entrySize)) {
+          return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+          if (!addEntry(block.data() + entrySize * i, split, level)) {
+            return false;
+          }
+        }
+      }
+    }
+    partition = Partition();
+
+    if (!split.empty()) {
+      if (!spillTable(split, level)) {
+        return false;
+      }
+      for (Partition& p : split) {
+        if (p.count && !mergePartition(p, level + 1)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    std::vector<char> points(stride * entryCount);
+    for (size_t i = 0; i < entryCount; i++) {
+      finalize(points.data() + stride * i, entry(i));
+    }
+    if (!fileWrite(output, points.data(), entryCount, stride)) {
+      return false;
+    }
+    clearTable();
+    return true;
+  }
+};
+
+VoxelFilter::~VoxelFilter()
+{
+  if (state && state->file) {
+    std::fclose(state->file);
+  }
+  delete state;
+}
+
+bool VoxelFilter::init(Logger logger, View<const ComponentWriteDesc> layout, const Axis(&axes)[3], double voxelSize, Mode mode, size_t memoryBudget)
+{
+  if (state) {
+    logError(logger, "Voxel filter already initialized");
+    return false;
+  }
+  if (!(0.0 < voxelSize) || layout.size == 0) {
+    logError(logger, "Voxel filter needs a positive voxel size and a layout");
+    return false;
+  }
+  for (size_t i = 0; i < layout.size; i++) {
+    if (layout[i].stride != layout[0].stride || layout[i].pointSetBase) {
+      logError(logger, "Voxel filter needs interleaved points with a common stride");
+      return false;
+    }
+  }
+  for (const Axis& axis : axes) {
+    if (layout.size <= axis.field) {
+      logError(logger, "Voxel filter axis field %zu out of range", axis.field);
+      return false;
+    }
+  }
+
+  state = new State();
+  State& s = *state;
+  s.logger = logger;
+  s.layout.assign(layout.data, layout.data + layout.size);
+  std::copy(std::begin(axes), std::end(axes), s.axes);
+  s.voxelSize = voxelSize;
+  s.mode = mode;
+  s.memoryBudget = memoryBudget;
+  s.stride = layout[0].stride;
+
+  if (mode == Mode::Centroid) {
+    for (const Axis& axis : axes) {
+      s.averaged.push_back(axis.field);
+    }
+  }
+  else if (mode == Mode::Average) {
+    for (size_t i = 0; i < layout.size; i++) {
+      s.averaged.push_back(i);
+    }
+  }
+  s.sumsOffset = EntryHeaderSize + ((s.stride + 7) & ~size_t(7));
+  s.entrySize = s.sumsOffset + sizeof(double) * s.averaged.size();
+  s.growTable(s.tableSizeFor(1));
+  return true;
+}
+
+bool VoxelFilter::consumeCallback(void* data, char* batch, size_t pointCount)
+{
+  VoxelFilter* that = reinterpret_cast<VoxelFilter*>(data);
+  if (!that->state || that->state->failed || that->state->finished) {
+    return false;
+  }
+  if (!that->state->addPoints(batch, pointCount)) {
+    that->state->failed = true;
+    return false;
+  }
+  return true;
+}
+
+bool VoxelFilter::finish(uint64_t& pointCount)
+{
+  if (!state || state->failed || state->finished) {
+    return false;
+  }
+  State& s = *state;
+  s.finished = true;
+
+  if (!s.partitions.empty()) {
+    if (!s.spillTable(s.partitions, 0)) {
+      s.failed = true;
+      return false;
+    }
+    for (Partition& partition : s.partitions) {
+      if (partition.count && !s.mergePartition(partition, 1)) {
+        s.failed = true;
+        return false;
+      }
+    }
+    s.partitions.clear();
+    s.entries = std::vector<char>();
+    s.table = std::vector<uint32_t>();
+    pointCount = s.output.count;
+  }
+  else {
+    pointCount = s.entryCount;
+  }
+  logInfo(s.logger, "Voxel filter: %" PRIu64 " points reduced to %" PRIu64 " in voxels of %g, %" PRIu64 " bytes spilled",
+          s.pointsIn, pointCount, s.voxelSize, s.fileSize);
+  return true;
+}
+
+bool VoxelFilter::emit(ConsumePointsCallback consume, void* consumeData, char* buffer, size_t capacity)
+{
+  if (!state || state->failed || !state->finished || capacity == 0) {
+    return false;
+  }
+  State& s = *state;
+
+  // Without spilling, the points are in the table in the order first seen.
+  if (s.output.blocks.empty()) {
+    for (size_t first = 0; first < s.entryCount; first += capacity) {
+      const size_t count = std::min(capacity, s.entryCount - first);
+      for (size_t i = 0; i < count; i++) {
+        s.finalize(buffer + s.stride * i, s.entry(first + i));
+      }
+      if (!consume(consumeData, buffer, count)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  for (const Partition::Block& b : s.output.blocks) {
+    for (uint64_t first = 0; first < b.count; first += capacity) {
+      const size_t count = static_cast<size_t>(std::min(uint64_t(capacity), b.count - first));
+      if (!s.fileRead(buffer, b.offset + s.stride * first, count, s.stride) || !consume(consumeData, buffer, count)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+#include <cstdint>
+#include "Common.h"
+#include "e57File.h"
+
+// Streaming voxel grid downsampling of decoded points.
+//
+// Sits between the decoder and a consumer of batches laid out by a set of write
+// descriptions with a common stride. Each point is hashed by the voxel its position falls
+// into, and an open addressing table keeps one entry per voxel. The consumer only gets
+// the reduced set, passed on by emit when the point set is done, in the order the voxels
+// were first seen unless entries were spilled.
+//
+// First keeps the first point of each voxel. Centroid keeps the first point with its
+// position replaced by the mean of the voxel. Average also replaces every other field,
+// like color and intensity, by its mean.
+//
+// When the table grows beyond the memory budget, its entries are written to a temporary
+// file in 64 partitions given by the hash of the voxel, and the table starts over. Finish
+// merges the partial entries one partition at a time, and partitions that still do not
+// fit are split further by the next bits of the hash.
+struct VoxelFilter
+{
+  enum struct Mode : uint32_t {
+    First,
+    Centroid,
+    Average
+  };
+
+  struct Axis
+  {
+    size_t field = 0;         // Index of the write description holding the coordinate.
+    double scale = 1.0;       // The coordinate is offset + scale * value, for unscaled integers.
+    double offset = 0.0;
+  };
+
+  VoxelFilter() = default;
+  VoxelFilter(const VoxelFilter&) = delete;
+  VoxelFilter& operator=(const VoxelFilter&) = delete;
+  ~VoxelFilter();
+
+  bool init(Logger logger, View<const ComponentWriteDesc> layout, const Axis(&axes)[3], double voxelSize, Mode mode, size_t memoryBudget);
+
+  // Consume callback that adds a batch of points laid out as given to init.
+  static bool consumeCallback(void* data, char* batch, size_t pointCount);
+
+  // Merges what was spilled, and gives the number of points emit will pass on.
+  bool finish(uint64_t& pointCount);
+
+  // Passes the reduced points on to consume in batches of up to capacity points, which
+  // are laid out in buffer.
+  bool emit(ConsumePointsCallback consume, void* consumeData, char* buffer, size_t capacity);
+
+  struct State;
+  State* state = nullptr;
+};
@@ -0,0 +1,991 @@
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <charconv>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "e57Writer.h"
+#include "e57Kernels.h"
+#include "cd_xml.h"
+
+namespace {
+
+  constexpr size_t FileHeaderSize = 8 + 2 * 4 + 4 * 8;
+  constexpr size_t SectionHeaderSize = 8 + 3 * 8;
+  constexpr size_t MaxPacketSize = 0x10000;         // Packet length minus one is 16 bits.
+  constexpr size_t MaxByteStreamSize = 0xFFFF;      // Bytestream lengths are 16 bits.
+  constexpr size_t MaxIndexEntries = 2048;
+  constexpr size_t MaxRecordsPerPacket = 0x10000;   // Only reached with very narrow components.
+  constexpr uint64_t NoPage = ~uint64_t(0);
+
+  const char* componentElementNames[] = {
+    "cartesianX",
+    "cartesianY",
+    "cartesianZ",
+    "sphericalRange",
+    "sphericalAzimuth",
+    "sphericalElevation",
+    "rowIndex",
+    "columnIndex",
+    "returnCount",
+    "returnIndex",
+    "timeStamp",
+    "intensity",
+    "colorRed",
+    "colorGreen",
+    "colorBlue",
+    "cartesianInvalidState",
+    "sphericalInvalidState",
+    "isTimeStampInvalid",
+    "isIntensityInvalid",
+    "isColorInvalid"
+  };
+  static_assert(sizeof(componentElementNames) == sizeof(componentElementNames[0]) * static_cast<size_t>(Component::Role::Count));
+
+  void putUint16LE(char* dst, uint64_t value)
+  {
+    dst[0] = static_cast<char>(value);
+    dst[1] = static_cast<char>(value >> 8);
+  }
+
+  void putUint64LE(char* dst, uint64_t value)
+  {
+    for (size_t i = 0; i < 8; i++) {
+      dst[i] = static_cast<char>(value >> (8 * i));
+    }
+  }
+
+  // Lays out logical bytes in checksummed pages, the inverse of readE57Bytes.
+  //
+  // Pages are written as they fill up, except pages that hold a header that is patched
+  // later. Those are held back until released, which is at most the file header page
+  // and the section header page of the point set being written.
+  struct PageWriter
+  {
+    enum Slot : size_t {
+      FileHeaderSlot,
+      SectionHeaderSlot,
+      SlotCount
+    };
+
+    struct Held
+    {
+      uint64_t pageIndex = NoPage;
+      bool full = false;            // Page is done and its bytes are in bytes.
+      std::vector<char> bytes;
+    };
+
+    Logger logger = nullptr;
+    WriteCallback writeCallback = nullptr;
+    void* writeData = nullptr;
+    size_t pageSize = 0;
+    size_t logicalSize = 0;
+
+    std::vector<char> page;         // Page being filled.
+    uint64_t pageIndex = 0;
+    size_t fill = 0;
+    Held held[SlotCount];
+
+    uint64_t physicalOffset() const { return pageIndex * pageSize + fill; }
+    uint64_t logicalOffset() const { return pageIndex * logicalSize + fill; }
+    size_t remainingInPage() const { return logicalSize - fill; }
+
+    bool emit(uint64_t index, std::vector<char>& bytes)
+    {
+      // Checksum is stored big endian, see checkPage.
+      uint32_t crc = crc32c(bytes.data(), logicalSize);
+      bytes[logicalSize + 0] = static_cast<char>(crc >> 24);
+      bytes[logicalSize + 1] = static_cast<char>(crc >> 16);
+      bytes[logicalSize + 2] = static_cast<char>(crc >> 8);
+      bytes[logicalSize + 3] = static_cast<char>(crc);
+      if (!writeCallback(writeData, index * pageSize, bytes.data(), pageSize)) {
+        logError(logger, "Failed to write page at offset %" PRIu64, index * pageSize);
+        return false;
+      }
+      return true;
+    }
+
+    bool nextPage()
+    {
+      bool ok = true;
+      bool isHeld = false;
+      for (Held& h : held) {
+        if (h.pageIndex == pageIndex) {
+          h.full = true;
+          std::swap(h.bytes, page);
+          page.resize(pageSize);
+          isHeld = true;
+          break;
+        }
+      }
+      if (!isHeld) {
+        ok = emit(pageIndex, page);
+      }
+      pageIndex++;
+      fill = 0;
+      return ok;
+    }
+
+    bool write(const void* src, size_t size)
+    {
+      const char* ptr = static_cast<const char*>(src);
+      while (size) {
+        size_t n = std::min(size, remainingInPage());
+        std::memcpy(page.data() + fill, ptr, n);
+        fill += n;
+        ptr += n;
+        size -= n;
+        if (fill == logicalSize && !nextPage()) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    bool writeZeros(size_t size)
+    {
+      while (size) {
+        size_t n = std::min(size, remainingInPage());
+        std::memset(page.data() + fill, 0, n);
+        fill += n;
+        size -= n;
+        if (fill == logicalSize && !nextPage()) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Hold back the current page until released.
+    void hold(Slot slot)
+    {
+      held[slot].pageIndex = pageIndex;
+      held[slot].full = false;
+    }
+
+    // Overwrite bytes in a held page, which must not span beyond the page payload.
+    void patch(Slot slot, uint64_t physicalOffset, const void* src, size_t size)
+    {
+      const uint64_t index = held[slot].pageIndex;
+      assert(index == physicalOffset / pageSize);
+      assert(physicalOffset % pageSize + size <= logicalSize);
+
+      // Two slots may hold the same page, the bytes are with the one that got them.
+      std::vector<char>* bytes = &page;
+      for (Held& h : held) {
+        if (h.pageIndex == index && h.full) {
+          bytes = &h.bytes;
+        }
+      }
+      std::memcpy(bytes->data() + physicalOffset % pageSize, src, size);
+    }
+
+    bool release(Slot slot)
+    {
+      Held& h = held[slot];
+      const uint64_t index = h.pageIndex;
+      if (index == NoPage) {
+        return true;
+      }
+      h.pageIndex = NoPage;
+      for (Held& other : held) {
+        if (other.pageIndex == index) {
+          if (h.full) {
+            std::swap(other.bytes, h.bytes);
+            other.full = true;
+            h.full = false;
+          }
+          return true;
+        }
+      }
+      bool ok = !h.full || emit(index, h.bytes);
+      h.full = false;
+      return ok;
+    }
+  };
+
+  // Encodes one component into its bytestream of the current data packet.
+  struct StreamEncoder
+  {
+    Component comp;
+    ComponentWriteDesc writeDesc;
+    uint32_t bitsPerRecord = 0;
+
+    std::vector<uint8_t> bytes;     // Bytestream of the current packet, with 8 bytes of slack.
+    size_t byteCount = 0;
+    uint64_t bits = 0;              // Less than 8 bits not yet in bytes.
+    uint32_t bitCount = 0;
+
+    // Extents of the encoded values, codes before scale and offset for integers.
+    int64_t codeMin = std::numeric_limits<int64_t>::max();
+    int64_t codeMax = std::numeric_limits<int64_t>::min();
+    double realMin = std::numeric_limits<double>::infinity();
+    double realMax = -std::numeric_limits<double>::infinity();
+  };
+
+  struct PointSetInfo
+  {
+    std::string name;
+    std::string guid;
+    uint64_t fileOffset = 0;
+    uint64_t recordCount = 0;
+    std::vector<Component> components;
+    bool hasBounds = false;
+    double bounds[6] = {};          // x, y and z minimum and maximum.
+    bool hasPose = false;
+    Pose pose{};
+  };
+
+  struct IndexEntry
+  {
+    uint64_t chunkRecordNumber;
+    uint64_t chunkPhysicalOffset;
+  };
+
+  template<typename WriteType>
+  double loadValue(const char* ptr)
+  {
+    WriteType value;
+    std::memcpy(&value, ptr, sizeof(WriteType));
+    return static_cast<double>(value);
+  }
+
+  // Append w <= 56 bits, with less than 8 bits pending, so bits never overflows.
+  inline void putBits(uint8_t*& dst, uint64_t& bits, uint32_t& bitCount, uint64_t value, uint32_t w)
+  {
+    static_assert(std::endian::native == std::endian::little);
+    bits |= value << bitCount;
+    bitCount += w;
+    std::memcpy(dst, &bits, sizeof(bits));
+    uint32_t byteCount = bitCount >> 3;
+    dst += byteCount;
+    bits >>= 8 * byteCount;
+    bitCount &= 7;
+  }
+
+  template<typename WriteType>
+  void encodeIntegers(StreamEncoder& s, const char* src, size_t count, uint64_t& clamped)
+  {
+    const Component& comp = s.comp;
+    const bool scaled = comp.type == Component::Type::ScaledInteger && !s.writeDesc.unscaled;
+    const double scale = scaled ? comp.integer.scale : 1.0;
+    const double offset = scaled ? comp.integer.offset : 0.0;
+    const int64_t lo = comp.integer.min;
+    const int64_t hi = comp.integer.max;
+    const double loLimit = static_cast<double>(lo) - 0.5;
+    const double hiLimit = static_cast<double>(hi) + 0.5;
+    const uint32_t w = s.bitsPerRecord;
+    const size_t stride = s.writeDesc.stride;
+
+    uint8_t* dst = s.bytes.data() + s.byteCount;
+    uint64_t bits = s.bits;
+    uint32_t bitCount = s.bitCount;
+    int64_t codeMin = s.codeMin;
+    int64_t codeMax = s.codeMax;
+    uint64_t outside = 0;
+    for (size_t i = 0; i < count; i++) {
+      double value = loadValue<WriteType>(src + stride * i);
+      if (scaled) {
+        value = (value - offset) / scale;
+      }
+
+      // NaN ends up as the minimum.
+      int64_t code;
+      if (!(loLimit <= value)) {
+        code = lo;
+        outside++;
+      }
+      else if (hiLimit <= value) {
+        code = hi;
+        outside++;
+      }
+      else {
+        code = std::clamp(static_cast<int64_t>(std::llround(value)), lo, hi);
+      }
+      codeMin = std::min(codeMin, code);
+      codeMax = std::max(codeMax, code);
+
+      uint64_t raw = static_cast<uint64_t>(code) - static_cast<uint64_t>(lo);
+      if (w <= 56) {
+        putBits(dst, bits, bitCount, raw, w);
+      }
+      else {
+        putBits(dst, bits, bitCount, raw & 0xFFFFFFFFu, 32);
+        putBits(dst, bits, bitCount, raw >> 32, w - 32);
+      }
+    }
+    s.byteCount = dst - s.bytes.data();
+    s.bits = bits;
+    s.bitCount = bitCount;
+    s.codeMin = codeMin;
+    s.codeMax = codeMax;
+    clamped += outside;
+  }
+
+  template<typename WriteType>
+  void encodeReals(StreamEncoder& s, const char* src, size_t count, uint64_t& clamped)
+  {
+    static_assert(std::endian::native == std::endian::little);
+    const double lo = s.comp.real.min;
+    const double hi = s.comp.real.max;
+    const bool single = s.comp.type == Component::Type::Float;
+    const size_t stride = s.writeDesc.stride;
+
+    uint8_t* dst = s.bytes.data() + s.byteCount;
+    double realMin = s.realMin;
+    double realMax = s.realMax;
+    uint64_t outside = 0;
+    for (size_t i = 0; i < count; i++) {
+      double value = loadValue<WriteType>(src + stride * i);
+      if (value < lo) {
+        value = lo;
+        outside++;
+      }
+      else if (hi < value) {
+        value = hi;
+        outside++;
+      }
+      realMin = std::min(realMin, value);
+      realMax = std::max(realMax, value);
+
+      if (single) {
+        float f = static_cast<float>(value);
+        std::memcpy(dst, &f, sizeof(f));
+        dst += sizeof(f);
+      }
+      else {
+        std::memcpy(dst, &value, sizeof(value));
+        dst += sizeof(value);
+      }
+    }
+    s.byteCount = dst - s.bytes.data();
+    s.realMin = realMin;
+    s.realMax = realMax;
+    clamped += outside;
+  }
+
+  template<typename WriteType>
+  void encodeAs(StreamEncoder& s, const char* src, size_t count, uint64_t& clamped)
+  {
+    if (s.comp.type == Component::Type::Integer || s.comp.type == Component::Type::ScaledInteger) {
+      encodeIntegers<WriteType>(s, src, count, clamped);
+    }
+    else {
+      encodeReals<WriteType>(s, src, count, clamped);
+    }
+  }
+
+  void encodeValues(StreamEncoder& s, const char* src, size_t count, uint64_t& clamped)
+  {
+    switch (s.writeDesc.type) {
+    case ComponentWriteDesc::Type::Float:  encodeAs<float>(s, src, count, clamped); break;
+    case ComponentWriteDesc::Type::Double: encodeAs<double>(s, src, count, clamped); break;
+    case ComponentWriteDesc::Type::UInt8:  encodeAs<uint8_t>(s, src, count, clamped); break;
+    case ComponentWriteDesc::Type::UInt16: encodeAs<uint16_t>(s, src, count, clamped); break;
+    case ComponentWriteDesc::Type::Int32:  encodeAs<int32_t>(s, src, count, clamped); break;
+    default:
+      assert(false && "Invalid write type");
+      break;
+    }
+  }
+
+  std::string formatNumber(double value)
+  {
+    char buf[32];
+    std::to_chars_result result = std::to_chars(buf, buf + sizeof(buf), value);
+    return std::string(buf, result.ptr);
+  }
+
+  std::string makeGuid(std::mt19937_64& random)
+  {
+    uint64_t a = random();
+    uint64_t b = random();
+    // Version 4, variant 1.
+    a = (a & ~uint64_t(0xF000)) | 0x4000;
+    b = (b & ~(uint64_t(0x3) << 62)) | (uint64_t(0x2) << 62);
+    char buf[48];
+    std::snprintf(buf, sizeof(buf), "{%08" PRIx64 "-%04" PRIx64 "-%04" PRIx64 "-%04" PRIx64 "-%012" PRIx64 "}",
+                  a >> 32, (a >> 16) & 0xFFFF, a & 0xFFFF, b >> 48, b & uint64_t(0xFFFFFFFFFFFF));
+    return buf;
+  }
+
+  // Builds the XML section with cd_xml, all strings are copied.
+  struct XmlBuilder
+  {
+    cd_xml_doc_t* doc = nullptr;
+    cd_xml_ns_ix_t ns = cd_xml_no_ix;
+
+    cd_xml_node_ix_t element(cd_xml_node_ix_t parent, const char* name, const char* type)
+    {
+      cd_xml_stringview_t nameStr = cd_xml_strv(name);
+      cd_xml_node_ix_t rv = cd_xml_add_element(doc, ns, &nameStr, parent, CD_XML_FLAGS_COPY_STRINGS);
+      attribute(rv, "type", type);
+      return rv;
+    }
+
+    void attribute(cd_xml_node_ix_t elem, const char* name, const std::string& value)
+    {
+      cd_xml_stringview_t nameStr = cd_xml_strv(name);
+      cd_xml_stringview_t valueStr{ value.data(), value.data() + value.size() };
+      cd_xml_add_attribute(doc, cd_xml_no_ix, &nameStr, &valueStr, elem, CD_XML_FLAGS_COPY_STRINGS);
+    }
+
+    cd_xml_node_ix_t valueElement(cd_xml_node_ix_t parent, const char* name, const char* type, const std::string& value)
+    {
+      cd_xml_node_ix_t rv = element(parent, name, type);
+      cd_xml_stringview_t valueStr{ value.data(), value.data() + value.size() };
+      cd_xml_add_text(doc, &valueStr, rv, CD_XML_FLAGS_COPY_STRINGS);
+      return rv;
+    }
+
+    void component(cd_xml_node_ix_t prototype, const Component& comp)
+    {
+      const char* name = componentElementNames[static_cast<size_t>(comp.role)];
+      switch (comp.type) {
+      case Component::Type::Integer: {
+        cd_xml_node_ix_t elem = element(prototype, name, "Integer");
+        attribute(elem, "minimum", std::to_string(comp.integer.min));
+        attribute(elem, "maximum", std::to_string(comp.integer.max));
+        break;
+      }
+      case Component::Type::ScaledInteger: {
+        cd_xml_node_ix_t elem = element(prototype, name, "ScaledInteger");
+        attribute(elem, "minimum", std::to_string(comp.integer.min));
+        attribute(elem, "maximum", std::to_string(comp.integer.max));
+        attribute(elem, "scale", formatNumber(comp.integer.scale));
+        attribute(elem, "offset", formatNumber(comp.integer.offset));
+        break;
+      }
+      case Component::Type::Float:
+      case Component::Type::Double: {
+        cd_xml_node_ix_t elem = element(prototype, name, "Float");
+        attribute(elem, "precision", comp.type == Component::Type::Float ? "single" : "double");
+        attribute(elem, "minimum", formatNumber(comp.real.min));
+        attribute(elem, "maximum", formatNumber(comp.real.max));
+        break;
+      }
+      default:
+        assert(false && "Invalid component type");
+        break;
+      }
+    }
+
+    void pointSet(cd_xml_node_ix_t data3D, const PointSetInfo& info)
+    {
+      cd_xml_node_ix_t child = element(data3D, "vectorChild", "Structure");
+      valueElement(child, "guid", "String", info.guid);
+      if (!info.name.empty()) {
+        valueElement(child, "name", "String", info.name);
+      }
+      if (info.hasBounds) {
+        static const char* boundNames[6] = { "xMinimum", "xMaximum", "yMinimum", "yMaximum", "zMinimum", "zMaximum" };
+        cd_xml_node_ix_t bounds = element(child, "cartesianBounds", "Structure");
+        for (size_t i = 0; i < 6; i++) {
+          valueElement(bounds, boundNames[i], "Float", formatNumber(info.bounds[i]));
+        }
+      }
+      if (info.hasPose) {
+        static const char* rotationNames[4] = { "w", "x", "y", "z" };
+        static const char* translationNames[3] = { "x", "y", "z" };
+        cd_xml_node_ix_t pose = element(child, "pose", "Structure");
+        cd_xml_node_ix_t rotation = element(pose, "rotation", "Structure");
+        for (size_t i = 0; i < 4; i++) {
+          valueElement(rotation, rotationNames[i], "Float", formatNumber(info.pose.rotation[i]));
+        }
+        cd_xml_node_ix_t translation = element(pose, "translation", "Structure");
+        for (size_t i = 0; i < 3; i++) {
+          valueElement(translation, translationNames[i], "Float", formatNumber(info.pose.translation[i]));
+        }
+      }
+
+      cd_xml_node_ix_t points = element(child, "points", "CompressedVector");
+      attribute(points, "fileOffset", std::to_string(info.fileOffset));
+      attribute(points, "recordCount", std::to_string(info.recordCount));
+      cd_xml_node_ix_t prototype = element(points, "prototype", "Structure");
+      for (const Component& comp : info.components) {
+        component(prototype, comp);
+      }
+      cd_xml_node_ix_t codecs = element(points, "codecs", "Vector");
+      attribute(codecs, "allowHeterogeneousChildren", "1");
+    }
+  };
+
+  bool xmlOutput(void* userdata, const char* ptr, size_t bytes)
+  {
+    return static_cast<PageWriter*>(userdata)->write(ptr, bytes);
+  }
+
+}
+
+struct E57Writer::State
+{
+  Logger logger = nullptr;
+  PageWriter pages;
+  std::vector<PointSetInfo> pointSets;
+  std::mt19937_64 random;
+  bool failed = false;
+  bool inPoints = false;
+  bool closed = false;
+
+  // Point set being written.
+  std::vector<StreamEncoder> streams;
+  std::vector<char> packet;
+  std::vector<IndexEntry> indexEntries;
+  size_t recordsPerPacket = 0;
+  size_t packetRecords = 0;
+  uint64_t recordCount = 0;
+  uint64_t valuesClamped = 0;
+  uint64_t sectionPhysicalOffset = 0;
+  uint64_t sectionLogicalOffset = 0;
+  uint64_t dataPhysicalOffset = 0;
+
+  bool writeDataPacket()
+  {
+    // Data packet:
+    //   0x00  uint8_t      Packet type: 1 = data
+    //   0x01  uint8_t      Flags
+    //   0x02  uint16_t     Packet logical length minus one
+    //   0x04  uint16_t     Bytestream count
+    //   0x06  uint16_t[]   Bytestream lengths, followed by the bytestreams.
+    const size_t streamCount = streams.size();
+    size_t size = 6 + 2 * streamCount;
+    for (StreamEncoder& s : streams) {
+      if (s.bitCount) {
+        s.bytes[s.byteCount++] = static_cast<uint8_t>(s.bits);
+        s.bits = 0;
+        s.bitCount = 0;
+      }
+      size += s.byteCount;
+    }
+    const size_t paddedSize = (size + 3) & ~size_t(3);
+    assert(paddedSize <= MaxPacketSize);
+
+    char* ptr = packet.data();
+    ptr[0] = 1;
+    ptr[1] = 0;
+    putUint16LE(ptr + 2, paddedSize - 1);
+    putUint16LE(ptr + 4, streamCount);
+    for (size_t i = 0; i < streamCount; i++) {
+      putUint16LE(ptr + 6 + 2 * i, streams[i].byteCount);
+    }
+    ptr += 6 + 2 * streamCount;
+    for (StreamEncoder& s : streams) {
+      std::memcpy(ptr, s.bytes.data(), s.byteCount);
+      ptr += s.byteCount;
+      s.byteCount = 0;
+    }
+    std::memset(ptr, 0, paddedSize - size);
+
+    indexEntries.push_back({ .chunkRecordNumber = recordCount - packetRecords, .chunkPhysicalOffset = pages.physicalOffset() });
+    packetRecords = 0;
+    return pages.write(packet.data(), paddedSize);
+  }
+
+  // Writes index packets bottom up, with at most MaxIndexEntries entries each, until a
+  // level fits in a single packet, which is the root.
+  bool writeIndexPackets(uint64_t& rootPhysicalOffset)
+  {
+    // Index packet:
+    //   0x00  uint8_t      Packet type: 0 = index
+    //   0x01  uint8_t      Flags
+    //   0x02  uint16_t     Packet logical length minus one
+    //   0x04  uint16_t     Entry count
+    //   0x06  uint8_t      Index level, 0 = entries refer to data packets
+    //   0x07  uint8_t[9]   Reserved
+    //   0x10               Entries of { uint64_t chunkRecordNumber, uint64_t chunkPhysicalOffset }
+    std::vector<IndexEntry> entries;
+    entries.swap(indexEntries);
+    for (uint8_t level = 0;; level++) {
+      std::vector<IndexEntry> parents;
+      for (size_t i = 0; i < entries.size(); i += MaxIndexEntries) {
+        const size_t count = std::min(MaxIndexEntries, entries.size() - i);
+        const size_t size = 16 + 16 * count;
+
+        char* ptr = packet.data();
+        std::memset(ptr, 0, 16);
+        putUint16LE(ptr + 2, size - 1);
+        putUint16LE(ptr + 4, count);
+        ptr[6] = static_cast<char>(level);
+        for (size_t k = 0; k < count; k++) {
+          putUint64LE(ptr + 16 + 16 * k, entries[i + k].chunkRecordNumber);
+          putUint64LE(ptr + 16 + 16 * k + 8, entries[i + k].chunkPhysicalOffset);
+        }
+
+        parents.push_back({ .chunkRecordNumber = entries[i].chunkRecordNumber, .chunkPhysicalOffset = pages.physicalOffset() });
+        if (!pages.write(packet.data(), size)) {
+          return false;
+        }
+      }
+      if (parents.size() <= 1) {
+        rootPhysicalOffset = parents.empty() ? 0 : parents[0].chunkPhysicalOffset;
+        return true;
+      }
+      entries.swap(parents);
+    }
+  }
+
+  bool writeXml()
+  {
+    XmlBuilder xml;
+    xml.doc = cd_xml_init();
+
+    cd_xml_stringview_t prefix = cd_xml_strv("");
+    cd_xml_stringview_t uri = cd_xml_strv("http://www.astm.org/COMMIT/E57/2010-e57-v1.0");
+    xml.ns = cd_xml_add_namespace(xml.doc, &prefix, &uri, CD_XML_FLAGS_COPY_STRINGS);
+
+    cd_xml_node_ix_t root = xml.element(cd_xml_no_ix, "e57Root", "Structure");
+    xml.valueElement(root, "formatName", "String", "ASTM E57 3D Imaging Data File");
+    xml.valueElement(root, "guid", "String", makeGuid(random));
+    xml.valueElement(root, "versionMajor", "Integer", "1");
+    xml.valueElement(root, "versionMinor", "Integer", "0");
+    cd_xml_node_ix_t data3D = xml.element(root, "data3D", "Vector");
+    xml.attribute(data3D, "allowHeterogeneousChildren", "1");
+    for (const PointSetInfo& info : pointSets) {
+      xml.pointSet(data3D, info);
+    }
+    cd_xml_node_ix_t images2D = xml.element(root, "images2D", "Vector");
+    xml.attribute(images2D, "allowHeterogeneousChildren", "1");
+
+    // Not pretty printed, as that would add whitespace to the text of string elements.
+    bool ok = cd_xml_write(xml.doc, xmlOutput, &pages, false);
+    cd_xml_free(&xml.doc);
+    return ok;
+  }
+};
+
+E57Writer::~E57Writer()
+{
+  delete state;
+}
+
+bool E57Writer::open(Logger logger, WriteCallback write, void* writeData, size_t pageSize)
+{
+  if (state) {
+    logError(logger, "E57 writer already open");
+    return false;
+  }
+  if (pageSize < 64 || (pageSize & (pageSize - 1)) != 0) {
+    logError(logger, "Page size %zu is not a power of 2 of at least 64", pageSize);
+    return false;
+  }
+
+  state = new State();
+  state->logger = logger;
+  state->random.seed(std::random_device()() ^ getMonotonicNanoseconds());
+  state->packet.resize(MaxPacketSize);
+
+  PageWriter& pages = state->pages;
+  pages.logger = logger;
+  pages.writeCallback = write;
+  pages.writeData = writeData;
+  pages.pageSize = pageSize;
+  pages.logicalSize = pageSize - sizeof(uint32_t);
+  pages.page.resize(pageSize);
+
+  // Header is filled in by close.
+  pages.hold(PageWriter::FileHeaderSlot);
+  if (!pages.writeZeros(FileHeaderSize)) {
+    state->failed = true;
+    return false;
+  }
+  return true;
+}
+
+bool E57Writer::beginPoints(View<const Component> components, View<const ComponentWriteDesc> writeDesc, const char* name, const Pose* pose)
+{
+  if (!state || state->failed || state->closed) {
+    return false;
+  }
+  State& s = *state;
+  if (s.inPoints) {
+    logError(s.logger, "Point set already begun");
+    return false;
+  }
+  if (components.size == 0 || writeDesc.size != components.size) {
+    logError(s.logger, "Expected one write description per component, got %zu for %zu components", writeDesc.size, components.size);
+    return false;
+  }
+
+  s.streams.clear();
+  s.streams.resize(components.size);
+  std::vector<bool> described(components.size, false);
+  for (size_t i = 0; i < writeDesc.size; i++) {
+    const ComponentWriteDesc& desc = writeDesc[i];
+    if (components.size <= desc.stream || described[desc.stream]) {
+      logError(s.logger, "Write description %zu refers to component %u, which is out of range or already described", i, desc.stream);
+      return false;
+    }
+    if (ComponentWriteDesc::typeSize(desc.type) == 0 || desc.pointSetBase) {
+      logError(s.logger, "Write description %zu has invalid type %u or pointSetBase set", i, uint32_t(desc.type));
+      return false;
+    }
+    described[desc.stream] = true;
+    s.streams[desc.stream].writeDesc = desc;
+  }
+
+  uint64_t bitsPerRecord = 0;
+  for (size_t i = 0; i < components.size; i++) {
+    const Component& comp = components[i];
+    StreamEncoder& stream = s.streams[i];
+    stream.comp = comp;
+    switch (comp.type) {
+    case Component::Type::Integer:
+    case Component::Type::ScaledInteger:
+      if (comp.integer.max < comp.integer.min) {
+        logError(s.logger, "Component %zu has minimum %" PRId64 " larger than maximum %" PRId64, i, comp.integer.min, comp.integer.max);
+        return false;
+      }
+      if (comp.type == Component::Type::ScaledInteger && !(comp.integer.scale != 0.0 && std::isfinite(comp.integer.scale))) {
+        logError(s.logger, "Component %zu has invalid scale %f", i, comp.integer.scale);
+        return false;
+      }
+      stream.bitsPerRecord = std::bit_width(static_cast<uint64_t>(comp.integer.max) - static_cast<uint64_t>(comp.integer.min));
+      stream.comp.integer.bitWidth = static_cast<uint8_t>(stream.bitsPerRecord);
+      break;
+    case Component::Type::Float:
+    case Component::Type::Double:
+      if (comp.real.max < comp.real.min) {
+        logError(s.logger, "Component %zu has minimum %f larger than maximum %f", i, comp.real.min, comp.real.max);
+        return false;
+      }
+      stream.bitsPerRecord = comp.type == Component::Type::Float ? 32 : 64;
+      break;
+    default:
+      logError(s.logger, "Component %zu has invalid type %u", i, uint32_t(comp.type));
+      return false;
+    }
+    bitsPerRecord += stream.bitsPerRecord;
+  }
+
+  // Records per packet is a multiple of 8, so every bytestream ends on a byte and
+  // record boundary, and readers that carry bits across packets agree with readers
+  // that do not.
+  const size_t headerSize = 6 + 2 * components.size;
+  if (MaxPacketSize < headerSize + 3) {
+    logError(s.logger, "Too many components (%zu)", components.size);
+    return false;
+  }
+  size_t recordsPerPacket = MaxRecordsPerPacket;
+  if (bitsPerRecord) {
+    recordsPerPacket = std::min(recordsPerPacket, static_cast<size_t>(8 * (MaxPacketSize - headerSize - 3) / bitsPerRecord));
+  }
+  for (const StreamEncoder& stream : s.streams) {
+    if (stream.bitsPerRecord) {
+      recordsPerPacket = std::min(recordsPerPacket, 8 * MaxByteStreamSize / stream.bitsPerRecord);
+    }
+  }
+  recordsPerPacket &= ~size_t(7);
+  if (recordsPerPacket == 0) {
+    logError(s.logger, "Records of %" PRIu64 " bits do not fit in a data packet", bitsPerRecord);
+    return false;
+  }
+  for (StreamEncoder& stream : s.streams) {
+    stream.bytes.resize((recordsPerPacket * stream.bitsPerRecord) / 8 + 8);
+  }
+  s.recordsPerPacket = recordsPerPacket;
+  s.packetRecords = 0;
+  s.recordCount = 0;
+  s.valuesClamped = 0;
+  s.indexEntries.clear();
+
+  PointSetInfo& info = s.pointSets.emplace_back();
+  info.name = name ? name : "";
+  info.hasPose = pose != nullptr;
+  if (pose) {
+    info.pose = *pose;
+  }
+  info.guid = makeGuid(s.random);
+  for (const StreamEncoder& stream : s.streams) {
+    info.components.push_back(stream.comp);
+  }
+
+  // Section header is filled in by endPoints, keep it within one page.
+  PageWriter& pages = s.pages;
+  if (!pages.writeZeros((4 - pages.logicalOffset() % 4) % 4) ||
+      (pages.remainingInPage() < SectionHeaderSize && !pages.writeZeros(pages.remainingInPage())))
+  {
+    s.failed = true;
+    return false;
+  }
+  s.sectionPhysicalOffset = pages.physicalOffset();
+  s.sectionLogicalOffset = pages.logicalOffset();
+  pages.hold(PageWriter::SectionHeaderSlot);
+  if (!pages.writeZeros(SectionHeaderSize)) {
+    s.failed = true;
+    return false;
+  }
+  s.dataPhysicalOffset = pages.physicalOffset();
+  info.fileOffset = s.sectionPhysicalOffset;
+
+  logDebug(s.logger, "Point set %zu: %zu components, %" PRIu64 " bits per record, %zu records per packet",
+           s.pointSets.size() - 1, components.size, bitsPerRecord, recordsPerPacket);
+  s.inPoints = true;
+  return true;
+}
+
+bool E57Writer::writePoints(const char* batch, size_t pointCount)
+{
+  if (!state || state->failed) {
+    return false;
+  }
+  State& s = *state;
+  if (!s.inPoints) {
+    logError(s.logger, "No point set begun");
+    return false;
+  }
+
+  size_t pointsDone = 0;
+  while (pointsDone < pointCount) {
+    size_t pointsToDo = std::min(pointCount - pointsDone, s.recordsPerPacket - s.packetRecords);
+    for (StreamEncoder& stream : s.streams) {
+      const char* src = batch + stream.writeDesc.offset + stream.writeDesc.stride * pointsDone;
+      encodeValues(stream, src, pointsToDo, s.valuesClamped);
+    }
+    s.packetRecords += pointsToDo;
+    s.recordCount += pointsToDo;
+    pointsDone += pointsToDo;
+
+    if (s.packetRecords == s.recordsPerPacket && !s.writeDataPacket()) {
+      s.failed = true;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool E57Writer::endPoints()
+{
+  if (!state || state->failed) {
+    return false;
+  }
+  State& s = *state;
+  if (!s.inPoints) {
+    logError(s.logger, "No point set begun");
+    return false;
+  }
+  s.inPoints = false;
+
+  if (s.packetRecords && !s.writeDataPacket()) {
+    s.failed = true;
+    return false;
+  }
+  uint64_t indexPhysicalOffset = 0;
+  if (!s.writeIndexPackets(indexPhysicalOffset)) {
+    s.failed = true;
+    return false;
+  }
+
+  // CompressedVectorSectionHeader, see readSectionHeader.
+  char header[SectionHeaderSize] = {};
+  header[0] = 1;
+  putUint64LE(header + 0x08, s.pages.logicalOffset() - s.sectionLogicalOffset);
+  putUint64LE(header + 0x10, s.recordCount ? s.dataPhysicalOffset : 0);
+  putUint64LE(header + 0x18, indexPhysicalOffset);
+  s.pages.patch(PageWriter::SectionHeaderSlot, s.sectionPhysicalOffset, header, sizeof(header));
+  if (!s.pages.release(PageWriter::SectionHeaderSlot)) {
+    s.failed = true;
+    return false;
+  }
+
+  PointSetInfo& info = s.pointSets.back();
+  info.recordCount = s.recordCount;
+  if (s.recordCount) {
+    size_t axesFound = 0;
+    for (const StreamEncoder& stream : s.streams) {
+      size_t axis = 0;
+      switch (stream.comp.role) {
+      case Component::Role::CartesianX: axis = 0; break;
+      case Component::Role::CartesianY: axis = 1; break;
+      case Component::Role::CartesianZ: axis = 2; break;
+      default: continue;
+      }
+      double lo = stream.realMin;
+      double hi = stream.realMax;
+      if (stream.comp.type == Component::Type::Integer || stream.comp.type == Component::Type::ScaledInteger) {
+        const bool scaled = stream.comp.type == Component::Type::ScaledInteger;
+        const double scale = scaled ? stream.comp.integer.scale : 1.0;
+        const double offset = scaled ? stream.comp.integer.offset : 0.0;
+        lo = scale * static_cast<double>(stream.codeMin) + offset;
+        hi = scale * static_cast<double>(stream.codeMax) + offset;
+        if (hi < lo) {
+          std::swap(lo, hi);
+        }
+      }
+      info.bounds[2 * axis + 0] = lo;
+      info.bounds[2 * axis + 1] = hi;
+      axesFound++;
+    }
+    info.hasBounds = axesFound == 3;
+  }
+
+  if (s.valuesClamped) {
+    logWarning(s.logger, "Point set %zu: %" PRIu64 " values outside of declared range were clamped", s.pointSets.size() - 1, s.valuesClamped);
+  }
+  logDebug(s.logger, "Point set %zu: wrote %" PRIu64 " records", s.pointSets.size() - 1, s.recordCount);
+  return true;
+}
+
+bool E57Writer::close()
+{
+  if (!state || state->closed) {
+    return false;
+  }
+  State& s = *state;
+  s.closed = true;
+  if (s.failed) {
+    return false;
+  }
+  if (s.inPoints) {
+    logError(s.logger, "Point set not ended before close");
+    s.failed = true;
+    return false;
+  }
+
+  PageWriter& pages = s.pages;
+  const uint64_t xmlPhysicalOffset = pages.physicalOffset();
+  const uint64_t xmlLogicalOffset = pages.logicalOffset();
+  if (!s.writeXml()) {
+    logError(s.logger, "Failed to write XML");
+    s.failed = true;
+    return false;
+  }
+  const uint64_t xmlLogicalLength = pages.logicalOffset() - xmlLogicalOffset;
+
+  if (pages.fill && !pages.writeZeros(pages.remainingInPage())) {
+    s.failed = true;
+    return false;
+  }
+  const uint64_t filePhysicalLength = pages.pageIndex * pages.pageSize;
+
+  // File header, see parseHeader.
+  char header[FileHeaderSize] = {};
+  std::memcpy(header, "ASTM-E57", 8);
+  header[8] = 1;    // Major version 1, minor version 0.
+  putUint64LE(header + 16, filePhysicalLength);
+  putUint64LE(header + 24, xmlPhysicalOffset);
+  putUint64LE(header + 32, xmlLogicalLength);
+  putUint64LE(header + 40, pages.pageSize);
+  pages.patch(PageWriter::FileHeaderSlot, 0, header, sizeof(header));
+  if (!pages.release(PageWriter::FileHeaderSlot)) {
+    s.failed = true;
+    return false;
+  }
+
+  logDebug(s.logger, "Wrote %zu point sets, %" PRIu64 " bytes", s.pointSets.size(), filePhysicalLength);
+  return true;
+}
+
+uint64_t E57Writer::fileSize() const
+{
+  return state ? state->pages.pageIndex * state->pages.pageSize : 0;
+}
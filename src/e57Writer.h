@@ -0,0 +1,55 @@
+#pragma once
+// This file is part of e57parser copyright 2023 Christopher Dyken
+// Released under the MIT license, please see LICENSE file for details.
+
+#include <cstdint>
+#include "Common.h"
+#include "e57File.h"
+
+// Write callback.
+//
+// Writes size bytes at a physical offset of the file, returning false on failure. Pages
+// are written in order, except the pages holding the file header and the header of the
+// point set being written, which are written when complete. So the callback must handle
+// writes at offsets before the end of what has been written.
+typedef bool(*WriteCallback)(void* callbackData, uint64_t offset, const void* data, size_t size);
+
+// Streaming writer of E57 files, the inverse of reading.
+//
+// Point sets are written one at a time. beginPoints takes the components of the point
+// set, like the prototype of Points, where integer and scaled integer components are
+// bit-packed in the width given by their minimum and maximum. Points are then passed
+// in batches laid out as described by one ComponentWriteDesc per component, where
+// stream is the index of the component. Values are converted to the encoding of the
+// component, values outside of the declared range are clamped. The record count is
+// given by the number of points written.
+//
+// Points are encoded as they arrive and written in data packets of up to 64 KB, with
+// the same number of records in every bytestream and a multiple of eight per packet,
+// so that bytestreams of each packet end on a record boundary. Index packets follow
+// the data packets of a point set. Memory use is bounded by a packet, two held pages
+// and 16 bytes of index entry per data packet. The XML and the file header are
+// written by close.
+struct E57Writer
+{
+  E57Writer() = default;
+  E57Writer(const E57Writer&) = delete;
+  E57Writer& operator=(const E57Writer&) = delete;
+  ~E57Writer();
+
+  // Page size must be a power of two, the standard size is 1024 bytes.
+  bool open(Logger logger, WriteCallback write, void* writeData, size_t pageSize = 1024);
+
+  // Name and pose may be null, the pose is written as the transform of the point set.
+  bool beginPoints(View<const Component> components, View<const ComponentWriteDesc> writeDesc, const char* name = nullptr, const Pose* pose = nullptr);
+  bool writePoints(const char* batch, size_t pointCount);
+  bool endPoints();
+
+  // Writes the XML and the file header, returns false if anything failed on the way.
+  bool close();
+
+  uint64_t fileSize() const;
+
+  struct State;
+  State* state = nullptr;
+};
@@ -6,6 +6,7 @@
 #include "cd_xml.h"
 
 #include <cassert>
+#include <cstring>
 #include <vector>
 #include <string>
 #include <limits>
@@ -40,6 +41,13 @@ namespace {
       YMax,
       ZMin,
       ZMax,
+      Pose,
+      Rotation,
+      Translation,
+      W,
+      X,
+      Y,
+      Z,
       Points,
       Prototype,
       Component,
@@ -49,6 +57,13 @@ namespace {
 
     union {
       CartesianBoundsData cartesianBounds;
+      struct {
+        Element* points;
+        cd_xml_stringview_t name;
+        Pose pose;
+        bool hasName;
+        bool hasPose;
+      } vectorChild;
       Component component;
       struct {
         UninitializedListHeader<Element> components;
@@ -72,6 +87,13 @@ namespace {
       "YMax",
       "ZMin",
       "ZMax",
+      "Pose",
+      "Rotation",
+      "Translation",
+      "W",
+      "X",
+      "Y",
+      "Z",
       "Points",
       "Prototype",
       "Component",
@@ -177,6 +199,13 @@ namespace {
     else if (key == "yMaximum") {               elem.kind = Element::Kind::YMax; }
     else if (key == "zMinimum") {               elem.kind = Element::Kind::ZMin; }
     else if (key == "zMaximum") {               elem.kind = Element::Kind::ZMax; }
+    else if (key == "pose") {                   elem.kind = Element::Kind::Pose; }
+    else if (key == "rotation") {               elem.kind = Element::Kind::Rotation; }
+    else if (key == "translation") {            elem.kind = Element::Kind::Translation; }
+    else if (key == "w") {                      elem.kind = Element::Kind::W; }
+    else if (key == "x") {                      elem.kind = Element::Kind::X; }
+    else if (key == "y") {                      elem.kind = Element::Kind::Y; }
+    else if (key == "z") {                      elem.kind = Element::Kind::Z; }
     else if (key == "prototype") {              elem.kind = Element::Kind::Prototype; }
     else if (key == "images2D") {               elem.kind = Element::Kind::Images2D; }
     else if (key == "cartesianX") {             elem.kind = Element::Kind::Component; elem.component.role = Component::Role::CartesianX; }
@@ -201,8 +230,23 @@ namespace {
     else { elem.kind = Element::Kind::Unknown; }
 
 
+    const size_t N = ctx.stack.size();
     switch (elem.kind) {
 
+    case Element::Kind::VectorChild:
+      elem.vectorChild.points = nullptr;
+      elem.vectorChild.name = cd_xml_stringview_t{};
+      elem.vectorChild.pose.init();
+      elem.vectorChild.hasName = false;
+      elem.vectorChild.hasPose = false;
+      break;
+
+    case Element::Kind::Pose:
+      if (2 <= N && ctx.stack[N - 2]->kind == Element::Kind::VectorChild) {
+        ctx.stack[N - 2]->vectorChild.hasPose = true;
+      }
+      break;
+
     case Element::Kind::Points:
       elem.points.components.init();
       elem.points.points.init();
@@ -244,6 +288,26 @@ namespace {
 
     case Element::Kind::Points:
       ctx.points.pushBack(elem);
+      if (2 <= N && ctx.stack[N - 2]->kind == Element::Kind::VectorChild) {
+        ctx.stack[N - 2]->vectorChild.points = elem;
+      }
+      break;
+
+    case Element::Kind::VectorChild:
+      // Name and pose may come before or after the points, so they are copied when the
+      // whole child is parsed.
+      if (Element* points = elem->vectorChild.points; points) {
+        Points& dst = points->points.points;
+        if (elem->vectorChild.hasName) {
+          const size_t length = elem->vectorChild.name.end - elem->vectorChild.name.begin;
+          char* name = static_cast<char*>(ctx.e57File->arena.alloc(length + 1));
+          std::memcpy(name, elem->vectorChild.name.begin, length);
+          name[length] = '\0';
+          dst.name = name;
+        }
+        dst.pose = elem->vectorChild.pose;
+        dst.hasPose = elem->vectorChild.hasPose;
+      }
       break;
 
     case Element::Kind::Component:
@@ -260,7 +324,6 @@ namespace {
     case Element::Kind::Unknown:
     case Element::Kind::E57Root:
     case Element::Kind::Data3D:
-    case Element::Kind::VectorChild:
     case Element::Kind::Name:
     case Element::Kind::XMin:
     case Element::Kind::XMax:
@@ -268,6 +331,13 @@ namespace {
     case Element::Kind::YMax:
     case Element::Kind::ZMin:
     case Element::Kind::ZMax:
+    case Element::Kind::Pose:
+    case Element::Kind::Rotation:
+    case Element::Kind::Translation:
+    case Element::Kind::W:
+    case Element::Kind::X:
+    case Element::Kind::Y:
+    case Element::Kind::Z:
     case Element::Kind::Prototype:
     case Element::Kind::Images2D:
     case Element::Kind::Count:
@@ -440,6 +510,28 @@ namespace {
       }
     }
 
+    if (2 <= N && ctx.stack[N - 1]->kind == Element::Kind::Name && ctx.stack[N - 2]->kind == Element::Kind::VectorChild) {
+      ctx.stack[N - 2]->vectorChild.name = *text;
+      ctx.stack[N - 2]->vectorChild.hasName = true;
+    }
+
+    if (4 <= N && ctx.stack[N - 3]->kind == Element::Kind::Pose && ctx.stack[N - 4]->kind == Element::Kind::VectorChild) {
+      Pose& pose = ctx.stack[N - 4]->vectorChild.pose;
+      const Element::Kind parent = ctx.stack[N - 2]->kind;
+      const Element::Kind kind = ctx.stack[N - 1]->kind;
+      if (parent == Element::Kind::Rotation) {
+        if (kind == Element::Kind::W) { return parseNumber(pose.rotation[0], text); }
+        else if (kind == Element::Kind::X) { return parseNumber(pose.rotation[1], text); }
+        else if (kind == Element::Kind::Y) { return parseNumber(pose.rotation[2], text); }
+        else if (kind == Element::Kind::Z) { return parseNumber(pose.rotation[3], text); }
+      }
+      else if (parent == Element::Kind::Translation) {
+        if (kind == Element::Kind::X) { return parseNumber(pose.translation[0], text); }
+        else if (kind == Element::Kind::Y) { return parseNumber(pose.translation[1], text); }
+        else if (kind == Element::Kind::Z) { return parseNumber(pose.translation[2], text); }
+      }
+    }
+
     return true;
   }
 }
@@ -516,8 +608,8 @@ bool parseE57Xml(E57File* e57File, Logger logger, const char* xmlBytes, size_t x
           logError(ctx.logger, "Integer/scaled integer component min is larger than max");
           return false;
         }
-        int64_t diff = dstComp.integer.max - dstComp.integer.min;
-        dstComp.integer.bitWidth = std::bit_width(static_cast<uint64_t>(diff));
+        const uint64_t diff = static_cast<uint64_t>(dstComp.integer.max) - static_cast<uint64_t>(dstComp.integer.min);
+        dstComp.integer.bitWidth = static_cast<uint8_t>(std::bit_width(diff));
         break;
       }
       default:
@@ -4,36 +4,63 @@
 // Don't complain about fopen
 #define _CRT_SECURE_NO_WARNINGS
 
-#ifdef _WIN32
-
-#define WIN32_LEAN_AND_MEAN
-#define NOMINMAX
-#include <Windows.h>
-
-#else
-
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/mman.h>
-
-#endif
-
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
 #include <string>
+#include <vector>
+#include <memory>
 #include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <cinttypes>
+#include <bit>
+#include <chrono>
+#include <charconv>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <limits>
 
 #include "Common.h"
 #include "e57File.h"
+#include "e57Histogram.h"
+#include "e57Trace.h"
+#include "e57Writer.h"
+#include "e57VoxelFilter.h"
+#include "e57Octree.h"
+#include "MemoryMappedFile.h"
 
 namespace {
 
   size_t logLevel = 2;
 
+  const char* componentRoleNames[] = {
+    "cartesianX",
+    "cartesianY",
+    "cartesianZ",
+    "sphericalRange",
+    "sphericalAzimuth",
+    "sphericalElevation",
+    "rowIndex",
+    "columnIndex",
+    "returnCount",
+    "returnIndex",
+    "timeStamp",
+    "intensity",
+    "colorRed",
+    "colorGreen",
+    "colorBlue",
+    "cartesianInvalidState",
+    "sphericalInvalidState",
+    "isTimeStampInvalid",
+    "isIntensityInvalid",
+    "isColorInvalid"
+  };
+  static_assert(sizeof(componentRoleNames) == sizeof(componentRoleNames[0]) * static_cast<size_t>(Component::Role::Count));
+
   void logger(size_t level, const char* msg, va_list arg)
   {
     if (level < logLevel) {
@@ -59,196 +86,2417 @@ namespace {
 
   using ProcessFileFunc = std::function<bool(const char* ptr, size_t size)>;
 
-#ifdef _WIN32
-  struct MemoryMappedFile
+  // Inserts -<suffix> in front of the file extension of path.
+  std::string suffixedPath(const std::string& path, const std::string& suffix)
+  {
+    std::string rv(path);
+    size_t dot = rv.find_last_of('.');
+    size_t sep = rv.find_last_of("/\\");
+    if (dot == std::string::npos || (sep != std::string::npos && dot < sep)) {
+      dot = rv.size();
+    }
+    rv.insert(dot, "-" + suffix);
+    return rv;
+  }
+
+  // Inserts -<index> in front of the file extension of path.
+  std::string pointSetPath(const char* path, size_t pointSetIndex)
+  {
+    return suffixedPath(path, std::to_string(pointSetIndex));
+  }
+
+  const Component* findComponent(const Points& pts, Component::Role role)
+  {
+    for (size_t i = 0; i < pts.components.size; i++) {
+      if (pts.components[i].role == role) {
+        return &pts.components[i];
+      }
+    }
+    return nullptr;
+  }
+
+  // Narrowest type that holds the values of a component without loss.
+  ComponentWriteDesc::Type nativeWriteType(const Component& comp)
+  {
+    switch (comp.type) {
+    case Component::Type::Float:
+      return ComponentWriteDesc::Type::Float;
+    case Component::Type::Integer:
+      if (0 <= comp.integer.min && comp.integer.max <= 0xFF) return ComponentWriteDesc::Type::UInt8;
+      if (0 <= comp.integer.min && comp.integer.max <= 0xFFFF) return ComponentWriteDesc::Type::UInt16;
+      if (INT32_MIN <= comp.integer.min && comp.integer.max <= INT32_MAX) return ComponentWriteDesc::Type::Int32;
+      return ComponentWriteDesc::Type::Double;
+    default:
+      return ComponentWriteDesc::Type::Double;
+    }
+  }
+
+  // Narrowest type that holds the values of both types without loss.
+  ComponentWriteDesc::Type widerWriteType(ComponentWriteDesc::Type a, ComponentWriteDesc::Type b)
+  {
+    using Type = ComponentWriteDesc::Type;
+    if (a == b) return a;
+    if (a == Type::Double || b == Type::Double) return Type::Double;
+    if (a == Type::Float || b == Type::Float) return a == Type::Int32 || b == Type::Int32 ? Type::Double : Type::Float;
+    if (a == Type::Int32 || b == Type::Int32) return Type::Int32;
+    return Type::UInt16;
+  }
+
+  // A file that the writers of several point sets decoded in parallel write into.
+  //
+  // Writers with fixed size records write at offsets given by the point set order, so the
+  // result does not depend on the order in which point sets finish. Others append chunks
+  // of whole records, so the point sets are interleaved in the order they are decoded.
+  struct SharedOutput
+  {
+    FILE* file = nullptr;
+    uint64_t position = 0;
+    std::mutex mutex;
+
+    bool open(const char* path, const char* mode)
+    {
+      file = std::fopen(path, mode);
+      if (!file) {
+        logError(logger, "Failed to open '%s' for writing\n", path);
+        return false;
+      }
+      return true;
+    }
+
+    bool writeAt(uint64_t offset, const void* data, size_t size)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (offset != position && !seekFile(file, offset)) {
+        logError(logger, "Failed to seek to offset %" PRIu64, offset);
+        return false;
+      }
+      position = offset;
+      if (std::fwrite(data, 1, size, file) != size) {
+        logError(logger, "Failed to write %zu bytes", size);
+        return false;
+      }
+      position += size;
+      return true;
+    }
+
+    bool append(const void* data, size_t size)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (std::fwrite(data, 1, size, file) != size) {
+        logError(logger, "Failed to write %zu bytes", size);
+        return false;
+      }
+      position += size;
+      return true;
+    }
+
+    bool close()
+    {
+      bool ok = true;
+      if (file) {
+        if (std::ferror(file) || std::fclose(file) != 0) {
+          logError(logger, "Failed to write merged output");
+          ok = false;
+        }
+        file = nullptr;
+      }
+      return ok;
+    }
+  };
+
+  // Voxel grid downsampling applied by the pts, PLY, LAS and E57 writers, a voxel size
+  // of zero disables it. Each point set is filtered on its own, with its own budget.
+  struct VoxelSettings
   {
-    MemoryMappedFile(const char* path)
+    double size = 0.0;
+    VoxelFilter::Mode mode = VoxelFilter::Mode::First;
+    size_t memoryBudget = 0;
+
+    bool enabled() const { return 0.0 < size; }
+
+    // Puts the filter between the decoder and the consume callback of args.
+    bool setup(VoxelFilter& filter, const std::vector<ComponentWriteDesc>& writeDescs, const VoxelFilter::Axis(&axes)[3], ReadPointsArgs& args) const
     {
-      h = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-      if (h == INVALID_HANDLE_VALUE) {
-        logError(logger, "CreateFileA returned INVALID_HANDLE_VALUE");
-        return;
+      if (!filter.init(logger, View<const ComponentWriteDesc>(writeDescs.data(), writeDescs.size()), axes, size, mode, memoryBudget)) {
+        return false;
       }
-      DWORD hiSize;
-      DWORD loSize = GetFileSize(h, &hiSize);
-      size = (size_t(hiSize) << 32u) + loSize;
+      args.consumeCallback = VoxelFilter::consumeCallback;
+      args.consumeCallbackData = &filter;
+      return true;
+    }
+  };
+
+  // Passes the points kept by the voxel filter of a writer on to the writer, using the
+  // first of its batch buffers, after telling it how many there are.
+  template<typename Writer>
+  bool emitVoxels(VoxelFilter& filter, Writer& writer, ConsumePointsCallback consume)
+  {
+    uint64_t pointCount = 0;
+    if (!filter.finish(pointCount)) {
+      return false;
+    }
+    writer.setPointCount(pointCount);
+    return filter.emit(consume, &writer, writer.buffer.data(), writer.pointCapacity);
+  }
+
+  // Range of values of a component as declared in the XML, after scale and offset.
+  void declaredRange(const Component& comp, double& lo, double& hi)
+  {
+    if (comp.type == Component::Type::Integer) {
+      lo = static_cast<double>(comp.integer.min);
+      hi = static_cast<double>(comp.integer.max);
+    }
+    else if (comp.type == Component::Type::ScaledInteger) {
+      lo = comp.integer.scale * static_cast<double>(comp.integer.min) + comp.integer.offset;
+      hi = comp.integer.scale * static_cast<double>(comp.integer.max) + comp.integer.offset;
+    }
+    else {
+      lo = comp.real.min;
+      hi = comp.real.max;
+    }
+  }
+
+  void declaredRange(const Component& comp, float& lo, float& hi)
+  {
+    double l, h;
+    declaredRange(comp, l, h);
+    lo = static_cast<float>(l);
+    hi = static_cast<float>(h);
+  }
 
-      m = CreateFileMappingA(h, 0, PAGE_READONLY, 0, 0, NULL);
-      if (m == INVALID_HANDLE_VALUE) {
-        logError(logger, "CreateFileMappingA returned INVALID_HANDLE_VALUE");
-        return;
+  // Longest fixed notation of a float: sign, 39 integer digits, point and decimals.
+  constexpr size_t maxFixedLength(size_t precision) { return 1 + 39 + 1 + precision; }
+
+  // Same text as printf's %.<precision>f, but without the locale and stream overhead.
+  char* formatFixed(char* dst, char* end, float value, int precision)
+  {
+    std::to_chars_result result = std::to_chars(dst, end, value, std::chars_format::fixed, precision);
+    assert(result.ec == std::errc());
+    return result.ptr;
+  }
+
+  // Maps a decoded value to an integer in [lo, hi], rounding to nearest.
+  int quantize(float value, float scale, float bias, int lo, int hi)
+  {
+    float v = std::floor(scale * value + bias + 0.5f);
+    return !(static_cast<float>(lo) < v) ? lo : (static_cast<float>(hi) < v ? hi : static_cast<int>(v));
+  }
+
+  // Columns of a pts line, x y z optionally followed by intensity and r g b. Points are
+  // consecutive floats in the same order.
+  struct PtsColumns
+  {
+    bool intensity = false;
+    bool color = false;
+    int precision = 6;
+
+    // Maps decoded intensity to [-2048, 2047] and colors to [0, 255].
+    float intensityScale = 1.f;
+    float intensityBias = 0.f;
+    float colorScale[3] = { 1.f, 1.f, 1.f };
+    float colorBias[3] = { 0.f, 0.f, 0.f };
+
+    size_t floats() const { return 3 + (intensity ? 1 : 0) + (color ? 3 : 0); }
+
+    // Intensity takes at most 6 bytes with its separator, a color 4.
+    size_t maxLineLength() const { return 3 * (maxFixedLength(precision) + 1) + (intensity ? 6 : 0) + (color ? 3 * 4 : 0); }
+  };
+
+  // Formats count points as lines of text, dst must have room for count lines of
+  // columns.maxLineLength() bytes.
+  char* formatPoints(char* dst, const float* ptr, size_t count, const PtsColumns& columns)
+  {
+    const int precision = columns.precision;
+    const size_t maxValue = maxFixedLength(precision);
+    const size_t stride = columns.floats();
+    for (size_t i = 0; i < count; i++, ptr += stride) {
+      dst = formatFixed(dst, dst + maxValue, ptr[0], precision);
+      *dst++ = ' ';
+      dst = formatFixed(dst, dst + maxValue, ptr[1], precision);
+      *dst++ = ' ';
+      dst = formatFixed(dst, dst + maxValue, ptr[2], precision);
+      size_t k = 3;
+      if (columns.intensity) {
+        *dst++ = ' ';
+        dst = std::to_chars(dst, dst + 5, quantize(ptr[k++], columns.intensityScale, columns.intensityBias, -2048, 2047)).ptr;
+      }
+      if (columns.color) {
+        for (size_t c = 0; c < 3; c++) {
+          *dst++ = ' ';
+          dst = std::to_chars(dst, dst + 3, quantize(ptr[k++], columns.colorScale[c], columns.colorBias[c], 0, 255)).ptr;
+        }
+      }
+      *dst++ = '\n';
+    }
+    return dst;
+  }
 
+  // Threads that run the slices of jobs submitted from any thread.
+  //
+  // The submitting thread works on the slices of its own job too, so a pool of n
+  // threads gives a job n + 1 threads.
+  struct WorkerPool
+  {
+    struct Job
+    {
+      const std::function<void(size_t)>* func = nullptr;
+      size_t sliceCount = 0;
+      size_t slicesStarted = 0;
+      size_t slicesDone = 0;
+    };
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Job*> jobs;    // Jobs with slices not yet started.
+    bool stop = false;
+
+    explicit WorkerPool(size_t threadCount)
+    {
+      for (size_t i = 0; i < threadCount; i++) {
+        threads.emplace_back([this]() { worker(); });
       }
-      assert(m);
+    }
 
-      ptr = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
-      if (ptr == nullptr) {
-        logError(logger, "MapViewOfFile returned INVALID_HANDLE_VALUE");
-        return;
+    ~WorkerPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+      }
+      cond.notify_all();
+      for (std::thread& thread : threads) {
+        thread.join();
       }
-      good = true;
     }
 
-    ~MemoryMappedFile()
+    // Starts the next slice of job, must hold the lock. Returns when the slice is done.
+    void runSlice(std::unique_lock<std::mutex>& lock, Job& job)
     {
-      if (ptr != nullptr) {
-        UnmapViewOfFile(ptr);
-        ptr = nullptr;
+      size_t slice = job.slicesStarted++;
+      if (job.slicesStarted == job.sliceCount) {
+        jobs.erase(std::find(jobs.begin(), jobs.end(), &job));
       }
-      if (m != INVALID_HANDLE_VALUE) {
-        CloseHandle(m);
-        m = INVALID_HANDLE_VALUE;
+      lock.unlock();
+      (*job.func)(slice);
+      lock.lock();
+      if (++job.slicesDone == job.sliceCount) {
+        cond.notify_all();
       }
-      if (h != INVALID_HANDLE_VALUE) {
-        CloseHandle(h);
-        h = INVALID_HANDLE_VALUE;
+    }
+
+    void worker()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        cond.wait(lock, [this]() { return stop || !jobs.empty(); });
+        if (stop) break;
+        runSlice(lock, *jobs.front());
       }
     }
 
-    HANDLE h = INVALID_HANDLE_VALUE;
-    HANDLE m = INVALID_HANDLE_VALUE;
-    void* ptr = nullptr;
-    size_t size = 0;
-    bool good = false;
+    // Runs func(0) to func(sliceCount - 1) and returns when all have finished.
+    void run(size_t sliceCount, const std::function<void(size_t)>& func)
+    {
+      Job job{ .func = &func, .sliceCount = sliceCount };
+      std::unique_lock<std::mutex> lock(mutex);
+      jobs.push_back(&job);
+      cond.notify_all();
+      while (job.slicesStarted < job.sliceCount) {
+        runSlice(lock, job);
+      }
+      cond.wait(lock, [&job]() { return job.slicesDone == job.sliceCount; });
+    }
   };
-#else
-  struct MemoryMappedFile
+
+  struct PtsWriter
   {
-    MemoryMappedFile(const char* path)
+    // Text is formatted into a buffer of this size that is written out when full.
+    static constexpr size_t TextBufferSize = size_t(4) << 20;
+
+    std::vector<ComponentWriteDesc> writeDescs;
+    Buffer<char> buffer;
+    Buffer<char> text;
+    size_t textFill = 0;
+    size_t pointCapacity = 0;
+    size_t bufferCount = 1;
+    PtsColumns columns;
+    FILE* file = nullptr;
+    SharedOutput* shared = nullptr;   // If set, text is appended to this instead of file.
+
+    // If set, large batches are split into slices that are formatted concurrently into
+    // separate buffers, which are written in order.
+    WorkerPool* pool = nullptr;
+    std::vector<std::vector<char>> sliceTexts;
+    std::vector<size_t> sliceSizes;
+    VoxelFilter voxelFilter;
+
+    const Component* addComponent(const Points& pts, Component::Role role)
+    {
+      for (size_t i = 0; i < pts.components.size; i++) {
+        if (pts.components[i].role == role) {
+          writeDescs.push_back({
+            .offset = writeDescs.size() * sizeof(float),
+            .stride = columns.floats() * sizeof(float),
+            .type = ComponentWriteDesc::Type::Float,
+            .stream = static_cast<uint32_t>(i) });
+          return &pts.components[i];
+        }
+      }
+      return nullptr;
+    }
+
+    bool init(const char* path, const E57File* e57, size_t pointSetIndex, size_t batchSize)
     {
-      fd = open(path, O_RDONLY);
-      if (fd == -1) {
-        logError(logger, "%s: open failed: %s", path, strerror(errno));
-        return;
+      const Points& pts = e57->points[pointSetIndex];
+
+      text.accommodate(std::max(TextBufferSize, 2 * maxLineLength()));
+      if (!shared) {
+        file = std::fopen(path, "w");
+        if (!file) {
+          logError(logger, "Failed to open '%s' for writing\n", path);
+          return false;
+        }
+        std::setvbuf(file, nullptr, _IONBF, 0);
+
+        char* dst = std::to_chars(text.data(), text.data() + text.size(), pts.recordCount).ptr;
+        *dst++ = '\n';
+        textFill = dst - text.data();
+      }
+
+      if (!addComponent(pts, Component::Role::CartesianX)) {
+        logError(logger, "No cartesian X component");
+        return false;
+      }
+      if (!addComponent(pts, Component::Role::CartesianY)) {
+        logError(logger, "No cartesian Y component");
+        return false;
+      }
+      if (!addComponent(pts, Component::Role::CartesianZ)) {
+        logError(logger, "No cartesian Z component");
+        return false;
+      }
+      if (columns.intensity) {
+        const Component* comp = addComponent(pts, Component::Role::Intensity);
+        if (!comp) {
+          logError(logger, "No intensity component");
+          return false;
+        }
+        float lo, hi;
+        declaredRange(*comp, lo, hi);
+        columns.intensityScale = lo < hi ? 4095.f / (hi - lo) : 0.f;
+        columns.intensityBias = -2048.f - columns.intensityScale * lo;
+      }
+      if (columns.color) {
+        const Component::Role roles[3] = { Component::Role::ColorRed, Component::Role::ColorGreen, Component::Role::ColorBlue };
+        for (size_t c = 0; c < 3; c++) {
+          const Component* comp = addComponent(pts, roles[c]);
+          if (!comp) {
+            logError(logger, "No color components");
+            return false;
+          }
+          float lo, hi;
+          declaredRange(*comp, lo, hi);
+          columns.colorScale[c] = lo < hi ? 255.f / (hi - lo) : 0.f;
+          columns.colorBias[c] = -columns.colorScale[c] * lo;
+        }
       }
+      assert(writeDescs.size() == columns.floats());
 
-      struct stat stat {};
-      if (fstat(fd, &stat) != 0) {
-        logError(logger, "%s: fstat failed: %s", path, strerror(errno));
-        return;
+      const size_t bytesPerPoint = columns.floats() * sizeof(float);
+      pointCapacity = batchSize ? batchSize : suggestE57BatchSize(e57, logger, pointSetIndex, bytesPerPoint);
+      if (pointCapacity == 0) {
+        return false;
       }
-      size = stat.st_size;
+      buffer.accommodate(bufferCount * pointCapacity * bytesPerPoint);
+      return true;
+    }
 
-#ifdef __linux__
-      ptr = mmap(nullptr, stat.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
-#else
-      ptr = mmap(nullptr, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-#endif
-      if (ptr == MAP_FAILED) {
-        logError(logger, "%s: mmap failed: %s", path, strerror(errno));
-        return;
+    size_t maxLineLength() const { return columns.maxLineLength(); }
+
+    // Replaces the point count of the header, which is still all there is in the text buffer.
+    void setPointCount(uint64_t pointCount)
+    {
+      if (!shared) {
+        char* dst = std::to_chars(text.data(), text.data() + text.size(), pointCount).ptr;
+        *dst++ = '\n';
+        textFill = dst - text.data();
       }
+    }
 
-      if (madvise(ptr, stat.st_size, MADV_SEQUENTIAL) != 0) {
-        logError(logger, "%s: madvise(MADV_SEQUENTIAL) failed: %s", path, strerror(errno));
-        return;
+    bool writeText(const char* data, size_t size)
+    {
+      if (size == 0) {
+        return true;
       }
-      good = true;
+      if (shared) {
+        return shared->append(data, size);
+      }
+      if (std::fwrite(data, 1, size, file) != size) {
+        logError(logger, "Failed to write %zu bytes of text", size);
+        return false;
+      }
+      return true;
     }
 
-    ~MemoryMappedFile()
+    bool flush()
+    {
+      size_t size = textFill;
+      textFill = 0;
+      return writeText(text.data(), size);
+    }
+
+    bool destroy()
     {
-      if (ptr != MAP_FAILED) {
-        if (munmap(ptr, size) != 0) {
-          logError(logger, "munmap failed: %s", strerror(errno));
+      bool ok = true;
+      if (shared) {
+        ok = flush();
+        shared = nullptr;
+      }
+      else if (file) {
+        ok = flush();
+        if (std::fclose(file) != 0) {
+          logError(logger, "Failed to close file");
+          ok = false;
         }
-        ptr = MAP_FAILED;
+        file = nullptr;
       }
-      if (fd != -1) {
-        close(fd);
-        fd = -1;
+      return ok;
+    }
+
+    bool formatSerial(const float* ptr, size_t pointCount)
+    {
+      const size_t maxLine = maxLineLength();
+      while (pointCount) {
+        size_t count = std::min(pointCount, (text.size() - textFill) / maxLine);
+        if (count == 0) {
+          if (!flush()) {
+            return false;
+          }
+          continue;
+        }
+        textFill = formatPoints(text.data() + textFill, ptr, count, columns) - text.data();
+        ptr += columns.floats() * count;
+        pointCount -= count;
       }
+      return true;
     }
 
-    void* ptr = nullptr;
-    size_t size = 0;
-    int fd = -1;
-    bool good = false;
-  };
-#endif
+    bool formatParallel(const float* ptr, size_t pointCount, size_t sliceCount)
+    {
+      if (!flush()) {
+        return false;
+      }
+
+      const size_t slicePoints = (pointCount + sliceCount - 1) / sliceCount;
+      if (sliceTexts.size() < sliceCount) {
+        sliceTexts.resize(sliceCount);
+        sliceSizes.resize(sliceCount);
+      }
+      std::function<void(size_t)> formatSlice = [&](size_t slice) {
+        size_t first = std::min(pointCount, slice * slicePoints);
+        size_t count = std::min(pointCount - first, slicePoints);
+        std::vector<char>& sliceText = sliceTexts[slice];
+        if (sliceText.size() < count * maxLineLength()) {
+          sliceText.resize(count * maxLineLength());
+        }
+        sliceSizes[slice] = formatPoints(sliceText.data(), ptr + columns.floats() * first, count, columns) - sliceText.data();
+      };
+      pool->run(sliceCount, formatSlice);
+
+      for (size_t slice = 0; slice < sliceCount; slice++) {
+        if (!writeText(sliceTexts[slice].data(), sliceSizes[slice])) {
+          return false;
+        }
+      }
+      return true;
+    }
 
+    static bool consumeCallback(void* data, char* batch, size_t pointCount)
+    {
+      // Splitting is not worth it for slices smaller than this.
+      constexpr size_t MinSlicePoints = 1024;
 
+      PtsWriter* that = reinterpret_cast<PtsWriter*>(data);
+      const float* ptr = reinterpret_cast<const float*>(batch);
+      size_t sliceCount = 1;
+      if (that->pool) {
+        sliceCount = std::min(that->pool->threads.size() + 1, pointCount / MinSlicePoints);
+      }
+      if (sliceCount <= 1) {
+        return that->formatSerial(ptr, pointCount);
+      }
+      return that->formatParallel(ptr, pointCount, sliceCount);
+    }
+  };
 
-  View<const char> memoryMappedFileCallback(void* callbackData, uint64_t offset, uint64_t size)
+  // Writes each of a set of point sets to its own pts file, driven by readE57PointSets.
+  //
+  // If merge is set, the point sets are instead written into one file. Lines have no
+  // fixed length, so chunks of lines are appended in the order they are formatted.
+  struct PtsPointSetsWriter
   {
-    const MemoryMappedFile* mappedFile = static_cast<const MemoryMappedFile*>(callbackData);
-    if (!mappedFile->good || mappedFile->size < offset || mappedFile->size < offset + size) {
-      return View<const char>(nullptr, 0);
+    const E57File* e57 = nullptr;
+    const char* path = nullptr;
+    bool multiple = false;
+    bool merge = false;
+    size_t pipelineDepth = 1;
+    size_t batchSize = 0;
+    PtsColumns columns;
+    VoxelSettings voxel;
+    WorkerPool* pool = nullptr;
+    std::vector<PtsWriter> writers;
+    std::atomic<bool> failed{ false };
+    SharedOutput merged;
+
+    // Opens the merged file and writes the total point count.
+    bool beginMerge(const std::vector<size_t>& pointSets)
+    {
+      if (!merged.open(path, "w")) {
+        return false;
+      }
+      uint64_t pointCount = 0;
+      for (size_t index : pointSets) {
+        pointCount += e57->points[index].recordCount;
+      }
+      const std::string header = std::to_string(pointCount) + "\n";
+      return merged.append(header.data(), header.size());
+    }
+
+    static bool setupCallback(void* data, ReadPointsArgs& args)
+    {
+      PtsPointSetsWriter* that = reinterpret_cast<PtsPointSetsWriter*>(data);
+      PtsWriter& writer = that->writers[args.pointSetIndex];
+
+      std::string path = that->multiple ? pointSetPath(that->path, args.pointSetIndex) : std::string(that->path);
+      writer.bufferCount = that->pipelineDepth;
+      writer.columns = that->columns;
+      writer.pool = that->pool;
+      writer.shared = that->merge ? &that->merged : nullptr;
+      if (!writer.init(path.c_str(), that->e57, args.pointSetIndex, that->batchSize)) {
+        return false;
+      }
+      args.buffer = View<char>(writer.buffer.data(), writer.buffer.size());
+      args.writeDesc = View<const ComponentWriteDesc>(writer.writeDescs.data(), writer.writeDescs.size());
+      args.consumeCallback = PtsWriter::consumeCallback;
+      args.consumeCallbackData = &writer;
+      args.pointCapacity = writer.pointCapacity;
+      args.bufferCount = writer.bufferCount;
+      if (that->voxel.enabled()) {
+        const VoxelFilter::Axis axes[3] = { { .field = 0 }, { .field = 1 }, { .field = 2 } };
+        return that->voxel.setup(writer.voxelFilter, writer.writeDescs, axes, args);
+      }
+      return true;
     }
-    return View<const char>((const char*)mappedFile->ptr + static_cast<size_t>(offset), size);
-  }
 
- 
+    static void finishCallback(void* data, size_t pointSetIndex, bool success)
+    {
+      PtsPointSetsWriter* that = reinterpret_cast<PtsPointSetsWriter*>(data);
+      PtsWriter& writer = that->writers[pointSetIndex];
+      if (success && that->voxel.enabled() && !emitVoxels(writer.voxelFilter, writer, PtsWriter::consumeCallback)) {
+        that->failed = true;
+      }
+      if (!writer.destroy()) {
+        that->failed = true;
+      }
+      logDebug(logger, "Point set %zu: %s", pointSetIndex, success ? "done" : "failed");
+    }
+  };
 
-  struct PtsWriter
+  // Writes a point set as binary little endian PLY.
+  //
+  // Components map to vertex properties in their native width, and batches are decoded
+  // directly in the vertex layout, so they are written to the file as they are.
+  struct PlyWriter
   {
+    struct Property
+    {
+      Component::Role role;
+      const char* name;
+      ComponentWriteDesc::Type type;
+    };
+
     std::vector<ComponentWriteDesc> writeDescs;
+    std::vector<Property> properties;
     Buffer<char> buffer;
-    size_t pointCapacity = 5;
+    size_t pointCapacity = 0;
+    size_t bufferCount = 1;
+    size_t vertexSize = 0;
     FILE* file = nullptr;
+    SharedOutput* shared = nullptr;   // If set, vertices are written to this at outputOffset instead of file.
+    uint64_t outputOffset = 0;
+    uint64_t vertexCount = 0;
+    bool headerPending = false;       // The header is written with the first vertices, when the count is final.
+    VoxelFilter voxelFilter;
 
-    bool addComponent(const Points& pts, size_t index, Component::Role role)
+    static const char* plyTypeName(ComponentWriteDesc::Type type)
     {
-      for (size_t i = 0; pts.components.size; i++) {
-        if (pts.components[i].role == role) {
-          writeDescs.push_back({
-            .offset = index * sizeof(float),
-            .stride = 3 * sizeof(float),
-            .type = ComponentWriteDesc::Type::Float,
-            .stream = static_cast<uint32_t>(i) });
-          return true;
+      switch (type) {
+      case ComponentWriteDesc::Type::Float:  return "float";
+      case ComponentWriteDesc::Type::Double: return "double";
+      case ComponentWriteDesc::Type::UInt8:  return "uchar";
+      case ComponentWriteDesc::Type::UInt16: return "ushort";
+      case ComponentWriteDesc::Type::Int32:  return "int";
+      default:
+        assert(false);
+        return "";
+      }
+    }
+
+    // Vertex properties of a point set in the native widths of the components.
+    static bool nativeProperties(std::vector<Property>& output, const Points& pts)
+    {
+      const Property candidates[] = {
+        { Component::Role::CartesianX, "x" },
+        { Component::Role::CartesianY, "y" },
+        { Component::Role::CartesianZ, "z" },
+        { Component::Role::Intensity, "intensity" },
+        { Component::Role::ColorRed, "red" },
+        { Component::Role::ColorGreen, "green" },
+        { Component::Role::ColorBlue, "blue" }
+      };
+      output.clear();
+      for (const Property& candidate : candidates) {
+        if (const Component* comp = findComponent(pts, candidate.role); comp) {
+          output.push_back({ candidate.role, candidate.name, nativeWriteType(*comp) });
+        }
+      }
+
+      size_t cartesian = 0;
+      size_t color = 0;
+      for (const Property& property : output) {
+        switch (property.role) {
+        case Component::Role::CartesianX:
+        case Component::Role::CartesianY:
+        case Component::Role::CartesianZ:
+          cartesian++;
+          break;
+        case Component::Role::ColorRed:
+        case Component::Role::ColorGreen:
+        case Component::Role::ColorBlue:
+          color++;
+          break;
+        default:
+          break;
+        }
+      }
+      if (cartesian != 3) {
+        logError(logger, "No cartesian components");
+        return false;
+      }
+      if (color != 0 && color != 3) {
+        logError(logger, "Incomplete color components");
+        return false;
+      }
+      return true;
+    }
+
+    static std::string header(uint64_t vertexCount, const std::vector<Property>& properties)
+    {
+      std::string rv = "ply\nformat binary_little_endian 1.0\ncomment written by e57parser\nelement vertex " + std::to_string(vertexCount) + "\n";
+      for (const Property& property : properties) {
+        rv += std::string("property ") + plyTypeName(property.type) + " " + property.name + "\n";
+      }
+      rv += "end_header\n";
+      return rv;
+    }
+
+    // If layout is set, it gives the properties, otherwise the native properties of the
+    // point set are used. The file is not opened when writing to a shared output.
+    bool init(const char* path, const E57File* e57, size_t pointSetIndex, size_t batchSize, const std::vector<Property>* layout = nullptr)
+    {
+      const Points& pts = e57->points[pointSetIndex];
+
+      if (layout) {
+        properties = *layout;
+      }
+      else if (!nativeProperties(properties, pts)) {
+        return false;
+      }
+      for (const Property& property : properties) {
+        const Component* comp = findComponent(pts, property.role);
+        if (!comp) {
+          logError(logger, "Point set %zu has no %s component", pointSetIndex, property.name);
+          return false;
+        }
+        writeDescs.push_back({
+          .offset = vertexSize,
+          .type = property.type,
+          .stream = static_cast<uint32_t>(comp - pts.components.data) });
+        vertexSize += ComponentWriteDesc::typeSize(property.type);
+      }
+      for (ComponentWriteDesc& writeDesc : writeDescs) {
+        writeDesc.stride = vertexSize;
+      }
+
+      pointCapacity = batchSize ? batchSize : suggestE57BatchSize(e57, logger, pointSetIndex, vertexSize);
+      if (pointCapacity == 0) {
+        return false;
+      }
+      buffer.accommodate(bufferCount * pointCapacity * vertexSize);
+
+      if (!shared) {
+        file = std::fopen(path, "wb");
+        if (!file) {
+          logError(logger, "Failed to open '%s' for writing\n", path);
+          return false;
         }
+        vertexCount = pts.recordCount;
+        headerPending = true;
+      }
+      return true;
+    }
+
+    void setPointCount(uint64_t pointCount) { vertexCount = pointCount; }
+
+    bool writeHeader()
+    {
+      headerPending = false;
+      const std::string text = header(vertexCount, properties);
+      if (std::fwrite(text.data(), 1, text.size(), file) != text.size()) {
+        logError(logger, "Failed to write PLY header");
+        return false;
+      }
+      return true;
+    }
+
+    bool destroy()
+    {
+      bool ok = true;
+      shared = nullptr;
+      if (file) {
+        if (headerPending && !writeHeader()) {
+          ok = false;
+        }
+        if (std::ferror(file) || std::fclose(file) != 0) {
+          logError(logger, "Failed to write PLY file");
+          ok = false;
+        }
+        file = nullptr;
+      }
+      return ok;
+    }
+
+    static bool consumeCallback(void* data, char* batch, size_t pointCount)
+    {
+      static_assert(std::endian::native == std::endian::little);
+      PlyWriter* that = reinterpret_cast<PlyWriter*>(data);
+      if (that->shared) {
+        const size_t size = that->vertexSize * pointCount;
+        if (!that->shared->writeAt(that->outputOffset, batch, size)) {
+          return false;
+        }
+        that->outputOffset += size;
+        return true;
+      }
+      if (that->headerPending && !that->writeHeader()) {
+        return false;
+      }
+      if (std::fwrite(batch, that->vertexSize, pointCount, that->file) != pointCount) {
+        logError(logger, "Failed to write %zu vertices", pointCount);
+        return false;
+      }
+      return true;
+    }
+  };
+
+  // Writes each of a set of point sets to its own PLY file, driven by readE57PointSets.
+  //
+  // If merge is set, the point sets are instead written into one file, in the order they
+  // are listed, with the properties they have in common in the widest of their types.
+  struct PlyPointSetsWriter
+  {
+    const E57File* e57 = nullptr;
+    const char* path = nullptr;
+    bool multiple = false;
+    bool merge = false;
+    size_t pipelineDepth = 1;
+    size_t batchSize = 0;
+    VoxelSettings voxel;
+    std::vector<PlyWriter> writers;
+    std::atomic<bool> failed{ false };
+    std::vector<PlyWriter::Property> layout;
+    std::vector<uint64_t> outputOffsets;
+    SharedOutput merged;
+
+    // Finds the common layout, writes the header and places each point set after the
+    // point sets before it.
+    bool beginMerge(const std::vector<size_t>& pointSets)
+    {
+      for (size_t k = 0; k < pointSets.size(); k++) {
+        std::vector<PlyWriter::Property> properties;
+        if (!PlyWriter::nativeProperties(properties, e57->points[pointSets[k]])) {
+          return false;
+        }
+        if (k == 0) {
+          layout = properties;
+          continue;
+        }
+        for (size_t i = 0; i < layout.size();) {
+          auto it = std::find_if(properties.begin(), properties.end(), [&](const PlyWriter::Property& p) { return p.role == layout[i].role; });
+          if (it == properties.end()) {
+            logWarning(logger, "Point set %zu has no %s component, property is left out", pointSets[k], layout[i].name);
+            layout.erase(layout.begin() + i);
+          }
+          else {
+            layout[i].type = widerWriteType(layout[i].type, it->type);
+            i++;
+          }
+        }
+      }
+
+      // Color is only kept if it is complete.
+      size_t color = 0;
+      for (const PlyWriter::Property& property : layout) {
+        color += property.role == Component::Role::ColorRed || property.role == Component::Role::ColorGreen || property.role == Component::Role::ColorBlue;
+      }
+      if (color != 3) {
+        std::erase_if(layout, [](const PlyWriter::Property& p) {
+          return p.role == Component::Role::ColorRed || p.role == Component::Role::ColorGreen || p.role == Component::Role::ColorBlue; });
+      }
+
+      size_t vertexSize = 0;
+      for (const PlyWriter::Property& property : layout) {
+        vertexSize += ComponentWriteDesc::typeSize(property.type);
+      }
+      uint64_t vertexCount = 0;
+      for (size_t index : pointSets) {
+        vertexCount += e57->points[index].recordCount;
+      }
+
+      if (!merged.open(path, "wb")) {
+        return false;
+      }
+      const std::string text = PlyWriter::header(vertexCount, layout);
+      if (!merged.writeAt(0, text.data(), text.size())) {
+        return false;
+      }
+      outputOffsets.assign(e57->points.size, 0);
+      uint64_t offset = text.size();
+      for (size_t index : pointSets) {
+        outputOffsets[index] = offset;
+        offset += vertexSize * e57->points[index].recordCount;
+      }
+      return true;
+    }
+
+    static bool setupCallback(void* data, ReadPointsArgs& args)
+    {
+      PlyPointSetsWriter* that = reinterpret_cast<PlyPointSetsWriter*>(data);
+      PlyWriter& writer = that->writers[args.pointSetIndex];
+
+      std::string path = that->multiple ? pointSetPath(that->path, args.pointSetIndex) : std::string(that->path);
+      writer.bufferCount = that->pipelineDepth;
+      if (that->merge) {
+        writer.shared = &that->merged;
+        writer.outputOffset = that->outputOffsets[args.pointSetIndex];
+      }
+      if (!writer.init(path.c_str(), that->e57, args.pointSetIndex, that->batchSize, that->merge ? &that->layout : nullptr)) {
+        return false;
+      }
+      args.buffer = View<char>(writer.buffer.data(), writer.buffer.size());
+      args.writeDesc = View<const ComponentWriteDesc>(writer.writeDescs.data(), writer.writeDescs.size());
+      args.consumeCallback = PlyWriter::consumeCallback;
+      args.consumeCallbackData = &writer;
+      args.pointCapacity = writer.pointCapacity;
+      args.bufferCount = writer.bufferCount;
+      if (that->voxel.enabled()) {
+        const VoxelFilter::Axis axes[3] = { { .field = 0 }, { .field = 1 }, { .field = 2 } };
+        return that->voxel.setup(writer.voxelFilter, writer.writeDescs, axes, args);
+      }
+      return true;
+    }
+
+    static void finishCallback(void* data, size_t pointSetIndex, bool success)
+    {
+      PlyPointSetsWriter* that = reinterpret_cast<PlyPointSetsWriter*>(data);
+      PlyWriter& writer = that->writers[pointSetIndex];
+      if (success && that->voxel.enabled() && !emitVoxels(writer.voxelFilter, writer, PlyWriter::consumeCallback)) {
+        that->failed = true;
+      }
+      if (!writer.destroy()) {
+        that->failed = true;
+      }
+      logDebug(logger, "Point set %zu: %s", pointSetIndex, success ? "done" : "failed");
+    }
+  };
+
+  // Writes the components of a point set as one NumPy .npy array each.
+  //
+  // The files are created at full size from the record count and memory mapped, and the
+  // decoder writes values straight into the arrays via ComponentWriteDesc::pointSetBase,
+  // so batches are not copied anywhere. Values are stored in their native widths.
+  struct NpyWriter
+  {
+    std::vector<ComponentWriteDesc> writeDescs;
+    std::vector<std::unique_ptr<MemoryMappedFile>> files;
+    size_t pointCapacity = 0;
+
+    static const char* npyTypeName(ComponentWriteDesc::Type type)
+    {
+      switch (type) {
+      case ComponentWriteDesc::Type::Float:  return "<f4";
+      case ComponentWriteDesc::Type::Double: return "<f8";
+      case ComponentWriteDesc::Type::UInt8:  return "|u1";
+      case ComponentWriteDesc::Type::UInt16: return "<u2";
+      case ComponentWriteDesc::Type::Int32:  return "<i4";
+      default:
+        assert(false);
+        return "";
+      }
+    }
+
+    // Format version 1.0 header, padded with spaces so the data starts at a multiple of 64.
+    static std::string npyHeader(ComponentWriteDesc::Type type, uint64_t count)
+    {
+      std::string dict = std::string("{'descr': '") + npyTypeName(type) + "', 'fortran_order': False, 'shape': (" + std::to_string(count) + ",), }";
+      const size_t preambleSize = 10;
+      const size_t headerSize = (preambleSize + dict.size() + 1 + 63) & ~size_t(63);
+      dict.append(headerSize - preambleSize - dict.size() - 1, ' ');
+      dict.push_back('\n');
+
+      std::string rv("\x93NUMPY\x01\x00", 8);
+      rv.push_back(static_cast<char>(dict.size() & 0xFF));
+      rv.push_back(static_cast<char>(dict.size() >> 8));
+      return rv + dict;
+    }
+
+    bool init(const char* path, const E57File* e57, size_t pointSetIndex, uint32_t roleMask, size_t batchSize)
+    {
+      static_assert(std::endian::native == std::endian::little);
+      const Points& pts = e57->points[pointSetIndex];
+
+      size_t pointSize = 0;
+      uint32_t rolesAdded = 0;
+      for (size_t i = 0; i < pts.components.size; i++) {
+        const Component& comp = pts.components[i];
+        const uint32_t roleBit = 1u << static_cast<uint32_t>(comp.role);
+        if (!(roleMask & roleBit) || (rolesAdded & roleBit)) {
+          continue;
+        }
+        rolesAdded |= roleBit;
+
+        ComponentWriteDesc::Type type = nativeWriteType(comp);
+        size_t typeSize = ComponentWriteDesc::typeSize(type);
+        std::string header = npyHeader(type, pts.recordCount);
+        std::string componentPath = suffixedPath(path, componentRoleNames[static_cast<size_t>(comp.role)]);
+
+        if (static_cast<uint64_t>(SIZE_MAX - header.size()) / typeSize < pts.recordCount) {
+          logError(logger, "Point set too large to map '%s'", componentPath.c_str());
+          return false;
+        }
+        files.push_back(std::make_unique<MemoryMappedFile>(logger, componentPath.c_str(), header.size() + typeSize * pts.recordCount));
+        MemoryMappedFile& file = *files.back();
+        if (!file.good) {
+          return false;
+        }
+        char* ptr = static_cast<char*>(file.ptr);
+        std::memcpy(ptr, header.data(), header.size());
+
+        writeDescs.push_back({
+          .offset = 0,
+          .stride = typeSize,
+          .type = type,
+          .stream = static_cast<uint32_t>(i),
+          .pointSetBase = ptr + header.size() });
+        pointSize += typeSize;
+        logDebug(logger, "Writing %s to '%s'", componentRoleNames[static_cast<size_t>(comp.role)], componentPath.c_str());
+      }
+      if (writeDescs.empty()) {
+        logError(logger, "Point set %zu has none of the selected components", pointSetIndex);
+        return false;
+      }
+
+      pointCapacity = batchSize ? batchSize : suggestE57BatchSize(e57, logger, pointSetIndex, pointSize);
+      return pointCapacity != 0;
+    }
+
+    // Unmapping writes the arrays back to the files.
+    void destroy()
+    {
+      writeDescs.clear();
+      files.clear();
+    }
+  };
+
+  // Writes each of a set of point sets to its own set of .npy files, driven by readE57PointSets.
+  struct NpyPointSetsWriter
+  {
+    const E57File* e57 = nullptr;
+    const char* path = nullptr;
+    bool multiple = false;
+    uint32_t roleMask = ~0u;
+    size_t batchSize = 0;
+    std::vector<NpyWriter> writers;
+
+    static bool setupCallback(void* data, ReadPointsArgs& args)
+    {
+      NpyPointSetsWriter* that = reinterpret_cast<NpyPointSetsWriter*>(data);
+      NpyWriter& writer = that->writers[args.pointSetIndex];
+
+      std::string path = that->multiple ? pointSetPath(that->path, args.pointSetIndex) : std::string(that->path);
+      if (!writer.init(path.c_str(), that->e57, args.pointSetIndex, that->roleMask, that->batchSize)) {
+        return false;
+      }
+      args.writeDesc = View<const ComponentWriteDesc>(writer.writeDescs.data(), writer.writeDescs.size());
+      args.pointCapacity = writer.pointCapacity;
+      args.bufferCount = 1;
+      return true;
+    }
+
+    static void finishCallback(void* data, size_t pointSetIndex, bool success)
+    {
+      NpyPointSetsWriter* that = reinterpret_cast<NpyPointSetsWriter*>(data);
+      that->writers[pointSetIndex].destroy();
+      logDebug(logger, "Point set %zu: %s", pointSetIndex, success ? "done" : "failed");
+    }
+  };
+
+  // Writes a point set as LAS 1.4 with point data record format 0, 2, 6 or 7.
+  //
+  // Scaled integer coordinates whose integers fit in 32 bits are written with the scale
+  // and offset of the E57 component, so the integers pass through without a detour via
+  // floating point. Other coordinates are quantized to millimeters around the middle of
+  // their declared range. Records are assembled in a buffer that is written when full,
+  // and the header is written last, with the bounds of the records written.
+  struct LasWriter
+  {
+    static constexpr size_t HeaderSize = 375;
+    static constexpr size_t OutputBufferSize = size_t(1) << 20;
+
+    // Layout of a decoded point, coordinates are int32 when passed through.
+    static constexpr size_t CoordinateOffset = 0;   // Three 8 byte slots
+    static constexpr size_t IntensityOffset = 24;   // float
+    static constexpr size_t ColorOffset = 28;       // Three floats
+    static constexpr size_t TimeOffset = 40;        // double
+    static constexpr size_t PointStride = 48;
+
+    struct Axis
+    {
+      bool passthrough = false;
+      double scale = 0.001;
+      double offset = 0.0;
+      int32_t min = std::numeric_limits<int32_t>::max();
+      int32_t max = std::numeric_limits<int32_t>::min();
+    };
+
+    std::vector<ComponentWriteDesc> writeDescs;
+    Buffer<char> buffer;
+    Buffer<char> output;
+    size_t outputFill = 0;
+    size_t pointCapacity = 0;
+    size_t bufferCount = 1;
+    FILE* file = nullptr;
+    SharedOutput* shared = nullptr;   // If set, records are written to this at outputOffset instead of file.
+    uint64_t outputOffset = 0;
+
+    uint8_t format = 0;
+    size_t recordLength = 0;
+    Axis axes[3];
+    bool hasIntensity = false;
+    bool hasColor = false;
+    bool hasTime = false;
+    float intensityScale = 1.f;
+    float intensityBias = 0.f;
+    float colorScale[3] = { 1.f, 1.f, 1.f };
+    float colorBias[3] = { 0.f, 0.f, 0.f };
+    uint64_t pointsWritten = 0;
+    uint64_t pointsClamped = 0;
+    VoxelFilter voxelFilter;
+
+    const Component* addComponent(const Points& pts, Component::Role role, size_t offset, ComponentWriteDesc::Type type, bool unscaled = false)
+    {
+      for (size_t i = 0; i < pts.components.size; i++) {
+        if (pts.components[i].role == role) {
+          writeDescs.push_back({
+            .offset = offset,
+            .stride = PointStride,
+            .type = type,
+            .stream = static_cast<uint32_t>(i),
+            .unscaled = unscaled });
+          return &pts.components[i];
+        }
+      }
+      return nullptr;
+    }
+
+    static constexpr Component::Role CoordinateRoles[3] = { Component::Role::CartesianX, Component::Role::CartesianY, Component::Role::CartesianZ };
+    static constexpr Component::Role ColorRoles[3] = { Component::Role::ColorRed, Component::Role::ColorGreen, Component::Role::ColorBlue };
+    static constexpr size_t RecordLengths[8] = { 20, 0, 26, 0, 0, 0, 30, 36 };
+
+    // Scaled integer coordinates that fit in 32 bits keep their scale and offset, others
+    // are centered on their declared range.
+    static Axis nativeAxis(const Component& comp)
+    {
+      Axis axis;
+      if (comp.type == Component::Type::ScaledInteger && INT32_MIN <= comp.integer.min && comp.integer.max <= INT32_MAX) {
+        axis.passthrough = true;
+        axis.scale = comp.integer.scale;
+        axis.offset = comp.integer.offset;
+      }
+      else {
+        float lo, hi;
+        declaredRange(comp, lo, hi);
+        if (lo <= hi && std::abs(lo) < 1e15f && std::abs(hi) < 1e15f) {
+          axis.offset = std::floor(0.5 * (double(lo) + double(hi)));
+        }
+      }
+      return axis;
+    }
+
+    static uint8_t autoFormat(bool hasTime, bool hasColor)
+    {
+      return hasTime ? (hasColor ? 7 : 6) : (hasColor ? 2 : 0);
+    }
+
+    // Format is 0, 2, 6 or 7, or -1 to pick from the components present. If common is
+    // set, its format and coordinate axes are used instead, and the file is not opened
+    // when writing to a shared output.
+    bool init(const char* path, const E57File* e57, size_t pointSetIndex, int requestedFormat, size_t batchSize, const LasWriter* common = nullptr)
+    {
+      const Points& pts = e57->points[pointSetIndex];
+
+      for (size_t a = 0; a < 3; a++) {
+        const Component* comp = findComponent(pts, CoordinateRoles[a]);
+        if (!comp) {
+          logError(logger, "No cartesian components");
+          return false;
+        }
+
+        Axis& axis = axes[a];
+        axis = common ? Axis{ .passthrough = common->axes[a].passthrough, .scale = common->axes[a].scale, .offset = common->axes[a].offset } : nativeAxis(*comp);
+        const size_t offset = CoordinateOffset + 8 * a;
+        if (axis.passthrough) {
+          addComponent(pts, CoordinateRoles[a], offset, ComponentWriteDesc::Type::Int32, true);
+        }
+        else {
+          addComponent(pts, CoordinateRoles[a], offset, ComponentWriteDesc::Type::Double);
+        }
+      }
+
+      // Integer intensities in 16 bits are kept as is, others are mapped from their declared range.
+      if (const Component* comp = addComponent(pts, Component::Role::Intensity, IntensityOffset, ComponentWriteDesc::Type::Float); comp) {
+        hasIntensity = true;
+        if (comp->type != Component::Type::Integer || comp->integer.min < 0 || 0xFFFF < comp->integer.max) {
+          float lo, hi;
+          declaredRange(*comp, lo, hi);
+          intensityScale = lo < hi ? 65535.f / (hi - lo) : 0.f;
+          intensityBias = -intensityScale * lo;
+        }
+      }
+
+      for (size_t c = 0; c < 3; c++) {
+        const Component* comp = addComponent(pts, ColorRoles[c], ColorOffset + sizeof(float) * c, ComponentWriteDesc::Type::Float);
+        if (!comp) {
+          break;
+        }
+        float lo, hi;
+        declaredRange(*comp, lo, hi);
+        colorScale[c] = lo < hi ? 65535.f / (hi - lo) : 0.f;
+        colorBias[c] = -colorScale[c] * lo;
+        hasColor = c == 2;
+      }
+
+      hasTime = addComponent(pts, Component::Role::TimeStamp, TimeOffset, ComponentWriteDesc::Type::Double) != nullptr;
+
+      if (common) {
+        format = common->format;
+      }
+      else if (requestedFormat < 0) {
+        format = autoFormat(hasTime, hasColor);
+      }
+      else {
+        format = static_cast<uint8_t>(requestedFormat);
+      }
+      if ((format == 2 || format == 7) && !hasColor) {
+        logError(logger, "LAS point format %u requires color components", format);
+        return false;
+      }
+      recordLength = RecordLengths[format];
+
+      pointCapacity = batchSize ? batchSize : suggestE57BatchSize(e57, logger, pointSetIndex, PointStride);
+      if (pointCapacity == 0) {
+        return false;
+      }
+      buffer.accommodate(bufferCount * pointCapacity * PointStride);
+      output.accommodate(OutputBufferSize);
+
+      if (!shared) {
+        file = std::fopen(path, "wb");
+        if (!file) {
+          logError(logger, "Failed to open '%s' for writing\n", path);
+          return false;
+        }
+
+        // Reserve room for the header, it is written when the bounds are known.
+        std::memset(output.data(), 0, HeaderSize);
+        outputFill = HeaderSize;
+      }
+      logDebug(logger, "Point set %zu: LAS point format %u, coordinates passed through: %s %s %s", pointSetIndex, format,
+               axes[0].passthrough ? "x" : "-", axes[1].passthrough ? "y" : "-", axes[2].passthrough ? "z" : "-");
+      return true;
+    }
+
+    bool flush()
+    {
+      size_t size = outputFill;
+      outputFill = 0;
+      if (shared) {
+        outputOffset += size;
+        return size == 0 || shared->writeAt(outputOffset - size, output.data(), size);
+      }
+      if (size && std::fwrite(output.data(), 1, size, file) != size) {
+        logError(logger, "Failed to write %zu bytes", size);
+        return false;
+      }
+      return true;
+    }
+
+    // The header counts the points as they are written.
+    void setPointCount(uint64_t) {}
+
+    template<typename T>
+    static void put(char* dst, size_t offset, T value) { std::memcpy(dst + offset, &value, sizeof(T)); }
+
+    bool writeHeader()
+    {
+      using namespace std::chrono;
+      const year_month_day today{ floor<days>(system_clock::now()) };
+      const int dayOfYear = (sys_days(today) - sys_days(today.year() / January / 1)).count() + 1;
+
+      char header[HeaderSize] = {};
+      std::memcpy(header, "LASF", 4);
+      put<uint16_t>(header, 6, 6 <= format ? 1 << 4 : 0);   // Global encoding, WKT is required for formats 6 and up.
+      header[24] = 1;                                       // Version 1.4
+      header[25] = 4;
+      std::memcpy(header + 26, "OTHER", 5);                 // System identifier
+      std::memcpy(header + 58, "e57parser", 9);             // Generating software
+      put<uint16_t>(header, 90, static_cast<uint16_t>(dayOfYear));
+      put<uint16_t>(header, 92, static_cast<uint16_t>(static_cast<int>(today.year())));
+      put<uint16_t>(header, 94, HeaderSize);
+      put<uint32_t>(header, 96, HeaderSize);                // Offset to point data, there are no VLRs.
+      header[104] = static_cast<char>(format);
+      put<uint16_t>(header, 105, static_cast<uint16_t>(recordLength));
+      if (format < 6 && pointsWritten <= UINT32_MAX) {
+        put<uint32_t>(header, 107, static_cast<uint32_t>(pointsWritten));    // Legacy point count
+        put<uint32_t>(header, 111, static_cast<uint32_t>(pointsWritten));    // Legacy points of first return
+      }
+      for (size_t a = 0; a < 3; a++) {
+        const Axis& axis = axes[a];
+        const bool empty = axis.max < axis.min;
+        put<double>(header, 131 + 8 * a, axis.scale);
+        put<double>(header, 155 + 8 * a, axis.offset);
+        put<double>(header, 179 + 16 * a, empty ? 0.0 : axis.scale * double(axis.max) + axis.offset);
+        put<double>(header, 187 + 16 * a, empty ? 0.0 : axis.scale * double(axis.min) + axis.offset);
+      }
+      put<uint64_t>(header, 247, pointsWritten);
+      put<uint64_t>(header, 255, pointsWritten);            // All points are single returns.
+
+      if (shared) {
+        return shared->writeAt(0, header, HeaderSize);
+      }
+      if (std::fseek(file, 0, SEEK_SET) != 0 || std::fwrite(header, 1, HeaderSize, file) != HeaderSize) {
+        logError(logger, "Failed to write LAS header");
+        return false;
+      }
+      return true;
+    }
+
+    bool destroy(bool success)
+    {
+      bool ok = true;
+      if (shared) {
+        if (success) {
+          ok = flush();
+        }
+        shared = nullptr;
+      }
+      else if (file) {
+        if (success) {
+          ok = flush() && writeHeader();
+        }
+        if (std::fclose(file) != 0) {
+          logError(logger, "Failed to close file");
+          ok = false;
+        }
+        file = nullptr;
+      }
+      if (pointsClamped) {
+        logWarning(logger, "%" PRIu64 " points had coordinates outside of the range of LAS", pointsClamped);
+      }
+      return ok;
+    }
+
+    static bool consumeCallback(void* data, char* batch, size_t pointCount)
+    {
+      LasWriter* that = reinterpret_cast<LasWriter*>(data);
+      const size_t recordLength = that->recordLength;
+      const bool extended = 6 <= that->format;
+      const size_t colorOffset = extended ? 30 : 20;
+
+      for (size_t i = 0; i < pointCount; i++) {
+        const char* src = batch + PointStride * i;
+        if (OutputBufferSize < that->outputFill + recordLength && !that->flush()) {
+          return false;
+        }
+        char* rec = that->output.data() + that->outputFill;
+        std::memset(rec, 0, recordLength);
+
+        for (size_t a = 0; a < 3; a++) {
+          Axis& axis = that->axes[a];
+          int32_t coord;
+          if (axis.passthrough) {
+            std::memcpy(&coord, src + CoordinateOffset + 8 * a, sizeof(int32_t));
+          }
+          else {
+            double value;
+            std::memcpy(&value, src + CoordinateOffset + 8 * a, sizeof(double));
+            double q = std::floor((value - axis.offset) / axis.scale + 0.5);
+            if (!(double(INT32_MIN) <= q && q <= double(INT32_MAX))) {
+              that->pointsClamped++;
+              q = q < 0.0 ? double(INT32_MIN) : double(INT32_MAX);
+            }
+            coord = static_cast<int32_t>(q);
+          }
+          axis.min = std::min(axis.min, coord);
+          axis.max = std::max(axis.max, coord);
+          put<int32_t>(rec, 4 * a, coord);
+        }
+
+        if (that->hasIntensity) {
+          float intensity;
+          std::memcpy(&intensity, src + IntensityOffset, sizeof(float));
+          put<uint16_t>(rec, 12, static_cast<uint16_t>(quantize(intensity, that->intensityScale, that->intensityBias, 0, 0xFFFF)));
+        }
+
+        // Return number 1 of 1.
+        rec[14] = extended ? 0x11 : 0x09;
+
+        if (extended && that->hasTime) {
+          std::memcpy(rec + 22, src + TimeOffset, sizeof(double));
+        }
+        if (that->format == 2 || that->format == 7) {
+          for (size_t c = 0; c < 3; c++) {
+            float color;
+            std::memcpy(&color, src + ColorOffset + sizeof(float) * c, sizeof(float));
+            put<uint16_t>(rec, colorOffset + 2 * c, static_cast<uint16_t>(quantize(color, that->colorScale[c], that->colorBias[c], 0, 0xFFFF)));
+          }
+        }
+        that->outputFill += recordLength;
+      }
+      that->pointsWritten += pointCount;
+      return true;
+    }
+  };
+
+  // Writes each of a set of point sets to its own LAS file, driven by readE57PointSets.
+  //
+  // If merge is set, the point sets are instead written into one file, in the order they
+  // are listed. Coordinates are passed through if all point sets have the same scale and
+  // offset, and are otherwise quantized to the finest scale among them.
+  struct LasPointSetsWriter
+  {
+    const E57File* e57 = nullptr;
+    const char* path = nullptr;
+    bool multiple = false;
+    bool merge = false;
+    int format = -1;
+    size_t pipelineDepth = 1;
+    size_t batchSize = 0;
+    VoxelSettings voxel;
+    std::vector<LasWriter> writers;
+    std::atomic<bool> failed{ false };
+    LasWriter common = LasWriter();   // Format, axes and totals of the merged file.
+    std::vector<uint64_t> outputOffsets;
+    SharedOutput merged;
+
+    bool beginMerge(const std::vector<size_t>& pointSets)
+    {
+      bool hasTime = true;
+      bool hasColor = true;
+      float lo[3], hi[3];
+      for (size_t k = 0; k < pointSets.size(); k++) {
+        const Points& pts = e57->points[pointSets[k]];
+        hasTime = hasTime && findComponent(pts, Component::Role::TimeStamp);
+        for (Component::Role role : LasWriter::ColorRoles) {
+          hasColor = hasColor && findComponent(pts, role);
+        }
+        for (size_t a = 0; a < 3; a++) {
+          const Component* comp = findComponent(pts, LasWriter::CoordinateRoles[a]);
+          if (!comp) {
+            logError(logger, "Point set %zu has no cartesian components", pointSets[k]);
+            return false;
+          }
+          const LasWriter::Axis axis = LasWriter::nativeAxis(*comp);
+          LasWriter::Axis& c = common.axes[a];
+          float l, h;
+          declaredRange(*comp, l, h);
+          if (k == 0) {
+            c = axis;
+            lo[a] = l;
+            hi[a] = h;
+            continue;
+          }
+          if (!(c.passthrough && axis.passthrough && c.scale == axis.scale && c.offset == axis.offset)) {
+            c.passthrough = false;
+          }
+          c.scale = std::min(c.scale, axis.scale);
+          lo[a] = std::min(lo[a], l);
+          hi[a] = std::max(hi[a], h);
+        }
+      }
+      for (size_t a = 0; a < 3; a++) {
+        LasWriter::Axis& c = common.axes[a];
+        if (!c.passthrough) {
+          c.offset = lo[a] <= hi[a] && std::abs(lo[a]) < 1e15f && std::abs(hi[a]) < 1e15f ? std::floor(0.5 * (double(lo[a]) + double(hi[a]))) : 0.0;
+        }
+      }
+
+      common.format = format < 0 ? LasWriter::autoFormat(hasTime, hasColor) : static_cast<uint8_t>(format);
+      if ((common.format == 2 || common.format == 7) && !hasColor) {
+        logError(logger, "LAS point format %u requires color components in all point sets", common.format);
+        return false;
+      }
+      common.recordLength = LasWriter::RecordLengths[common.format];
+      common.shared = &merged;
+      logDebug(logger, "Merged LAS point format %u, coordinates passed through: %s %s %s", common.format,
+               common.axes[0].passthrough ? "x" : "-", common.axes[1].passthrough ? "y" : "-", common.axes[2].passthrough ? "z" : "-");
+
+      if (!merged.open(path, "wb")) {
+        return false;
+      }
+      outputOffsets.assign(e57->points.size, 0);
+      uint64_t offset = LasWriter::HeaderSize;
+      for (size_t index : pointSets) {
+        outputOffsets[index] = offset;
+        offset += common.recordLength * e57->points[index].recordCount;
+      }
+      return true;
+    }
+
+    // Writes the header with the totals of all point sets if successful, and closes the file.
+    bool endMerge(const std::vector<size_t>& pointSets, bool success)
+    {
+      bool ok = true;
+      if (success) {
+        for (size_t index : pointSets) {
+          const LasWriter& writer = writers[index];
+          common.pointsWritten += writer.pointsWritten;
+          for (size_t a = 0; a < 3; a++) {
+            common.axes[a].min = std::min(common.axes[a].min, writer.axes[a].min);
+            common.axes[a].max = std::max(common.axes[a].max, writer.axes[a].max);
+          }
+        }
+        ok = common.writeHeader();
+      }
+      const bool closed = merged.close();
+      return ok && closed;
+    }
+
+    static bool setupCallback(void* data, ReadPointsArgs& args)
+    {
+      LasPointSetsWriter* that = reinterpret_cast<LasPointSetsWriter*>(data);
+      LasWriter& writer = that->writers[args.pointSetIndex];
+
+      std::string path = that->multiple ? pointSetPath(that->path, args.pointSetIndex) : std::string(that->path);
+      writer.bufferCount = that->pipelineDepth;
+      if (that->merge) {
+        writer.shared = &that->merged;
+        writer.outputOffset = that->outputOffsets[args.pointSetIndex];
+      }
+      if (!writer.init(path.c_str(), that->e57, args.pointSetIndex, that->format, that->batchSize, that->merge ? &that->common : nullptr)) {
+        return false;
+      }
+      args.buffer = View<char>(writer.buffer.data(), writer.buffer.size());
+      args.writeDesc = View<const ComponentWriteDesc>(writer.writeDescs.data(), writer.writeDescs.size());
+      args.consumeCallback = LasWriter::consumeCallback;
+      args.consumeCallbackData = &writer;
+      args.pointCapacity = writer.pointCapacity;
+      args.bufferCount = writer.bufferCount;
+      if (that->voxel.enabled()) {
+        // Coordinates are added first, passed through ones are scaled integers.
+        VoxelFilter::Axis axes[3];
+        for (size_t a = 0; a < 3; a++) {
+          const LasWriter::Axis& axis = writer.axes[a];
+          axes[a] = { .field = a, .scale = axis.passthrough ? axis.scale : 1.0, .offset = axis.passthrough ? axis.offset : 0.0 };
+        }
+        return that->voxel.setup(writer.voxelFilter, writer.writeDescs, axes, args);
+      }
+      return true;
+    }
+
+    static void finishCallback(void* data, size_t pointSetIndex, bool success)
+    {
+      LasPointSetsWriter* that = reinterpret_cast<LasPointSetsWriter*>(data);
+      LasWriter& writer = that->writers[pointSetIndex];
+      if (success && that->voxel.enabled() && !emitVoxels(writer.voxelFilter, writer, LasWriter::consumeCallback)) {
+        that->failed = true;
+        success = false;
+      }
+      if (!writer.destroy(success)) {
+        that->failed = true;
+      }
+      logDebug(logger, "Point set %zu: %s", pointSetIndex, success ? "done" : "failed");
+    }
+  };
+
+  // Builds a single level of detail octree of a set of point sets, driven by readE57PointSets.
+  //
+  // The cube is given by the declared ranges of the cartesian components, or by a pass
+  // over the points if these are not finite. Positions are quantized to millimeters, or
+  // coarser if the cube is too large for 31 bits. Intensity and color are mapped from
+  // their declared range to 0..255, and are only kept if all point sets have them.
+  struct OctreePointSetsWriter
+  {
+    static constexpr size_t PointStride = 3 * sizeof(double) + 4 * sizeof(float);
+
+    struct PointSet
+    {
+      std::vector<ComponentWriteDesc> writeDescs;
+      Buffer<char> buffer;
+      std::vector<OctreePoint> points;
+      size_t pointCapacity = 0;
+      float intensityScale = 0.f;
+      float intensityBias = 0.f;
+      float colorScale[3] = { 0.f, 0.f, 0.f };
+      float colorBias[3] = { 0.f, 0.f, 0.f };
+      OctreePointSetsWriter* owner = nullptr;
+    };
+
+    const E57File* e57 = nullptr;
+    const char* path = nullptr;
+    size_t pipelineDepth = 1;
+    size_t batchSize = 0;
+    size_t memoryBudget = 0;
+    uint32_t maxNodePoints = 0;
+    std::vector<PointSet> pointSets;
+    OctreeDesc desc;
+    OctreeBuilder builder;
+    std::mutex mutex;
+
+    static constexpr Component::Role CoordinateRoles[3] = { Component::Role::CartesianX, Component::Role::CartesianY, Component::Role::CartesianZ };
+    static constexpr Component::Role ColorRoles[3] = { Component::Role::ColorRed, Component::Role::ColorGreen, Component::Role::ColorBlue };
+
+    // Finds the extents of the cartesian components by decoding them.
+    bool measureBounds(const std::vector<size_t>& indices, double* lo, double* hi)
+    {
+      for (size_t index : indices) {
+        const Points& pts = e57->points[index];
+        ComponentWriteDesc writeDescs[3];
+        for (size_t a = 0; a < 3; a++) {
+          writeDescs[a] = ComponentWriteDesc{
+            .offset = sizeof(double) * a,
+            .stride = 3 * sizeof(double),
+            .type = ComponentWriteDesc::Type::Double,
+            .stream = static_cast<uint32_t>(findComponent(pts, CoordinateRoles[a]) - pts.components.data) };
+        }
+        size_t pointCapacity = batchSize ? batchSize : suggestE57BatchSize(e57, logger, index, 3 * sizeof(double));
+        if (pointCapacity == 0) {
+          return false;
+        }
+        Buffer<char> buffer;
+        buffer.accommodate(3 * sizeof(double) * pointCapacity);
+        ComponentStats stats[3];
+        ReadPointsArgs readPointsArgs{
+          .buffer = View<char>(buffer.data(), buffer.size()),
+          .writeDesc = View<const ComponentWriteDesc>(writeDescs, 3),
+          .pointCapacity = pointCapacity,
+          .pointSetIndex = index,
+          .componentStats = stats
+        };
+        if (!readE57Points(e57, logger, readPointsArgs)) {
+          return false;
+        }
+        for (size_t a = 0; a < 3; a++) {
+          if (stats[a].count) {
+            lo[a] = std::min(lo[a], stats[a].min);
+            hi[a] = std::max(hi[a], stats[a].max);
+          }
+        }
+      }
+      return true;
+    }
+
+    bool open(const std::vector<size_t>& indices)
+    {
+      double lo[3], hi[3];
+      for (size_t a = 0; a < 3; a++) {
+        lo[a] = std::numeric_limits<double>::infinity();
+        hi[a] = -std::numeric_limits<double>::infinity();
+      }
+      bool finite = true;
+      desc.hasIntensity = true;
+      desc.hasColor = true;
+      for (size_t index : indices) {
+        const Points& pts = e57->points[index];
+        for (size_t a = 0; a < 3; a++) {
+          const Component* comp = findComponent(pts, CoordinateRoles[a]);
+          if (!comp) {
+            logError(logger, "Point set %zu has no cartesian components", index);
+            return false;
+          }
+          double l, h;
+          declaredRange(*comp, l, h);
+          finite = finite && std::abs(l) < 1e15 && std::abs(h) < 1e15;
+          lo[a] = std::min(lo[a], std::min(l, h));
+          hi[a] = std::max(hi[a], std::max(l, h));
+        }
+        desc.hasIntensity = desc.hasIntensity && findComponent(pts, Component::Role::Intensity);
+        for (Component::Role role : ColorRoles) {
+          desc.hasColor = desc.hasColor && findComponent(pts, role);
+        }
+      }
+      if (!finite) {
+        logInfo(logger, "Declared cartesian ranges are not finite, measuring bounds");
+        for (size_t a = 0; a < 3; a++) {
+          lo[a] = std::numeric_limits<double>::infinity();
+          hi[a] = -std::numeric_limits<double>::infinity();
+        }
+        if (!measureBounds(indices, lo, hi)) {
+          return false;
+        }
+      }
+
+      double extent = 0.0;
+      for (size_t a = 0; a < 3; a++) {
+        if (hi[a] < lo[a]) {
+          lo[a] = hi[a] = 0.0;
+        }
+        desc.offset[a] = lo[a];
+        extent = std::max(extent, hi[a] - lo[a]);
+      }
+      desc.scale = 0.001;
+      desc.bits = 1;
+      while (desc.bits < 31 && double(uint64_t(1) << desc.bits) <= extent / desc.scale + 1.0) {
+        desc.bits++;
+      }
+      if (double(uint64_t(1) << desc.bits) <= extent / desc.scale + 1.0) {
+        desc.scale = extent / double((uint64_t(1) << desc.bits) - 2);
+      }
+      logDebug(logger, "Octree cube at [%g %g %g] with %u bits of %g", desc.offset[0], desc.offset[1], desc.offset[2], desc.bits, desc.scale);
+      return builder.open(logger, path, desc, memoryBudget, maxNodePoints);
+    }
+
+    static bool setupCallback(void* data, ReadPointsArgs& args)
+    {
+      OctreePointSetsWriter* that = reinterpret_cast<OctreePointSetsWriter*>(data);
+      PointSet& pointSet = that->pointSets[args.pointSetIndex];
+      const Points& pts = that->e57->points[args.pointSetIndex];
+      pointSet.owner = that;
+
+      auto addComponent = [&](const Component* comp, size_t offset, ComponentWriteDesc::Type type) {
+        pointSet.writeDescs.push_back({
+          .offset = offset,
+          .stride = PointStride,
+          .type = type,
+          .stream = static_cast<uint32_t>(comp - pts.components.data) });
+      };
+      for (size_t a = 0; a < 3; a++) {
+        addComponent(findComponent(pts, CoordinateRoles[a]), sizeof(double) * a, ComponentWriteDesc::Type::Double);
+      }
+      if (that->desc.hasIntensity) {
+        const Component* comp = findComponent(pts, Component::Role::Intensity);
+        float lo, hi;
+        declaredRange(*comp, lo, hi);
+        pointSet.intensityScale = lo < hi ? 255.f / (hi - lo) : 0.f;
+        pointSet.intensityBias = -pointSet.intensityScale * lo;
+        addComponent(comp, 3 * sizeof(double), ComponentWriteDesc::Type::Float);
+      }
+      if (that->desc.hasColor) {
+        for (size_t c = 0; c < 3; c++) {
+          const Component* comp = findComponent(pts, ColorRoles[c]);
+          float lo, hi;
+          declaredRange(*comp, lo, hi);
+          pointSet.colorScale[c] = lo < hi ? 255.f / (hi - lo) : 0.f;
+          pointSet.colorBias[c] = -pointSet.colorScale[c] * lo;
+          addComponent(comp, 3 * sizeof(double) + sizeof(float) * (1 + c), ComponentWriteDesc::Type::Float);
+        }
+      }
+
+      pointSet.pointCapacity = that->batchSize ? that->batchSize : suggestE57BatchSize(that->e57, logger, args.pointSetIndex, PointStride);
+      if (pointSet.pointCapacity == 0) {
+        return false;
+      }
+      pointSet.buffer.accommodate(that->pipelineDepth * pointSet.pointCapacity * PointStride);
+      pointSet.points.resize(pointSet.pointCapacity);
+
+      args.buffer = View<char>(pointSet.buffer.data(), pointSet.buffer.size());
+      args.writeDesc = View<const ComponentWriteDesc>(pointSet.writeDescs.data(), pointSet.writeDescs.size());
+      args.consumeCallback = consumeCallback;
+      args.consumeCallbackData = &pointSet;
+      args.pointCapacity = pointSet.pointCapacity;
+      args.bufferCount = that->pipelineDepth;
+      return true;
+    }
+
+    static bool consumeCallback(void* data, char* batch, size_t pointCount)
+    {
+      PointSet& pointSet = *reinterpret_cast<PointSet*>(data);
+      const OctreePointSetsWriter& owner = *pointSet.owner;
+      const double maxCode = double((uint64_t(1) << owner.desc.bits) - 1);
+
+      for (size_t i = 0; i < pointCount; i++) {
+        const char* src = batch + PointStride * i;
+        double xyz[3];
+        float attributes[4];
+        std::memcpy(xyz, src, sizeof(xyz));
+        std::memcpy(attributes, src + sizeof(xyz), sizeof(attributes));
+
+        uint32_t codes[3];
+        for (size_t a = 0; a < 3; a++) {
+          const double q = std::floor((xyz[a] - owner.desc.offset[a]) / owner.desc.scale);
+          codes[a] = static_cast<uint32_t>(std::clamp(std::isnan(q) ? 0.0 : q, 0.0, maxCode));
+        }
+        OctreePoint& p = pointSet.points[i];
+        p = OctreePoint{ .x = codes[0], .y = codes[1], .z = codes[2] };
+        if (owner.desc.hasIntensity) {
+          p.intensity = static_cast<uint8_t>(quantize(attributes[0], pointSet.intensityScale, pointSet.intensityBias, 0, 255));
+        }
+        if (owner.desc.hasColor) {
+          p.r = static_cast<uint8_t>(quantize(attributes[1], pointSet.colorScale[0], pointSet.colorBias[0], 0, 255));
+          p.g = static_cast<uint8_t>(quantize(attributes[2], pointSet.colorScale[1], pointSet.colorBias[1], 0, 255));
+          p.b = static_cast<uint8_t>(quantize(attributes[3], pointSet.colorScale[2], pointSet.colorBias[2], 0, 255));
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(pointSet.owner->mutex);
+      return pointSet.owner->builder.addPoints(pointSet.points.data(), pointCount);
+    }
+
+    static void finishCallback(void* data, size_t pointSetIndex, bool success)
+    {
+      OctreePointSetsWriter* that = reinterpret_cast<OctreePointSetsWriter*>(data);
+      PointSet& pointSet = that->pointSets[pointSetIndex];
+      pointSet.points = std::vector<OctreePoint>();
+      logDebug(logger, "Point set %zu: %s", pointSetIndex, success ? "done" : "failed");
+    }
+  };
+
+  enum struct ImageChannel : uint32_t {
+    Auto,       // Color for PPM, intensity otherwise.
+    Intensity,
+    Range,
+    Color
+  };
+
+  enum struct ImageFormat : uint32_t {
+    Pgm,
+    Ppm,
+    Pfm
+  };
+
+  bool imageFormatFromPath(ImageFormat& format, const char* path)
+  {
+    const char* dot = std::strrchr(path, '.');
+    if (dot && (strcmp(dot, ".pgm") == 0 || strcmp(dot, ".PGM") == 0)) {
+      format = ImageFormat::Pgm;
+    }
+    else if (dot && (strcmp(dot, ".ppm") == 0 || strcmp(dot, ".PPM") == 0)) {
+      format = ImageFormat::Ppm;
+    }
+    else if (dot && (strcmp(dot, ".pfm") == 0 || strcmp(dot, ".PFM") == 0)) {
+      format = ImageFormat::Pfm;
+    }
+    else {
+      logError(logger, "%s: unrecognized image format, expected .pgm, .ppm or .pfm", path);
+      return false;
+    }
+    return true;
+  }
+
+  // Renders a point set with row and column indices as an image, one pixel per cell.
+  //
+  // Points are binned into pixels as batches are consumed, and the points of a pixel
+  // are averaged. Scans larger than maxSize are binned down by an integer factor, so
+  // memory use is bounded by the image size and a single decode pass is needed.
+  struct ImageWriter
+  {
+    std::vector<ComponentWriteDesc> writeDescs;
+    Buffer<char> buffer;
+    size_t pointCapacity = 0;
+    size_t bufferCount = 1;
+
+    ImageChannel channel = ImageChannel::Intensity;
+    size_t pointFloats = 0;         // Floats per point: row, column, values and optionally an invalid state.
+    size_t valueCount = 0;          // Values per point, 3 for color and cartesian range.
+    bool cartesianRange = false;    // Range is computed from cartesian coordinates.
+    bool hasInvalid = false;
+    float colorMin[3] = { 0.f, 0.f, 0.f };
+    float colorMax[3] = { 1.f, 1.f, 1.f };
+    double stretch[2] = { 0.0, 1.0 };           // Quantiles of the decoded values that intensity and range are stretched between.
+    std::vector<ComponentHistogram> histograms; // One per write description when stretch is not the full range.
+
+    size_t factor = 1;              // Scan rows and columns per pixel.
+    size_t width = 0;
+    size_t height = 0;
+    size_t channels = 1;
+    std::vector<float> sums;        // Sum of values per pixel channel.
+    std::vector<uint32_t> counts;   // Points per pixel.
+
+    const Component* addComponent(const Points& pts, Component::Role role)
+    {
+      for (size_t i = 0; i < pts.components.size; i++) {
+        if (pts.components[i].role == role) {
+          writeDescs.push_back({
+            .offset = writeDescs.size() * sizeof(float),
+            .type = ComponentWriteDesc::Type::Float,
+            .stream = static_cast<uint32_t>(i) });
+          return &pts.components[i];
+        }
+      }
+      return nullptr;
+    }
+
+    bool init(const E57File* e57, size_t pointSetIndex, ImageChannel channel_, size_t maxSize, bool includeInvalid, size_t batchSize)
+    {
+      const Points& pts = e57->points[pointSetIndex];
+      channel = channel_;
+
+      size_t rows = 0;
+      size_t columns = 0;
+      if (!getE57GridSize(e57, logger, pointSetIndex, rows, columns)) {
+        return false;
+      }
+      addComponent(pts, Component::Role::RowIndex);
+      addComponent(pts, Component::Role::ColumnIndex);
+
+      Component::Role invalidRole = Component::Role::Count;
+      switch (channel) {
+      case ImageChannel::Intensity:
+        if (!addComponent(pts, Component::Role::Intensity)) {
+          logError(logger, "No intensity component");
+          return false;
+        }
+        valueCount = 1;
+        invalidRole = Component::Role::IsIntensityInvalid;
+        break;
+      case ImageChannel::Range:
+        if (addComponent(pts, Component::Role::SphericalRange)) {
+          valueCount = 1;
+          invalidRole = Component::Role::SphericalInvalidState;
+        }
+        else if (addComponent(pts, Component::Role::CartesianX) && addComponent(pts, Component::Role::CartesianY) && addComponent(pts, Component::Role::CartesianZ)) {
+          valueCount = 3;
+          cartesianRange = true;
+          invalidRole = Component::Role::CartesianInvalidState;
+        }
+        else {
+          logError(logger, "No spherical range or cartesian components");
+          return false;
+        }
+        break;
+      case ImageChannel::Color: {
+        const Component::Role roles[3] = { Component::Role::ColorRed, Component::Role::ColorGreen, Component::Role::ColorBlue };
+        for (size_t c = 0; c < 3; c++) {
+          const Component* comp = addComponent(pts, roles[c]);
+          if (!comp) {
+            logError(logger, "No color components");
+            return false;
+          }
+          declaredRange(*comp, colorMin[c], colorMax[c]);
+        }
+        valueCount = 3;
+        invalidRole = Component::Role::IsColorInvalid;
+        break;
+      }
+      default:
+        assert(false);
+        return false;
+      }
+      if (!includeInvalid && addComponent(pts, invalidRole)) {
+        hasInvalid = true;
+      }
+
+      pointFloats = writeDescs.size();
+      for (ComponentWriteDesc& writeDesc : writeDescs) {
+        writeDesc.stride = pointFloats * sizeof(float);
+      }
+
+      histograms.clear();
+      if (stretch[0] != 0.0 || stretch[1] != 1.0) {
+        if (channel == ImageChannel::Color || cartesianRange) {
+          logWarning(logger, "Point set %zu: stretch quantiles only apply to intensity and spherical range", pointSetIndex);
+        }
+        else {
+          histograms.resize(writeDescs.size());
+          for (size_t i = 0; i < writeDescs.size(); i++) {
+            histograms[i].init(pts.components[writeDescs[i].stream]);
+          }
+        }
+      }
+
+      factor = 1;
+      if (maxSize) {
+        factor = std::max(size_t(1), (std::max(rows, columns) + maxSize - 1) / maxSize);
+      }
+      width = (columns + factor - 1) / factor;
+      height = (rows + factor - 1) / factor;
+      channels = channel == ImageChannel::Color ? 3 : 1;
+      sums.assign(width * height * channels, 0.f);
+      counts.assign(width * height, 0);
+      logDebug(logger, "Point set %zu: %zu x %zu cells, binned by %zu into %zu x %zu pixels", pointSetIndex, columns, rows, factor, width, height);
+
+      pointCapacity = batchSize ? batchSize : suggestE57BatchSize(e57, logger, pointSetIndex, pointFloats * sizeof(float));
+      if (pointCapacity == 0) {
+        return false;
+      }
+      buffer.accommodate(bufferCount * pointCapacity * pointFloats * sizeof(float));
+      return true;
+    }
+
+    void destroy()
+    {
+      std::vector<float>().swap(sums);
+      std::vector<uint32_t>().swap(counts);
+      std::vector<ComponentHistogram>().swap(histograms);
+    }
+
+    static bool consumeCallback(void* data, char* batch, size_t pointCount)
+    {
+      ImageWriter* that = reinterpret_cast<ImageWriter*>(data);
+      const float* ptr = reinterpret_cast<const float*>(batch);
+      const float rows = static_cast<float>(that->height * that->factor);
+      const float columns = static_cast<float>(that->width * that->factor);
+      for (size_t i = 0; i < pointCount; i++, ptr += that->pointFloats) {
+        const float row = ptr[0];
+        const float column = ptr[1];
+        if (!(0.f <= row && row < rows && 0.f <= column && column < columns)) {
+          continue;
+        }
+        if (that->hasInvalid && ptr[that->pointFloats - 1] != 0.f) {
+          continue;
+        }
+        const size_t pixel = (static_cast<size_t>(row) / that->factor) * that->width + static_cast<size_t>(column) / that->factor;
+        float* sum = that->sums.data() + that->channels * pixel;
+        if (that->cartesianRange) {
+          sum[0] += std::sqrt(ptr[2] * ptr[2] + ptr[3] * ptr[3] + ptr[4] * ptr[4]);
+        }
+        else {
+          for (size_t c = 0; c < that->channels; c++) {
+            sum[c] += ptr[2 + c];
+          }
+        }
+        that->counts[pixel]++;
+      }
+      return true;
+    }
+
+    // Writes the averages of the pixels, pixels without points are zero. For PGM and PPM,
+    // intensity and range are stretched over the values present, or between the stretch
+    // quantiles of the decoded values if histograms are kept, and colors are mapped from
+    // their declared range. PFM holds the values as is, except colors which are mapped
+    // to [0, 1].
+    bool write(const char* path, ImageFormat format)
+    {
+      float lo = std::numeric_limits<float>::max();
+      float hi = -std::numeric_limits<float>::max();
+      for (size_t pixel = 0; pixel < counts.size(); pixel++) {
+        if (uint32_t count = counts[pixel]; count) {
+          for (size_t c = 0; c < channels; c++) {
+            float& value = sums[channels * pixel + c];
+            value = value / static_cast<float>(count);
+            if (channel == ImageChannel::Color) {
+              value = colorMax[c] != colorMin[c] ? std::clamp((value - colorMin[c]) / (colorMax[c] - colorMin[c]), 0.f, 1.f) : 0.f;
+            }
+            lo = std::min(lo, value);
+            hi = std::max(hi, value);
+          }
+        }
+      }
+      if (channel == ImageChannel::Color) {
+        lo = 0.f;
+        hi = 1.f;
+      }
+      else if (!histograms.empty() && histograms[2].count()) {
+        lo = static_cast<float>(histograms[2].quantile(stretch[0]));
+        hi = static_cast<float>(histograms[2].quantile(stretch[1]));
+        logDebug(logger, "Stretching %.6g..%.6g over %" PRIu64 " values", lo, hi, histograms[2].count());
+      }
+      const float scale = lo < hi ? 1.f / (hi - lo) : 0.f;
+
+      FILE* file = std::fopen(path, "wb");
+      if (!file) {
+        logError(logger, "Failed to open '%s' for writing\n", path);
+        return false;
+      }
+
+      const size_t outChannels = format == ImageFormat::Pgm ? 1 : (format == ImageFormat::Ppm ? 3 : channels);
+      if (format == ImageFormat::Pfm) {
+        fprintf(file, "%s\n%zu %zu\n-1.0\n", outChannels == 3 ? "PF" : "Pf", width, height);
+      }
+      else {
+        fprintf(file, "%s\n%zu %zu\n255\n", outChannels == 3 ? "P6" : "P5", width, height);
+      }
+
+      std::vector<char> line(width * outChannels * sizeof(float));
+      for (size_t y = 0; y < height; y++) {
+
+        // PFM scanlines run bottom to top.
+        const size_t row = format == ImageFormat::Pfm ? height - 1 - y : y;
+        const float* src = sums.data() + channels * width * row;
+        const uint32_t* count = counts.data() + width * row;
+        if (format == ImageFormat::Pfm) {
+          float* dst = reinterpret_cast<float*>(line.data());
+          for (size_t x = 0; x < width * channels; x++) {
+            dst[x] = count[x / channels] ? src[x] : 0.f;
+          }
+          std::fwrite(line.data(), sizeof(float), width * channels, file);
+        }
+        else {
+          uint8_t* dst = reinterpret_cast<uint8_t*>(line.data());
+          for (size_t x = 0; x < width; x++) {
+            float value[3] = { 0.f, 0.f, 0.f };
+            if (count[x]) {
+              for (size_t c = 0; c < 3; c++) {
+                value[c] = std::clamp(scale * (src[channels * x + (channels == 3 ? c : 0)] - lo), 0.f, 1.f);
+              }
+            }
+            if (outChannels == 1) {
+              dst[x] = static_cast<uint8_t>(255.f * (value[0] + value[1] + value[2]) / 3.f + 0.5f);
+            }
+            else {
+              for (size_t c = 0; c < 3; c++) {
+                dst[3 * x + c] = static_cast<uint8_t>(255.f * value[c] + 0.5f);
+              }
+            }
+          }
+          std::fwrite(line.data(), 1, width * outChannels, file);
+        }
+      }
+
+      bool ok = std::ferror(file) == 0;
+      std::fclose(file);
+      if (!ok) {
+        logError(logger, "Failed to write '%s'", path);
+        return false;
+      }
+      logDebug(logger, "Wrote %zu x %zu image to %s", width, height, path);
+      return true;
+    }
+  };
+
+  // Writes each of a set of point sets to its own image, driven by readE57PointSets.
+  struct ImagePointSetsWriter
+  {
+    const E57File* e57 = nullptr;
+    const char* path = nullptr;
+    ImageFormat format = ImageFormat::Pgm;
+    ImageChannel channel = ImageChannel::Intensity;
+    bool multiple = false;
+    bool includeInvalid = false;
+    size_t maxSize = 0;
+    double stretch[2] = { 0.0, 1.0 };
+    size_t pipelineDepth = 1;
+    size_t batchSize = 0;
+    std::vector<ImageWriter> writers;
+    std::atomic<bool> failed{ false };
+
+    static bool setupCallback(void* data, ReadPointsArgs& args)
+    {
+      ImagePointSetsWriter* that = reinterpret_cast<ImagePointSetsWriter*>(data);
+      ImageWriter& writer = that->writers[args.pointSetIndex];
+
+      writer.bufferCount = that->pipelineDepth;
+      writer.stretch[0] = that->stretch[0];
+      writer.stretch[1] = that->stretch[1];
+      if (!writer.init(that->e57, args.pointSetIndex, that->channel, that->maxSize, that->includeInvalid, that->batchSize)) {
+        return false;
+      }
+      args.buffer = View<char>(writer.buffer.data(), writer.buffer.size());
+      args.writeDesc = View<const ComponentWriteDesc>(writer.writeDescs.data(), writer.writeDescs.size());
+      args.consumeCallback = ImageWriter::consumeCallback;
+      args.consumeCallbackData = &writer;
+      args.pointCapacity = writer.pointCapacity;
+      args.bufferCount = writer.bufferCount;
+      args.componentHistograms = writer.histograms.empty() ? nullptr : writer.histograms.data();
+      return true;
+    }
+
+    static void finishCallback(void* data, size_t pointSetIndex, bool success)
+    {
+      ImagePointSetsWriter* that = reinterpret_cast<ImagePointSetsWriter*>(data);
+      ImageWriter& writer = that->writers[pointSetIndex];
+      if (success) {
+        std::string path = that->multiple ? pointSetPath(that->path, pointSetIndex) : std::string(that->path);
+        if (!writer.write(path.c_str(), that->format)) {
+          that->failed = true;
+        }
+      }
+      writer.destroy();
+      logDebug(logger, "Point set %zu: %s", pointSetIndex, success ? "done" : "failed");
+    }
+  };
+
+
+  // Writes point sets into a single new E57 file.
+  //
+  // The name and pose of each point set are carried over, other metadata of the source,
+  // like descriptions, sensor information and images2D, is not.
+  //
+  // Values are decoded as doubles, integers before scale and offset, so they pass
+  // through exactly as long as they fit in 53 bits. Every component keeps its encoding,
+  // unless recompress is set. Then a first pass over each point set finds the actual
+  // extents of the components, and the encodings are tightened to these:
+  //
+  // - Integer and scaled integer components keep their values and scale, but get the
+  //   smallest and largest value present as minimum and maximum, and thus fewer bits.
+  // - Float cartesian coordinates and ranges become scaled integers with precision as
+  //   scale, that is, rounded to the nearest multiple of precision, if that needs fewer
+  //   bits. Other float components, like angles and time stamps, are kept as they are.
+  struct E57Output
+  {
+    E57Writer writer;
+    FILE* file = nullptr;
+    uint64_t filePosition = 0;
+    bool recompress = false;
+    double precision = 0.0;     // Scale of float components converted by recompress, zero keeps floats.
+    VoxelSettings voxel;
+
+    static bool writeCallback(void* data, uint64_t offset, const void* ptr, size_t size)
+    {
+      E57Output* that = reinterpret_cast<E57Output*>(data);
+      if (offset != that->filePosition && !seekFile(that->file, offset)) {
+        return false;
+      }
+      if (std::fwrite(ptr, 1, size, that->file) != size) {
+        return false;
+      }
+      that->filePosition = offset + size;
+      return true;
+    }
+
+    static bool consumeCallback(void* data, char* batch, size_t pointCount)
+    {
+      E57Output* that = reinterpret_cast<E57Output*>(data);
+      return that->writer.writePoints(batch, pointCount);
+    }
+
+    // Integers pass as codes, while floats pass as values so that the writer applies
+    // the scale of floats that recompress turns into scaled integers.
+    static std::vector<ComponentWriteDesc> doubleWriteDescs(const Points& pts)
+    {
+      std::vector<ComponentWriteDesc> writeDescs;
+      for (size_t i = 0; i < pts.components.size; i++) {
+        const Component::Type type = pts.components[i].type;
+        writeDescs.push_back({
+          .offset = sizeof(double) * i,
+          .stride = sizeof(double) * pts.components.size,
+          .type = ComponentWriteDesc::Type::Double,
+          .stream = static_cast<uint32_t>(i),
+          .unscaled = type == Component::Type::Integer || type == Component::Type::ScaledInteger });
+      }
+      return writeDescs;
+    }
+
+    static uint32_t bitsPerRecord(const Component& comp)
+    {
+      switch (comp.type) {
+      case Component::Type::Integer:
+      case Component::Type::ScaledInteger:
+        return std::bit_width(static_cast<uint64_t>(comp.integer.max) - static_cast<uint64_t>(comp.integer.min));
+      case Component::Type::Float:
+        return 32;
+      default:
+        return 64;
+      }
+    }
+
+    Component recompressedComponent(const Component& comp, const ComponentStats& stats) const
+    {
+      if (stats.count == 0) {
+        return comp;
+      }
+
+      Component rv = comp;
+      switch (comp.type) {
+      case Component::Type::Integer:
+      case Component::Type::ScaledInteger: {
+        // Stats are after scale and offset, which a negative scale flips.
+        const double scale = comp.type == Component::Type::ScaledInteger ? comp.integer.scale : 1.0;
+        const double offset = comp.type == Component::Type::ScaledInteger ? comp.integer.offset : 0.0;
+        const int64_t a = std::llround((stats.min - offset) / scale);
+        const int64_t b = std::llround((stats.max - offset) / scale);
+        rv.integer.min = std::max(comp.integer.min, std::min(a, b));
+        rv.integer.max = std::min(comp.integer.max, std::max(a, b));
+        break;
+      }
+      case Component::Type::Float:
+      case Component::Type::Double: {
+        if (precision <= 0.0 ||
+            (comp.role != Component::Role::CartesianX && comp.role != Component::Role::CartesianY &&
+             comp.role != Component::Role::CartesianZ && comp.role != Component::Role::SphericalRange))
+        {
+          break;
+        }
+        const double lo = std::floor(stats.min / precision);
+        const double hi = std::ceil(stats.max / precision);
+        constexpr double codeLimit = 4611686018427387904.0;  // 2^62, keeps the code range within 64 bits.
+        if (!(-codeLimit < lo && hi < codeLimit)) {
+          break;
+        }
+        rv.type = Component::Type::ScaledInteger;
+        rv.integer.min = static_cast<int64_t>(lo);
+        rv.integer.max = static_cast<int64_t>(hi);
+        rv.integer.scale = precision;
+        rv.integer.offset = 0.0;
+        if (bitsPerRecord(comp) <= bitsPerRecord(rv)) {
+          rv = comp;
+        }
+        break;
+      }
+      default:
+        break;
       }
-      return false;
+      return rv;
     }
 
-    bool init(const char* path, const Points& pts)
+    // Decode the point set once to find the extents of the values.
+    bool gatherStats(const E57File* e57, size_t pointSetIndex, std::vector<ComponentStats>& stats, size_t batchSize)
     {
-      file = std::fopen(path, "w");
-      if (!file) {
-        logError(logger, "Failed to open '%s' for writing\n", path);
+      const Points& pts = e57->points[pointSetIndex];
+      const size_t stride = sizeof(double) * pts.components.size;
+      std::vector<ComponentWriteDesc> writeDescs = doubleWriteDescs(pts);
+      stats.assign(pts.components.size, ComponentStats());
+
+      size_t pointCapacity = batchSize ? batchSize : suggestE57BatchSize(e57, logger, pointSetIndex, stride);
+      if (pointCapacity == 0) {
         return false;
       }
-      fprintf(file, "%" PRIu64 "\n", pts.recordCount);
+      Buffer<char> buffer;
+      buffer.accommodate(pointCapacity * stride);
+
+      ReadPointsArgs readPointsArgs{
+        .buffer = View<char>(buffer.data(), buffer.size()),
+        .writeDesc = View<const ComponentWriteDesc>(writeDescs.data(), writeDescs.size()),
+        .pointCapacity = pointCapacity,
+        .pointSetIndex = pointSetIndex,
+        .componentStats = stats.data()
+      };
+      return readE57Points(e57, logger, readPointsArgs);
+    }
 
-      if (!addComponent(pts, 0, Component::Role::CartesianX)) {
-        logError(logger, "No cartesian X component");
-        return false;
+    bool copyPointSet(const E57File* e57, size_t pointSetIndex, size_t pipelineDepth, size_t batchSize)
+    {
+      const Points& pts = e57->points[pointSetIndex];
+      const size_t stride = sizeof(double) * pts.components.size;
+      std::vector<ComponentWriteDesc> writeDescs = doubleWriteDescs(pts);
+      std::vector<Component> components(pts.components.data, pts.components.data + pts.components.size);
+
+      if (recompress) {
+        std::vector<ComponentStats> stats;
+        if (!gatherStats(e57, pointSetIndex, stats, batchSize)) {
+          return false;
+        }
+        uint32_t bitsBefore = 0;
+        uint32_t bitsAfter = 0;
+        for (size_t i = 0; i < components.size(); i++) {
+          bitsBefore += bitsPerRecord(components[i]);
+          components[i] = recompressedComponent(components[i], stats[i]);
+          bitsAfter += bitsPerRecord(components[i]);
+        }
+        logInfo(logger, "Point set %zu: recompressed from %u to %u bits per record", pointSetIndex, bitsBefore, bitsAfter);
       }
-      if (!addComponent(pts, 1, Component::Role::CartesianY)) {
-        logError(logger, "No cartesian Y component");
+
+      View<const ComponentWriteDesc> writeDesc(writeDescs.data(), writeDescs.size());
+      if (!writer.beginPoints(View<const Component>(components.data(), components.size()), writeDesc, pts.name, pts.hasPose ? &pts.pose : nullptr)) {
         return false;
       }
-      if (!addComponent(pts, 2, Component::Role::CartesianZ)) {
-        logError(logger, "No cartesian Z component");
+
+      size_t pointCapacity = batchSize ? batchSize : suggestE57BatchSize(e57, logger, pointSetIndex, stride);
+      if (pointCapacity == 0) {
         return false;
       }
-      assert(writeDescs.size() == 3);
+      Buffer<char> buffer;
+      buffer.accommodate(pipelineDepth * pointCapacity * stride);
+
+      ReadPointsArgs readPointsArgs{
+        .buffer = View<char>(buffer.data(), buffer.size()),
+        .writeDesc = writeDesc,
+        .consumeCallback = consumeCallback,
+        .consumeCallbackData = this,
+        .pointCapacity = pointCapacity,
+        .pointSetIndex = pointSetIndex,
+        .bufferCount = pipelineDepth
+      };
+      if (!voxel.enabled()) {
+        return readE57Points(e57, logger, readPointsArgs) && writer.endPoints();
+      }
 
-      buffer.accommodate(pointCapacity * 3 * sizeof(float));
-      return true;
+      // Integer coordinates pass as codes, the filter needs their scale and offset.
+      VoxelFilter voxelFilter;
+      VoxelFilter::Axis axes[3];
+      const Component::Role roles[3] = { Component::Role::CartesianX, Component::Role::CartesianY, Component::Role::CartesianZ };
+      for (size_t a = 0; a < 3; a++) {
+        const Component* comp = findComponent(pts, roles[a]);
+        if (!comp) {
+          logError(logger, "Point set %zu has no cartesian components to filter by", pointSetIndex);
+          return false;
+        }
+        const bool scaled = comp->type == Component::Type::ScaledInteger;
+        axes[a] = { .field = static_cast<size_t>(comp - pts.components.data), .scale = scaled ? comp->integer.scale : 1.0, .offset = scaled ? comp->integer.offset : 0.0 };
+      }
+      uint64_t pointCount = 0;
+      return voxel.setup(voxelFilter, writeDescs, axes, readPointsArgs) &&
+        readE57Points(e57, logger, readPointsArgs) &&
+        voxelFilter.finish(pointCount) &&
+        voxelFilter.emit(consumeCallback, this, buffer.data(), pointCapacity) &&
+        writer.endPoints();
     }
 
-    bool destroy()
+    bool write(const char* path, const E57File* e57, const std::vector<size_t>& pointSets, size_t pipelineDepth, size_t batchSize)
     {
-      if (file) {
-        std::fclose(file);
-        file = nullptr;
+      file = std::fopen(path, "wb");
+      if (!file) {
+        logError(logger, "Failed to open '%s' for writing\n", path);
+        return false;
       }
-      return true;
-    }
 
-    static bool consumeCallback(void* data, size_t pointCount)
-    {
-      PtsWriter* that = reinterpret_cast<PtsWriter*>(data);
-      const float* ptr = reinterpret_cast<const float*>(that->buffer.data());
-      for (size_t i = 0; i < pointCount; i++) {
-        fprintf(that->file, "%f %f %f\n", ptr[3 * i + 0], ptr[3 * i + 1], ptr[3 * i + 2]);
+      bool ok = writer.open(logger, writeCallback, this);
+      for (size_t i = 0; ok && i < pointSets.size(); i++) {
+        ok = copyPointSet(e57, pointSets[i], pipelineDepth, batchSize);
       }
-      return true;
+      ok = writer.close() && ok;
+
+      if (std::ferror(file) || std::fclose(file) != 0) {
+        logError(logger, "Failed to write E57 file '%s'", path);
+        ok = false;
+      }
+      file = nullptr;
+      if (ok) {
+        logDebug(logger, "Wrote %zu point sets to '%s'", pointSets.size(), path);
+      }
+      return ok;
     }
   };
 
+  void logStats(const E57Stats& stats, const E57File& e57, uint64_t wallNanoseconds)
+  {
+    auto seconds = [&](E57Stats::Stage stage) { return 1e-9 * double(stats.stageNanoseconds[static_cast<size_t>(stage)].load()); };
+    auto rate = [](double amount, double seconds) { return 0.0 < seconds ? amount / seconds : 0.0; };
+
+    uint64_t recordsDecoded = 0;
+    for (const auto& count : stats.recordsDecoded) {
+      recordsDecoded += count.load();
+    }
+
+    const double read = seconds(E57Stats::Stage::Read);
+    const double verify = seconds(E57Stats::Stage::Verify);
+    const double unpack = seconds(E57Stats::Stage::Unpack);
+    const double consume = seconds(E57Stats::Stage::Consume);
+    const double verifiedBytes = double(stats.pagesVerified.load()) * double(e57.page.size);
+
+    logInfo(logger, "stats: wall time %.3fs, stage times are summed over threads", 1e-9 * double(wallNanoseconds));
+    logInfo(logger, "  read:     %.3fs %" PRIu64 " bytes %.1f MB/s", read, stats.bytesRead.load(), 1e-6 * rate(double(stats.bytesRead.load()), read));
+    logInfo(logger, "  verify:   %.3fs %" PRIu64 " pages %.1f MB/s", verify, stats.pagesVerified.load(), 1e-6 * rate(verifiedBytes, verify));
+    logInfo(logger, "  unpack:   %.3fs %" PRIu64 " values %.1f M/s", unpack, recordsDecoded, 1e-6 * rate(double(recordsDecoded), unpack));
+    logInfo(logger, "  consume:  %.3fs %" PRIu64 " points %.1f M/s", consume, stats.pointsConsumed.load(), 1e-6 * rate(double(stats.pointsConsumed.load()), consume));
+    logInfo(logger, "  packets:  %" PRIu64 " fetched, %" PRIu64 " re-fetched", stats.packetsFetched.load(), stats.packetsRefetched.load());
+    for (size_t i = 0; i < static_cast<size_t>(Component::Role::Count); i++) {
+      if (uint64_t count = stats.recordsDecoded[i].load(); count) {
+        logInfo(logger, "  records:  %" PRIu64 " %s", count, componentRoleNames[i]);
+      }
+    }
+  }
 
   void printHelp(const char* path)
   {
@@ -265,12 +2513,127 @@ Options:
   --loglevel=<uint>            Specifies amount of logging, 0=trace,
                                1=debug, 2=info, 3=warnings, 4=errors,
                                5=silent.
-  --pointset=<uint>            Selects which point set to process, defaults
+  --stats                      Output byte and packet counts and time spent
+                               in each stage of reading when done.
+  --trace=<filename.json>      Record a timeline of reads, checksums, packet
+                               fetches, unpacking and consume callbacks per
+                               thread, written as Chrome trace JSON.
+  --pointset=<list>            Selects which point sets to process, either a
+                               single index, a comma-separated list of distinct
+                               indices or 'all'. Defaults to 0.
+  --threads=<uint>             Number of threads used when processing multiple
+                               point sets, 0=one per core. Defaults to 0.
+  --io-budget=<uint>           Max number of threads that read from the file
+                               at the same time, 0=unlimited. Defaults to 0.
+  --pipeline-depth=<uint>      Number of point batch buffers. With more than
+                               one, points are decoded on a separate thread
+                               while the previous batch is written. Defaults
+                               to 2.
+  --batch-size=<uint>          Number of points decoded per batch, 0=derive
+                               from packet size and cache size. Defaults
                                to 0.
   --include-invalid=<bool>     If enabled, also output points where
                                InvalidState is set. Defaults to false.
+  --format-threads=<uint>      Number of threads formatting text output,
+                               0=one per core. The output does not depend
+                               on the number of threads. Defaults to 0.
+  --precision=<uint>           Number of decimals of coordinates in text
+                               output. Defaults to 6.
+  --pts-intensity=<bool>       Add an intensity column to pts output, mapped
+                               from its declared range to -2048..2047.
+                               Defaults to false.
+  --pts-color=<bool>           Add r g b columns to pts output, mapped from
+                               their declared range to 0..255. Defaults to
+                               false.
   --output-xml=<filename.xml>  Write the embedded XML to a file.
-  --output-pts=<filename.pts>  Write the selected point set to file as pts.
+  --merge=<bool>               If enabled, --output-pts, --output-ply and
+                               --output-las write all selected point sets
+                               into a single file. PLY and LAS keep the
+                               order of the point sets, pts interleaves
+                               them in chunks as they are decoded. Points
+                               stay in the coordinate frame of their own
+                               point set, poses are not applied, so scans
+                               of a registered file may not line up.
+                               Defaults to false.
+  --voxel-size=<float>         Downsample the points written by --output-pts,
+                               --output-ply, --output-las, --output-e57 and
+                               --recompress to one per voxel of this size,
+                               0=off. Each point set is reduced on its own
+                               and written when it is fully read. Can not be
+                               combined with --merge. Defaults to 0.
+  --voxel-mode=<name>          What is kept of each voxel, 'first' keeps the
+                               first point, 'centroid' moves it to the mean
+                               position and 'average' also averages intensity
+                               and color. Defaults to first.
+  --voxel-memory=<uint>        Megabytes of voxels kept in memory per point
+                               set before spilling to a temporary file.
+                               Defaults to 1024.
+  --output-pts=<filename.pts>  Write the selected point sets to file as pts.
+                               With multiple point sets, the point set index
+                               is appended to the filename.
+  --output-ply=<filename.ply>  Write the selected point sets to file as binary
+                               PLY, with position, intensity and color in
+                               their native widths. With multiple point sets,
+                               the point set index is appended to the
+                               filename.
+  --npy-components=<list>      Components written by --output-npy, a comma-
+                               separated list of names like cartesianX or
+                               intensity, or 'all'. Defaults to all.
+  --output-npy=<filename.npy>  Write the components of the selected point
+                               sets as NumPy arrays in their native widths,
+                               one file per component with the component
+                               name appended to the filename. With multiple
+                               point sets, the point set index is appended
+                               first.
+  --las-format=<uint>          LAS point data record format, 0, 2, 6 or 7, or
+                               'auto' to pick from the components present.
+                               Defaults to auto.
+  --output-las=<filename.las>  Write the selected point sets to file as LAS
+                               1.4. Scaled integer coordinates keep their
+                               scale and offset. With multiple point sets,
+                               the point set index is appended to the
+                               filename.
+  --image-channel=<name>       Value rendered by --output-image, either
+                               'intensity', 'range' or 'color'. Defaults to
+                               color for .ppm and intensity otherwise.
+  --image-max-size=<uint>      Max width and height of images, larger scans
+                               are binned down by an integer factor, 0=no
+                               limit. Defaults to 2048.
+  --image-stretch=<lo>,<hi>    Percentiles of the intensity or spherical
+                               range values that PGM and PPM images are
+                               stretched between. Defaults to 0,100, the
+                               range of the pixel values.
+  --output-image=<filename>    Render the selected point sets as panoramas
+                               using their row and column indices. The
+                               format is given by the extension, .pgm, .ppm
+                               or .pfm. With multiple point sets, the point
+                               set index is appended to the filename.
+  --output-e57=<filename.e57>  Write the selected point sets into a single
+                               new E57 file, keeping the encoding of every
+                               component. Names and poses of the point sets
+                               are kept, other metadata like descriptions,
+                               sensor information and images2D is dropped.
+  --recompress-precision=<float>
+                               Precision of float coordinates and ranges
+                               converted to scaled integers by --recompress,
+                               0=keep floats. Defaults to 0.0001.
+  --recompress=<filename.e57>  Write the selected point sets into a single
+                               new E57 file with encodings tightened to the
+                               values present. Integers get the smallest bit
+                               width that holds their values, and float
+                               coordinates and ranges become scaled integers
+                               when that is smaller. Metadata is kept as by
+                               --output-e57.
+  --octree-memory=<uint>       Megabytes of points --output-octree holds in
+                               memory before spilling to a temporary file.
+                               Defaults to 1024.
+  --octree-node-points=<uint>  Max number of points of an octree leaf, larger
+                               nodes are split. Defaults to 20000.
+  --output-octree=<directory>  Build a level of detail octree of the selected
+                               point sets for streaming to viewers, in a
+                               single read. Writes octree.bin with the points
+                               of each node, hierarchy.bin with the nodes in
+                               breadth first order and metadata.json.
 
 Post bug reports or questions at https://github.com/cdyk/e57parser
 )help", path);
@@ -316,6 +2679,103 @@ Post bug reports or questions at https://github.com/cdyk/e57parser
     return false;
   }
 
+  bool parseDouble(double& output, const char* ptr, size_t offset)
+  {
+    const char* begin = ptr + offset;
+    std::from_chars_result result = std::from_chars(begin, begin + std::strlen(begin), output);
+    if (result.ec != std::errc() || *result.ptr != '\0' || !std::isfinite(output)) {
+      logError(logger, "%.*s: invalid number '%s'", int(offset), ptr, begin);
+      return false;
+    }
+    return true;
+  }
+
+  // Parses '<lo>,<hi>' with 0 <= lo < hi <= 100.
+  bool parsePercentiles(double (&output)[2], const char* ptr, size_t offset)
+  {
+    const char* begin = ptr + offset;
+    const char* end = begin + std::strlen(begin);
+    std::from_chars_result result = std::from_chars(begin, end, output[0]);
+    if (result.ec == std::errc() && *result.ptr == ',') {
+      result = std::from_chars(result.ptr + 1, end, output[1]);
+    }
+    else {
+      result.ec = std::errc::invalid_argument;
+    }
+    if (result.ec != std::errc() || *result.ptr != '\0' || !(0.0 <= output[0] && output[0] < output[1] && output[1] <= 100.0)) {
+      logError(logger, "%.*s: invalid percentiles '%s'", int(offset), ptr, begin);
+      return false;
+    }
+    return true;
+  }
+
+  bool parsePointSets(std::vector<size_t>& output, const char* ptr, size_t offset, size_t pointSetCount)
+  {
+    output.clear();
+    if (strcmp(ptr + offset, "all") == 0) {
+      for (size_t i = 0; i < pointSetCount; i++) {
+        output.push_back(i);
+      }
+      return true;
+    }
+
+    std::string item;
+    for (const char* p = ptr + offset;; p++) {
+      if (*p == ',' || *p == '\0') {
+        size_t index = 0;
+        if (!parseUint(index, item.c_str(), 0)) {
+          return false;
+        }
+        if (pointSetCount <= index) {
+          logError(logger, "specified point set index %zu is greater than the number of point sets (=%zu)", index, pointSetCount);
+          return false;
+        }
+        if (std::find(output.begin(), output.end(), index) != output.end()) {
+          logError(logger, "point set index %zu is specified more than once", index);
+          return false;
+        }
+        output.push_back(index);
+        item.clear();
+        if (*p == '\0') break;
+      }
+      else {
+        item.push_back(*p);
+      }
+    }
+    return true;
+  }
+
+  bool parseComponentRoles(uint32_t& output, const char* ptr, size_t offset)
+  {
+    static_assert(static_cast<size_t>(Component::Role::Count) <= 32);
+    if (strcmp(ptr + offset, "all") == 0) {
+      output = ~0u;
+      return true;
+    }
+
+    output = 0;
+    std::string item;
+    for (const char* p = ptr + offset;; p++) {
+      if (*p == ',' || *p == '\0') {
+        size_t role = 0;
+        while (role < static_cast<size_t>(Component::Role::Count) && item != componentRoleNames[role]) {
+          role++;
+        }
+        if (role == static_cast<size_t>(Component::Role::Count)) {
+          logError(logger, "unknown component name '%s'", item.c_str());
+          return false;
+        }
+        output |= 1u << role;
+        item.clear();
+        if (*p == '\0') break;
+      }
+      else {
+        item.push_back(*p);
+      }
+    }
+    return true;
+  }
+
 
 }
 
@@ -327,16 +2787,53 @@ int main(int argc, char** argv)
   static const std::string option_help            = "--help";
   static const std::string option_info            = "--info";
   static const std::string option_loglevel        = "--loglevel=";
+  static const std::string option_stats           = "--stats";
+  static const std::string option_trace           = "--trace=";
   static const std::string option_pointset        = "--pointset=";
+  static const std::string option_threads         = "--threads=";
+  static const std::string option_io_budget       = "--io-budget=";
+  static const std::string option_pipeline_depth  = "--pipeline-depth=";
+  static const std::string option_batch_size      = "--batch-size=";
   static const std::string option_include_invalid = "--include-invalid=";
+  static const std::string option_format_threads  = "--format-threads=";
+  static const std::string option_precision       = "--precision=";
+  static const std::string option_pts_intensity   = "--pts-intensity=";
+  static const std::string option_pts_color       = "--pts-color=";
   static const std::string option_output_xml      = "--output-xml=";
+  static const std::string option_merge           = "--merge=";
+  static const std::string option_voxel_size      = "--voxel-size=";
+  static const std::string option_voxel_mode      = "--voxel-mode=";
+  static const std::string option_voxel_memory    = "--voxel-memory=";
   static const std::string option_output_pts      = "--output-pts=";
-
+  static const std::string option_output_ply      = "--output-ply=";
+  static const std::string option_npy_components  = "--npy-components=";
+  static const std::string option_output_npy      = "--output-npy=";
+  static const std::string option_las_format      = "--las-format=";
+  static const std::string option_output_las      = "--output-las=";
+  static const std::string option_image_channel   = "--image-channel=";
+  static const std::string option_image_max_size  = "--image-max-size=";
+  static const std::string option_image_stretch   = "--image-stretch=";
+  static const std::string option_output_image    = "--output-image=";
+  static const std::string option_output_e57      = "--output-e57=";
+  static const std::string option_recompress_precision = "--recompress-precision=";
+  static const std::string option_recompress      = "--recompress=";
+  static const std::string option_octree_memory   = "--octree-memory=";
+  static const std::string option_octree_node_points = "--octree-node-points=";
+  static const std::string option_output_octree   = "--output-octree=";
+
+  bool collectStats = false;
+  const char* tracePath = nullptr;
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], option_help.c_str()) == 0) {
       printHelp(argv[0]);
       return EXIT_SUCCESS;
     }
+    else if (strcmp(argv[i], option_stats.c_str()) == 0) {
+      collectStats = true;
+    }
+    else if (strncmp(argv[i], option_trace.c_str(), option_trace.length()) == 0) {
+      tracePath = argv[i] + option_trace.length();
+    }
     else if (strncmp(argv[i], option_loglevel.c_str(), option_loglevel.length()) == 0) {
       size_t newlevel = 0;
       if (!parseUint(newlevel, argv[i], option_loglevel.length())) {
@@ -359,9 +2856,19 @@ int main(int argc, char** argv)
   bool success = true;
   const char* inpath = argv[argc - 1];
   {    
-    MemoryMappedFile mappedFile(inpath);
+    uint64_t startTime = getMonotonicNanoseconds();
+    MemoryMappedFile mappedFile(logger, inpath);
 
+    E57Stats stats;
+    std::unique_ptr<E57Trace> trace;
     E57File e57;
+    if (collectStats) {
+      e57.stats = &stats;
+    }
+    if (tracePath) {
+      trace = std::make_unique<E57Trace>();
+      e57.trace = trace.get();
+    }
     if(!openE57(e57, logger, memoryMappedFileCallback, &mappedFile, mappedFile.size)) {
       success = false;
     }
@@ -369,13 +2876,33 @@ int main(int argc, char** argv)
       logDebug(logger, "Opened '%s'", inpath);
 
       bool includeInvalid = false;
-      size_t pointSet = 0;
+      std::vector<size_t> pointSets = { 0 };
+      size_t threadCount = 0;
+      size_t maxConcurrentReads = 0;
+      size_t pipelineDepth = 2;
+      size_t batchSize = 0;
+      size_t formatThreadCount = 0;
+      size_t precision = 6;
+      bool ptsIntensity = false;
+      bool mergeOutput = false;
+      VoxelSettings voxel{ .memoryBudget = size_t(1024) << 20 };
+      bool ptsColor = false;
+      uint32_t npyRoleMask = ~0u;
+      int lasFormat = -1;
+      ImageChannel imageChannel = ImageChannel::Auto;
+      size_t imageMaxSize = 2048;
+      double imageStretch[2] = { 0.0, 100.0 };
+      double recompressPrecision = 0.0001;
+      size_t octreeMemory = 1024;
+      size_t octreeNodePoints = 20000;
 
       for (int i = 1; success && i + 1 < argc; i++) {
 
-        // Help and loglevel handled further up.
+        // Help, loglevel, stats and trace handled further up.
         if (strcmp(argv[i], option_help.c_str()) == 0) {}
         else if (strncmp(argv[i], option_loglevel.c_str(), option_loglevel.length()) == 0) {}
+        else if (strcmp(argv[i], option_stats.c_str()) == 0) {}
+        else if (strncmp(argv[i], option_trace.c_str(), option_trace.length()) == 0) {}
 
         // Output info about the e57 file
         else if (strcmp(argv[i], option_info.c_str()) == 0) {
@@ -389,6 +2916,14 @@ int main(int argc, char** argv)
           for (size_t j = 0; j < e57.points.size; j++) {
             const Points& points = e57.points[j];
             logInfo(logger, "pointset %zu: fileOffset=%" PRIu64 " recordCount=%" PRIu64, j, points.fileOffset, points.recordCount);
+            if (points.name) {
+              logInfo(logger, "   name=%s", points.name);
+            }
+            if (points.hasPose) {
+              logInfo(logger, "   pose rotation=[%f %f %f %f] translation=[%f %f %f]",
+                      points.pose.rotation[0], points.pose.rotation[1], points.pose.rotation[2], points.pose.rotation[3],
+                      points.pose.translation[0], points.pose.translation[1], points.pose.translation[2]);
+            }
             for (size_t i = 0; i < points.components.size; i++) {
               const Component& comp = points.components[i];
               switch (comp.type) {
@@ -414,11 +2949,39 @@ int main(int argc, char** argv)
 
         // Specify point set
         else if (strncmp(argv[i], option_pointset.c_str(), option_pointset.length()) == 0) {
-          if (!parseUint(pointSet, argv[i], option_pointset.length())) {
+          if (!parsePointSets(pointSets, argv[i], option_pointset.length(), e57.points.size)) {
+            success = false;
+          }
+        }
+
+        // Specify number of threads
+        else if (strncmp(argv[i], option_threads.c_str(), option_threads.length()) == 0) {
+          if (!parseUint(threadCount, argv[i], option_threads.length())) {
+            success = false;
+          }
+        }
+
+        // Specify shared I/O budget
+        else if (strncmp(argv[i], option_io_budget.c_str(), option_io_budget.length()) == 0) {
+          if (!parseUint(maxConcurrentReads, argv[i], option_io_budget.length())) {
+            success = false;
+          }
+        }
+
+        // Specify number of batch buffers
+        else if (strncmp(argv[i], option_pipeline_depth.c_str(), option_pipeline_depth.length()) == 0) {
+          if (!parseUint(pipelineDepth, argv[i], option_pipeline_depth.length())) {
+            success = false;
+          }
+          else if (pipelineDepth == 0) {
+            logError(logger, "Pipeline depth must be at least 1");
             success = false;
           }
-          else if (e57.points.size <= pointSet) {
-            logError(logger, "specified point set index %zu is greater than the number of point sets (=%zu)", pointSet, e57.points.size);
+        }
+
+        // Specify number of points per batch
+        else if (strncmp(argv[i], option_batch_size.c_str(), option_batch_size.length()) == 0) {
+          if (!parseUint(batchSize, argv[i], option_batch_size.length())) {
             success = false;
           }
         }
@@ -430,6 +2993,36 @@ int main(int argc, char** argv)
           }
         }
 
+        // Specify number of threads formatting text
+        else if (strncmp(argv[i], option_format_threads.c_str(), option_format_threads.length()) == 0) {
+          if (!parseUint(formatThreadCount, argv[i], option_format_threads.length())) {
+            success = false;
+          }
+        }
+
+        // Specify decimals in text output
+        else if (strncmp(argv[i], option_precision.c_str(), option_precision.length()) == 0) {
+          if (!parseUint(precision, argv[i], option_precision.length())) {
+            success = false;
+          }
+          else if (17 < precision) {
+            logError(logger, "Precision must be at most 17");
+            success = false;
+          }
+        }
+
+        // Enable or disable extra pts columns
+        else if (strncmp(argv[i], option_pts_intensity.c_str(), option_pts_intensity.length()) == 0) {
+          if (!parseBool(ptsIntensity, argv[i], option_pts_intensity.length())) {
+            success = false;
+          }
+        }
+        else if (strncmp(argv[i], option_pts_color.c_str(), option_pts_color.length()) == 0) {
+          if (!parseBool(ptsColor, argv[i], option_pts_color.length())) {
+            success = false;
+          }
+        }
+
         // Output embedded xml
         else if (strncmp(argv[i], option_output_xml.c_str(), option_output_xml.length()) == 0) {
           const char* path = argv[i] + option_output_xml.length();
@@ -454,43 +3047,414 @@ int main(int argc, char** argv)
           }
         }
 
+        // Specify if point sets are merged into one file
+        else if (strncmp(argv[i], option_merge.c_str(), option_merge.length()) == 0) {
+          if (!parseBool(mergeOutput, argv[i], option_merge.length())) {
+            success = false;
+          }
+        }
+
+        // Specify voxel size of downsampling
+        else if (strncmp(argv[i], option_voxel_size.c_str(), option_voxel_size.length()) == 0) {
+          if (!parseDouble(voxel.size, argv[i], option_voxel_size.length())) {
+            success = false;
+          }
+          else if (!(0.0 <= voxel.size && voxel.size < HUGE_VAL)) {
+            logError(logger, "%s: voxel size must be a non-negative number", option_voxel_size.c_str());
+            success = false;
+          }
+        }
+
+        // Specify what is kept of each voxel
+        else if (strncmp(argv[i], option_voxel_mode.c_str(), option_voxel_mode.length()) == 0) {
+          const char* name = argv[i] + option_voxel_mode.length();
+          if (strcmp(name, "first") == 0) {
+            voxel.mode = VoxelFilter::Mode::First;
+          }
+          else if (strcmp(name, "centroid") == 0) {
+            voxel.mode = VoxelFilter::Mode::Centroid;
+          }
+          else if (strcmp(name, "average") == 0) {
+            voxel.mode = VoxelFilter::Mode::Average;
+          }
+          else {
+            logError(logger, "%s: invalid voxel mode '%s'", option_voxel_mode.c_str(), name);
+            success = false;
+          }
+        }
+
+        // Specify voxel filter memory budget
+        else if (strncmp(argv[i], option_voxel_memory.c_str(), option_voxel_memory.length()) == 0) {
+          size_t megabytes = 0;
+          if (!parseUint(megabytes, argv[i], option_voxel_memory.length())) {
+            success = false;
+          }
+          else {
+            voxel.memoryBudget = megabytes << 20;
+          }
+        }
+
         // Output point set as pts
         else if (strncmp(argv[i], option_output_pts.c_str(), option_output_pts.length()) == 0) {
           const char* path = argv[i] + option_output_pts.length();
 
-          if (e57.points.size <= pointSet) {
-            logError(logger, "specified point set index %zu is greater than the number of point sets (=%zu)", pointSet, e57.points.size);
+          // The calling thread takes part in formatting.
+          std::unique_ptr<WorkerPool> formatPool;
+          size_t formatThreads = formatThreadCount ? formatThreadCount : std::max(1u, std::thread::hardware_concurrency());
+          if (1 < formatThreads) {
+            formatPool = std::make_unique<WorkerPool>(formatThreads - 1);
+          }
+
+          PtsPointSetsWriter writer{
+            .e57 = &e57,
+            .path = path,
+            .multiple = !mergeOutput && 1 < pointSets.size(),
+            .merge = mergeOutput,
+            .pipelineDepth = pipelineDepth,
+            .batchSize = batchSize,
+            .columns = PtsColumns{ .intensity = ptsIntensity, .color = ptsColor, .precision = static_cast<int>(precision) },
+            .voxel = voxel,
+            .pool = formatPool.get(),
+            .writers = std::vector<PtsWriter>(e57.points.size)
+          };
+
+          ReadPointSetsArgs readPointSetsArgs{
+            .pointSetIndices = View<const size_t>(pointSets.data(), pointSets.size()),
+            .setupCallback = PtsPointSetsWriter::setupCallback,
+            .finishCallback = PtsPointSetsWriter::finishCallback,
+            .callbackData = &writer,
+            .threadCount = threadCount,
+            .maxConcurrentReads = maxConcurrentReads
+          };
+
+          if (mergeOutput && voxel.enabled()) {
+            logError(logger, "%s can not be combined with %s", option_merge.c_str(), option_voxel_size.c_str());
+            success = false;
+          }
+          else if (mergeOutput && !writer.beginMerge(pointSets)) {
+            success = false;
+          }
+          else if (!readE57PointSets(&e57, logger, readPointSetsArgs) || writer.failed) {
+            success = false;
+          }
+          if (mergeOutput && !writer.merged.close()) {
+            success = false;
+          }
+        }
+        // Output point sets as ply
+        else if (strncmp(argv[i], option_output_ply.c_str(), option_output_ply.length()) == 0) {
+          const char* path = argv[i] + option_output_ply.length();
+
+          PlyPointSetsWriter writer{
+            .e57 = &e57,
+            .path = path,
+            .multiple = !mergeOutput && 1 < pointSets.size(),
+            .merge = mergeOutput,
+            .pipelineDepth = pipelineDepth,
+            .batchSize = batchSize,
+            .voxel = voxel,
+            .writers = std::vector<PlyWriter>(e57.points.size)
+          };
+
+          ReadPointSetsArgs readPointSetsArgs{
+            .pointSetIndices = View<const size_t>(pointSets.data(), pointSets.size()),
+            .setupCallback = PlyPointSetsWriter::setupCallback,
+            .finishCallback = PlyPointSetsWriter::finishCallback,
+            .callbackData = &writer,
+            .threadCount = threadCount,
+            .maxConcurrentReads = maxConcurrentReads
+          };
+
+          if (mergeOutput && voxel.enabled()) {
+            logError(logger, "%s can not be combined with %s", option_merge.c_str(), option_voxel_size.c_str());
+            success = false;
+          }
+          else if (mergeOutput && !writer.beginMerge(pointSets)) {
+            success = false;
+          }
+          else if (!readE57PointSets(&e57, logger, readPointSetsArgs) || writer.failed) {
+            success = false;
+          }
+          if (mergeOutput && !writer.merged.close()) {
+            success = false;
+          }
+        }
+
+        // Specify components written as npy
+        else if (strncmp(argv[i], option_npy_components.c_str(), option_npy_components.length()) == 0) {
+          if (!parseComponentRoles(npyRoleMask, argv[i], option_npy_components.length())) {
+            success = false;
+          }
+        }
+
+        // Output components of point sets as npy
+        else if (strncmp(argv[i], option_output_npy.c_str(), option_output_npy.length()) == 0) {
+          const char* path = argv[i] + option_output_npy.length();
+
+          NpyPointSetsWriter writer{
+            .e57 = &e57,
+            .path = path,
+            .multiple = 1 < pointSets.size(),
+            .roleMask = npyRoleMask,
+            .batchSize = batchSize,
+            .writers = std::vector<NpyWriter>(e57.points.size)
+          };
+
+          ReadPointSetsArgs readPointSetsArgs{
+            .pointSetIndices = View<const size_t>(pointSets.data(), pointSets.size()),
+            .setupCallback = NpyPointSetsWriter::setupCallback,
+            .finishCallback = NpyPointSetsWriter::finishCallback,
+            .callbackData = &writer,
+            .threadCount = threadCount,
+            .maxConcurrentReads = maxConcurrentReads
+          };
+
+          if (voxel.enabled()) {
+            logWarning(logger, "%s does not apply to %s", option_voxel_size.c_str(), option_output_npy.c_str());
+          }
+          if (!readE57PointSets(&e57, logger, readPointSetsArgs)) {
+            success = false;
+          }
+        }
+
+        // Specify LAS point format
+        else if (strncmp(argv[i], option_las_format.c_str(), option_las_format.length()) == 0) {
+          size_t format = 0;
+          if (strcmp(argv[i] + option_las_format.length(), "auto") == 0) {
+            lasFormat = -1;
+          }
+          else if (!parseUint(format, argv[i], option_las_format.length())) {
+            success = false;
+          }
+          else if (format != 0 && format != 2 && format != 6 && format != 7) {
+            logError(logger, "Unsupported LAS point format %zu, expected 0, 2, 6 or 7", format);
+            success = false;
+          }
+          else {
+            lasFormat = static_cast<int>(format);
+          }
+        }
+
+        // Output point sets as las
+        else if (strncmp(argv[i], option_output_las.c_str(), option_output_las.length()) == 0) {
+          const char* path = argv[i] + option_output_las.length();
+
+          LasPointSetsWriter writer{
+            .e57 = &e57,
+            .path = path,
+            .multiple = !mergeOutput && 1 < pointSets.size(),
+            .merge = mergeOutput,
+            .format = lasFormat,
+            .pipelineDepth = pipelineDepth,
+            .batchSize = batchSize,
+            .voxel = voxel,
+            .writers = std::vector<LasWriter>(e57.points.size)
+          };
+
+          ReadPointSetsArgs readPointSetsArgs{
+            .pointSetIndices = View<const size_t>(pointSets.data(), pointSets.size()),
+            .setupCallback = LasPointSetsWriter::setupCallback,
+            .finishCallback = LasPointSetsWriter::finishCallback,
+            .callbackData = &writer,
+            .threadCount = threadCount,
+            .maxConcurrentReads = maxConcurrentReads
+          };
+
+          bool read = false;
+          if (mergeOutput && voxel.enabled()) {
+            logError(logger, "%s can not be combined with %s", option_merge.c_str(), option_voxel_size.c_str());
+            success = false;
+          }
+          else if (mergeOutput && !writer.beginMerge(pointSets)) {
+            success = false;
+          }
+          else if (!(read = readE57PointSets(&e57, logger, readPointSetsArgs)) || writer.failed) {
+            success = false;
+          }
+          if (mergeOutput && !writer.endMerge(pointSets, read && !writer.failed)) {
+            success = false;
+          }
+        }
+
+        // Specify what to render into images
+        else if (strncmp(argv[i], option_image_channel.c_str(), option_image_channel.length()) == 0) {
+          const char* name = argv[i] + option_image_channel.length();
+          if (strcmp(name, "intensity") == 0) {
+            imageChannel = ImageChannel::Intensity;
+          }
+          else if (strcmp(name, "range") == 0) {
+            imageChannel = ImageChannel::Range;
+          }
+          else if (strcmp(name, "color") == 0) {
+            imageChannel = ImageChannel::Color;
+          }
+          else {
+            logError(logger, "%s: invalid image channel '%s'", option_image_channel.c_str(), name);
+            success = false;
+          }
+        }
+
+        // Specify max image size
+        else if (strncmp(argv[i], option_image_max_size.c_str(), option_image_max_size.length()) == 0) {
+          if (!parseUint(imageMaxSize, argv[i], option_image_max_size.length())) {
+            success = false;
+          }
+        }
+
+        // Specify image stretch percentiles
+        else if (strncmp(argv[i], option_image_stretch.c_str(), option_image_stretch.length()) == 0) {
+          if (!parsePercentiles(imageStretch, argv[i], option_image_stretch.length())) {
+            success = false;
+          }
+        }
+
+        // Output point sets as images
+        else if (strncmp(argv[i], option_output_image.c_str(), option_output_image.length()) == 0) {
+          const char* path = argv[i] + option_output_image.length();
+
+          ImagePointSetsWriter writer{
+            .e57 = &e57,
+            .path = path,
+            .multiple = 1 < pointSets.size(),
+            .includeInvalid = includeInvalid,
+            .maxSize = imageMaxSize,
+            .stretch = { imageStretch[0] / 100.0, imageStretch[1] / 100.0 },
+            .pipelineDepth = pipelineDepth,
+            .batchSize = batchSize,
+            .writers = std::vector<ImageWriter>(e57.points.size)
+          };
+          if (!imageFormatFromPath(writer.format, path)) {
             success = false;
           }
           else {
-            const Points& pts = e57.points[pointSet];
+            writer.channel = imageChannel;
+            if (imageChannel == ImageChannel::Auto) {
+              writer.channel = writer.format == ImageFormat::Ppm ? ImageChannel::Color : ImageChannel::Intensity;
+            }
 
-            PtsWriter writer;
-            if (!writer.init(path, pts)) {
+            ReadPointSetsArgs readPointSetsArgs{
+              .pointSetIndices = View<const size_t>(pointSets.data(), pointSets.size()),
+              .setupCallback = ImagePointSetsWriter::setupCallback,
+              .finishCallback = ImagePointSetsWriter::finishCallback,
+              .callbackData = &writer,
+              .threadCount = threadCount,
+              .maxConcurrentReads = maxConcurrentReads
+            };
+
+            if (voxel.enabled()) {
+              logWarning(logger, "%s does not apply to %s", option_voxel_size.c_str(), option_output_image.c_str());
+            }
+            if (!readE57PointSets(&e57, logger, readPointSetsArgs) || writer.failed) {
               success = false;
             }
-            else {
-              ReadPointsArgs readPointsArgs{
-                .buffer = View<char>(writer.buffer.data(), writer.buffer.size()),
-                .writeDesc = View<const ComponentWriteDesc>(writer.writeDescs.data(), writer.writeDescs.size()),
-                .consumeCallback = PtsWriter::consumeCallback,
-                .consumeCallbackData = &writer,
-                .pointCapacity = writer.pointCapacity,
-                .pointSetIndex = pointSet
-              };
-
-              if (!readE57Points(&e57, logger, readPointsArgs)) {
-                success = false;
-              }
+          }
+        }
+
+        // Output point sets as e57
+        else if (strncmp(argv[i], option_output_e57.c_str(), option_output_e57.length()) == 0) {
+          const char* path = argv[i] + option_output_e57.length();
+          if (strcmp(path, inpath) == 0) {
+            logError(logger, "Output file '%s' is the input file", path);
+            success = false;
+          }
+          else {
+            E57Output output;
+            output.voxel = voxel;
+            if (!output.write(path, &e57, pointSets, pipelineDepth, batchSize)) {
+              success = false;
+            }
+          }
+        }
+
+        // Specify precision of recompressed floats
+        else if (strncmp(argv[i], option_recompress_precision.c_str(), option_recompress_precision.length()) == 0) {
+          if (!parseDouble(recompressPrecision, argv[i], option_recompress_precision.length())) {
+            success = false;
+          }
+          else if (recompressPrecision < 0.0) {
+            logError(logger, "%s: precision must not be negative", option_recompress_precision.c_str());
+            success = false;
+          }
+        }
+
+        // Output point sets as recompressed e57
+        else if (strncmp(argv[i], option_recompress.c_str(), option_recompress.length()) == 0) {
+          const char* path = argv[i] + option_recompress.length();
+          if (strcmp(path, inpath) == 0) {
+            logError(logger, "Output file '%s' is the input file", path);
+            success = false;
+          }
+          else {
+            E57Output output;
+            output.recompress = true;
+            output.precision = recompressPrecision;
+            output.voxel = voxel;
+            if (!output.write(path, &e57, pointSets, pipelineDepth, batchSize)) {
+              success = false;
             }
           }
         }
+
+        // Specify octree memory budget
+        else if (strncmp(argv[i], option_octree_memory.c_str(), option_octree_memory.length()) == 0) {
+          if (!parseUint(octreeMemory, argv[i], option_octree_memory.length())) {
+            success = false;
+          }
+        }
+
+        // Specify max points of octree leaves
+        else if (strncmp(argv[i], option_octree_node_points.c_str(), option_octree_node_points.length()) == 0) {
+          if (!parseUint(octreeNodePoints, argv[i], option_octree_node_points.length())) {
+            success = false;
+          }
+          else if (octreeNodePoints == 0 || UINT32_MAX < octreeNodePoints) {
+            logError(logger, "%s: invalid node point count %zu", option_octree_node_points.c_str(), octreeNodePoints);
+            success = false;
+          }
+        }
+
+        // Output point sets as level of detail octree
+        else if (strncmp(argv[i], option_output_octree.c_str(), option_output_octree.length()) == 0) {
+          OctreePointSetsWriter writer{
+            .e57 = &e57,
+            .path = argv[i] + option_output_octree.length(),
+            .pipelineDepth = pipelineDepth,
+            .batchSize = batchSize,
+            .memoryBudget = octreeMemory << 20,
+            .maxNodePoints = static_cast<uint32_t>(octreeNodePoints),
+            .pointSets = std::vector<OctreePointSetsWriter::PointSet>(e57.points.size)
+          };
+
+          ReadPointSetsArgs readPointSetsArgs{
+            .pointSetIndices = View<const size_t>(pointSets.data(), pointSets.size()),
+            .setupCallback = OctreePointSetsWriter::setupCallback,
+            .finishCallback = OctreePointSetsWriter::finishCallback,
+            .callbackData = &writer,
+            .threadCount = threadCount,
+            .maxConcurrentReads = maxConcurrentReads
+          };
+
+          if (voxel.enabled()) {
+            logWarning(logger, "%s does not apply to %s", option_voxel_size.c_str(), option_output_octree.c_str());
+          }
+          if (!writer.open(pointSets) || !readE57PointSets(&e57, logger, readPointSetsArgs) || !writer.builder.close()) {
+            success = false;
+          }
+        }
+
         else {
           logError(logger, "Unrecoginzed command line option '%s'", argv[i]);
           success = false;
         }
       }
     }
+
+    if (collectStats) {
+      logStats(stats, e57, getMonotonicNanoseconds() - startTime);
+    }
+    if (trace && !writeE57Trace(trace.get(), logger, tracePath)) {
+      success = false;
+    }
   }
 
   if (success) {